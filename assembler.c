@@ -0,0 +1,1046 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcc.h"
+
+// An x86-64 assembler for the instructions generated by codegen. Instructions are
+// encoded into the .text section as they come in. Jumps to labels are first emitted in
+// their long form and made short in finish_assembler() where possible, the same as
+// the GNU assembler does.
+
+#define REX_W 8
+#define REX_R 4
+#define REX_X 2
+#define REX_B 1
+
+#define REGISTER_RIP -2
+
+enum {
+    OPERAND_REGISTER = 1,
+    OPERAND_IMMEDIATE,
+    OPERAND_MEMORY,
+};
+
+enum {
+    REGISTER_CLASS_GPR = 1,
+    REGISTER_CLASS_XMM,
+    REGISTER_CLASS_X87,
+};
+
+enum {
+    FORM_ALU = 1,       // add, or, and, sub, xor, cmp
+    FORM_MOV,
+    FORM_MOVABS,
+    FORM_TEST,
+    FORM_SHIFT,
+    FORM_UNARY,         // not, neg, mul, div, idiv
+    FORM_IMUL,
+    FORM_LEA,
+    FORM_PUSH,
+    FORM_POP,
+    FORM_EXTEND,        // movzx, movsx & movslq
+    FORM_REG_RM,        // Register destination, register or memory source
+    FORM_SSE_MOV,       // movss & movsd
+    FORM_SET,
+    FORM_CMOV,
+    FORM_JCC,
+    FORM_JMP,
+    FORM_CALL,
+    FORM_FIXED,         // Instructions without operands
+    FORM_X87_MEMORY,
+    FORM_X87_REGISTER,
+};
+
+typedef struct x86_operand {
+    int kind;
+    int register_class;
+    int reg;            // Hardware register number for registers
+    int size;           // Register size in bytes
+    int is_indirect;    // Operand is prefixed with *
+    long value;         // Immediate value or displacement
+    ElfSymbol *symbol;  // Symbol in the displacement
+    int is_got;         // symbol@GOTPCREL
+    int base;           // Base register, REGISTER_RIP or -1
+    int index;          // Index register or -1
+    int scale;
+} X86Operand;
+
+typedef struct x86_mnemonic {
+    char *name;
+    int form;
+    int opcode;         // Up to three opcode bytes, the first byte in the most significant position
+    int digit;          // Opcode extension in the reg field of the ModR/M byte
+    int prefix;         // Mandatory prefix
+    int size;           // Operand size, zero if it's determined by a suffix or the operands
+} X86Mnemonic;
+
+// A jump to a label, emitted in the long form until it's relaxed
+typedef struct jump {
+    int offset;         // Offset of the jump in the unrelaxed code
+    int condition;      // Condition code or -1 for jmp
+    ElfSymbol *target;
+    int is_long;
+} Jump;
+
+// A reference to a symbol that is either resolved in finish_assembler() or
+// turned into a relocation
+typedef struct fixup {
+    int offset;         // Offset of the 32 bit field in the unrelaxed code
+    ElfSymbol *symbol;
+    int type;
+    long addend;
+} Fixup;
+
+static X86Mnemonic mnemonics[] = {
+    { "add",        FORM_ALU,           0x00,       0, 0,    0 },
+    { "or",         FORM_ALU,           0x08,       1, 0,    0 },
+    { "and",        FORM_ALU,           0x20,       4, 0,    0 },
+    { "sub",        FORM_ALU,           0x28,       5, 0,    0 },
+    { "xor",        FORM_ALU,           0x30,       6, 0,    0 },
+    { "cmp",        FORM_ALU,           0x38,       7, 0,    0 },
+    { "mov",        FORM_MOV,           0,          0, 0,    0 },
+    { "movabs",     FORM_MOVABS,        0xb8,       0, 0,    0 },
+    { "test",       FORM_TEST,          0x84,       0, 0,    0 },
+    { "shl",        FORM_SHIFT,         0,          4, 0,    0 },
+    { "shr",        FORM_SHIFT,         0,          5, 0,    0 },
+    { "sar",        FORM_SHIFT,         0,          7, 0,    0 },
+    { "not",        FORM_UNARY,         0xf6,       2, 0,    0 },
+    { "neg",        FORM_UNARY,         0xf6,       3, 0,    0 },
+    { "mul",        FORM_UNARY,         0xf6,       4, 0,    0 },
+    { "div",        FORM_UNARY,         0xf6,       6, 0,    0 },
+    { "idiv",       FORM_UNARY,         0xf6,       7, 0,    0 },
+    { "imul",       FORM_IMUL,          0x0faf,     5, 0,    0 },
+    { "lea",        FORM_LEA,           0x8d,       0, 0,    0 },
+    { "push",       FORM_PUSH,          0x50,       6, 0,    0 },
+    { "pop",        FORM_POP,           0x58,       0, 0,    0 },
+    { "movzbw",     FORM_EXTEND,        0x0fb6,     0, 0,    2 },
+    { "movzbl",     FORM_EXTEND,        0x0fb6,     0, 0,    4 },
+    { "movzbq",     FORM_EXTEND,        0x0fb6,     0, 0,    8 },
+    { "movzwl",     FORM_EXTEND,        0x0fb7,     0, 0,    4 },
+    { "movzwq",     FORM_EXTEND,        0x0fb7,     0, 0,    8 },
+    { "movsbw",     FORM_EXTEND,        0x0fbe,     0, 0,    2 },
+    { "movsbl",     FORM_EXTEND,        0x0fbe,     0, 0,    4 },
+    { "movsbq",     FORM_EXTEND,        0x0fbe,     0, 0,    8 },
+    { "movswl",     FORM_EXTEND,        0x0fbf,     0, 0,    4 },
+    { "movswq",     FORM_EXTEND,        0x0fbf,     0, 0,    8 },
+    { "movslq",     FORM_EXTEND,        0x63,       0, 0,    8 },
+    { "bsr",        FORM_REG_RM,        0x0fbd,     0, 0,    0 },
+    { "tzcnt",      FORM_REG_RM,        0x0fbc,     0, 0xf3, 0 },
+    { "addss",      FORM_REG_RM,        0x0f58,     0, 0xf3, 4 },
+    { "addsd",      FORM_REG_RM,        0x0f58,     0, 0xf2, 4 },
+    { "subss",      FORM_REG_RM,        0x0f5c,     0, 0xf3, 4 },
+    { "subsd",      FORM_REG_RM,        0x0f5c,     0, 0xf2, 4 },
+    { "mulss",      FORM_REG_RM,        0x0f59,     0, 0xf3, 4 },
+    { "mulsd",      FORM_REG_RM,        0x0f59,     0, 0xf2, 4 },
+    { "divss",      FORM_REG_RM,        0x0f5e,     0, 0xf3, 4 },
+    { "divsd",      FORM_REG_RM,        0x0f5e,     0, 0xf2, 4 },
+    { "comiss",     FORM_REG_RM,        0x0f2f,     0, 0,    4 },
+    { "comisd",     FORM_REG_RM,        0x0f2f,     0, 0x66, 4 },
+    { "ucomiss",    FORM_REG_RM,        0x0f2e,     0, 0,    4 },
+    { "ucomisd",    FORM_REG_RM,        0x0f2e,     0, 0x66, 4 },
+    { "cvtss2sd",   FORM_REG_RM,        0x0f5a,     0, 0xf3, 4 },
+    { "cvtsd2ss",   FORM_REG_RM,        0x0f5a,     0, 0xf2, 4 },
+    { "cvtsi2ssl",  FORM_REG_RM,        0x0f2a,     0, 0xf3, 4 },
+    { "cvtsi2ssq",  FORM_REG_RM,        0x0f2a,     0, 0xf3, 8 },
+    { "cvtsi2sdl",  FORM_REG_RM,        0x0f2a,     0, 0xf2, 4 },
+    { "cvtsi2sdq",  FORM_REG_RM,        0x0f2a,     0, 0xf2, 8 },
+    { "cvttss2sil", FORM_REG_RM,        0x0f2c,     0, 0xf3, 4 },
+    { "cvttss2siq", FORM_REG_RM,        0x0f2c,     0, 0xf3, 8 },
+    { "cvttsd2sil", FORM_REG_RM,        0x0f2c,     0, 0xf2, 4 },
+    { "cvttsd2siq", FORM_REG_RM,        0x0f2c,     0, 0xf2, 8 },
+    { "movss",      FORM_SSE_MOV,       0x0f10,     0, 0xf3, 4 },
+    { "movsd",      FORM_SSE_MOV,       0x0f10,     0, 0xf2, 4 },
+    { "jmp",        FORM_JMP,           0xe9,       4, 0,    0 },
+    { "call",       FORM_CALL,          0xe8,       2, 0,    0 },
+    { "cltq",       FORM_FIXED,         0x4898,     0, 0,    8 },
+    { "cltd",       FORM_FIXED,         0x99,       0, 0,    4 },
+    { "cqto",       FORM_FIXED,         0x4899,     0, 0,    8 },
+    { "leave",      FORM_FIXED,         0xc9,       0, 0,    0 },
+    { "ret",        FORM_FIXED,         0xc3,       0, 0,    0 },
+    { "fldz",       FORM_FIXED,         0xd9ee,     0, 0,    0 },
+    { "flds",       FORM_X87_MEMORY,    0xd9,       0, 0,    0 },
+    { "fldl",       FORM_X87_MEMORY,    0xdd,       0, 0,    0 },
+    { "fldt",       FORM_X87_MEMORY,    0xdb,       5, 0,    0 },
+    { "fstps",      FORM_X87_MEMORY,    0xd9,       3, 0,    0 },
+    { "fstpl",      FORM_X87_MEMORY,    0xdd,       3, 0,    0 },
+    { "fstpt",      FORM_X87_MEMORY,    0xdb,       7, 0,    0 },
+    { "filds",      FORM_X87_MEMORY,    0xdf,       0, 0,    0 },
+    { "fildl",      FORM_X87_MEMORY,    0xdb,       0, 0,    0 },
+    { "fildq",      FORM_X87_MEMORY,    0xdf,       5, 0,    0 },
+    { "fistps",     FORM_X87_MEMORY,    0xdf,       3, 0,    0 },
+    { "fistpl",     FORM_X87_MEMORY,    0xdb,       3, 0,    0 },
+    { "fistpq",     FORM_X87_MEMORY,    0xdf,       7, 0,    0 },
+    { "fldcw",      FORM_X87_MEMORY,    0xd9,       5, 0,    0 },
+    { "fnstcw",     FORM_X87_MEMORY,    0xd9,       7, 0,    0 },
+    { "fadds",      FORM_X87_MEMORY,    0xd8,       0, 0,    0 },
+    { "fstp",       FORM_X87_REGISTER,  0xddd8,     0, 0,    0 },
+    { "fxch",       FORM_X87_REGISTER,  0xd9c8,     0, 0,    0 },
+    { "faddp",      FORM_X87_REGISTER,  0xdec0,     0, 0,    0 },
+    { "fmulp",      FORM_X87_REGISTER,  0xdec8,     0, 0,    0 },
+    // The GNU assembler swaps fsubp/fsubrp and fdivp/fdivrp compared to the Intel manuals
+    { "fsubp",      FORM_X87_REGISTER,  0xdee0,     0, 0,    0 },
+    { "fsubrp",     FORM_X87_REGISTER,  0xdee8,     0, 0,    0 },
+    { "fdivp",      FORM_X87_REGISTER,  0xdef0,     0, 0,    0 },
+    { "fdivrp",     FORM_X87_REGISTER,  0xdef8,     0, 0,    0 },
+    { "fcomip",     FORM_X87_REGISTER,  0xdff0,     0, 0,    0 },
+    { "fucomip",    FORM_X87_REGISTER,  0xdfe8,     0, 0,    0 },
+    { "fucomi",     FORM_X87_REGISTER,  0xdbe8,     0, 0,    0 },
+    { "fcmovnbe",   FORM_X87_REGISTER,  0xdbd0,     0, 0,    0 },
+    { 0 },
+};
+
+static X86Mnemonic set_mnemonic  = { "set",  FORM_SET,  0x0f90, 0, 0, 1 };
+static X86Mnemonic cmov_mnemonic = { "cmov", FORM_CMOV, 0x0f40, 0, 0, 0 };
+static X86Mnemonic jcc_mnemonic  = { "j",    FORM_JCC,  0x0f80, 0, 0, 0 };
+
+static char *condition_codes[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+// Alternative names for the condition codes
+static char *condition_code_aliases[] = {
+    "c", "2", "nae", "2", "nb", "3", "nc", "3", "z", "4", "nz", "5", "na", "6", "nbe", "7",
+    "pe", "10", "po", "11", "nge", "12", "nl", "13", "ng", "14", "nle", "15", 0,
+};
+
+static char *quad_register_names[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+static char *long_register_names[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+};
+
+static char *word_register_names[] = {
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"
+};
+
+static char *byte_register_names[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+};
+
+static char *xmm_register_names[] = {
+    "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"
+};
+
+static StrMap *mnemonics_map;   // Map of name to X86Mnemonic
+static StrMap *registers_map;   // Map of name to register, with the hardware number in the low 8 bits
+
+static ElfSection *text;
+static List *jumps;
+static List *fixups;
+static List *text_symbols;      // Symbols defined in the .text section
+
+static char *instruction;       // Instruction currently being assembled, for error messages
+static unsigned char code[32];  // Encoding of the current instruction
+static int code_size;
+
+void init_assembler(ElfSection *text_section) {
+    text = text_section;
+    jumps = new_list(1024);
+    fixups = new_list(1024);
+    text_symbols = new_list(1024);
+
+    mnemonics_map = new_strmap();
+    for (X86Mnemonic *m = mnemonics; m->name; m++) strmap_put(mnemonics_map, m->name, m);
+
+    registers_map = new_strmap();
+    for (int i = 0; i < 16; i++) {
+        strmap_put(registers_map, quad_register_names[i], (void *) (long) ((REGISTER_CLASS_GPR << 16) + (8 << 8) + i));
+        strmap_put(registers_map, long_register_names[i], (void *) (long) ((REGISTER_CLASS_GPR << 16) + (4 << 8) + i));
+        strmap_put(registers_map, word_register_names[i], (void *) (long) ((REGISTER_CLASS_GPR << 16) + (2 << 8) + i));
+        strmap_put(registers_map, byte_register_names[i], (void *) (long) ((REGISTER_CLASS_GPR << 16) + (1 << 8) + i));
+    }
+
+    for (int i = 0; i < 16; i++)
+        strmap_put(registers_map, xmm_register_names[i], (void *) (long) ((REGISTER_CLASS_XMM << 16) + (16 << 8) + i));
+}
+
+void free_assembler(void) {
+    for (int i = 0; i < jumps->length; i++) wfree(jumps->elements[i]);
+    free_list(jumps);
+    for (int i = 0; i < fixups->length; i++) wfree(fixups->elements[i]);
+    free_list(fixups);
+    free_list(text_symbols);
+    free_strmap(mnemonics_map);
+    free_strmap(registers_map);
+}
+
+static int find_condition_code(char *name) {
+    for (int i = 0; i < 16; i++)
+        if (!strcmp(condition_codes[i], name)) return i;
+
+    for (int i = 0; condition_code_aliases[i]; i += 2)
+        if (!strcmp(condition_code_aliases[i], name)) return atoi(condition_code_aliases[i + 1]);
+
+    return -1;
+}
+
+static int is_suffix(char c) {
+    return c == 'b' || c == 'w' || c == 'l' || c == 'q';
+}
+
+static int suffix_size(char c) {
+    return c == 'b' ? 1 : c == 'w' ? 2 : c == 'l' ? 4 : 8;
+}
+
+// Find a mnemonic, the operand size given by its suffix and a condition code, if any
+static X86Mnemonic *find_mnemonic(char *name, int *size, int *condition) {
+    *size = 0;
+    *condition = -1;
+
+    X86Mnemonic *m = strmap_get(mnemonics_map, name);
+    if (m) {
+        *size = m->size;
+        return m;
+    }
+
+    int length = strlen(name);
+
+    if (length > 3 && !memcmp(name, "set", 3) && (*condition = find_condition_code(name + 3)) != -1) {
+        *size = 1;
+        return &set_mnemonic;
+    }
+
+    if (length > 1 && name[0] == 'j' && (*condition = find_condition_code(name + 1)) != -1)
+        return &jcc_mnemonic;
+
+    if (length > 4 && !memcmp(name, "cmov", 4)) {
+        if ((*condition = find_condition_code(name + 4)) != -1) return &cmov_mnemonic;
+
+        char *cc = wstrdup(name + 4);
+        cc[length - 5] = 0;
+        *condition = find_condition_code(cc);
+        wfree(cc);
+        if (*condition != -1) {
+            *size = suffix_size(name[length - 1]);
+            return &cmov_mnemonic;
+        }
+    }
+
+    if (length > 1 && is_suffix(name[length - 1])) {
+        char *base = wstrdup(name);
+        base[length - 1] = 0;
+        m = strmap_get(mnemonics_map, base);
+        wfree(base);
+
+        if (m && !m->size) {
+            *size = suffix_size(name[length - 1]);
+            return m;
+        }
+    }
+
+    panic("Unknown instruction %s", instruction);
+}
+
+static int is_symbol_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '$';
+}
+
+// Parse a register starting at the % and return a pointer to the character following it
+static char *parse_register(char *p, X86Operand *operand) {
+    if (*p != '%') panic("Expected register in %s", instruction);
+    p++;
+
+    char name[8];
+    int length = 0;
+    while (((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')) && length < 7) name[length++] = *p++;
+    name[length] = 0;
+
+    operand->kind = OPERAND_REGISTER;
+
+    if (!strcmp(name, "st")) {
+        operand->register_class = REGISTER_CLASS_X87;
+        operand->reg = 0;
+        if (*p == '(') {
+            operand->reg = p[1] - '0';
+            p += 3;
+        }
+        return p;
+    }
+
+    if (!strcmp(name, "rip")) {
+        operand->reg = REGISTER_RIP;
+        operand->size = 8;
+        return p;
+    }
+
+    long value = (long) strmap_get(registers_map, name);
+    if (!value) panic("Unknown register %%%s in %s", name, instruction);
+
+    operand->register_class = value >> 16;
+    operand->size = (value >> 8) & 0xff;
+    operand->reg = value & 0xff;
+
+    return p;
+}
+
+// Parse an operand and return a pointer to the character following it
+static char *parse_operand(char *p, X86Operand *operand) {
+    memset(operand, 0, sizeof(X86Operand));
+    operand->base = -1;
+    operand->index = -1;
+    operand->scale = 1;
+
+    if (*p == '*') {
+        operand->is_indirect = 1;
+        p++;
+    }
+
+    if (*p == '%') return parse_register(p, operand);
+
+    if (*p == '$') {
+        operand->kind = OPERAND_IMMEDIATE;
+        operand->value = strtol(p + 1, &p, 0);
+        return p;
+    }
+
+    operand->kind = OPERAND_MEMORY;
+
+    // Displacement, made of an optional symbol and numbers
+    if (is_symbol_char(*p) && !(*p >= '0' && *p <= '9')) {
+        char *start = p;
+        while (is_symbol_char(*p)) p++;
+        char *name = wmalloc(p - start + 1);
+        memcpy(name, start, p - start);
+        name[p - start] = 0;
+        operand->symbol = get_elf_symbol(name);
+        wfree(name);
+
+        if (*p == '@') {
+                 if (!memcmp(p, "@GOTPCREL", 9)) { operand->is_got = 1; p += 9; }
+            else if (!memcmp(p, "@PLT", 4)) p += 4;
+            else panic("Unknown symbol modifier in %s", instruction);
+        }
+    }
+
+    while (*p == ' ') p++;
+    while ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+') {
+        operand->value += strtol(p, &p, 0);
+        while (*p == ' ') p++;
+    }
+
+    if (*p == '(') {
+        p++;
+        X86Operand reg;
+        if (*p == '%') {
+            p = parse_register(p, &reg);
+            operand->base = reg.reg;
+        }
+        if (*p == ',') {
+            p = parse_register(p + 1, &reg);
+            operand->index = reg.reg;
+            if (*p == ',') operand->scale = strtol(p + 1, &p, 10);
+        }
+        if (*p != ')') panic("Expected ) in %s", instruction);
+        p++;
+    }
+
+    return p;
+}
+
+static int fits_in_byte(long value) {
+    return value >= -128 && value <= 127;
+}
+
+static int fits_in_int(long value) {
+    return value >= -2147483648L && value <= 2147483647L;
+}
+
+// Sign extend an immediate from the operand size, the way the CPU sees it
+static long sign_extend(long value, int size) {
+         if (size == 1) return (char) value;
+    else if (size == 2) return (short) value;
+    else if (size == 4) return (int) value;
+    else return value;
+}
+
+static void emit_byte(int value) {
+    code[code_size++] = value;
+}
+
+static void emit_value(long value, int size) {
+    for (int i = 0; i < size; i++) {
+        code[code_size++] = value;
+        value >>= 8;
+    }
+}
+
+static void emit_opcode(int opcode) {
+    if (opcode > 0xffff) emit_byte(opcode >> 16);
+    if (opcode > 0xff) emit_byte(opcode >> 8);
+    emit_byte(opcode);
+}
+
+static void add_fixup(ElfSymbol *symbol, int type, long addend) {
+    Fixup *fixup = wmalloc(sizeof(Fixup));
+    fixup->offset = text->size + code_size;
+    fixup->symbol = symbol;
+    fixup->type = type;
+    fixup->addend = addend;
+    append_to_list(fixups, fixup);
+}
+
+// spl, bpl, sil and dil can only be encoded with a REX prefix
+static int is_rex_byte_register(X86Operand *operand) {
+    return operand && operand->kind == OPERAND_REGISTER && operand->register_class == REGISTER_CLASS_GPR &&
+        operand->size == 1 && operand->reg >= 4 && operand->reg <= 7;
+}
+
+// Emit an instruction with a ModR/M byte. The reg field is either a register in
+// reg_operand or an opcode extension in digit.
+static void emit_modrm_instruction(int prefix, int rex_w, int opcode, int digit, X86Operand *reg_operand, X86Operand *rm, int immediate_size, long immediate) {
+    int reg = reg_operand ? reg_operand->reg : digit;
+    int rex = rex_w ? REX_W : 0;
+    int need_rex = is_rex_byte_register(reg_operand) || is_rex_byte_register(rm);
+
+    if (reg >= 8) rex |= REX_R;
+
+    if (rm->kind == OPERAND_REGISTER) {
+        if (rm->reg >= 8) rex |= REX_B;
+    }
+    else {
+        if (rm->base >= 8) rex |= REX_B;
+        if (rm->index >= 8) rex |= REX_X;
+    }
+
+    if (prefix) emit_byte(prefix);
+    if (rex || need_rex) emit_byte(0x40 | rex);
+    emit_opcode(opcode);
+
+    reg &= 7;
+
+    if (rm->kind == OPERAND_REGISTER)
+        emit_byte(0xc0 | (reg << 3) | (rm->reg & 7));
+
+    else if (rm->base == REGISTER_RIP) {
+        emit_byte(0x05 | (reg << 3));
+        if (rm->symbol) {
+            int type = R_X86_64_PC32;
+            if (rm->is_got) type = opcode != 0x8b ? R_X86_64_GOTPCREL : rex ? R_X86_64_REX_GOTPCRELX : R_X86_64_GOTPCRELX;
+            add_fixup(rm->symbol, type, rm->value - 4 - immediate_size);
+            emit_value(0, 4);
+        }
+        else
+            emit_value(rm->value, 4);
+    }
+
+    else {
+        if (rm->base == -1 || rm->symbol) panic("Unsupported memory operand in %s", instruction);
+
+        int mod = !rm->value && (rm->base & 7) != 5 ? 0 : fits_in_byte(rm->value) ? 1 : 2;
+
+        if (rm->index == -1 && (rm->base & 7) != 4)
+            emit_byte((mod << 6) | (reg << 3) | (rm->base & 7));
+        else {
+            int scale = rm->scale == 1 ? 0 : rm->scale == 2 ? 1 : rm->scale == 4 ? 2 : 3;
+            int index = rm->index == -1 ? 4 : rm->index & 7;
+            emit_byte((mod << 6) | (reg << 3) | 4);
+            emit_byte((scale << 6) | (index << 3) | (rm->base & 7));
+        }
+
+        if (mod == 1) emit_value(rm->value, 1);
+        else if (mod == 2) emit_value(rm->value, 4);
+    }
+
+    if (immediate_size) emit_value(immediate, immediate_size);
+}
+
+// Emit an instruction with the register encoded in the low three bits of the opcode
+static void emit_opcode_register_instruction(int prefix, int rex_w, int opcode, X86Operand *operand) {
+    int rex = rex_w ? REX_W : 0;
+    if (operand->reg >= 8) rex |= REX_B;
+
+    if (prefix) emit_byte(prefix);
+    if (rex || is_rex_byte_register(operand)) emit_byte(0x40 | rex);
+    emit_byte(opcode + (operand->reg & 7));
+}
+
+// Add a jump to a label. It's emitted in the long form and possibly shortened later on.
+static void emit_jump(int condition, X86Operand *target) {
+    if (target->kind != OPERAND_MEMORY || !target->symbol || target->base != -1) panic("Invalid jump target in %s", instruction);
+
+    Jump *jump = wmalloc(sizeof(Jump));
+    jump->offset = text->size;
+    jump->condition = condition;
+    jump->target = target->symbol;
+    jump->is_long = 0;
+    append_to_list(jumps, jump);
+
+    if (condition == -1) {
+        emit_byte(0xe9);
+        emit_value(0, 4);
+    }
+    else {
+        emit_opcode(0x0f80 + condition);
+        emit_value(0, 4);
+    }
+}
+
+// Determine the operand size from the suffix or the register operands
+static int get_operand_size(int size, X86Operand *operands, int operand_count) {
+    if (size) return size;
+
+    for (int i = operand_count - 1; i >= 0; i--)
+        if (operands[i].kind == OPERAND_REGISTER && operands[i].register_class == REGISTER_CLASS_GPR) return operands[i].size;
+
+    panic("Unable to determine operand size in %s", instruction);
+}
+
+static void assemble_alu(X86Mnemonic *m, int size, X86Operand *src, X86Operand *dst) {
+    int prefix = size == 2 ? 0x66 : 0;
+    int rex_w = size == 8;
+
+    if (src->kind == OPERAND_IMMEDIATE) {
+        long value = sign_extend(src->value, size);
+        int is_accumulator = dst->kind == OPERAND_REGISTER && dst->reg == 0;
+
+        if (size == 1) {
+            if (is_accumulator) { emit_byte(m->opcode + 4); emit_value(value, 1); }
+            else emit_modrm_instruction(0, 0, 0x80, m->digit, 0, dst, 1, value);
+        }
+        else if (fits_in_byte(value))
+            emit_modrm_instruction(prefix, rex_w, 0x83, m->digit, 0, dst, 1, value);
+        else {
+            int immediate_size = size == 2 ? 2 : 4;
+            if (!fits_in_int(value)) panic("Immediate out of range in %s", instruction);
+            if (is_accumulator) {
+                if (prefix) emit_byte(prefix);
+                if (rex_w) emit_byte(0x40 | REX_W);
+                emit_byte(m->opcode + 5);
+                emit_value(value, immediate_size);
+            }
+            else
+                emit_modrm_instruction(prefix, rex_w, 0x81, m->digit, 0, dst, immediate_size, value);
+        }
+    }
+    else if (src->kind == OPERAND_REGISTER)
+        emit_modrm_instruction(prefix, rex_w, m->opcode + (size == 1 ? 0 : 1), 0, src, dst, 0, 0);
+    else
+        emit_modrm_instruction(prefix, rex_w, m->opcode + (size == 1 ? 2 : 3), 0, dst, src, 0, 0);
+}
+
+static int is_xmm(X86Operand *operand) {
+    return operand->kind == OPERAND_REGISTER && operand->register_class == REGISTER_CLASS_XMM;
+}
+
+static void assemble_mov(int size, X86Operand *operands, int operand_count) {
+    X86Operand *src = &operands[0];
+    X86Operand *dst = &operands[1];
+
+    // movq with xmm registers
+    if (is_xmm(src) || is_xmm(dst)) {
+        if (is_xmm(dst) && (is_xmm(src) || src->kind == OPERAND_MEMORY))
+            emit_modrm_instruction(0xf3, 0, 0x0f7e, 0, dst, src, 0, 0);
+        else if (is_xmm(src) && dst->kind == OPERAND_MEMORY)
+            emit_modrm_instruction(0x66, 0, 0x0fd6, 0, src, dst, 0, 0);
+        else if (is_xmm(dst))
+            emit_modrm_instruction(0x66, 1, 0x0f6e, 0, dst, src, 0, 0);
+        else
+            emit_modrm_instruction(0x66, 1, 0x0f7e, 0, src, dst, 0, 0);
+        return;
+    }
+
+    size = get_operand_size(size, operands, operand_count);
+    int prefix = size == 2 ? 0x66 : 0;
+    int rex_w = size == 8;
+
+    if (src->kind == OPERAND_IMMEDIATE) {
+        long value = sign_extend(src->value, size);
+        if (dst->kind == OPERAND_REGISTER) {
+            if (size == 8 && !fits_in_int(value)) {
+                emit_opcode_register_instruction(0, 1, 0xb8, dst);
+                emit_value(value, 8);
+            }
+            else if (size == 8)
+                emit_modrm_instruction(0, 1, 0xc7, 0, 0, dst, 4, value);
+            else {
+                emit_opcode_register_instruction(prefix, 0, size == 1 ? 0xb0 : 0xb8, dst);
+                emit_value(value, size);
+            }
+        }
+        else {
+            if (!fits_in_int(value)) panic("Immediate out of range in %s", instruction);
+            emit_modrm_instruction(prefix, rex_w, size == 1 ? 0xc6 : 0xc7, 0, 0, dst, size == 8 ? 4 : size, value);
+        }
+    }
+    else if (src->kind == OPERAND_REGISTER)
+        emit_modrm_instruction(prefix, rex_w, size == 1 ? 0x88 : 0x89, 0, src, dst, 0, 0);
+    else
+        emit_modrm_instruction(prefix, rex_w, size == 1 ? 0x8a : 0x8b, 0, dst, src, 0, 0);
+}
+
+static void assemble_test(int size, X86Operand *src, X86Operand *dst) {
+    int prefix = size == 2 ? 0x66 : 0;
+    int rex_w = size == 8;
+
+    if (src->kind == OPERAND_IMMEDIATE) {
+        int immediate_size = size == 8 ? 4 : size;
+        if (dst->kind == OPERAND_REGISTER && dst->reg == 0) {
+            if (prefix) emit_byte(prefix);
+            if (rex_w) emit_byte(0x40 | REX_W);
+            emit_byte(size == 1 ? 0xa8 : 0xa9);
+            emit_value(src->value, immediate_size);
+        }
+        else
+            emit_modrm_instruction(prefix, rex_w, size == 1 ? 0xf6 : 0xf7, 0, 0, dst, immediate_size, src->value);
+    }
+    else if (src->kind == OPERAND_REGISTER)
+        emit_modrm_instruction(prefix, rex_w, size == 1 ? 0x84 : 0x85, 0, src, dst, 0, 0);
+    else
+        emit_modrm_instruction(prefix, rex_w, size == 1 ? 0x84 : 0x85, 0, dst, src, 0, 0);
+}
+
+static void assemble_shift(X86Mnemonic *m, int size, X86Operand *operands, int operand_count) {
+    int prefix = size == 2 ? 0x66 : 0;
+    int rex_w = size == 8;
+    int byte_adjust = size == 1 ? 0 : 1;
+    X86Operand *dst = &operands[operand_count - 1];
+
+    if (operand_count == 1 || (operands[0].kind == OPERAND_IMMEDIATE && operands[0].value == 1))
+        emit_modrm_instruction(prefix, rex_w, 0xd0 + byte_adjust, m->digit, 0, dst, 0, 0);
+    else if (operands[0].kind == OPERAND_IMMEDIATE)
+        emit_modrm_instruction(prefix, rex_w, 0xc0 + byte_adjust, m->digit, 0, dst, 1, operands[0].value);
+    else
+        emit_modrm_instruction(prefix, rex_w, 0xd2 + byte_adjust, m->digit, 0, dst, 0, 0);
+}
+
+static void assemble_imul(X86Mnemonic *m, int size, X86Operand *operands, int operand_count) {
+    int prefix = size == 2 ? 0x66 : 0;
+    int rex_w = size == 8;
+
+    if (operand_count == 1) {
+        emit_modrm_instruction(prefix, rex_w, size == 1 ? 0xf6 : 0xf7, m->digit, 0, &operands[0], 0, 0);
+        return;
+    }
+
+    if (operands[0].kind == OPERAND_IMMEDIATE) {
+        // imul $imm, src, dst or imul $imm, dst
+        X86Operand *dst = &operands[operand_count - 1];
+        X86Operand *src = &operands[1];
+        long value = sign_extend(operands[0].value, size);
+        if (fits_in_byte(value))
+            emit_modrm_instruction(prefix, rex_w, 0x6b, 0, dst, src, 1, value);
+        else
+            emit_modrm_instruction(prefix, rex_w, 0x69, 0, dst, src, size == 2 ? 2 : 4, value);
+        return;
+    }
+
+    emit_modrm_instruction(prefix, rex_w, m->opcode, 0, &operands[1], &operands[0], 0, 0);
+}
+
+static void assemble_push(X86Mnemonic *m, X86Operand *operand) {
+    if (operand->kind == OPERAND_REGISTER)
+        emit_opcode_register_instruction(0, 0, m->opcode, operand);
+    else if (operand->kind == OPERAND_IMMEDIATE) {
+        if (fits_in_byte(operand->value)) {
+            emit_byte(0x6a);
+            emit_value(operand->value, 1);
+        }
+        else {
+            emit_byte(0x68);
+            emit_value(operand->value, 4);
+        }
+    }
+    else
+        emit_modrm_instruction(0, 0, 0xff, m->digit, 0, operand, 0, 0);
+}
+
+// Call to a symbol or an indirect call
+static void assemble_call(X86Mnemonic *m, X86Operand *operand) {
+    if (operand->is_indirect) {
+        emit_modrm_instruction(0, 0, 0xff, m->digit, 0, operand, 0, 0);
+        return;
+    }
+
+    if (operand->kind != OPERAND_MEMORY || !operand->symbol || operand->base != -1) panic("Invalid call target in %s", instruction);
+
+    emit_byte(m->opcode);
+    add_fixup(operand->symbol, R_X86_64_PLT32, operand->value - 4);
+    emit_value(0, 4);
+}
+
+// Assemble an x86 instruction in AT&T syntax and add it to the .text section
+void assemble_x86_instruction(char *x86_instruction) {
+    instruction = x86_instruction;
+    code_size = 0;
+
+    char *p = instruction;
+    while (*p == ' ') p++;
+
+    char name[16];
+    int length = 0;
+    while (*p && *p != ' ' && length < 15) name[length++] = *p++;
+    name[length] = 0;
+
+    X86Operand operands[3];
+    int operand_count = 0;
+    while (*p == ' ') p++;
+    while (*p) {
+        if (operand_count == 3) panic("Too many operands in %s", instruction);
+        p = parse_operand(p, &operands[operand_count++]);
+        while (*p == ' ') p++;
+        if (*p == ',') p++;
+        else if (*p && *p != '#') panic("Unexpected %c in %s", *p, instruction);
+        else break;
+        while (*p == ' ') p++;
+    }
+
+    int size;
+    int condition;
+    X86Mnemonic *m = find_mnemonic(name, &size, &condition);
+
+    X86Operand *src = &operands[0];
+    X86Operand *dst = &operands[operand_count - 1];
+
+    switch (m->form) {
+        case FORM_ALU:
+            assemble_alu(m, get_operand_size(size, operands, operand_count), src, dst);
+            break;
+
+        case FORM_MOV:
+            assemble_mov(size, operands, operand_count);
+            break;
+
+        case FORM_MOVABS:
+            emit_opcode_register_instruction(0, 1, m->opcode, dst);
+            emit_value(src->value, 8);
+            break;
+
+        case FORM_TEST:
+            assemble_test(get_operand_size(size, operands, operand_count), src, dst);
+            break;
+
+        case FORM_SHIFT:
+            assemble_shift(m, get_operand_size(size, operands, operand_count), operands, operand_count);
+            break;
+
+        case FORM_UNARY:
+            size = get_operand_size(size, operands, operand_count);
+            emit_modrm_instruction(size == 2 ? 0x66 : 0, size == 8, size == 1 ? m->opcode : m->opcode + 1, m->digit, 0, dst, 0, 0);
+            break;
+
+        case FORM_IMUL:
+            assemble_imul(m, get_operand_size(size, operands, operand_count), operands, operand_count);
+            break;
+
+        case FORM_LEA:
+            size = get_operand_size(size, operands, operand_count);
+            emit_modrm_instruction(size == 2 ? 0x66 : 0, size == 8, m->opcode, 0, dst, src, 0, 0);
+            break;
+
+        case FORM_PUSH:
+            assemble_push(m, src);
+            break;
+
+        case FORM_POP:
+            emit_opcode_register_instruction(0, 0, m->opcode, src);
+            break;
+
+        case FORM_EXTEND:
+            emit_modrm_instruction(size == 2 ? 0x66 : 0, size == 8, m->opcode, 0, dst, src, 0, 0);
+            break;
+
+        case FORM_REG_RM:
+        case FORM_CMOV:
+            if (m->form == FORM_CMOV || !m->size) size = get_operand_size(size, operands, operand_count);
+            if (m->form == FORM_CMOV)
+                emit_modrm_instruction(size == 2 ? 0x66 : 0, size == 8, m->opcode + condition, 0, dst, src, 0, 0);
+            else
+                emit_modrm_instruction(size == 2 ? 0x66 : m->prefix, size == 8, m->opcode, 0, dst, src, 0, 0);
+            break;
+
+        case FORM_SSE_MOV:
+            if (dst->kind == OPERAND_MEMORY)
+                emit_modrm_instruction(m->prefix, 0, m->opcode + 1, 0, src, dst, 0, 0);
+            else
+                emit_modrm_instruction(m->prefix, 0, m->opcode, 0, dst, src, 0, 0);
+            break;
+
+        case FORM_SET:
+            emit_modrm_instruction(0, 0, m->opcode + condition, 0, 0, dst, 0, 0);
+            break;
+
+        case FORM_JCC:
+            emit_jump(condition, src);
+            break;
+
+        case FORM_JMP:
+            if (src->is_indirect)
+                emit_modrm_instruction(0, 0, 0xff, m->digit, 0, src, 0, 0);
+            else
+                emit_jump(-1, src);
+            break;
+
+        case FORM_CALL:
+            assemble_call(m, src);
+            break;
+
+        case FORM_FIXED:
+            emit_opcode(m->opcode);
+            break;
+
+        case FORM_X87_MEMORY:
+            emit_modrm_instruction(0, 0, m->opcode, m->digit, 0, src, 0, 0);
+            break;
+
+        case FORM_X87_REGISTER: {
+            // The register is the one that isn't %st, or %st(1) if there are no operands
+            int reg = operand_count ? 0 : 1;
+            for (int i = 0; i < operand_count; i++)
+                if (operands[i].reg > reg) reg = operands[i].reg;
+            emit_opcode(m->opcode + reg);
+            break;
+        }
+
+        default:
+            panic("Unhandled form %d in %s", m->form, instruction);
+    }
+
+    elf_section_append(text, code, code_size);
+}
+
+// Define a label at the current position in the .text section
+void assemble_label(ElfSymbol *symbol) {
+    define_elf_symbol(symbol, text, text->size);
+    append_to_list(text_symbols, symbol);
+}
+
+// Return the index of the first jump at or after offset
+static int find_jump(int offset) {
+    int low = 0;
+    int high = jumps->length;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        Jump *jump = jumps->elements[middle];
+        if (jump->offset < offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+// Translate an offset in the unrelaxed code to an offset in the relaxed code. shrinkage
+// has the cumulative amount of bytes saved by short jumps.
+static int relaxed_offset(int *shrinkage, int offset) {
+    return offset - shrinkage[find_jump(offset)];
+}
+
+static int long_jump_size(Jump *jump) {
+    return jump->condition == -1 ? 5 : 6;
+}
+
+static int is_local_text_symbol(ElfSymbol *symbol) {
+    return symbol->section == text && symbol->binding == STB_LOCAL;
+}
+
+static void write_int(char *data, int value) {
+    for (int i = 0; i < 4; i++) {
+        data[i] = value;
+        value >>= 8;
+    }
+}
+
+// Shorten jumps, resolve references to local labels and add relocations for everything else
+void finish_assembler(void) {
+    int *shrinkage = wcalloc(jumps->length + 1, sizeof(int));
+
+    // Jumps to other sections or to global symbols are always long
+    for (int i = 0; i < jumps->length; i++) {
+        Jump *jump = jumps->elements[i];
+        if (!is_local_text_symbol(jump->target)) jump->is_long = 1;
+    }
+
+    // Start with all jumps short and make them long until nothing changes
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (int i = 0; i < jumps->length; i++) {
+            Jump *jump = jumps->elements[i];
+            shrinkage[i + 1] = shrinkage[i] + (jump->is_long ? 0 : long_jump_size(jump) - 2);
+        }
+
+        for (int i = 0; i < jumps->length; i++) {
+            Jump *jump = jumps->elements[i];
+            if (jump->is_long) continue;
+
+            int end = relaxed_offset(shrinkage, jump->offset) + 2;
+            int displacement = relaxed_offset(shrinkage, jump->target->value) - end;
+            if (!fits_in_byte(displacement)) {
+                jump->is_long = 1;
+                changed = 1;
+            }
+        }
+    }
+
+    // Move the symbols
+    for (int i = 0; i < text_symbols->length; i++) {
+        ElfSymbol *symbol = text_symbols->elements[i];
+        int end = symbol->value + symbol->size;
+        symbol->value = relaxed_offset(shrinkage, symbol->value);
+        if (symbol->size) symbol->size = relaxed_offset(shrinkage, end) - symbol->value;
+    }
+
+    // Make the final code. The code between the jumps is copied over and the fixups in
+    // it are resolved, so that the relocations end up in order of offset.
+    char *data = wmalloc(text->size + 1);
+    int size = 0;
+    int position = 0;
+    int fixup_index = 0;
+    for (int i = 0; i <= jumps->length; i++) {
+        Jump *jump = i < jumps->length ? jumps->elements[i] : 0;
+        int end = jump ? jump->offset : text->size;
+        memcpy(data + size, text->data + position, end - position);
+        size += end - position;
+
+        for (; fixup_index < fixups->length; fixup_index++) {
+            Fixup *fixup = fixups->elements[fixup_index];
+            if (fixup->offset >= end) break;
+
+            int offset = relaxed_offset(shrinkage, fixup->offset);
+            if (is_local_text_symbol(fixup->symbol) && (fixup->type == R_X86_64_PC32 || fixup->type == R_X86_64_PLT32))
+                write_int(data + offset, fixup->symbol->value + fixup->addend - offset);
+            else
+                add_elf_relocation(text, offset, fixup->symbol, fixup->type, fixup->addend);
+        }
+
+        if (!jump) break;
+
+        position = jump->offset + long_jump_size(jump);
+        int target = jump->target->value;
+
+        if (!jump->is_long) {
+            data[size++] = jump->condition == -1 ? 0xeb : 0x70 + jump->condition;
+            data[size] = target - (size + 1);
+            size++;
+        }
+        else {
+            if (jump->condition == -1)
+                data[size++] = 0xe9;
+            else {
+                data[size++] = 0x0f;
+                data[size++] = 0x80 + jump->condition;
+            }
+
+            if (is_local_text_symbol(jump->target))
+                write_int(data + size, target - (size + 4));
+            else {
+                write_int(data + size, 0);
+                add_elf_relocation(text, size, jump->target, R_X86_64_PLT32, -4);
+            }
+            size += 4;
+        }
+    }
+
+    wfree(text->data);
+    text->data = data;
+    text->size = size;
+    text->allocated = text->size + 1;
+
+    wfree(shrinkage);
+}
@@ -0,0 +1,869 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcc.h"
+
+// Bottom up rewrite system (BURS) states for tiling instruction trees.
+//
+// Each node in an instruction tree is labelled with a state. A state has an item for
+// each non terminal the node's subtree can be reduced to, with the cheapest rule that
+// does it. Item costs are relative to the cheapest item, so that the same state turns
+// up over and over again. The state of an operation node only depends on the
+// operation, the states of its operands and what its dst must match, so labelling a
+// node is a lookup in a table of transitions.
+//
+// All reachable states can't be worked out ahead of time, since the partial matches of
+// the many multi level rules combine into far too many states. instrgen works out
+// what doesn't depend on the operand states and writes it to instrrules-generated.c:
+// the states of leaves, and for each operation what rule dsts each context (i.e. what
+// an operation's dst must match) allows. The transitions and the states they lead to
+// are worked out the first time they are needed and are then looked up.
+//
+// To make transitions reusable, operand states are mapped to representers, which only
+// have the non terminals the operation's rules use for the operand. Ties between equally
+// cheap rules go to the rule with the lowest index.
+
+enum {
+    INITIAL_TRANSITIONS_SIZE = 1024,
+
+    // Contexts. Context zero is for operations without a dst.
+    TYPE_CONTEXTS = 1,                                          // The dst type must match
+    ROOT_CONTEXTS = 1 + AUTO_NON_TERMINAL_START * VTC_COUNT,    // The dst must match exactly
+    CONTEXT_COUNT = 1 + 2 * AUTO_NON_TERMINAL_START * VTC_COUNT,
+};
+
+// A growable array of ints
+typedef struct int_array {
+    int *elements;
+    int length;
+    int allocated;
+} IntArray;
+
+// Hash consed sequences of ints. Each distinct sequence gets an id.
+typedef struct sequences {
+    IntArray *values;    // All sequences, back to back
+    IntArray *starts;    // Start of each sequence in values, count + 1 entries
+    int *table;          // Open addressed hash table of ids + 1
+    int table_size;
+} Sequences;
+
+// The state for an operation index, context and operand representers
+typedef struct transition {
+    int index;
+    int context;
+    int representer1;
+    int representer2;
+    int state;
+} Transition;
+
+BursTables *burs_tables;
+
+static BursTables *made_tables;          // Tables made by remake_burs_tables()
+
+static Sequences *states;                // Non terminal, rule, cost triples, sorted by non terminal
+static IntArray *root_rules;             // Cheapest rule of each state
+static int operation_limit;
+static int operation_count;
+static int *operation_indexes;           // Index + 1 by operand count - 1 & operation
+static List **operation_rules;           // Rules for each operation index
+static int *operation_operand_counts;
+static char **operand_non_terminals;     // Which non terminals the rules use for an operation index & operand
+static Sequences **representers;         // Non terminal, cost pairs for an operation index & operand
+static IntArray **state_representers;    // Representer + 1 of each state for an operation index & operand
+static Transition *transitions;          // Open addressed hash table of transitions
+static int transitions_size;
+static int transitions_count;
+
+// Scratch space for making states, indexed by non terminal
+static int *best_costs;
+static int *best_rules;
+static IntArray *best_non_terminals;
+static int *src1_costs;
+static int *src2_costs;
+static char *allowed_dsts;
+
+static IntArray *new_int_array(void) {
+    IntArray *a = wcalloc(1, sizeof(IntArray));
+    a->allocated = 16;
+    a->elements = wmalloc(a->allocated * sizeof(int));
+
+    return a;
+}
+
+static void free_int_array(IntArray *a) {
+    wfree(a->elements);
+    wfree(a);
+}
+
+static void append_int(IntArray *a, int value) {
+    if (a->length == a->allocated) {
+        a->allocated *= 2;
+        a->elements = wrealloc(a->elements, a->allocated * sizeof(int));
+    }
+
+    a->elements[a->length++] = value;
+}
+
+static Sequences *new_sequences(void) {
+    Sequences *s = wcalloc(1, sizeof(Sequences));
+    s->values = new_int_array();
+    s->starts = new_int_array();
+    append_int(s->starts, 0);
+    s->table_size = 64;
+    s->table = wcalloc(s->table_size, sizeof(int));
+
+    return s;
+}
+
+static void free_sequences(Sequences *s) {
+    free_int_array(s->values);
+    free_int_array(s->starts);
+    wfree(s->table);
+    wfree(s);
+}
+
+#define sequence_count(s) ((s)->starts->length - 1)
+#define sequence_values(s, id) (&(s)->values->elements[(s)->starts->elements[id]])
+#define sequence_length(s, id) ((s)->starts->elements[(id) + 1] - (s)->starts->elements[id])
+
+static unsigned int hash_ints(int *values, int length) {
+    unsigned int hash = 2166136261;
+    for (int i = 0; i < length; i++) hash = (hash ^ values[i]) * 16777619;
+
+    return hash;
+}
+
+static void grow_sequences_table(Sequences *s) {
+    int new_size = s->table_size * 2;
+    int mask = new_size - 1;
+    int *new_table = wcalloc(new_size, sizeof(int));
+
+    for (int id = 0; id < sequence_count(s); id++) {
+        unsigned int pos = hash_ints(sequence_values(s, id), sequence_length(s, id)) & mask;
+        while (new_table[pos]) pos = (pos + 1) & mask;
+        new_table[pos] = id + 1;
+    }
+
+    wfree(s->table);
+    s->table = new_table;
+    s->table_size = new_size;
+}
+
+// Return the id of a sequence, adding it if it isn't there yet
+static int intern_sequence(Sequences *s, int *values, int length, int *is_new) {
+    int mask = s->table_size - 1;
+    unsigned int pos = hash_ints(values, length) & mask;
+
+    int id;
+    while ((id = s->table[pos])) {
+        id--;
+        if (sequence_length(s, id) == length && !memcmp(sequence_values(s, id), values, length * sizeof(int))) {
+            if (is_new) *is_new = 0;
+            return id;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    id = sequence_count(s);
+    for (int i = 0; i < length; i++) append_int(s->values, values[i]);
+    append_int(s->starts, s->values->length);
+    s->table[pos] = id + 1;
+    if (sequence_count(s) * 2 >= s->table_size) grow_sequences_table(s);
+
+    if (is_new) *is_new = 1;
+    return id;
+}
+
+static void init_scratch_space(void) {
+    best_costs = wmalloc(AUTO_NON_TERMINAL_END * sizeof(int));
+    best_rules = wmalloc(AUTO_NON_TERMINAL_END * sizeof(int));
+    src1_costs = wmalloc(AUTO_NON_TERMINAL_END * sizeof(int));
+    src2_costs = wmalloc(AUTO_NON_TERMINAL_END * sizeof(int));
+    for (int i = 0; i < AUTO_NON_TERMINAL_END; i++) {
+        best_costs[i] = -1;
+        src1_costs[i] = -1;
+        src2_costs[i] = -1;
+    }
+    best_non_terminals = new_int_array();
+    allowed_dsts = wcalloc(AUTO_NON_TERMINAL_END, sizeof(char));
+}
+
+static void free_scratch_space(void) {
+    wfree(best_costs);
+    wfree(best_rules);
+    free_int_array(best_non_terminals);
+    wfree(src1_costs);
+    wfree(src2_costs);
+    wfree(allowed_dsts);
+}
+
+// Add a rule to the state being made, keeping the cheapest rule for each non terminal
+static void add_to_state(Rule *r, int cost) {
+    int dst = r->dst;
+
+    if (best_costs[dst] == -1) {
+        append_int(best_non_terminals, dst);
+        best_costs[dst] = cost;
+        best_rules[dst] = r->index;
+    }
+    else if (cost < best_costs[dst]) {
+        best_costs[dst] = cost;
+        best_rules[dst] = r->index;
+    }
+}
+
+// Add the cheapest rule of a new state to root_rules. State zero has no items and
+// doesn't have one.
+static void add_root_rule(int state) {
+    int *items = sequence_values(states, state);
+    int count = sequence_length(states, state) / 3;
+
+    int root_rule = -1;
+    int root_cost = 0;
+    for (int i = 0; i < count; i++) {
+        int rule = items[i * 3 + 1];
+        int cost = items[i * 3 + 2];
+        if (root_rule == -1 || cost < root_cost || (cost == root_cost && rule < root_rule)) {
+            root_rule = rule;
+            root_cost = cost;
+        }
+    }
+
+    append_int(root_rules, root_rule);
+}
+
+// Make a state from the rules added with add_to_state() and reset the scratch space
+static int make_state(void) {
+    int count = best_non_terminals->length;
+    int *nts = best_non_terminals->elements;
+
+    // Sort by non terminal
+    for (int i = 1; i < count; i++) {
+        int nt = nts[i];
+        int j = i - 1;
+        while (j >= 0 && nts[j] > nt) {
+            nts[j + 1] = nts[j];
+            j--;
+        }
+        nts[j + 1] = nt;
+    }
+
+    int min_cost = 0;
+    for (int i = 0; i < count; i++)
+        if (i == 0 || best_costs[nts[i]] < min_cost) min_cost = best_costs[nts[i]];
+
+    int *items = wmalloc((count * 3 + 1) * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int nt = nts[i];
+        items[i * 3] = nt;
+        items[i * 3 + 1] = best_rules[nt];
+        items[i * 3 + 2] = best_costs[nt] - min_cost;
+        best_costs[nt] = -1;
+    }
+    best_non_terminals->length = 0;
+
+    int is_new;
+    int state = intern_sequence(states, items, count * 3, &is_new);
+    wfree(items);
+
+    if (is_new && root_rules) add_root_rule(state);
+
+    return state;
+}
+
+// Group the rules with an operation by operation and operand count
+static void index_operations(void) {
+    operation_limit = 1;
+    for (int i = 0; i < instr_rule_count; i++)
+        if (instr_rules[i].operation >= operation_limit) operation_limit = instr_rules[i].operation + 1;
+
+    operation_indexes = wcalloc(operation_limit * 2, sizeof(int));
+
+    operation_count = 0;
+    for (int i = 0; i < instr_rule_count; i++) {
+        Rule *r = &(instr_rules[i]);
+        if (r->operation <= 0) continue;
+
+        int key = (r->src2 ? operation_limit : 0) + r->operation;
+        if (!operation_indexes[key]) operation_indexes[key] = ++operation_count;
+    }
+
+    operation_rules = wmalloc(operation_count * sizeof(List *));
+    operation_operand_counts = wmalloc(operation_count * sizeof(int));
+    operand_non_terminals = wcalloc(operation_count * 2, sizeof(char *));
+
+    for (int i = 0; i < operation_limit * 2; i++) {
+        int index = operation_indexes[i] - 1;
+        if (index < 0) continue;
+
+        int operand_count = i < operation_limit ? 1 : 2;
+        operation_operand_counts[index] = operand_count;
+        operation_rules[index] = new_list(128);
+
+        for (int j = 0; j < operand_count; j++)
+            operand_non_terminals[index * 2 + j] = wcalloc(AUTO_NON_TERMINAL_END, sizeof(char));
+    }
+
+    for (int i = 0; i < instr_rule_count; i++) {
+        Rule *r = &(instr_rules[i]);
+        if (r->operation <= 0) continue;
+
+        int index = operation_indexes[(r->src2 ? operation_limit : 0) + r->operation] - 1;
+        append_to_list(operation_rules[index], r);
+        operand_non_terminals[index * 2][r->src1] = 1;
+        if (r->src2) operand_non_terminals[index * 2 + 1][r->src2] = 1;
+    }
+}
+
+static void free_operations(void) {
+    for (int i = 0; i < operation_count; i++) free_list(operation_rules[i]);
+    for (int i = 0; i < operation_count * 2; i++)
+        if (operand_non_terminals[i]) wfree(operand_non_terminals[i]);
+
+    wfree(operation_indexes);
+    wfree(operation_rules);
+    wfree(operation_operand_counts);
+    wfree(operand_non_terminals);
+}
+
+// Return a mask of the constant non terminals a constant value matches
+static int constant_mask(Value *v) {
+    int mask = 0;
+
+    for (int nt = CSTV1; nt <= CS4; nt++)
+        if (match_value_to_rule_src(v, nt)) mask |= 1 << nt;
+
+    return mask;
+}
+
+// Make a leaf state, either for a non terminal and type class, or for a constant mask
+static int make_leaf_state(int non_terminal, int type_class, int mask) {
+    long type_non_terminals = type_class_non_terminals(type_class);
+
+    // Labels and functions match any dst
+    int match_any_dst = non_terminal == LAB || non_terminal == FUN;
+
+    for (int i = 0; i < instr_rule_count; i++) {
+        Rule *r = &(instr_rules[i]);
+        if (r->operation) continue;
+
+        if (mask) {
+            if (r->src1 > CS4 || !(mask & (1 << r->src1))) continue;
+        }
+        else {
+            if (r->src1 != non_terminal) continue;
+            if (!match_any_dst && r->dst != non_terminal && r->dst < AUTO_NON_TERMINAL_START && !((type_non_terminals >> r->dst) & 1)) continue;
+        }
+
+        add_to_state(r, r->cost);
+    }
+
+    return make_state();
+}
+
+static void make_leaf_states(BursTables *tables) {
+    tables->leaf_states = wmalloc(AUTO_NON_TERMINAL_START * VTC_COUNT * sizeof(short));
+
+    for (int nt = 0; nt < AUTO_NON_TERMINAL_START; nt++)
+        for (int tc = 0; tc < VTC_COUNT; tc++)
+            tables->leaf_states[nt * VTC_COUNT + tc] = make_leaf_state(nt, tc, 0);
+}
+
+// The integer constant non terminals depend on the signedness, whether the type is a long
+// and on the value, compared with the limits of the various sizes. Find all possible
+// constant masks by trying all kinds of types with values at and around the limits.
+static void make_constant_leaf_states(BursTables *tables) {
+    long values[] = {
+        0, 1, 2, 3, 4, -1,
+        0x7f, 0x80, -0x80, -0x81, 0xff, 0x100,
+        0x7fff, 0x8000, -0x8000, -0x8001, 0xffff, 0x10000, 0xfffff, 0x100000,
+        0x7fffffff, 0x80000000, -0x80000000l, -0x80000001l, 0xffffffff, 0x100000000,
+        0x7fffffffffffffff, -0x7fffffffffffffff - 1,
+    };
+    int value_count = sizeof(values) / sizeof(long);
+
+    int types[] = { TYPE_INT, TYPE_LONG, TYPE_FLOAT, TYPE_DOUBLE, TYPE_LONG_DOUBLE };
+    int type_count = sizeof(types) / sizeof(int);
+
+    int *masks = wmalloc(type_count * 2 * value_count * sizeof(int));
+    int mask_count = 0;
+
+    Type type;
+    Value v;
+    memset(&type, 0, sizeof(Type));
+    memset(&v, 0, sizeof(Value));
+    v.type = &type;
+    v.is_constant = 1;
+
+    for (int i = 0; i < type_count; i++) {
+        for (int is_unsigned = 0; is_unsigned < 2; is_unsigned++) {
+            for (int j = 0; j < value_count; j++) {
+                type.type = types[i];
+                type.is_unsigned = is_unsigned;
+                v.int_value = values[j];
+
+                int mask = constant_mask(&v);
+
+                // Insert into the sorted masks, if it isn't there already
+                int k = 0;
+                while (k < mask_count && masks[k] < mask) k++;
+                if (k < mask_count && masks[k] == mask) continue;
+                memmove(&masks[k + 1], &masks[k], (mask_count - k) * sizeof(int));
+                masks[k] = mask;
+                mask_count++;
+            }
+        }
+    }
+
+    tables->constant_count = mask_count;
+    tables->constant_masks = masks;
+    tables->constant_states = wmalloc(mask_count * sizeof(short));
+
+    for (int i = 0; i < mask_count; i++)
+        tables->constant_states[i] = make_leaf_state(0, 0, masks[i]);
+}
+
+// An operation without operands gets the first rule for the operation
+static void make_operandless_states(BursTables *tables) {
+    tables->operation_limit = operation_limit;
+    tables->operandless_states = wcalloc(operation_limit, sizeof(short));
+    char *done = wcalloc(operation_limit, sizeof(char));
+
+    for (int i = 0; i < instr_rule_count; i++) {
+        Rule *r = &(instr_rules[i]);
+        if (r->operation <= 0 || done[r->operation]) continue;
+
+        add_to_state(r, r->cost);
+        tables->operandless_states[r->operation] = make_state();
+        done[r->operation] = 1;
+    }
+
+    wfree(done);
+}
+
+// Does a rule dst match a context?
+static int context_allows_dst(int context, int dst) {
+    if (!context) return 1;
+
+    int root = context >= ROOT_CONTEXTS;
+    int c = context - (root ? ROOT_CONTEXTS : TYPE_CONTEXTS);
+    int non_terminal = c / VTC_COUNT;
+    int type_class = c % VTC_COUNT;
+
+    if (dst == non_terminal) return 1;
+    if (root) return 0;
+    if (dst >= AUTO_NON_TERMINAL_START) return 1;
+
+    return (type_class_non_terminals(type_class) >> dst) & 1;
+}
+
+// Map each context to the set of dsts it allows for each operation index. Contexts that
+// map to the same sets for all operation indexes share a class.
+static void make_contexts(BursTables *tables) {
+    Sequences **contexts = wmalloc(operation_count * sizeof(Sequences *));
+    for (int i = 0; i < operation_count; i++) contexts[i] = new_sequences();
+
+    Sequences *classes = new_sequences();
+    int *class_contexts = wmalloc(operation_count * sizeof(int));
+    int *dsts = wmalloc(AUTO_NON_TERMINAL_END * sizeof(int));
+    char *seen = wmalloc(AUTO_NON_TERMINAL_END);
+
+    tables->context_classes = wmalloc(CONTEXT_COUNT * sizeof(short));
+
+    for (int context = 0; context < CONTEXT_COUNT; context++) {
+        for (int index = 0; index < operation_count; index++) {
+            List *rules = operation_rules[index];
+            memset(seen, 0, AUTO_NON_TERMINAL_END);
+
+            int dst_count = 0;
+            for (int i = 0; i < rules->length; i++) {
+                Rule *r = rules->elements[i];
+                if (seen[r->dst] || !context_allows_dst(context, r->dst)) continue;
+                seen[r->dst] = 1;
+                dsts[dst_count++] = r->dst;
+            }
+
+            class_contexts[index] = intern_sequence(contexts[index], dsts, dst_count, 0);
+        }
+
+        tables->context_classes[context] = intern_sequence(classes, class_contexts, operation_count, 0);
+    }
+
+    int class_count = sequence_count(classes);
+    tables->operation_count = operation_count;
+    tables->context_class_count = class_count;
+    tables->operation_contexts = wmalloc(operation_count * class_count * sizeof(short));
+    for (int i = 0; i < class_count; i++) {
+        int *values = sequence_values(classes, i);
+        for (int index = 0; index < operation_count; index++)
+            tables->operation_contexts[index * class_count + i] = values[index];
+    }
+
+    // Concatenate the contexts of all operation indexes
+    int context_count = 0;
+    int dst_count = 0;
+    for (int index = 0; index < operation_count; index++) {
+        context_count += sequence_count(contexts[index]);
+        dst_count += contexts[index]->values->length;
+    }
+
+    tables->context_count = context_count;
+    tables->context_starts = wmalloc((operation_count + 1) * sizeof(int));
+    tables->context_dst_starts = wmalloc((context_count + 1) * sizeof(int));
+    tables->context_dsts = wmalloc((dst_count + 1) * sizeof(short));
+
+    context_count = 0;
+    dst_count = 0;
+    for (int index = 0; index < operation_count; index++) {
+        Sequences *s = contexts[index];
+        tables->context_starts[index] = context_count;
+
+        for (int i = 0; i < sequence_count(s); i++) {
+            tables->context_dst_starts[context_count++] = dst_count;
+            for (int j = 0; j < sequence_length(s, i); j++)
+                tables->context_dsts[dst_count++] = sequence_values(s, i)[j];
+        }
+    }
+    tables->context_starts[operation_count] = context_count;
+    tables->context_dst_starts[context_count] = dst_count;
+
+    for (int i = 0; i < operation_count; i++) free_sequences(contexts[i]);
+    wfree(contexts);
+    free_sequences(classes);
+    wfree(class_contexts);
+    wfree(dsts);
+    wfree(seen);
+}
+
+// Copy the states made so far into the tables
+static void make_state_tables(BursTables *tables) {
+    int state_count = sequence_count(states);
+    int item_count = states->values->length / 3;
+
+    tables->state_count = state_count;
+    tables->state_items = wmalloc((state_count + 1) * sizeof(int));
+    tables->item_non_terminals = wmalloc((item_count + 1) * sizeof(short));
+    tables->item_rules = wmalloc((item_count + 1) * sizeof(short));
+    tables->item_costs = wmalloc((item_count + 1) * sizeof(short));
+
+    for (int state = 0; state <= state_count; state++) tables->state_items[state] = states->starts->elements[state] / 3;
+
+    for (int i = 0; i < item_count; i++) {
+        tables->item_non_terminals[i] = states->values->elements[i * 3];
+        tables->item_rules[i] = states->values->elements[i * 3 + 1];
+        tables->item_costs[i] = states->values->elements[i * 3 + 2];
+    }
+}
+
+// Make the tables for the rules in instr_rules
+BursTables *make_burs_tables(void) {
+    BursTables *tables = wcalloc(1, sizeof(BursTables));
+
+    states = new_sequences();
+    init_scratch_space();
+    index_operations();
+
+    make_state(); // State zero has no items and is used when no rules match
+    make_leaf_states(tables);
+    make_constant_leaf_states(tables);
+    make_operandless_states(tables);
+    make_contexts(tables);
+    make_state_tables(tables);
+
+    free_operations();
+    free_scratch_space();
+    free_sequences(states);
+    states = 0;
+
+    return tables;
+}
+
+void free_burs_tables(BursTables *tables) {
+    wfree(tables->state_items);
+    wfree(tables->item_non_terminals);
+    wfree(tables->item_rules);
+    wfree(tables->item_costs);
+    wfree(tables->leaf_states);
+    wfree(tables->constant_masks);
+    wfree(tables->constant_states);
+    wfree(tables->operandless_states);
+    wfree(tables->context_classes);
+    wfree(tables->operation_contexts);
+    wfree(tables->context_starts);
+    wfree(tables->context_dst_starts);
+    wfree(tables->context_dsts);
+    wfree(tables);
+}
+
+// Set up labelling with burs_tables
+void init_burs(void) {
+    states = new_sequences();
+    root_rules = new_int_array();
+    init_scratch_space();
+    index_operations();
+
+    if (operation_count != burs_tables->operation_count) panic("BURS tables don't match the rules");
+
+    BursTables *t = burs_tables;
+    for (int state = 0; state < t->state_count; state++) {
+        for (int i = t->state_items[state]; i < t->state_items[state + 1]; i++) {
+            Rule r;
+            r.index = t->item_rules[i];
+            r.dst = t->item_non_terminals[i];
+            add_to_state(&r, t->item_costs[i]);
+        }
+
+        if (make_state() != state) panic("Duplicate state %d in BURS tables", state);
+    }
+
+    representers = wcalloc(operation_count * 2, sizeof(Sequences *));
+    state_representers = wcalloc(operation_count * 2, sizeof(IntArray *));
+    for (int i = 0; i < operation_count * 2; i++) {
+        if (!operand_non_terminals[i]) continue;
+        representers[i] = new_sequences();
+        state_representers[i] = new_int_array();
+    }
+
+    transitions_size = INITIAL_TRANSITIONS_SIZE;
+    transitions = wcalloc(transitions_size, sizeof(Transition));
+    transitions_count = 0;
+}
+
+void free_burs(void) {
+    if (!states) return;
+
+    for (int i = 0; i < operation_count * 2; i++) {
+        if (!representers[i]) continue;
+        free_sequences(representers[i]);
+        free_int_array(state_representers[i]);
+    }
+
+    wfree(representers);
+    wfree(state_representers);
+    wfree(transitions);
+    free_operations();
+    free_scratch_space();
+    free_int_array(root_rules);
+    free_sequences(states);
+    root_rules = 0;
+    states = 0;
+
+    if (made_tables) free_burs_tables(made_tables);
+    made_tables = 0;
+}
+
+// Make new tables after the rules have been changed, e.g. by a test
+void remake_burs_tables(void) {
+    free_burs();
+
+    made_tables = make_burs_tables();
+    burs_tables = made_tables;
+    init_burs();
+}
+
+// Return the state for a leaf value, or zero if no rules match
+int burs_leaf_state(Value *v) {
+    BursTables *t = burs_tables;
+
+    if (!v->is_constant)
+        return t->leaf_states[non_terminal_for_value(v) * VTC_COUNT + value_type_class(v)];
+
+    int mask = constant_mask(v);
+    int low = 0;
+    int high = t->constant_count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (t->constant_masks[middle] == mask) return t->constant_states[middle];
+        else if (t->constant_masks[middle] < mask) low = middle + 1;
+        else high = middle - 1;
+    }
+
+    panic("No BURS state for constant mask %#x", mask);
+}
+
+// Return what the dst of a rule must match for an operation
+static int operation_context(Tac *tac, int is_root) {
+    // IR_MOVE_TO_PTR is a special case since it doesn't have a dst. The dst is actually
+    // src1, which isn't modified.
+    Value *v = tac->operation == IR_MOVE_TO_PTR ? tac->src1 : tac->dst;
+    if (!v) return 0;
+
+    int context = non_terminal_for_value(v) * VTC_COUNT + value_type_class(v);
+
+    // If this is the top level, the dst must match exactly
+    return (is_root && tac->dst ? ROOT_CONTEXTS : TYPE_CONTEXTS) + context;
+}
+
+// Return the representer of a state for an operation index & operand
+static int representer(int index, int operand, int state) {
+    IntArray *a = state_representers[index * 2 + operand];
+    while (a->length <= state) append_int(a, 0);
+    if (a->elements[state]) return a->elements[state] - 1;
+
+    char *used = operand_non_terminals[index * 2 + operand];
+    int *items = sequence_values(states, state);
+    int item_count = sequence_length(states, state) / 3;
+    int *pairs = wmalloc((item_count * 2 + 1) * sizeof(int));
+
+    int count = 0;
+    int min_cost = 0;
+    for (int i = 0; i < item_count; i++) {
+        if (!used[items[i * 3]]) continue;
+        pairs[count * 2] = items[i * 3];
+        pairs[count * 2 + 1] = items[i * 3 + 2];
+        if (!count || items[i * 3 + 2] < min_cost) min_cost = items[i * 3 + 2];
+        count++;
+    }
+
+    for (int i = 0; i < count; i++) pairs[i * 2 + 1] -= min_cost;
+
+    int result = intern_sequence(representers[index * 2 + operand], pairs, count * 2, 0);
+    wfree(pairs);
+
+    a->elements[state] = result + 1;
+
+    return result;
+}
+
+static void set_representer_costs(int index, int operand, int representer, int *costs, int clear) {
+    Sequences *s = representers[index * 2 + operand];
+    int *pairs = sequence_values(s, representer);
+    int count = sequence_length(s, representer) / 2;
+    for (int i = 0; i < count; i++) costs[pairs[i * 2]] = clear ? -1 : pairs[i * 2 + 1];
+}
+
+static void set_allowed_dsts(int index, int context, int value) {
+    BursTables *t = burs_tables;
+    int c = t->context_starts[index] + context;
+    for (int i = t->context_dst_starts[c]; i < t->context_dst_starts[c + 1]; i++) allowed_dsts[t->context_dsts[i]] = value;
+}
+
+// Work out the state for an operation index, context and operand representers
+static int make_transition_state(int index, int context, int representer1, int representer2) {
+    int operand_count = operation_operand_counts[index];
+
+    set_allowed_dsts(index, context, 1);
+    set_representer_costs(index, 0, representer1, src1_costs, 0);
+    if (operand_count == 2) set_representer_costs(index, 1, representer2, src2_costs, 0);
+
+    List *rules = operation_rules[index];
+    for (int i = 0; i < rules->length; i++) {
+        Rule *r = rules->elements[i];
+        if (!allowed_dsts[r->dst]) continue;
+
+        int cost1 = src1_costs[r->src1];
+        if (cost1 == -1) continue;
+
+        int cost2 = 0;
+        if (operand_count == 2) {
+            cost2 = src2_costs[r->src2];
+            if (cost2 == -1) continue;
+        }
+
+        add_to_state(r, r->cost + cost1 + cost2);
+    }
+
+    set_allowed_dsts(index, context, 0);
+    set_representer_costs(index, 0, representer1, src1_costs, 1);
+    if (operand_count == 2) set_representer_costs(index, 1, representer2, src2_costs, 1);
+
+    return make_state();
+}
+
+static unsigned int hash_transition(int index, int context, int representer1, int representer2) {
+    unsigned int hash = 2166136261;
+    hash = (hash ^ index) * 16777619;
+    hash = (hash ^ context) * 16777619;
+    hash = (hash ^ representer1) * 16777619;
+    hash = (hash ^ representer2) * 16777619;
+
+    return hash;
+}
+
+static void grow_transitions(void) {
+    int new_size = transitions_size * 2;
+    int mask = new_size - 1;
+    Transition *new_transitions = wcalloc(new_size, sizeof(Transition));
+
+    for (int i = 0; i < transitions_size; i++) {
+        Transition *t = &transitions[i];
+        if (!t->index) continue;
+
+        unsigned int pos = hash_transition(t->index, t->context, t->representer1, t->representer2) & mask;
+        while (new_transitions[pos].index) pos = (pos + 1) & mask;
+        new_transitions[pos] = *t;
+    }
+
+    wfree(transitions);
+    transitions = new_transitions;
+    transitions_size = new_size;
+}
+
+// Return the state for an operation with its operand states, or zero if no rules match
+int burs_operation_state(Tac *tac, int is_root, int operand_count, int src1_state, int src2_state) {
+    BursTables *t = burs_tables;
+    int operation = tac->operation;
+
+    if (operation >= operation_limit) return 0;
+    if (!operand_count) return t->operandless_states[operation];
+
+    int index = operation_indexes[(operand_count == 2 ? operation_limit : 0) + operation] - 1;
+    if (index < 0) return 0;
+
+    int context_class = t->context_classes[operation_context(tac, is_root)];
+    int context = t->operation_contexts[index * t->context_class_count + context_class];
+    int representer1 = representer(index, 0, src1_state);
+    int representer2 = operand_count == 2 ? representer(index, 1, src2_state) : 0;
+
+    // Look up the transition. Transitions are stored with index + 1, so that an empty
+    // slot has a zero index.
+    unsigned int mask = transitions_size - 1;
+    unsigned int pos = hash_transition(index + 1, context, representer1, representer2) & mask;
+    Transition *tr;
+    while ((tr = &transitions[pos])->index) {
+        if (tr->index == index + 1 && tr->context == context && tr->representer1 == representer1 && tr->representer2 == representer2)
+            return tr->state;
+        pos = (pos + 1) & mask;
+    }
+
+    int state = make_transition_state(index, context, representer1, representer2);
+
+    tr->index = index + 1;
+    tr->context = context;
+    tr->representer1 = representer1;
+    tr->representer2 = representer2;
+    tr->state = state;
+
+    transitions_count++;
+    if (transitions_count * 2 >= transitions_size) grow_transitions();
+
+    return state;
+}
+
+// Return the cheapest rule in a state that reduces to a non terminal
+Rule *burs_state_rule(int state, int non_terminal) {
+    int *items = sequence_values(states, state);
+    int count = sequence_length(states, state) / 3;
+
+    for (int i = 0; i < count; i++)
+        if (items[i * 3] == non_terminal) return &(instr_rules[items[i * 3 + 1]]);
+
+    return 0;
+}
+
+// Return the cheapest rule in a state
+Rule *burs_root_rule(int state) {
+    return &(instr_rules[root_rules->elements[state]]);
+}
+
+void print_burs_state(int state) {
+    int *items = sequence_values(states, state);
+    int count = sequence_length(states, state) / 3;
+
+    printf("state %d:\n", state);
+    for (int i = 0; i < count; i++) {
+        printf("    %-5d %-5d  ", items[i * 3 + 1], items[i * 3 + 2]);
+        print_rule(&(instr_rules[items[i * 3 + 1]]), 0, 0);
+    }
+}
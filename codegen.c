@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
@@ -31,7 +32,12 @@ static int need_ru4_to_ld_symbol;
 static int need_ld_to_ru4_symbol;
 static int elf_section;
 
-static FILE *f; // Output file handle
+#define OUTPUT_BUFFER_SIZE 65536
+#define MAX_RENDERED_OPERAND_SIZE 64    // Excluding the identifier of a global symbol
+
+static int output_fd;               // Output file descriptor
+static char *output_buffer;         // Assembly output, written out when it's full
+static int output_buffer_position;
 static int cur_stack_push_count; // Used in codegen to keep track of stack position
 
 Tac *ir_start, *ir;               // intermediate representation for currently parsed function
@@ -40,12 +46,12 @@ int cur_loop;                     // Current loop being parsed
 int loop_count;                   // Loop counter
 int total_stack_register_count;   // Spilled register count for all functions
 
-typedef enum elf_section {
+typedef enum assembly_section {
     SEC_NONE,
     SEC_TEXT,
     SEC_DATA,
     SEC_BSS,
-} ElfSection;
+} AssemblySection;
 
 typedef struct floating_point_literal {
     int type;
@@ -64,6 +70,11 @@ int last_outputted_filename_line_number;    // Keep track of last printed .loc l
 
 static List *allocated_strings;
 
+static ElfSection *text_section;            // Sections of the object file made by output_object_code()
+static ElfSection *data_section;
+static ElfSection *bss_section;
+static List *local_common_symbols;          // Symbols placed at the end of .bss
+
 static void check_preg(int preg, int preg_class) {
     if (preg == -1) panic("Illegal attempt to output -1 preg");
     if (preg < 0 || preg >= 32) panic("Illegal preg %d", preg);
@@ -71,43 +82,60 @@ static void check_preg(int preg, int preg_class) {
         panic("Illegal int preg %d", preg);
 }
 
-static void append_byte_register_name(char *buffer, int preg) {
-    check_preg(preg, PC_INT);
-    char *names = "al   bl   cl   dl   sil  dil  bpl  spl  r8b  r9b  r10b r11b r12b r13b r14b r15b";
-         if (preg < 4)  sprintf(buffer, "%%%.2s", &names[preg * 5]);
-    else if (preg < 10) sprintf(buffer, "%%%.3s", &names[preg * 5]);
-    else                sprintf(buffer, "%%%.4s", &names[preg * 5]);
-}
+static char *byte_register_names[] = {
+    "%al", "%bl", "%cl", "%dl", "%sil", "%dil", "%bpl", "%spl", "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b"
+};
+
+static char *word_register_names[] = {
+    "%ax", "%bx", "%cx", "%dx", "%si", "%di", "%bp", "%sp", "%r8w", "%r9w", "%r10w", "%r11w", "%r12w", "%r13w", "%r14w", "%r15w"
+};
 
-static void append_word_register_name(char *buffer, int preg) {
-    check_preg(preg, PC_INT);
-    char *names = "ax   bx   cx   dx   si   di   bp   sp   r8w  r9w  r10w r11w r12w r13w r14w r15w";
-         if (preg < 8)  sprintf(buffer, "%%%.2s", &names[preg * 5]);
-    else if (preg < 10) sprintf(buffer, "%%%.3s", &names[preg * 5]);
-    else                sprintf(buffer, "%%%.4s", &names[preg * 5]);
+static char *long_register_names[] = {
+    "%eax", "%ebx", "%ecx", "%edx", "%esi", "%edi", "%ebp", "%esp", "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d",
+    "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "%xmm7", "%xmm8", "%xmm9", "%xmm10", "%xmm11", "%xmm12", "%xmm13", "%xmm14", "%xmm15"
+};
+
+static char *quad_register_names[] = {
+    "%rax", "%rbx", "%rcx", "%rdx", "%rsi", "%rdi", "%rbp", "%rsp", "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+    "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "%xmm7", "%xmm8", "%xmm9", "%xmm10", "%xmm11", "%xmm12", "%xmm13", "%xmm14", "%xmm15"
+};
+
+// Copy a string to buffer and return a pointer to the terminating zero
+static char *append_string(char *buffer, char *string) {
+    while (*string) *buffer++ = *string++;
+    *buffer = 0;
+    return buffer;
 }
 
-static void append_long_register_name(char *buffer, int preg) {
-    check_preg(preg, PC_INT | PC_SSE);
-    char *names = "eax   ebx   ecx   edx   esi   edi   ebp   esp   r8d   r9d   r10d  r11d  r12d  r13d  r14d  r15d  xmm0  xmm1  xmm2  xmm3  xmm4  xmm5  xmm6  xmm7  xmm8  xmm9  xmm10 xmm11 xmm12 xmm13 xmm14 xmm15";
-         if (preg < 10) sprintf(buffer, "%%%.3s", &names[preg * 6]);
-    else if (preg < 26) sprintf(buffer, "%%%.4s", &names[preg * 6]);
-    else                sprintf(buffer, "%%%.5s", &names[preg * 6]);
+// Write a decimal integer to buffer and return a pointer to the terminating zero
+static char *append_int(char *buffer, long value) {
+    char digits[24];
+    int count = 0;
+
+    // Negate digit by digit, so that the most negative long works
+    if (value < 0) *buffer++ = '-';
+    do {
+        int digit = value % 10;
+        digits[count++] = '0' + (digit < 0 ? -digit : digit);
+        value /= 10;
+    } while (value);
+
+    while (count) *buffer++ = digits[--count];
+    *buffer = 0;
+    return buffer;
 }
 
-static void append_quad_register_name(char *buffer, int preg) {
-    check_preg(preg, PC_INT | PC_SSE);
-    char *names = "rax   rbx   rcx   rdx   rsi   rdi   rbp   rsp   r8    r9    r10   r11   r12   r13   r14   r15   xmm0  xmm1  xmm2  xmm3  xmm4  xmm5  xmm6  xmm7  xmm8  xmm9  xmm10 xmm11 xmm12 xmm13 xmm14 xmm15";
-         if (preg == 8 || preg == 9) sprintf(buffer, "%%%.2s", &names[preg * 6]);
-    else if (preg < 16)              sprintf(buffer, "%%%.3s", &names[preg * 6]);
-    else if (preg < 26)              sprintf(buffer, "%%%.4s", &names[preg * 6]);
-    else                             sprintf(buffer, "%%%.5s", &names[preg * 6]);
+static char *append_register_name(char *buffer, int preg, int x86_size) {
+         if (x86_size == 1) { check_preg(preg, PC_INT);          return append_string(buffer, byte_register_names[preg]); }
+    else if (x86_size == 2) { check_preg(preg, PC_INT);          return append_string(buffer, word_register_names[preg]); }
+    else if (x86_size == 3) { check_preg(preg, PC_INT | PC_SSE); return append_string(buffer, long_register_names[preg]); }
+    else if (x86_size == 4) { check_preg(preg, PC_INT | PC_SSE); return append_string(buffer, quad_register_names[preg]); }
+    else panic("Unknown register size %d", x86_size);
 }
 
 char *register_name(int preg) {
     char *buffer = wmalloc(16);
-    buffer[0] = 0;
-    append_quad_register_name(buffer, preg);
+    append_register_name(buffer, preg, 4);
     return buffer;
 }
 
@@ -242,12 +270,31 @@ static int add_long_double_literal(Value *value) {
     return floating_point_literal_count++;
 }
 
-char *render_x86_operation(Tac *tac, int function_pc, int expect_preg) {
-    char *t = tac->x86_template;
+// Return an upper bound of the length of a rendered instruction, including the terminating
+// zero. Each placeholder can render a global symbol, so the longest identifier of the
+// instruction's values is added for each of them.
+static int rendered_x86_operation_size(Tac *tac) {
+    int identifier_length = 0;
+    Value *values[3] = {tac->dst, tac->src1, tac->src2};
+    for (int i = 0; i < 3; i++) {
+        if (!values[i] || !values[i]->global_symbol || !values[i]->global_symbol->global_identifier) continue;
+        int length = strlen(values[i]->global_symbol->global_identifier);
+        if (length > identifier_length) identifier_length = length;
+    }
+
+    int size = 12 + 1; // Mnemonic padding and the terminating zero
+    for (char *t = tac->x86_template; *t; t++) {
+        size++;
+        if (*t == '%') size += MAX_RENDERED_OPERAND_SIZE + identifier_length;
+    }
 
-    if (!t) return 0;
+    return size;
+}
 
-    char *buffer = wcalloc(1, 128);
+// Render an instruction into buffer, which must have room for rendered_x86_operation_size()
+// bytes. Returns a pointer to the terminating zero.
+static char *render_x86_operation_to_buffer(char *buffer, Tac *tac, int function_pc, int expect_preg) {
+    char *t = tac->x86_template;
     char *result = buffer;
 
     while (*t && *t != ' ') *buffer++ = *t++;
@@ -320,47 +367,47 @@ char *render_x86_operation(Tac *tac, int function_pc, int expect_preg) {
                 if (!v) panic("Unexpectedly got a null value while the template %s is expecting it", tac->x86_template);
 
                 if (is_offset) {
-                    if (v->offset || offset_is_required) sprintf(buffer, "%d", v->offset);
+                    if (v->offset || offset_is_required) buffer = append_int(buffer, v->offset);
                 }
                 else if (!expect_preg && v->vreg) {
                     if (!x86_size) panic("Missing size on register value \"%s\"", tac->x86_template);
                     if (v->global_symbol) panic("Got global symbol in vreg");
 
                     *buffer++ = 'r';
-                    sprintf(buffer, "%d", v->vreg);
-                    while (*buffer) buffer++;
+                    buffer = append_int(buffer, v->vreg);
                     *buffer++ = size_to_x86_size(x86_size);
                 }
                 else if (expect_preg && v->preg != -1) {
                     if (!x86_size) panic("Missing size on register value \"%s\"", tac->x86_template);
-
-                         if (x86_size == 1) append_byte_register_name(buffer, v->preg);
-                    else if (x86_size == 2) append_word_register_name(buffer, v->preg);
-                    else if (x86_size == 3) append_long_register_name(buffer, v->preg);
-                    else if (x86_size == 4) append_quad_register_name(buffer, v->preg);
-                    else panic("Unknown register size %d", x86_size);
+                    buffer = append_register_name(buffer, v->preg, x86_size);
                 }
                 else if (v->is_constant) {
                     if (is_floating_point_type(v->type)) {
-                        if (low)
-                            sprintf(buffer, "$%ld", ((long *) &v->fp_value)[0]);
-                        else if (high)
+                        if (low) {
+                            *buffer++ = '$';
+                            buffer = append_int(buffer, ((long *) &v->fp_value)[0]);
+                        }
+                        else if (high) {
                             // The & is to be compatible with gcc
-                            sprintf(buffer, "$%ld", ((long *) &v->fp_value)[1] & 0xffff);
+                            *buffer++ = '$';
+                            buffer = append_int(buffer, ((long *) &v->fp_value)[1] & 0xffff);
+                        }
                         else if (float_arg) {
                             float f = v->fp_value;
-                            sprintf(buffer, "$%d", *((int *) &f));
+                            *buffer++ = '$';
+                            buffer = append_int(buffer, *((int *) &f));
                         }
                         else if (double_arg) {
                             double d = v->fp_value;
-                            sprintf(buffer, "$%ld", *((long *) &d));
+                            *buffer++ = '$';
+                            buffer = append_int(buffer, *((long *) &d));
+                        }
+                        else if (float_literal || double_literal || long_double_literal) {
+                            int index = float_literal ? add_float_literal(v) : double_literal ? add_double_literal(v) : add_long_double_literal(v);
+                            buffer = append_string(buffer, ".LFP");
+                            buffer = append_int(buffer, index);
+                            buffer = append_string(buffer, "(%rip)");
                         }
-                        else if (float_literal)
-                            sprintf(buffer, ".LFP%d(%%rip)", add_float_literal(v));
-                        else if (double_literal)
-                            sprintf(buffer, ".LFP%d(%%rip)", add_double_literal(v));
-                        else if (long_double_literal)
-                            sprintf(buffer, ".LFP%d(%%rip)", add_long_double_literal(v));
                         else
                             panic("Did not get L/H/C/F/D specifier for floating point constant");
                     }
@@ -372,60 +419,54 @@ char *render_x86_operation(Tac *tac, int function_pc, int expect_preg) {
                         }
 
                         if (x86_size == 1)
-                            sprintf(buffer, "%ld", (long) (v->int_value & 0xff));
+                            buffer = append_int(buffer, (long) (v->int_value & 0xff));
                         else if (x86_size == 2)
-                            sprintf(buffer, "%ld", (long) (v->int_value & 0xffff));
+                            buffer = append_int(buffer, (long) (v->int_value & 0xffff));
                         else if (x86_size == 3)
-                            sprintf(buffer, "%ld", (long) (v->int_value & 0xffffffff));
+                            buffer = append_int(buffer, (long) (v->int_value & 0xffffffff));
                         else
-                            sprintf(buffer, "%ld", (long) v->int_value);
+                            buffer = append_int(buffer, (long) v->int_value);
                     }
                 }
-                else if (v->is_string_literal)
-                    sprintf(buffer, ".LS%d(%%rip)", v->string_literal_index);
+                else if (v->is_string_literal) {
+                    buffer = append_string(buffer, ".LS");
+                    buffer = append_int(buffer, v->string_literal_index);
+                    buffer = append_string(buffer, "(%rip)");
+                }
                 else if (v->global_symbol) {
+                    int offset = v->offset;
                     if (v->type->type == TYPE_LONG_DOUBLE) {
-                        if (low) {
-                            if (v->offset)
-                                sprintf(buffer, "%s+%d(%%rip)", v->global_symbol->global_identifier, v->offset);
-                            else {
-                                if (v->load_from_got)
-                                    sprintf(buffer, "%s@GOTPCREL(%%rip)", v->global_symbol->global_identifier);
-                                else
-                                    sprintf(buffer, "%s(%%rip)", v->global_symbol->global_identifier);
-                            }
-                        }
-                        else if (high)
-                            sprintf(buffer, "%s+%d(%%rip)", v->global_symbol->global_identifier, v->offset + 8);
-                        else
+                        if (high)
+                            offset += 8;
+                        else if (!low)
                             panic("Did not get L/H/C specifier for double long constant");
                     }
-                    else {
-                        if (v->offset)
-                            sprintf(buffer, "%s+%d(%%rip)", v->global_symbol->global_identifier, v->offset);
-                        else {
-                            if (v->load_from_got)
-                                sprintf(buffer, "%s@GOTPCREL(%%rip)", v->global_symbol->global_identifier);
-                            else
-                                sprintf(buffer, "%s(%%rip)", v->global_symbol->global_identifier);
-                        }
+
+                    buffer = append_string(buffer, v->global_symbol->global_identifier);
+                    if (offset) {
+                        *buffer++ = '+';
+                        buffer = append_int(buffer, offset);
                     }
+                    else if (v->load_from_got)
+                        buffer = append_string(buffer, "@GOTPCREL");
+                    buffer = append_string(buffer, "(%rip)");
                 }
                 else if (v->stack_index) {
-                    int stack_offset = get_stack_offset(function_pc, v);
+                    int stack_offset = get_stack_offset(function_pc, v) + v->offset;
                     if (v->type->type == TYPE_LONG_DOUBLE) {
-                        if (low)
-                            sprintf(buffer, "%d(%%rbp)", stack_offset + v->offset);
-                        else if (high)
-                            sprintf(buffer, "%d(%%rbp)", stack_offset + v->offset + 8);
-                        else
+                        if (high)
+                            stack_offset += 8;
+                        else if (!low)
                             panic("Did not get L/H specifier for double long stack index");
                     }
-                    else
-                        sprintf(buffer, "%d(%%rbp)", stack_offset + v->offset);
+
+                    buffer = append_int(buffer, stack_offset);
+                    buffer = append_string(buffer, "(%rbp)");
+                }
+                else if (v->label) {
+                    buffer = append_string(buffer, ".L");
+                    buffer = append_int(buffer, v->label);
                 }
-                else if (v->label)
-                    sprintf(buffer, ".L%d", v->label);
                 else {
                     print_value(stdout, v, 0);
                     printf("\n");
@@ -436,19 +477,106 @@ char *render_x86_operation(Tac *tac, int function_pc, int expect_preg) {
         else
             *buffer++ = *t;
 
-        while (*buffer) buffer++;
         t++;
     }
 
-    return result;
+    *buffer = 0;
+
+    return buffer;
 }
 
-static void output_x86_operation(Tac *tac, int function_pc) {
-    char *buffer = render_x86_operation(tac, function_pc, 1);
-    if (buffer) {
-        fprintf(f, "    %s\n", buffer);
-        wfree(buffer);
+char *render_x86_operation(Tac *tac, int function_pc, int expect_preg) {
+    if (!tac->x86_template) return 0;
+
+    char *buffer = wmalloc(rendered_x86_operation_size(tac));
+    render_x86_operation_to_buffer(buffer, tac, function_pc, expect_preg);
+    return buffer;
+}
+
+static void flush_output(void) {
+    char *data = output_buffer;
+    int size = output_buffer_position;
+
+    while (size > 0) {
+        int written = write(output_fd, data, size);
+        if (written == -1) {
+            perror("Unable to write output");
+            exit(1);
+        }
+        data += written;
+        size -= written;
     }
+
+    output_buffer_position = 0;
+}
+
+// Make sure there is room for size bytes in the output buffer and return a pointer to it
+static char *reserve_output(int size) {
+    if (output_buffer_position + size > OUTPUT_BUFFER_SIZE) flush_output();
+    if (size > OUTPUT_BUFFER_SIZE) panic("Output of %d bytes doesn't fit in the output buffer", size);
+    return output_buffer + output_buffer_position;
+}
+
+// Mark the output buffer as used up to end
+static void commit_output(char *end) {
+    output_buffer_position = end - output_buffer;
+}
+
+static void output_string(char *string) {
+    int length = strlen(string);
+    memcpy(reserve_output(length), string, length);
+    output_buffer_position += length;
+}
+
+static void output_char(char c) {
+    *reserve_output(1) = c;
+    output_buffer_position++;
+}
+
+static void output_int(long value) {
+    commit_output(append_int(reserve_output(24), value));
+}
+
+// Output a label, followed by a colon and a newline
+static void output_label(char *prefix, char *name, int number) {
+    output_string(prefix);
+    if (name) output_string(name);
+    if (number != -1) output_int(number);
+    output_string(":\n");
+}
+
+// Output a directive with a string argument
+static void output_directive(char *directive, char *argument) {
+    output_string(directive);
+    output_string(argument);
+    output_char('\n');
+}
+
+// Output a directive with an integer argument
+static void output_int_directive(char *directive, long value) {
+    output_string(directive);
+    output_int(value);
+    output_char('\n');
+}
+
+// printf into the output buffer, for the directives that are only output once
+static void output_format(char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int size = vsnprintf(reserve_output(4096), 4096, format, ap);
+    va_end(ap);
+    if (size >= 4096) panic("Output too long for output_format");
+    output_buffer_position += size;
+}
+
+static void output_x86_operation(Tac *tac, int function_pc) {
+    if (!tac->x86_template) return;
+
+    char *buffer = reserve_output(rendered_x86_operation_size(tac) + 5); // Indentation and newline
+    buffer = append_string(buffer, "    ");
+    buffer = render_x86_operation_to_buffer(buffer, tac, function_pc, 1);
+    *buffer++ = '\n';
+    commit_output(buffer);
 }
 
 // Add an instruction after ir and return ir of the new instruction
@@ -753,6 +881,52 @@ int fprintf_escaped_string_literal(void *f, StringLiteral* sl, int for_assembly)
     return c;
 }
 
+// Output a string literal as one or more .string directives. An embedded NUL
+// terminates the current .string and starts a new one.
+static void output_escaped_string_literal(StringLiteral *sl) {
+    unsigned char *data = (unsigned char *) sl->data;
+
+    output_string("    .string \"");
+
+    int data_count = sl->is_wide_char ? sl->size * 4 : sl->size;
+    for (int i = 0; i < data_count; i++) {
+        unsigned char c = data[i];
+
+        if (c == 0) {
+            if (i != data_count - 1) output_string("\"\n    .string \"");
+        }
+        else if (c == '"' ) output_string("\\\"");
+        else if (c == '\\') output_string("\\\\");
+        else if (c == '\b') output_string("\\b");
+        else if (c == '\f') output_string("\\f");
+        else if (c == '\n') output_string("\\n");
+        else if (c == '\r') output_string("\\r");
+        else if (c == '\t') output_string("\\t");
+        else if (c < 32 || c >= 128) {
+            char *buffer = reserve_output(4);
+            *buffer++ = '\\';
+            *buffer++ = '0' + ((c >> 6) & 7);
+            *buffer++ = '0' + ((c >> 3) & 7);
+            *buffer++ = '0' + (c & 7);
+            commit_output(buffer);
+        }
+        else output_char(c);
+    }
+
+    output_string("\"\n");
+}
+
+// Output the common lines for an object in the data or bss section
+static void output_object_header(Symbol *symbol, int size) {
+    output_int_directive("    .align   ", get_type_alignment(symbol->type));
+    output_string("    .type    ");
+    output_directive(symbol->global_identifier, ", @object");
+    output_string("    .size    ");
+    output_string(symbol->global_identifier);
+    output_int_directive(", ", size);
+    output_label("", symbol->global_identifier, -1);
+}
+
 // Add a ".loc" line with an integer identifying the filename and the line number.
 // The debug_strings map has the mapping from filename to id.
 static void output_debug_loc(Tac *tac) {
@@ -761,11 +935,15 @@ static void output_debug_loc(Tac *tac) {
         if (!id) {
             id = ++debug_string_counter;
             strmap_put(debug_strings, wstrdup(tac->origin->filename), (void *) (long) id);
-            fprintf(f, "    .file       %d \"%s\"\n", id, tac->origin->filename);
+            output_format("    .file       %d \"%s\"\n", id, tac->origin->filename);
         }
 
         if (id != last_outputted_filename_id || tac->origin->line_number != last_outputted_filename_line_number) {
-            fprintf(f, "    .loc        %d %d\n", id, tac->origin->line_number);
+            output_string("    .loc        ");
+            output_int(id);
+            output_char(' ');
+            output_int(tac->origin->line_number);
+            output_char('\n');
             last_outputted_filename_id = id;
             last_outputted_filename_line_number = tac->origin->line_number;
         }
@@ -777,7 +955,7 @@ static void output_function_body_code(Symbol *symbol) {
     int function_pc = symbol->function->type->function->param_count;
 
     for (Tac *tac = symbol->function->ir; tac; tac = tac->next) {
-        if (tac->label) fprintf(f, ".L%d:\n", tac->label);
+        if (tac->label) output_label(".L", 0, tac->label);
         if (tac->operation != IR_NOP) {
             output_debug_loc(tac);
             output_x86_operation(tac, function_pc);
@@ -785,36 +963,64 @@ static void output_function_body_code(Symbol *symbol) {
     }
 }
 
+// Output the jump tables of all functions. Each entry is the offset of the target
+// relative to the start of the table.
+static void output_jump_tables(void) {
+    int seen_jump_table = 0;
+
+    for (int i = 0; i < global_scope->symbol_list->length; i++) {
+        Symbol *symbol = global_scope->symbol_list->elements[i];
+        if (symbol->type->type != TYPE_FUNCTION || !symbol->function->is_defined) continue;
+
+        for (Tac *tac = symbol->function->ir; tac; tac = tac->next) {
+            if (tac->operation != X_JMP_TABLE) continue;
+
+            if (!seen_jump_table) {
+                output_string("\n    .section .rodata\n");
+                seen_jump_table = 1;
+            }
+
+            int table_label = tac->src2->label;
+            JumpTable *jump_table = tac->src2->jump_table;
+            output_string("    .align   4\n");
+            output_label(".L", 0, table_label);
+            for (int j = 0; j < jump_table->count; j++)
+                output_format("    .long   .L%d-.L%d\n", jump_table->labels[j], table_label);
+        }
+    }
+
+    if (seen_jump_table) output_string("\n");
+}
+
 static void output_symbol(Symbol *symbol) {
     if (symbol->linkage == LINKAGE_INTERNAL && !symbol->initializers) {
-        if (elf_section != SEC_TEXT) { fprintf(f, "    .text\n"); elf_section = SEC_TEXT; }
-        fprintf(f, "    .local  %s\n", symbol->global_identifier);
+        if (elf_section != SEC_TEXT) { output_string("    .text\n"); elf_section = SEC_TEXT; }
+        output_directive("    .local  ", symbol->global_identifier);
     }
 
     if ((symbol->linkage == LINKAGE_INTERNAL || symbol->linkage == LINKAGE_EXTERNAL) && symbol->definition_status == DEFINITION_STATUS_TENTATIVE) {
-        if (elf_section != SEC_TEXT) { fprintf(f, "    .text\n"); elf_section = SEC_TEXT; }
+        if (elf_section != SEC_TEXT) { output_string("    .text\n"); elf_section = SEC_TEXT; }
 
         // opt_enable_common_symbols applies to symbols with external linkage.
         // For symbols with internal linkage, a .comm section will do just fine.
         if (symbol->linkage == LINKAGE_INTERNAL || opt_enable_common_symbols) {
-            fprintf(f, "    .comm   %s,%d,%d\n",
-                symbol->global_identifier,
-                get_type_size(symbol->type),
-                get_type_alignment(symbol->type));
+            output_string("    .comm   ");
+            output_string(symbol->global_identifier);
+            output_char(',');
+            output_int(get_type_size(symbol->type));
+            output_char(',');
+            output_int_directive("", get_type_alignment(symbol->type));
         }
         else {
             int size = get_type_size(symbol->type);
 
             if (symbol->linkage == LINKAGE_EXTERNAL)
-                fprintf(f, "    .globl   %s\n", symbol->global_identifier);
+                output_directive("    .globl   ", symbol->global_identifier);
 
-            if (elf_section != SEC_BSS) { fprintf(f, "    .bss\n"); elf_section = SEC_BSS; }
+            if (elf_section != SEC_BSS) { output_string("    .bss\n"); elf_section = SEC_BSS; }
 
-            fprintf(f, "    .align   %d\n", get_type_alignment(symbol->type));
-            fprintf(f, "    .type    %s, @object\n", symbol->global_identifier);
-            fprintf(f, "    .size    %s, %d\n", symbol->global_identifier, size);
-            fprintf(f, "%s:\n", symbol->global_identifier);
-            fprintf(f, "    .zero    %d\n", size);
+            output_object_header(symbol, size);
+            output_int_directive("    .zero    ", size);
         }
     }
 
@@ -823,47 +1029,44 @@ static void output_symbol(Symbol *symbol) {
 
         int size = get_type_size(symbol->type);
         if (symbol->linkage == LINKAGE_EXTERNAL)
-            fprintf(f, "    .globl   %s\n", symbol->global_identifier);
+            output_directive("    .globl   ", symbol->global_identifier);
 
-        if (elf_section != SEC_DATA) { fprintf(f, "    .data\n"); elf_section = SEC_DATA; }
+        if (elf_section != SEC_DATA) { output_string("    .data\n"); elf_section = SEC_DATA; }
 
-        fprintf(f, "    .align   %d\n", get_type_alignment(symbol->type));
-        fprintf(f, "    .type    %s, @object\n", symbol->global_identifier);
-        fprintf(f, "    .size    %s, %d\n", symbol->global_identifier, size);
-        fprintf(f, "%s:\n", symbol->global_identifier);
+        output_object_header(symbol, size);
 
         for (int i = 0; i < symbol->initializers->length; i++) {
             Initializer *in = (Initializer *) symbol->initializers->elements[i];
 
             if (in->is_address_of || in->symbol) {
-                if (in->address_of_offset)
-                    fprintf(f,"    .quad    %s + %d\n", in->symbol->global_identifier, in->address_of_offset);
-                else
-                    fprintf(f,"    .quad    %s\n", in->symbol->global_identifier);
+                output_string("    .quad    ");
+                output_string(in->symbol->global_identifier);
+                if (in->address_of_offset) output_int_directive(" + ", in->address_of_offset);
+                else output_char('\n');
                 size -= 8;
             }
             else if (in->is_string_literal) {
-                if (in->address_of_offset)
-                    fprintf(f,"    .quad    .LS%d + %d\n", in->string_literal_index, in->address_of_offset);
-                else
-                    fprintf(f,"    .quad    .LS%d\n", in->string_literal_index);
+                output_string("    .quad    .LS");
+                output_int(in->string_literal_index);
+                if (in->address_of_offset) output_int_directive(" + ", in->address_of_offset);
+                else output_char('\n');
                 size -= 8;
             }
             else {
                 if (!in->data) {
                     if (in->size < 0)
                         panic("Got negative .zero padding %d for the intializer for %s", in->size, symbol->identifier);
-                    fprintf(f,"    .zero    %d\n", in->size);
+                    output_int_directive("    .zero    ", in->size);
                 }
-                else if (in->size == 1) fprintf(f,"    .byte    %d\n", *((char *) in->data));
-                else if (in->size == 2) fprintf(f,"    .word    %d\n", *((short *) in->data));
-                else if (in->size == 4) fprintf(f,"    .long    %d\n", *((int *) in->data));
-                else if (in->size == 8) fprintf(f,"    .quad    %ld\n", *((long *) in->data));
+                else if (in->size == 1) output_int_directive("    .byte    ", *((char *) in->data));
+                else if (in->size == 2) output_int_directive("    .word    ", *((short *) in->data));
+                else if (in->size == 4) output_int_directive("    .long    ", *((int *) in->data));
+                else if (in->size == 8) output_int_directive("    .quad    ", *((long *) in->data));
                 else if (in->size == 16) {
-                    fprintf(f, "    .long   %d\n", (((int *) in->data))[0]);
-                    fprintf(f, "    .long   %d\n", (((int *) in->data))[1]);
-                    fprintf(f, "    .long   %d\n", (((int *) in->data))[2] & 0xffff);
-                    fprintf(f, "    .long   0\n");
+                    output_int_directive("    .long   ", (((int *) in->data))[0]);
+                    output_int_directive("    .long   ", (((int *) in->data))[1]);
+                    output_int_directive("    .long   ", (((int *) in->data))[2] & 0xffff);
+                    output_string("    .long   0\n");
                 }
                 else panic("Unknown initializer size=%d data=%p\n", in->size, in->data);
                 size -= in->size;
@@ -874,7 +1077,7 @@ static void output_symbol(Symbol *symbol) {
         if (size < 0)
             panic("Got negative .zero padding %d for final padding", size);
 
-        if (size) fprintf(f,"    .zero    %d\n", size);
+        if (size) output_int_directive("    .zero    ", size);
     }
 }
 
@@ -886,86 +1089,91 @@ void output_debug_sections(char *input_filename) {
     if (!getcwd(cwd, 1024)) panic("Unable to get cwd");
 
     // Output debug_info section
-    fprintf(f, "    .section .debug_info,\"\",@progbits\n\n");
+    output_string("    .section .debug_info,\"\",@progbits\n\n");
 
-    fprintf(f, ".Ldebug_info0:\n");
-    fprintf(f, "    .long   .Ldebug_info_end - .Ldebug_info_start\n"); // Size
+    output_string(".Ldebug_info0:\n");
+    output_string("    .long   .Ldebug_info_end - .Ldebug_info_start\n"); // Size
 
-    fprintf(f, ".Ldebug_info_start:\n");
-    fprintf(f, "    .value  %d\n", DWARF_VERSION);
-    fprintf(f, "    .long   .debug_abbrev\n");      // Pointer to debug_abbrev section
-    fprintf(f, "    .byte   0x8\n");                // Pointer size
+    output_string(".Ldebug_info_start:\n");
+    output_format("    .value  %d\n", DWARF_VERSION);
+    output_string("    .long   .debug_abbrev\n");      // Pointer to debug_abbrev section
+    output_string("    .byte   0x8\n");                // Pointer size
 
     // Output DW_TAG_compile_unit
-    fprintf(f, "    .uleb128 0x1\n");                               // DW_TAG_compile_unit
-    fprintf(f, "    .long   .Ldebug_info.producer\n");              // DW_AT_producer
-    fprintf(f, "    .byte   %d\n", DW_LANG_C89);                    // DW_AT_language
-    fprintf(f, "    .long   .Ldebug_info.filename\n");              // DW_AT_name
-    fprintf(f, "    .long   .debug_info.cwd\n");                    // DW_AT_comp_dir
-    fprintf(f, "    .quad   .Lall.code.start\n");                   // DW_AT_low_pc (start of code)
-    fprintf(f, "    .quad   .Lall.code.end-.Lall.code.start \n");   // DW_AT_high_pc (size of code)
-    fprintf(f, "    .long   .Lline_table_start\n");                 // DW_AT_stmt_list (pointer to line number table)
-    fprintf(f, ".Ldebug_info_end:\n\n");
+    output_string("    .uleb128 0x1\n");                               // DW_TAG_compile_unit
+    output_string("    .long   .Ldebug_info.producer\n");              // DW_AT_producer
+    output_format("    .byte   %d\n", DW_LANG_C89);                    // DW_AT_language
+    output_string("    .long   .Ldebug_info.filename\n");              // DW_AT_name
+    output_string("    .long   .debug_info.cwd\n");                    // DW_AT_comp_dir
+    output_string("    .quad   .Lall.code.start\n");                   // DW_AT_low_pc (start of code)
+    output_string("    .quad   .Lall.code.end-.Lall.code.start \n");   // DW_AT_high_pc (size of code)
+    output_string("    .long   .Lline_table_start\n");                 // DW_AT_stmt_list (pointer to line number table)
+    output_string(".Ldebug_info_end:\n\n");
 
     // Output debug_abbrev section. All lines with DW are pairs of a key & data type
-    fprintf(f, "    .section    .debug_abbrev,\"\",@progbits\n");
-
-    fprintf(f, "    .uleb128 0x1\n");                       // type number 1
-    fprintf(f, "    .uleb128 %d\n", DW_TAG_compile_unit);   // tag: DW_TAG_compile_unit
-    fprintf(f, "    .byte   0\n");                          // has children 0
-    fprintf(f, "    .uleb128 %d\n", DW_AT_producer);        // DW_AT_producer / DW_FORM_strp
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_strp);
-    fprintf(f, "    .uleb128 %d\n", DW_AT_language);        // DW_AT_language / DW_FORM_data1
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_data1);
-    fprintf(f, "    .uleb128 %d\n", DW_AT_name);            // DW_AT_name / DW_FORM_strp
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_strp);
-    fprintf(f, "    .uleb128 %d\n", DW_AT_comp_dir);        // DW_AT_comp_dir / DW_FORM_strp
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_strp);
-    fprintf(f, "    .uleb128 %d\n", DW_AT_low_pc);          // DW_AT_low_pc / DW_FORM_addr
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_addr);
-    fprintf(f, "    .uleb128 %d\n", DW_AT_high_pc);         // DW_AT_high_pc / DW_FORM_data8
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_data8);
-    fprintf(f, "    .uleb128 %d\n", DW_AT_stmt_list);       // DW_AT_stmt_list / DW_FORM_sec_offset
-    fprintf(f, "    .uleb128 %d\n", DW_FORM_sec_offset);
-    fprintf(f, "    .byte   0\n");                          // End
-    fprintf(f, "    .byte   0\n");
-    fprintf(f, "    .byte   0\n");
+    output_string("    .section    .debug_abbrev,\"\",@progbits\n");
+
+    output_string("    .uleb128 0x1\n");                       // type number 1
+    output_format("    .uleb128 %d\n", DW_TAG_compile_unit);   // tag: DW_TAG_compile_unit
+    output_string("    .byte   0\n");                          // has children 0
+    output_format("    .uleb128 %d\n", DW_AT_producer);        // DW_AT_producer / DW_FORM_strp
+    output_format("    .uleb128 %d\n", DW_FORM_strp);
+    output_format("    .uleb128 %d\n", DW_AT_language);        // DW_AT_language / DW_FORM_data1
+    output_format("    .uleb128 %d\n", DW_FORM_data1);
+    output_format("    .uleb128 %d\n", DW_AT_name);            // DW_AT_name / DW_FORM_strp
+    output_format("    .uleb128 %d\n", DW_FORM_strp);
+    output_format("    .uleb128 %d\n", DW_AT_comp_dir);        // DW_AT_comp_dir / DW_FORM_strp
+    output_format("    .uleb128 %d\n", DW_FORM_strp);
+    output_format("    .uleb128 %d\n", DW_AT_low_pc);          // DW_AT_low_pc / DW_FORM_addr
+    output_format("    .uleb128 %d\n", DW_FORM_addr);
+    output_format("    .uleb128 %d\n", DW_AT_high_pc);         // DW_AT_high_pc / DW_FORM_data8
+    output_format("    .uleb128 %d\n", DW_FORM_data8);
+    output_format("    .uleb128 %d\n", DW_AT_stmt_list);       // DW_AT_stmt_list / DW_FORM_sec_offset
+    output_format("    .uleb128 %d\n", DW_FORM_sec_offset);
+    output_string("    .byte   0\n");                          // End
+    output_string("    .byte   0\n");
+    output_string("    .byte   0\n");
 
     // Output debug_str section
-    fprintf(f, "\n    .section    .debug_str,\"MS\",@progbits,1\n");
-    fprintf(f, ".Ldebug_info.producer:\n");
-    fprintf(f, "    .string  \"wcc\"\n");
-    fprintf(f, ".Ldebug_info.filename:\n");
-    fprintf(f, "    .string  \"%s\"\n", input_filename);
-    fprintf(f, ".debug_info.cwd:\n");
-    fprintf(f, "    .string  \"%s\"\n", cwd);
+    output_string("\n    .section    .debug_str,\"MS\",@progbits,1\n");
+    output_string(".Ldebug_info.producer:\n");
+    output_string("    .string  \"wcc\"\n");
+    output_string(".Ldebug_info.filename:\n");
+    output_format("    .string  \"%s\"\n", input_filename);
+    output_string(".debug_info.cwd:\n");
+    output_format("    .string  \"%s\"\n", cwd);
 
     // Output debug_line section. There's nothing much here, the assembler populates
     // this with information from the .loc lines.
-    fprintf(f, "\n    .section    .debug_line,\"\",@progbits\n");
-    fprintf(f, "\n.Lline_table_start:\n");
+    output_string("\n    .section    .debug_line,\"\",@progbits\n");
+    output_string("\n.Lline_table_start:\n");
 
     wfree(cwd);
 }
 
 // Output code for the translation unit
 void output_code(char *input_filename, char *output_filename) {
-    if (!strcmp(output_filename, "-"))
-        f = stdout;
+    if (!strcmp(output_filename, "-")) {
+        fflush(stdout);
+        output_fd = 1;
+    }
     else {
         // Open output file for writing
-        f = fopen(output_filename, "w");
-        if (f == 0) {
+        output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fd == -1) {
             perror(output_filename);
             exit(1);
         }
     }
 
-    fprintf(f, "    .file   \"%s\"\n", input_filename);
+    output_buffer = wmalloc(OUTPUT_BUFFER_SIZE);
+    output_buffer_position = 0;
+
+    output_format("    .file   \"%s\"\n", input_filename);
 
     // Indicate this object file doesn't need an executable stack
     // See https://man7.org/linux/man-pages/man5/elf.5.html
-    fprintf(f, "    .section .note.GNU-stack,\"\",@progbits\n\n");
+    output_string("    .section .note.GNU-stack,\"\",@progbits\n\n");
 
     // Output symbols
     elf_section = SEC_NONE;
@@ -988,31 +1196,32 @@ void output_code(char *input_filename, char *output_filename) {
 
     // Output string literals
     if (string_literal_count > 0) {
-        fprintf(f, "\n    .section .rodata\n\n");
-        fprintf(f, ".Ltext0:\n\n");
+        output_string("\n    .section .rodata\n\n");
+        output_string(".Ltext0:\n\n");
         for (int i = 0; i < string_literal_count; i++) {
             StringLiteral *sl = &(string_literals[i]);
-            if (sl->is_wide_char) fprintf(f, "    .align   4\n");
-            fprintf(f, ".LS%d:\n", i);
-            fprintf_escaped_string_literal(f, sl, 1);
+            if (sl->is_wide_char) output_string("    .align   4\n");
+            output_label(".LS", 0, i);
+            output_escaped_string_literal(sl);
         }
-        fprintf(f, "\n");
+        output_string("\n");
     }
 
     // Output code
-    fprintf(f, "    .text\n");
+    output_string("    .text\n");
 
     // Output symbols for all functions that are defined and have external linkage
     for (int i = 0; i < global_scope->symbol_list->length; i++) {
         Symbol *symbol = global_scope->symbol_list->elements[i];
         if (symbol->type->type == TYPE_FUNCTION && symbol->function->is_defined) {
             if (symbol->linkage == LINKAGE_EXTERNAL)
-                fprintf(f, "    .globl  %s\n", symbol->identifier);
-            fprintf(f, "    .type   %s, @function\n", symbol->global_identifier);
+                output_directive("    .globl  ", symbol->identifier);
+            output_string("    .type   ");
+            output_directive(symbol->global_identifier, ", @function");
         }
     }
 
-    fprintf(f, "\n");
+    output_string("\n");
 
     label_count = 0; // Used in label renumbering
 
@@ -1021,60 +1230,310 @@ void output_code(char *input_filename, char *output_filename) {
     // Output functions code
     need_ru4_to_ld_symbol = 0;
     need_ld_to_ru4_symbol = 0;
-    fprintf(f, ".Lall.code.start:\n");
+    floating_point_literal_count = 0;
+    output_string(".Lall.code.start:\n");
     for (int i = 0; i < global_scope->symbol_list->length; i++) {
         Symbol *symbol = global_scope->symbol_list->elements[i];
         if (symbol->type->type == TYPE_FUNCTION && symbol->function->is_defined) {
-            fprintf(f, "%s:\n", symbol->identifier);
-            fprintf(f, ".L%s.start:\n", symbol->identifier);
+            output_label("", symbol->identifier, -1);
+            output_string(".L");
+            output_directive(symbol->identifier, ".start:");
             output_function_body_code(symbol);
-            fprintf(f, "    .size       %s, .-%s\n", symbol->global_identifier, symbol->global_identifier);
-            fprintf(f, ".L%s.end:\n", symbol->identifier);
-            fprintf(f, "\n");
+            output_string("    .size       ");
+            output_string(symbol->global_identifier);
+            output_directive(", .-", symbol->global_identifier);
+            output_string(".L");
+            output_directive(symbol->identifier, ".end:");
+            output_string("\n");
         }
     }
-    fprintf(f, ".Lall.code.end:\n\n");
+    output_string(".Lall.code.end:\n\n");
 
     // Output floating point literals
     if (floating_point_literal_count > 0) {
         for (int i = 0; i < floating_point_literal_count; i++) {
             // The zero and & is to be compatible with gcc
-            fprintf(f, ".LFP%d:\n", i);
+            output_label(".LFP", 0, i);
 
             if (floating_point_literals[i].type == TYPE_FLOAT) {
                 float fl = floating_point_literals[i].f;
-                fprintf(f, "    .long   %d\n", *((int *) &fl));
+                output_int_directive("    .long   ", *((int *) &fl));
             }
             else if (floating_point_literals[i].type == TYPE_DOUBLE) {
                 double d = floating_point_literals[i].d;
-                fprintf(f, "    .long   %d\n", *((int *) &d));
-                fprintf(f, "    .long   %d\n", *((int *) &d + 1));
+                output_int_directive("    .long   ", *((int *) &d));
+                output_int_directive("    .long   ", *((int *) &d + 1));
             }
             else {
                 long double ld = floating_point_literals[i].ld;
-                fprintf(f, "    .long   %d\n", ((int *) &ld)[0]);
-                fprintf(f, "    .long   %d\n", ((int *) &ld)[1]);
-                fprintf(f, "    .long   %d\n", ((int *) &ld)[2] & 0xffff);
-                fprintf(f, "    .long   0\n");
+                output_int_directive("    .long   ", ((int *) &ld)[0]);
+                output_int_directive("    .long   ", ((int *) &ld)[1]);
+                output_int_directive("    .long   ", ((int *) &ld)[2] & 0xffff);
+                output_string("    .long   0\n");
             }
         }
     }
 
     if (need_ru4_to_ld_symbol) {
-        fprintf(f, ".RU4TOLD:\n");
-        fprintf(f, "    .long   0\n");
-        fprintf(f, "    .long   1602224128 # 0x5f800000\n");
-        fprintf(f, "\n");
+        output_string(".RU4TOLD:\n");
+        output_string("    .long   0\n");
+        output_string("    .long   1602224128 # 0x5f800000\n");
+        output_string("\n");
     }
 
     if (need_ld_to_ru4_symbol) {
-        fprintf(f, ".LDTORU4:\n");
-        fprintf(f, "     .long   1593835520 # 9223372036854775808\n");
+        output_string(".LDTORU4:\n");
+        output_string("     .long   1593835520 # 9223372036854775808\n");
     }
 
+    output_jump_tables();
+
     if (opt_debug_symbols) output_debug_sections(input_filename);
 
-    fclose(f);
+    flush_output();
+    wfree(output_buffer);
+    output_buffer = 0;
+    if (output_fd != 1) close(output_fd);
+}
+
+static void add_object_symbol(Symbol *symbol) {
+    ElfSymbol *elf_symbol = get_elf_symbol(symbol->global_identifier);
+    int size = get_type_size(symbol->type);
+    int alignment = get_type_alignment(symbol->type);
+
+    if ((symbol->linkage == LINKAGE_INTERNAL || symbol->linkage == LINKAGE_EXTERNAL) && symbol->definition_status == DEFINITION_STATUS_TENTATIVE) {
+        elf_symbol->type = STT_OBJECT;
+        elf_symbol->size = size;
+
+        // Local common symbols go at the end of .bss, global ones are allocated by the linker
+        if (symbol->linkage == LINKAGE_INTERNAL) {
+            elf_symbol->value = alignment;
+            append_to_list(local_common_symbols, elf_symbol);
+        }
+        else if (opt_enable_common_symbols) {
+            elf_symbol->binding = STB_GLOBAL;
+            elf_symbol->is_common = 1;
+            elf_symbol->value = alignment;
+        }
+        else {
+            elf_symbol->binding = STB_GLOBAL;
+            elf_section_align(bss_section, alignment);
+            define_elf_symbol(elf_symbol, bss_section, bss_section->size);
+            elf_section_append_zeros(bss_section, size);
+        }
+    }
+
+    else if (symbol->definition_status == DEFINITION_STATUS_DEFINED) {
+        if (!symbol->initializers) panic("Expected initializers for a symbol with definition status defined");
+
+        if (symbol->linkage == LINKAGE_EXTERNAL) elf_symbol->binding = STB_GLOBAL;
+        elf_symbol->type = STT_OBJECT;
+        elf_symbol->size = size;
+        elf_section_align(data_section, alignment);
+        define_elf_symbol(elf_symbol, data_section, data_section->size);
+
+        for (int i = 0; i < symbol->initializers->length; i++) {
+            Initializer *in = (Initializer *) symbol->initializers->elements[i];
+
+            if (in->is_address_of || in->symbol || in->is_string_literal) {
+                char label[32];
+                char *name;
+                if (in->is_string_literal) {
+                    sprintf(label, ".LS%d", in->string_literal_index);
+                    name = label;
+                }
+                else
+                    name = in->symbol->global_identifier;
+
+                add_elf_relocation(data_section, data_section->size, get_elf_symbol(name), R_X86_64_64, in->address_of_offset);
+                elf_section_append_zeros(data_section, 8);
+                size -= 8;
+            }
+            else if (!in->data) {
+                if (in->size < 0)
+                    panic("Got negative .zero padding %d for the intializer for %s", in->size, symbol->identifier);
+                elf_section_append_zeros(data_section, in->size);
+                size -= in->size;
+            }
+            else if (in->size == 1 || in->size == 2 || in->size == 4 || in->size == 8) {
+                elf_section_append(data_section, in->data, in->size);
+                size -= in->size;
+            }
+            else if (in->size == 16) {
+                // Long doubles are 10 bytes, padded with zeros
+                int data[4];
+                memcpy(data, in->data, 12);
+                data[2] &= 0xffff;
+                data[3] = 0;
+                elf_section_append(data_section, data, 16);
+                size -= 16;
+            }
+            else panic("Unknown initializer size=%d data=%p\n", in->size, in->data);
+        }
+
+        // Add padding for structs that have padding at the end
+        if (size < 0)
+            panic("Got negative .zero padding %d for final padding", size);
+
+        elf_section_append_zeros(data_section, size);
+    }
+}
+
+// Add a label in the .text section, followed by data
+static void add_text_data(char *name, void *data, int size) {
+    assemble_label(get_elf_symbol(name));
+    elf_section_append(text_section, data, size);
+}
+
+// Make an object file for the translation unit without going through an assembler.
+// The layout of the sections and symbols is the same as what the GNU assembler makes
+// from the output of output_code().
+void output_object_code(char *input_filename, char *output_filename) {
+    init_elf_object(input_filename);
+    text_section = add_elf_section(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+    data_section = add_elf_section(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE);
+    bss_section = add_elf_section(".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
+    add_elf_section(".note.GNU-stack", SHT_PROGBITS, 0);
+    local_common_symbols = new_list(32);
+
+    init_assembler(text_section);
+
+    // Symbols and static local symbols
+    for (int i = 0; i < global_scope->symbol_list->length; i++) {
+        Symbol *symbol = global_scope->symbol_list->elements[i];
+        if (!symbol->scope->parent && symbol->type->type != TYPE_FUNCTION && symbol->type->type != TYPE_TYPEDEF && !symbol->is_enum_value)
+            add_object_symbol(symbol);
+    }
+
+    for (int i = 0; i < global_scope->symbol_list->length; i++) {
+        Symbol *symbol = global_scope->symbol_list->elements[i];
+        if (symbol->type->type == TYPE_FUNCTION && symbol->function->is_defined) {
+            Function *function = symbol->function;
+            for (int j = 0; j < function->static_symbols->length; j++)
+                add_object_symbol(function->static_symbols->elements[j]);
+        }
+    }
+
+    // String literals
+    ElfSection *rodata_section = 0;
+    if (string_literal_count > 0) {
+        rodata_section = add_elf_section(".rodata", SHT_PROGBITS, SHF_ALLOC);
+
+        for (int i = 0; i < string_literal_count; i++) {
+            StringLiteral *sl = &(string_literals[i]);
+            if (sl->is_wide_char) elf_section_align(rodata_section, 4);
+
+            char label[32];
+            sprintf(label, ".LS%d", i);
+            define_elf_symbol(get_elf_symbol(label), rodata_section, rodata_section->size);
+
+            // The same bytes as fprintf_escaped_string_literal() outputs with .string
+            int data_count = sl->is_wide_char ? sl->size * 4 : sl->size;
+            elf_section_append(rodata_section, sl->data, data_count);
+            if (!data_count || sl->data[data_count - 1]) elf_section_append_zeros(rodata_section, 1);
+        }
+    }
+
+    // Functions
+    need_ru4_to_ld_symbol = 0;
+    need_ld_to_ru4_symbol = 0;
+    floating_point_literal_count = 0;
+    for (int i = 0; i < global_scope->symbol_list->length; i++) {
+        Symbol *symbol = global_scope->symbol_list->elements[i];
+        if (symbol->type->type != TYPE_FUNCTION || !symbol->function->is_defined) continue;
+
+        ElfSymbol *elf_symbol = get_elf_symbol(symbol->identifier);
+        if (symbol->linkage == LINKAGE_EXTERNAL) elf_symbol->binding = STB_GLOBAL;
+        assemble_label(elf_symbol);
+
+        int function_pc = symbol->function->type->function->param_count;
+        for (Tac *tac = symbol->function->ir; tac; tac = tac->next) {
+            if (tac->label) {
+                char label[32];
+                sprintf(label, ".L%d", tac->label);
+                assemble_label(get_elf_symbol(label));
+            }
+
+            if (tac->operation != IR_NOP) {
+                char *buffer = render_x86_operation(tac, function_pc, 1);
+                if (buffer) {
+                    assemble_x86_instruction(buffer);
+                    wfree(buffer);
+                }
+            }
+        }
+
+        ElfSymbol *global_elf_symbol = get_elf_symbol(symbol->global_identifier);
+        global_elf_symbol->type = STT_FUNC;
+        global_elf_symbol->size = text_section->size - global_elf_symbol->value;
+    }
+
+    // Floating point literals
+    for (int i = 0; i < floating_point_literal_count; i++) {
+        char label[32];
+        sprintf(label, ".LFP%d", i);
+
+        if (floating_point_literals[i].type == TYPE_FLOAT)
+            add_text_data(label, &floating_point_literals[i].f, 4);
+        else if (floating_point_literals[i].type == TYPE_DOUBLE)
+            add_text_data(label, &floating_point_literals[i].d, 8);
+        else {
+            int data[4];
+            memcpy(data, &floating_point_literals[i].ld, 12);
+            data[2] &= 0xffff;
+            data[3] = 0;
+            add_text_data(label, data, 16);
+        }
+    }
+
+    if (need_ru4_to_ld_symbol) {
+        int data[2] = { 0, 1602224128 };
+        add_text_data(".RU4TOLD", data, 8);
+    }
+
+    if (need_ld_to_ru4_symbol) {
+        int data = 1593835520;
+        add_text_data(".LDTORU4", &data, 4);
+    }
+
+    // Jump tables, the same as output_jump_tables() outputs
+    for (int i = 0; i < global_scope->symbol_list->length; i++) {
+        Symbol *symbol = global_scope->symbol_list->elements[i];
+        if (symbol->type->type != TYPE_FUNCTION || !symbol->function->is_defined) continue;
+
+        for (Tac *tac = symbol->function->ir; tac; tac = tac->next) {
+            if (tac->operation != X_JMP_TABLE) continue;
+
+            if (!rodata_section) rodata_section = add_elf_section(".rodata", SHT_PROGBITS, SHF_ALLOC);
+            elf_section_align(rodata_section, 4);
+
+            char label[32];
+            sprintf(label, ".L%d", tac->src2->label);
+            define_elf_symbol(get_elf_symbol(label), rodata_section, rodata_section->size);
+
+            JumpTable *jump_table = tac->src2->jump_table;
+            for (int j = 0; j < jump_table->count; j++) {
+                sprintf(label, ".L%d", jump_table->labels[j]);
+                add_elf_relocation(rodata_section, rodata_section->size, get_elf_symbol(label), R_X86_64_PC32, j * 4);
+                elf_section_append_zeros(rodata_section, 4);
+            }
+        }
+    }
+
+    finish_assembler();
+
+    for (int i = 0; i < local_common_symbols->length; i++) {
+        ElfSymbol *elf_symbol = local_common_symbols->elements[i];
+        elf_section_align(bss_section, elf_symbol->value);
+        define_elf_symbol(elf_symbol, bss_section, bss_section->size);
+        elf_section_append_zeros(bss_section, elf_symbol->size);
+    }
+
+    write_elf_object(output_filename);
+
+    free_list(local_common_symbols);
+    free_assembler();
+    free_elf_object();
 }
 
 void init_codegen(void) {
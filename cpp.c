@@ -6,10 +6,6 @@
 
 #include "wcc.h"
 
-enum {
-    MAX_CPP_OUTPUT_SIZE = 10 * 1024 * 1024,
-};
-
 enum hchar_lex_state {
     HLS_START_OF_LINE,
     HLS_SEEN_HASH,
@@ -17,6 +13,14 @@ enum hchar_lex_state {
     HLS_OTHER,
 };
 
+// Multiple include guard detection, see track_include_guard_directive()
+enum include_guard_state {
+    IGS_START,          // Nothing but whitespace has been seen so far
+    IGS_IN_GUARD,       // Inside the #ifndef group that starts the file
+    IGS_AFTER_ENDIF,    // The guard #endif has been seen, only whitespace may follow
+    IGS_INVALID,        // The file isn't wrapped in an include guard
+};
+
 typedef struct conditional_include {
     int matched;    // Is the evaluated controlling expression 1?
     int skipping;   // Is a group being skipped?
@@ -27,6 +31,7 @@ typedef struct conditional_include {
 typedef struct cpp_state {
     char *               input;
     int                  input_size;
+    int                  input_is_mapped;             // Is input a mapped file, rather than allocated memory?
     int                  ip;                          // Offset in input
     char *               filename;                    // Current filename
     char *               override_filename;           // Overridden filename with #line
@@ -39,13 +44,24 @@ typedef struct cpp_state {
     int                  output_line_number;          // How many lines have been outputted
     ConditionalInclude * conditional_include_stack;   // Includes
     int                  include_depth;               // How deep are we in nested includes
+    int                  include_guard_state;         // Include guard detection state
+    char *               include_guard;               // Candidate include guard macro
+    ConditionalInclude * include_guard_conditional;   // The #ifndef group of the candidate include guard
 } CppState;
 
+// What is known about a file that has been included before
+typedef struct include_file {
+    char *guard;        // Macro that guards the entire file, if any
+    int pragma_once;    // Does the file contain #pragma once?
+} IncludeFile;
+
 CppState state;
 
 CliDirective *cli_directives;           // Linked list of directives passed on the command line with -D
 CliIncludePath *cli_include_paths;      // Linked list of include paths passed on the command line with -I
 StrMap *directives;                     // Map of CPP directives
+static int directives_generation = 1;   // Incremented whenever a macro is defined or undefined
+StrMap *include_files;                  // Map of canonical path to IncludeFile
 
 #define INITIAL_WHITESPACE_BUFFER_SIZE 16
 
@@ -55,19 +71,30 @@ typedef struct whitespace {
     int allocated;  // Amount of allocated memory
 } Whitespace;
 
-List *allocated_tokens;            // Keep track of all wmalloc'd tokens
-List *allocated_tokens_duplicates; // Keep track of all wmalloc'd shallow copied tokens
-List *allocated_strsets;
-List *allocated_strings;
+// Actual parameters of a function-like macro invocation
+typedef struct macro_actuals {
+    CppToken **tokens;      // Tokens of each actual parameter, zero if empty
+    CppToken **expanded;    // Fully macro replaced tokens of each actual parameter
+    char *is_expanded;      // Has the actual parameter been macro replaced?
+} MacroActuals;
+
+static Arena *cpp_tokens_arena;         // Tokens and their strings, freed at the end of preprocessing
+static Whitespace whitespace_buffer;    // Whitespace that is being lexed
 
 // Output
 FILE *cpp_output_file;         // Output file handle
 StringBuffer *output;          // Output string buffer;
+static CppOutput *token_output;    // Output tokens for the parser, used instead of the output string buffer if set
+
+static char *token_output_filename;     // Filename of the next output token
+static int token_output_line_number;    // Line number of the next output token, as if the output was lexed as text
+static int token_output_newlines;       // Amount of trailing newlines, as if the output was text
 
 static void cpp_next();
 static void cpp_parse();
-static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppToken *os);
-static CppToken *hsadd(StrSet *hs, CppToken *ts);
+static CppToken *subst(CppToken *is, StrMap *fp, MacroActuals *ap, HideSet *hs, CppToken *os);
+static CppToken *hsadd(HideSet *hs, CppToken *ts);
+static CppToken *expand(CppToken *is);
 
 const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
@@ -131,48 +158,215 @@ void get_cpp_filename_and_line() {
     cur_filename = state.filename;
 }
 
-static void init_cpp_from_fh(FILE *f, char *path) {
-    fseek(f, 0, SEEK_END);
-    state.input_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+// Map a file and prepare the state for preprocessing it. Returns zero if the
+// file can't be read.
+static int init_cpp_from_file(char *path) {
+    state.input = map_file(path, &state.input_size);
+    if (!state.input) return 0;
 
-    state.input = wmalloc(state.input_size + 1);
-    int read = fread(state.input, 1, state.input_size, f);
-    if (read != state.input_size) {
-        printf("Unable to read input file\n");
-        exit(1);
-    }
-
-    fclose(f);
-
-    state.input[state.input_size] = 0;
+    state.input_is_mapped = 1;
     state.filename = wstrdup(path);
     cur_filename = state.filename;
     cur_line = 1;
     state.hchar_lex_state = HLS_START_OF_LINE;
+    state.include_guard_state = IGS_START;
+    state.include_guard = 0;
+    state.include_guard_conditional = 0;
 
     state.conditional_include_stack = wcalloc(1, sizeof(ConditionalInclude));
+
+    return 1;
+}
+
+// Unmap or free the input
+static void release_input(void) {
+    if (state.input_is_mapped)
+        unmap_file(state.input, state.input_size);
+    else
+        wfree(state.input);
+
+    state.input_is_mapped = 0;
+}
+
+// Return a wmalloc'd canonical path for a file, so that the same file included
+// through different paths is recognized.
+static char *get_canonical_path(char *path) {
+    char *resolved_path = realpath(path, 0);
+    if (!resolved_path) return wstrdup(path);
+    char *result = wstrdup(resolved_path);
+    free(resolved_path);
+    return result;
+}
+
+// Set the include guard and #pragma once for a file. guard is copied.
+void set_include_file_state(char *path, char *guard, int pragma_once) {
+    char *canonical_path = get_canonical_path(path);
+    IncludeFile *include_file = strmap_get(include_files, canonical_path);
+
+    if (include_file)
+        wfree(canonical_path);
+    else {
+        include_file = wcalloc(1, sizeof(IncludeFile));
+        strmap_put(include_files, canonical_path, include_file);
+    }
+
+    char *old_guard = include_file->guard;
+    include_file->guard = guard ? wstrdup(guard) : 0;
+    cpp_cache_include_file_changed(canonical_path, old_guard, include_file->pragma_once, include_file->guard, pragma_once);
+    include_file->pragma_once = pragma_once;
+    wfree(old_guard);
+}
+
+// Record the include guard for the current file if it's entirely wrapped in one
+static void finish_include_guard_detection(void) {
+    if (state.include_guard_state == IGS_AFTER_ENDIF) {
+        char *canonical_path = get_canonical_path(state.filename);
+        IncludeFile *include_file = strmap_get(include_files, canonical_path);
+        wfree(canonical_path);
+        set_include_file_state(state.filename, state.include_guard, include_file && include_file->pragma_once);
+    }
+
+    wfree(state.include_guard);
+    state.include_guard = 0;
+}
+
+// Can including a file be skipped, since it has a #pragma once or its include
+// guard is defined?
+static int can_skip_include_file(char *path) {
+    char *canonical_path = get_canonical_path(path);
+    IncludeFile *include_file = strmap_get(include_files, canonical_path);
+    wfree(canonical_path);
+
+    if (!include_file) return 0;
+    if (include_file->pragma_once) return 1;
+    return include_file->guard && strmap_get(directives, include_file->guard);
+}
+
+static void free_include_files(void) {
+    // Free the keys last, since strmap_get compares against them
+    strmap_foreach(include_files, it) {
+        IncludeFile *include_file = strmap_get(include_files, strmap_iterator_key(&it));
+        wfree(include_file->guard);
+        wfree(include_file);
+    }
+    strmap_foreach(include_files, it) wfree(strmap_iterator_key(&it));
+
+    free_strmap(include_files);
+    include_files = 0;
+}
+
+// Append a string to the output. When outputting tokens, only the line number and
+// trailing newlines are tracked, so that the tokens get the same line numbers as the
+// lexer would have given them when lexing the output as text.
+static void output_string(char *string) {
+    if (!token_output) {
+        append_to_string_buffer(output, string);
+        return;
+    }
+
+    for (char *s = string; *s; s++) {
+        if (*s == '\n') {
+            token_output_line_number++;
+            token_output_newlines++;
+        }
+        else
+            token_output_newlines = 0;
+    }
+}
+
+// Add a token with a string that outlives the preprocessor to the output tokens. A new
+// line is started if the line number or filename has changed.
+static void add_output_token(int kind, char *str) {
+    CppOutput *to = token_output;
+
+    CppOutputLine *line = to->line_count ? &to->lines[to->line_count - 1] : 0;
+    if (!line || line->line_number != token_output_line_number || line->filename != token_output_filename) {
+        if (to->line_count == to->allocated_lines) {
+            to->allocated_lines *= 2;
+            to->lines = wrealloc(to->lines, to->allocated_lines * sizeof(CppOutputLine));
+        }
+
+        line = &to->lines[to->line_count++];
+        line->token_index = to->token_count;
+        line->line_number = token_output_line_number;
+        line->filename = token_output_filename;
+    }
+
+    if (to->token_count == to->allocated_tokens) {
+        to->allocated_tokens *= 2;
+        to->tokens = wrealloc(to->tokens, to->allocated_tokens * sizeof(CppOutputToken));
+    }
+
+    CppOutputToken *token = &to->tokens[to->token_count++];
+    token->kind = kind;
+    token->str = str;
+    token_output_newlines = 0;
+}
+
+// Append a token to the output
+static void output_token(CppToken *token) {
+    if (!token_output) {
+        append_to_string_buffer(output, token->str);
+        return;
+    }
+
+    // The string must outlive the preprocessor's tokens. Only string literals are copied,
+    // the rest is interned, since they are mostly the same few punctuators and numbers.
+    // The lexer looks up interned identifiers and punctuators without lexing them again.
+    if (token->kind == CPP_TOK_STRING_LITERAL) {
+        int length = strlen(token->str);
+        char *str = arena_alloc(token_output->arena, length + 1);
+        memcpy(str, token->str, length + 1);
+        add_output_token(CPP_TOK_STRING_LITERAL, str);
+    }
+    else if (is_identifier(token))
+        add_output_token(CPP_TOK_IDENTIFIER, token->str);
+    else
+        add_output_token(token->kind, intern(token->str));
+}
+
+// Output a # <line> "<filename>" <flags> line marker
+static void output_line_marker(int line_number, char *filename, char *flags, int add_eol) {
+    if (!token_output) {
+        char *buf;
+        wasprintf(&buf, "# %d \"%s\"%s%s", line_number, filename, flags, add_eol ? "\n" : "");
+        append_to_string_buffer(output, buf);
+        wfree(buf);
+        return;
+    }
+
+    // The lexer skips the rest of the line, then continues with line_number
+    token_output_filename = intern(filename);
+    token_output_line_number = line_number - 1;
+    token_output_newlines = 0;
+    if (add_eol) output_string("\n");
 }
 
 static void output_line_directive(int offset, int add_eol, CppToken *token) {
     if (!token) return;
 
-    char *buf = wmalloc(256);
     char *filename = state.override_filename ? state.override_filename : state.filename;
-    sprintf(buf, "# %d \"%s\"%s", state.line_number_offset + token->line_number + offset, filename, add_eol ? "\n" : "");
-    append_to_string_buffer(output, buf);
-    wfree(buf);
+    output_line_marker(state.line_number_offset + token->line_number + offset, filename, "", add_eol);
 }
 
 // If the output has an amount newlines > threshold, collapse them into a # line statement
 static void collapse_trailing_newlines(int threshold, int output_line, CppToken *token) {
     int count = 0;
-    while (output->position - count > 0 && output->data[output->position - count - 1] == '\n') count++;
+    if (token_output)
+        count = token_output_newlines;
+    else
+        while (output->position - count > 0 && output->data[output->position - count - 1] == '\n') count++;
 
     if (count > threshold) {
         // Rewind output by count -1 characters
-        output->data[output->position - count + 1] = '\n';
-        output->position -= count - 1;
+        if (token_output) {
+            token_output_line_number -= count - 1;
+            token_output_newlines = 1;
+        }
+        else {
+            output->data[output->position - count + 1] = '\n';
+            output->position -= count - 1;
+        }
 
         if (output_line) output_line_directive(0, 1, token);
     }
@@ -194,17 +388,15 @@ static void run_preprocessor_on_file(char *filename, int first_file) {
 
     cpp_next();
 
-    append_to_string_buffer(output, "# 1 \"");
-    append_to_string_buffer(output, filename);
-    append_to_string_buffer(output, "\"");
-    if (!first_file) append_to_string_buffer(output, " 1");
-    append_to_string_buffer(output, "\n");
+    output_line_marker(1, filename, first_file ? "" : " 1", 1);
 
     cpp_parse();
 
+    finish_include_guard_detection();
+
     collapse_trailing_newlines(0, 0, 0);
 
-    wfree(state.input);
+    release_input();
     wfree(state.filename);
 
     LineMap *lm = state.line_map_start;
@@ -218,6 +410,7 @@ static void run_preprocessor_on_file(char *filename, int first_file) {
 void init_cpp_from_string(char *string) {
     state.input = wstrdup(string);
     state.input_size = strlen(string);
+    state.input_is_mapped = 0;
     state.filename = 0;
 
     state.ip = 0;
@@ -227,10 +420,9 @@ void init_cpp_from_string(char *string) {
 
 // Shallow copy a new CPP token
 static CppToken *dup_cpp_token(CppToken *tok) {
-    CppToken *result = wmalloc(sizeof(CppToken));
+    CppToken *result = arena_alloc(cpp_tokens_arena, sizeof(CppToken));
     *result = *tok;
     result->next = result;
-    append_to_list(allocated_tokens_duplicates, result);
     return result;
 }
 
@@ -277,23 +469,31 @@ static CppToken *dup_cll(CppToken *src) {
     return dst;
 }
 
-// Free a CPP token
-static void free_cpp_token(CppToken *token) {
-    if (token->str) wfree(token->str);
-    if (token->whitespace) wfree(token->whitespace);
-    wfree(token);
+// Create a new CPP token. Tokens are allocated in an arena, together with their strings,
+// except identifiers and whitespace, which are interned.
+CppToken *new_cpp_token(int kind) {
+    CppToken *tok = arena_alloc(cpp_tokens_arena, sizeof(CppToken));
+    tok->next = tok;
+    tok->kind = kind;
+
+    return tok;
 }
 
-// Create a new CPP token
-static CppToken *new_cpp_token(int kind) {
-    CppToken *tok = wcalloc(1, sizeof(CppToken));
-    tok->next = tok;
+// Copy the first length characters of string to a new string with the lifetime of the tokens
+char *new_cpp_token_string(char *string, int length) {
+    char *result = arena_alloc(cpp_tokens_arena, length + 1);
+    memcpy(result, string, length);
+    result[length] = 0;
 
-    append_to_list(allocated_tokens, tok);
+    return result;
+}
 
-    tok->kind = kind;
+// Move a wmalloc'd string to a new string with the lifetime of the tokens
+static char *move_to_cpp_token_string(char *string) {
+    char *result = new_cpp_token_string(string, strlen(string));
+    wfree(string);
 
-    return tok;
+    return result;
 }
 
 static void add_builtin_directive(char *identifier, DirectiveRenderer renderer) {
@@ -305,64 +505,117 @@ static void add_builtin_directive(char *identifier, DirectiveRenderer renderer)
 static CppToken *render_file(CppToken *directive_token) {
     CppToken *result = new_cpp_token(CPP_TOK_STRING_LITERAL);
     wasprintf(&(result->str), "\"%s\"", state.override_filename ? state.override_filename : state.filename);
+    result->str = move_to_cpp_token_string(result->str);
     return result;
 }
 
 static CppToken *render_line(CppToken *directive_token) {
     CppToken *result = new_cpp_token(CPP_TOK_NUMBER);
     wasprintf(&(result->str), "%d", directive_token->line_number_offset + directive_token->line_number);
+    result->str = move_to_cpp_token_string(result->str);
     return result;
 }
 
 static CppToken *render_time(CppToken *directive_token) {
+    cpp_cache_mark_uncacheable();
+
     time_t rawtime;
     struct tm *info;
     time(&rawtime);
     info = localtime(&rawtime);
     CppToken *result = new_cpp_token(CPP_TOK_STRING_LITERAL);
     wasprintf(&(result->str), "\"%02d:%02d:%02d\"", info->tm_hour, info->tm_min, info->tm_sec);
+    result->str = move_to_cpp_token_string(result->str);
     return result;
 }
 
 static CppToken *render_date(CppToken *directive_token) {
+    cpp_cache_mark_uncacheable();
+
     time_t rawtime;
     struct tm *info;
     time(&rawtime);
     info = localtime(&rawtime);
     CppToken *result = new_cpp_token(CPP_TOK_STRING_LITERAL);
     wasprintf(&(result->str), "\"%3s %2d %04d\"", months[info->tm_mon], info->tm_mday, info->tm_year + 1900);
+    result->str = move_to_cpp_token_string(result->str);
     return result;
 }
 
 static CppToken *render_numeric_token(int value) {
     CppToken *result = new_cpp_token(CPP_TOK_NUMBER);
     wasprintf(&(result->str), "%d", value);
+    result->str = move_to_cpp_token_string(result->str);
     return result;
 }
 
 static CppToken *render_string_token(const char *value) {
     CppToken *result = new_cpp_token(CPP_TOK_IDENTIFIER);
-    wasprintf(&(result->str), "%s", value);
+    result->str = intern((char *) value);
     return result;
 }
 
 Directive *make_numeric_directive(int value) {
     Directive *directive = wcalloc(1, sizeof(Directive));
     directive->tokens = render_numeric_token(value);
+    classify_directive(directive);
     return directive;
 }
 
 Directive *make_string_directive(const char *value) {
     Directive *directive = wcalloc(1, sizeof(Directive));
     directive->tokens = render_string_token(value);
+    classify_directive(directive);
     return directive;
 }
 
 Directive *make_empty_directive(void) {
     Directive *directive = wcalloc(1, sizeof(Directive));
+    classify_directive(directive);
     return directive;
 }
 
+// Determine if an object-like macro's replacement list can be expanded any further.
+// If it can't, expanding the macro is just a matter of copying the replacement list.
+void classify_directive(Directive *directive) {
+    directive->leaf_kind = MACRO_NOT_LEAF;
+    if (directive->is_function || directive->renderer) return;
+
+    int has_identifiers = 0;
+    CppToken *tokens = directive->tokens;
+    for (CppToken *tok = tokens ? tokens->next : 0; tok; tok = cll_next(tokens, tok)) {
+        if (tok->kind == CPP_TOK_PASTE) return;
+        if (is_identifier(tok)) has_identifiers = 1;
+    }
+
+    directive->leaf_kind = has_identifiers ? MACRO_LEAF : MACRO_CONSTANT;
+    directive->leaf_generation = 0;
+}
+
+// Can an object-like macro's replacement list not be expanded any further? For macros
+// with identifiers, this holds until one of the identifiers is defined as a macro. This
+// is checked again when any macro has been defined or undefined since the last time.
+static int is_leaf_directive(Directive *directive) {
+    if (directive->leaf_kind == MACRO_CONSTANT) return 1;
+    if (directive->leaf_kind != MACRO_LEAF) return 0;
+
+    if (directive->leaf_generation != directives_generation) {
+        directive->is_leaf = 1;
+
+        CppToken *tokens = directive->tokens;
+        for (CppToken *tok = tokens->next; tok; tok = cll_next(tokens, tok)) {
+            if (is_identifier(tok) && strmap_get(directives, tok->str)) {
+                directive->is_leaf = 0;
+                break;
+            }
+        }
+
+        directive->leaf_generation = directives_generation;
+    }
+
+    return directive->is_leaf;
+}
+
 void free_directive(Directive *d) {
     if (d) {
         if (d->param_identifiers) free_strmap(d->param_identifiers);
@@ -450,6 +703,25 @@ void free_directives(void) {
     free_strmap(directives);
 }
 
+// Define or redefine a macro
+void define_directive(char *identifier, Directive *directive) {
+    Directive *existing_directive = strmap_get(directives, identifier);
+    cpp_cache_directive_changed(identifier, existing_directive, directive);
+    if (existing_directive) free_directive(existing_directive);
+    strmap_put(directives, identifier, directive);
+    directives_generation++;
+}
+
+void undefine_directive(char *identifier) {
+    Directive *existing_directive = strmap_get(directives, identifier);
+    if (!existing_directive) return;
+
+    cpp_cache_directive_changed(identifier, existing_directive, 0);
+    free_directive(existing_directive);
+    strmap_delete(directives, identifier);
+    directives_generation++;
+}
+
 char *get_cpp_input(void) {
     return state.input;
 }
@@ -497,7 +769,7 @@ void transform_trigraphs(void) {
         else output[op++] = state.input[ip++];
     }
 
-    wfree(state.input);
+    release_input();
 
     output[op] = 0;
     state.input = output;
@@ -519,8 +791,23 @@ void strip_backslash_newlines(void) {
     LineMap *lm = state.line_map;
 
     if (state.input_size == 0) {
-        wfree(state.input);
-        state.input = output;
+        wfree(output);
+        return;
+    }
+
+    // The common case is no backslash newlines and a trailing newline. The input
+    // is then used in place and only the line map is made.
+    int in_place = state.input[state.input_size - 1] == '\n';
+    for (char *p = memchr(state.input, '\\', state.input_size); in_place && p; p = memchr(p + 1, '\\', state.input + state.input_size - p - 1))
+        if (p[1] == '\n') in_place = 0;
+
+    if (in_place) {
+        wfree(output);
+
+        for (char *p = memchr(state.input, '\n', state.input_size); p; p = memchr(p + 1, '\n', state.input + state.input_size - p - 1))
+            lm = add_to_linemap(lm, p - state.input + 1, ++line_number);
+
+        lm->next = 0;
         return;
     }
 
@@ -549,7 +836,7 @@ void strip_backslash_newlines(void) {
         line_number++;
     }
 
-    wfree(state.input);
+    release_input();
 
     output[op] = 0;
     state.input = output;
@@ -601,7 +888,7 @@ static int need_token_space(CppToken *t1, CppToken *t2) {
     return 0;
 }
 
-static void append_tokens_to_string_buffer(StringBuffer *sb, CppToken *tokens, int collapse_whitespace, int update_output) {
+static void append_tokens_to_string_buffer(StringBuffer *sb, CppToken *tokens, int collapse_whitespace) {
     if (!tokens) return;
 
     CppToken *prev = 0;
@@ -633,32 +920,54 @@ static void append_tokens_to_string_buffer(StringBuffer *sb, CppToken *tokens, i
         else if (seen_whitespace && collapse_whitespace)
             append_to_string_buffer(sb, " ");
 
-        if (update_output && !is_eol) collapse_trailing_newlines(8, 1, token);
         append_to_string_buffer(sb, token->str);
 
         prev = token;
         token = token->next;
+    } while (token != head);
+}
 
-        if (update_output) {
-            if (is_eol) state.output_line_number++;
+// Append macro expanded tokens to the output, keeping each line in the input on the same
+// line in the output
+static void append_tokens_to_output(CppToken *tokens) {
+    if (!tokens) return;
 
-            if (is_eol && token) {
-                // Output sufficient newlines to catch up with token->line_number.
-                // This ensures that each line in the input ends up on the same line
-                // in the output.
-                while (state.output_line_number < token->line_number) {
-                    state.output_line_number++;
-                    append_to_string_buffer(sb, "\n");
-                }
+    CppToken *prev = 0;
+    CppToken *head = tokens->next;
+    CppToken *token = head;
+
+    do {
+        int is_eol = (token->kind == CPP_TOK_EOL);
+
+        if (!is_eol && token->whitespace)
+            output_string(token->whitespace);
+        else if (prev && need_token_space(prev, token))
+            output_string(" ");
+
+        if (is_eol)
+            output_string(token->str);
+        else {
+            collapse_trailing_newlines(8, 1, token);
+            output_token(token);
+        }
+
+        prev = token;
+        token = token->next;
+
+        if (is_eol) {
+            state.output_line_number++;
+
+            // Output sufficient newlines to catch up with token->line_number.
+            // This ensures that each line in the input ends up on the same line
+            // in the output.
+            while (state.output_line_number < token->line_number) {
+                state.output_line_number++;
+                output_string("\n");
             }
         }
     } while (token != head);
 }
 
-static void append_tokens_to_output(CppToken *tokens) {
-    append_tokens_to_string_buffer(output, tokens, 0, 1);
-}
-
 #define advance_ip() do { \
     if (state.line_map && state.ip == state.line_map->position) { \
         state.line_number = state.line_map->line_number; \
@@ -687,23 +996,25 @@ static void add_to_whitespace(Whitespace *whitespace, char c) {
     (whitespace->data)[(whitespace->size)++] = c;
 }
 
+// Lex whitespace and comments and return the interned whitespace, or zero if there is none
 static char *lex_whitespace(void) {
-    Whitespace whitespace = {0};
+    Whitespace whitespace = whitespace_buffer;
+    whitespace.size = 0;
 
     // Process whitespace and comments
     while (state.ip < state.input_size) {
         char c = state.input[state.ip];
-        if (c == '\f' || c == '\v' || c == '\r') state.input[state.ip] = ' ';
+        if (c == '\f' || c == '\v' || c == '\r') c = ' ';
 
-        if ((state.input[state.ip] == '\t' || state.input[state.ip] == ' ')) {
-            add_to_whitespace(&whitespace, state.input[state.ip]);
+        if (c == '\t' || c == ' ') {
+            add_to_whitespace(&whitespace, c);
             advance_ip();
             continue;
         }
 
         // Process // comment
         if (state.input_size - state.ip >= 2 && state.input[state.ip] == '/' && state.input[state.ip + 1] == '/') {
-            while (state.input[state.ip] != '\n') advance_ip();
+            while (state.ip < state.input_size && state.input[state.ip] != '\n') advance_ip();
             add_to_whitespace(&whitespace, ' ');
             continue;
         }
@@ -726,10 +1037,10 @@ static char *lex_whitespace(void) {
         break;
     }
 
-    if (whitespace.data)
-        add_to_whitespace(&whitespace, 0);
+    // Keep the buffer around for the next token
+    whitespace_buffer = whitespace;
 
-    return whitespace.data;
+    return whitespace.size ? intern_string(whitespace.data, whitespace.size) : 0;
 }
 
 static void lex_string_and_char_literal(char delimiter) {
@@ -777,7 +1088,7 @@ static void lex_string_and_char_literal(char delimiter) {
     data[data_offset + size + 2] = 0;
 
     state.token = new_cpp_token(CPP_TOK_STRING_LITERAL);
-    state.token->str = data;
+    state.token->str = move_to_cpp_token_string(data);
 }
 
 #define is_pp_number(c1, c2) (c1 >= '0' && c1 <= '9') || (state.input_size - state.ip >= 2 && c1 == '.' && (c2 >= '0' && c2 <= '9'))
@@ -795,9 +1106,7 @@ static void lex_string_and_char_literal(char delimiter) {
 
 #define copy_token_str(start, size) \
     do { \
-        state.token->str = wmalloc(size + 1); \
-        memcpy(state.token->str, start, size); \
-        state.token->str[size] = 0; \
+        state.token->str = new_cpp_token_string(start, size); \
     } while (0)
 
 // Lex one CPP token, starting with optional whitespace
@@ -818,7 +1127,7 @@ static void cpp_next() {
 
         if (c1 == '\n') {
             state.token = new_cpp_token(CPP_TOK_EOL);
-            state.token->str = wstrdup("\n");
+            state.token->str = "\n";
             state.token->line_number = state.line_number; // Needs to be the line number of the \n token, not the next token
             state.hchar_lex_state = HLS_START_OF_LINE;
             advance_ip();
@@ -871,31 +1180,12 @@ static void cpp_next() {
         else if ((c1 >= 'a' && c1 <= 'z') || (c1 >= 'A' && c1 <= 'Z') || c1 == '_') {
             int start_ip = state.ip;
             int size = 0;
-            while (((i[state.ip] >= 'a' && i[state.ip] <= 'z') || (i[state.ip] >= 'A' && i[state.ip] <= 'Z') || (i[state.ip] >= '0' && i[state.ip] <= '9') || (i[state.ip] == '_')) && state.ip < state.input_size) {
+            while (state.ip < state.input_size && ((i[state.ip] >= 'a' && i[state.ip] <= 'z') || (i[state.ip] >= 'A' && i[state.ip] <= 'Z') || (i[state.ip] >= '0' && i[state.ip] <= '9') || (i[state.ip] == '_'))) {
                 if (size == MAX_IDENTIFIER_SIZE) panic("Exceeded maximum identifier size %d", MAX_IDENTIFIER_SIZE);
                 size++;
                 advance_ip();
             }
-            char *identifier = wmalloc(size + 1);
-            memcpy(identifier, &i[start_ip], size);
-            identifier[size] = 0;
-
-            #define is_identifier(t) (\
-                t->kind == CPP_TOK_IDENTIFIER || \
-                t->kind == CPP_TOK_INCLUDE    || \
-                t->kind == CPP_TOK_DEFINE     || \
-                t->kind == CPP_TOK_UNDEF      || \
-                t->kind == CPP_TOK_IF         || \
-                t->kind == CPP_TOK_IFDEF      || \
-                t->kind == CPP_TOK_IFNDEF     || \
-                t->kind == CPP_TOK_ELIF       || \
-                t->kind == CPP_TOK_ELSE       || \
-                t->kind == CPP_TOK_ENDIF      || \
-                t->kind == CPP_TOK_LINE       || \
-                t->kind == CPP_TOK_DEFINED    || \
-                t->kind == CPP_TOK_WARNING    || \
-                t->kind == CPP_TOK_ERROR      || \
-                t->kind == CPP_TOK_PRAGMA)
+            char *identifier = intern_string(&i[start_ip], size);
 
             if      (!strcmp(identifier, "define"))   { state.token = new_cpp_token(CPP_TOK_DEFINE);  state.token->str = identifier; }
             else if (!strcmp(identifier, "include"))  { state.token = new_cpp_token(CPP_TOK_INCLUDE); state.token->str = identifier; }
@@ -967,11 +1257,18 @@ static void set_line_number_on_token_sequence(CppToken *ts, int line_number) {
 
 // Parse function-like macro call, starting with the '('
 // Loop over ts; ts is advanced up to the enclosing ')'
-// Returns a ptr to the token sequences for each actual parameter.
+// Returns the token sequences for each actual parameter, terminated by a zero.
 // Nested () are taken into account, for cases like f((1, 2), 3), which
 // results in (1, 2) and 3 for the actual parameters.
-CppToken **make_function_actual_parameters(CppToken **ts, Directive *directive) {
-    CppToken **result = wcalloc(MAX_CPP_MACRO_PARAM_COUNT, sizeof(CppToken *));
+static MacroActuals *make_function_actual_parameters(CppToken **ts, Directive *directive) {
+    // One more than the parameters to detect too many actuals, plus the terminating zero
+    int size = directive->param_count + 2;
+
+    MacroActuals *actuals = arena_alloc(cpp_tokens_arena, sizeof(MacroActuals));
+    actuals->tokens = arena_alloc(cpp_tokens_arena, size * sizeof(CppToken *));
+    actuals->expanded = arena_alloc(cpp_tokens_arena, size * sizeof(CppToken *));
+    actuals->is_expanded = arena_alloc(cpp_tokens_arena, size);
+    CppToken **result = actuals->tokens;
 
     int parenthesis_nesting_level = 0;
     CppToken *current_actual = 0;
@@ -985,7 +1282,7 @@ CppToken **make_function_actual_parameters(CppToken **ts, Directive *directive)
         if (token->kind == CPP_TOK_RPAREN && !parenthesis_nesting_level) {
             // We're not in nested parentheses
             result[index++] = current_actual;
-            return result;
+            return actuals;
         }
         else if (token->kind == CPP_TOK_RPAREN) {
             // We're in nested parentheses
@@ -1003,6 +1300,7 @@ CppToken **make_function_actual_parameters(CppToken **ts, Directive *directive)
             }
             else {
                 // Finish current ap and start next ap
+                if (index == size - 2) error("Mismatch in number of macro parameters");
                 result[index++] = current_actual;
                 current_actual = 0;
             }
@@ -1018,38 +1316,17 @@ CppToken **make_function_actual_parameters(CppToken **ts, Directive *directive)
     }
 }
 
-void free_function_actual_parameters(CppToken **actuals) {
-    wfree(actuals); // The tokens are freed as part of the garbage freeing
-}
-
-// Call strset_union and register the allocated strset for freeing later on.
-StrSet *cpp_strset_union(StrSet *set1, StrSet *set2) {
-    StrSet *s = strset_union(set1, set2);
-    append_to_list(allocated_strsets, s);
-    return s;
-}
-
-// Union two sets. Either or both may be NULL
-#define safe_strset_union(set1, set2) \
-    set1 && set2 \
-        ? cpp_strset_union(set1, set2) \
-        : set1 \
-            ? set1 \
-            : set2
+// Return a fully macro replaced copy of an actual parameter. The expansion is done once
+// per actual parameter, no matter how often the formal parameter is used.
+static CppToken *expand_actual_parameter(MacroActuals *ap, int index) {
+    if (!ap->is_expanded[index]) {
+        ap->expanded[index] = expand(dup_cll(ap->tokens[index]));
+        ap->is_expanded[index] = 1;
+    }
 
-// Call strset_intersection and register the allocated strset for freeing later on.
-StrSet *cpp_strset_intersection(StrSet *set1, StrSet *set2) {
-    StrSet *s = strset_intersection(set1, set2);
-    append_to_list(allocated_strsets, s);
-    return s;
+    return dup_cll(ap->expanded[index]);
 }
 
-// Intersect two sets. Either or both may be NULL
-#define safe_strset_intersection(set1, set2) \
-    set1 && set2 \
-        ? cpp_strset_intersection(set1, set2) \
-        : 0;
-
 // Implementation of Dave Prosser's C Preprocessing Algorithm
 // This is the main macro expansion function: expand an input sequence into an output sequence.
 static CppToken *expand(CppToken *is) {
@@ -1078,7 +1355,7 @@ static CppToken *expand(CppToken *is) {
     CppToken *tok1 = tok->next != is_head ? tok->next : 0;
     while (tok1 && tok1->kind == CPP_TOK_EOL) tok1 = cll_next(is, tok1);
 
-    if (tok->str && tok->hide_set && strset_in(tok->hide_set, tok->str)) {
+    if (tok->str && hide_set_in(tok->hide_set, tok->str)) {
         // The first token tok in its own hide set, don't expand it
         // return the first token + the expanded rest
         if (is_tail == is_head) return is_tail; // Only one token
@@ -1092,10 +1369,24 @@ static CppToken *expand(CppToken *is) {
     if (directive && !directive->is_function) {
         // Object like macro
 
-        StrSet *identifier_hs = new_strset();
-        append_to_list(allocated_strsets, identifier_hs);
-        strset_add(identifier_hs, tok->str);
-        StrSet *hs = tok->hide_set ? cpp_strset_union(tok->hide_set, identifier_hs) : identifier_hs;
+        HideSet *hs = hide_set_add(tok->hide_set, tok->str);
+
+        if (is_leaf_directive(directive)) {
+            // The replacement tokens can't be expanded any further, so skip subst() and
+            // rescanning them
+            CppToken *replacement = dup_cll(directive->tokens);
+            if (replacement) {
+                for (CppToken *t = replacement->next; t; t = cll_next(replacement, t)) {
+                    t->hide_set = hide_set_union(t->hide_set, hs);
+                    t->line_number = tok->line_number;
+                }
+
+                replacement->next->whitespace = tok->whitespace;
+            }
+
+            return concat_clls(replacement, expand(cll_from_next(is, tok)));
+        }
+
         CppToken *replacement_tokens = directive->renderer ? directive->renderer(tok) : directive->tokens;
         CppToken *substituted = subst(replacement_tokens, 0, 0, hs, 0);
 
@@ -1111,37 +1402,29 @@ static CppToken *expand(CppToken *is) {
         // Function like macro
 
         CppToken *directive_token = tok;
-        StrSet *directive_token_hs = tok->hide_set;
+        HideSet *directive_token_hs = tok->hide_set;
         tok = cll_next(is, tok1);
-        CppToken **actuals = make_function_actual_parameters(&tok, directive);
+        MacroActuals *actuals = make_function_actual_parameters(&tok, directive);
         if (!tok || tok->kind != CPP_TOK_RPAREN) error("Expected )");
 
         int actuals_count = 0;
-        for (CppToken **tok = actuals; *tok; tok++, actuals_count++);
+        for (CppToken **tok = actuals->tokens; *tok; tok++, actuals_count++);
         if (!directive->is_variadic && actuals_count > directive->param_count)
             error("Mismatch in number of macro parameters");
 
-        StrSet *rparen_hs = tok->hide_set;
+        HideSet *rparen_hs = tok->hide_set;
 
         // Make the hideset for the macro subsitution
         // T is the directive token
         // HS is directive token hide set
         // HS' is ')' hide set
         // HS = (HS ∩ HS’) ∪ {T}
-        StrSet *hs1 = safe_strset_intersection(directive_token_hs, rparen_hs);
-
-        StrSet *hs2 = new_strset();
-        strset_add(hs2, directive_token->str);
-        if (hs2) append_to_list(allocated_strsets, hs2);
-
-        StrSet *hs = safe_strset_union(hs1, hs2);
+        HideSet *hs = hide_set_add(hide_set_intersection(directive_token_hs, rparen_hs), directive_token->str);
 
         CppToken *substituted = 0;
         if (directive->tokens)
             substituted = subst(dup_cll(directive->tokens), directive->param_identifiers, actuals, hs, 0);
 
-        free_function_actual_parameters(actuals);
-
         if (substituted) {
             set_line_number_on_token_sequence(substituted, directive_token->line_number);
             substituted->next->whitespace = directive_token->whitespace;
@@ -1159,7 +1442,7 @@ static CppToken *expand(CppToken *is) {
 static CppToken *stringize(CppToken *ts) {
     StringBuffer *rendered = new_string_buffer(128);
 
-    append_tokens_to_string_buffer(rendered, ts, 1, 0);
+    append_tokens_to_string_buffer(rendered, ts, 1);
 
     terminate_string_buffer(rendered);
 
@@ -1215,9 +1498,9 @@ static CppToken *stringize(CppToken *ts) {
     append_to_string_buffer(escaped, "\"");
 
     CppToken *result = new_cpp_token(CPP_TOK_STRING_LITERAL);
-    result->str = escaped->data;
+    result->str = new_cpp_token_string(escaped->data, strlen(escaped->data));
 
-    free_string_buffer(escaped, 0);
+    free_string_buffer(escaped, 1);
     free_string_buffer(rendered, 1);
 
     return result;
@@ -1229,11 +1512,14 @@ static CppToken *glue(CppToken *ls, CppToken *rs) {
     if (ls == 0) return rs;
     if (rs == 0) error("Attempt to glue an empty right side");
 
-    // Mutating ls, this is allowed since ls is append only
-    wasprintf(&ls->str, "%s%s", ls->str, rs->next->str);
-    append_to_list(allocated_strings, ls->str);
+    // Mutating ls, this is allowed since ls is append only. The result is interned,
+    // since it can be the identifier of a macro, which go in hide sets.
+    char *glued;
+    wasprintf(&glued, "%s%s", ls->str, rs->next->str);
+    ls->str = intern(glued);
+    wfree(glued);
     ls->kind = CPP_TOK_OTHER;
-    ls->hide_set = safe_strset_intersection(ls->hide_set, rs->next->hide_set);
+    ls->hide_set = hide_set_intersection(ls->hide_set, rs->next->hide_set);
 
     // Copy all elements from the right side except the first
     CppToken *rs_tok = rs->next;
@@ -1254,7 +1540,7 @@ static CppToken *glue(CppToken *ls, CppToken *rs) {
 //   os: output sequence
 // Output
 //   output sequence
-static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppToken *os) {
+static CppToken *subst(CppToken *is, StrMap *fp, MacroActuals *ap, HideSet *hs, CppToken *os) {
     // Empty token sequence, update the hide set and return output sequence
     if (!is) {
         if (!os) return os;
@@ -1274,7 +1560,7 @@ static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppT
 
     // # FP
     if (tok->kind == CPP_TOK_HASH && tok1_fp_index) {
-        CppToken *replacement = ap[tok1_fp_index - 1];
+        CppToken *replacement = ap->tokens[tok1_fp_index - 1];
         os = cll_append_token(os, stringize(replacement));
 
         return subst(cll_from_next(is, tok1), fp, ap, hs, os);
@@ -1282,7 +1568,7 @@ static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppT
 
     // ## FP
     if (tok->kind == CPP_TOK_PASTE && tok1_fp_index) {
-        CppToken *replacement = ap[tok1_fp_index - 1];
+        CppToken *replacement = ap->tokens[tok1_fp_index - 1];
         if (!replacement)
             return subst(cll_from_next(is, tok1), fp, ap, hs, os);
         else
@@ -1298,11 +1584,11 @@ static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppT
 
     // FP ##
     if (tok_fp_index && tok1 && tok1->kind == CPP_TOK_PASTE) {
-        CppToken *replacement = ap[tok_fp_index - 1];
+        CppToken *replacement = ap->tokens[tok_fp_index - 1];
         if (!replacement) {
             if (tok2 && tok2_fp_index) {
                 // (empty) ## (replacement2) ...
-                CppToken *replacement2 = ap[tok2_fp_index - 1];
+                CppToken *replacement2 = ap->tokens[tok2_fp_index - 1];
                 return subst(cll_from_next(is, tok2), fp, ap, hs, concat_clls(os, dup_cll(replacement2)));
             }
             else
@@ -1316,9 +1602,7 @@ static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppT
 
     // FP
     if (tok_fp_index) {
-        CppToken *replacement = ap[tok_fp_index - 1];
-
-        CppToken *expanded = expand(dup_cll(replacement));
+        CppToken *expanded = expand_actual_parameter(ap, tok_fp_index - 1);
         if (expanded) expanded->next->whitespace = tok->whitespace;
 
         if (expanded) os = concat_clls(os, expanded);
@@ -1334,25 +1618,15 @@ static CppToken *subst(CppToken *is, StrMap *fp, CppToken **ap, StrSet *hs, CppT
 }
 
 // Add a a hide set to a token sequence's hide set.
-static CppToken *hsadd(StrSet *hs, CppToken *ts) {
+// ts is mutated, this is allowed since the output sequence of subst only has copied tokens.
+static CppToken *hsadd(HideSet *hs, CppToken *ts) {
     if (!hs) panic("Empty hs in hsadd");
     if (!ts) return 0;
 
-    CppToken *result = 0;
-    for (CppToken *tok = ts->next; tok; tok = cll_next(ts, tok)) {
-        CppToken *new_token = dup_cpp_token(tok);
+    for (CppToken *tok = ts->next; tok; tok = cll_next(ts, tok))
+        tok->hide_set = hide_set_union(tok->hide_set, hs);
 
-        if (new_token->hide_set)
-            new_token->hide_set = cpp_strset_union(new_token->hide_set, hs);
-        else {
-            new_token->hide_set = dup_strset(hs);
-            if (new_token->hide_set) append_to_list(allocated_strsets, new_token->hide_set);
-        }
-
-        result = cll_append_token(result, new_token);
-    }
-
-    return result;
+    return ts;
 }
 
 static char *get_current_file_path() {
@@ -1365,48 +1639,38 @@ static char *get_current_file_path() {
     return path;
 }
 
-static int try_and_open_include_file(char *full_path, char *path) {
-    FILE *file = fopen(full_path, "r" );
-    if (file) {
-        init_cpp_from_fh(file, full_path);
-        return 1;
-    }
-
+// Return full_path if it can be read, otherwise free it
+static char *try_include_file(char *full_path) {
+    if (!access(full_path, R_OK)) return full_path;
+    wfree(full_path);
     return 0;
 }
 
-// Locate a filename in the search paths open it.
-static int open_include_file(char *path, int is_system_include) {
+// Locate a filename in the search paths and return a wmalloc'd full path to it
+static char *find_include_file(char *path, int is_system_include) {
+    char *full_path;
+
     if (path[0] == '/')
         // Absolute path
-        return try_and_open_include_file(path, path);
+        return try_include_file(wstrdup(path));
 
     // Relative path
     if (!is_system_include) {
-        char *full_path;
         char *current_file_path = get_current_file_path();
         wasprintf(&full_path, "%s%s", current_file_path, path);
         wfree(current_file_path);
-        int ok = try_and_open_include_file(full_path, path);
-        wfree(full_path);
-        if (ok) return 1;
+        if ((full_path = try_include_file(full_path))) return full_path;
     }
 
     for (CliIncludePath *cip = cli_include_paths; cip; cip = cip->next) {
-        char *full_path;
         wasprintf(&full_path, "%s/%s", cip->path, path);
-        int ok = try_and_open_include_file(full_path, path);
-        wfree(full_path);
-        if (ok) return 1;
+        if ((full_path = try_include_file(full_path))) return full_path;
     }
 
     const char *include_path;
     for (int i = 0; (include_path = builtin_include_paths[i]); i++) {
-        char *full_path;
         wasprintf(&full_path, "%s/%s", include_path, path);
-        int ok = try_and_open_include_file(full_path, path);
-        wfree(full_path);
-        if (ok) return 1;
+        if ((full_path = try_include_file(full_path))) return full_path;
     }
 
     return 0;
@@ -1460,28 +1724,42 @@ static void parse_include() {
     is_system = include_token->kind == CPP_TOK_HCHAR_STRING_LITERAL;
 
     skip_until_eol();
+
+    char *full_path = find_include_file(path, is_system);
+    if (!full_path) error("Unable to find %s in any include paths", path);
+
+    if (can_skip_include_file(full_path)) {
+        wfree(full_path);
+        return;
+    }
+
     collapse_trailing_newlines(0, 0, 0);
 
-    // Backup current parsing state
-    CppState backup_state = state;
+    if (!cpp_cache_replay(full_path, output)) {
+        cpp_cache_start_recording(full_path, output);
 
-    if (!open_include_file(path, is_system)) error("Unable to find %s in any include paths", path);
+        // Backup current parsing state
+        CppState backup_state = state;
 
-    state.include_depth++;
-    run_preprocessor_on_file(state.filename, 0);
-    state.include_depth--;
+        if (!init_cpp_from_file(full_path)) error("Unable to open %s", full_path);
 
-    wfree(state.conditional_include_stack);
+        state.include_depth++;
+        run_preprocessor_on_file(state.filename, 0);
+        state.include_depth--;
 
-    // Restore parsing state
-    state = backup_state;
-    cur_filename = state.filename;
+        wfree(state.conditional_include_stack);
+
+        // Restore parsing state
+        state = backup_state;
+        cur_filename = state.filename;
+
+        cpp_cache_finish_recording(output);
+    }
+
+    wfree(full_path);
 
-    char *buf = wmalloc(256);
     char *filename = state.override_filename ? state.override_filename : state.filename;
-    sprintf(buf, "# %d \"%s\" 2", state.line_number_offset + state.line_number + 1, filename);
-    append_to_string_buffer(output, buf);
-    wfree(buf);
+    output_line_marker(state.line_number_offset + state.line_number + 1, filename, " 2", 0);
 }
 
 static CppToken *parse_define_replacement_tokens(void) {
@@ -1500,7 +1778,6 @@ static CppToken *parse_define_replacement_tokens(void) {
     if (result->kind == CPP_TOK_PASTE) error("## at end of macro replacement list");
 
     // Clear whitespace on initial token
-    wfree(result->next->whitespace);
     result->next->whitespace = NULL;
 
     return result;
@@ -1584,6 +1861,7 @@ static Directive *parse_define_tokens(void) {
     }
 
     directive->tokens = tokens;
+    classify_directive(directive);
 
     return directive;
 }
@@ -1600,9 +1878,7 @@ static void enter_if() {
 static CppToken *make_boolean_token(int value) {
     CppToken *result = new_cpp_token(CPP_TOK_NUMBER);
 
-    result->str = wmalloc(2);
-    result->str[0] = '0' + value;
-    result->str[1] = 0;
+    result->str = value ? "1" : "0";
 
     return result;
 }
@@ -1669,7 +1945,7 @@ static long parse_conditional_expression() {
         }
 
     StringBuffer *rendered = new_string_buffer(128);
-    append_tokens_to_string_buffer(rendered, expanded, 1, 0);
+    append_tokens_to_string_buffer(rendered, expanded, 1);
 
     char *data = rendered->data;
     free_string_buffer(rendered, 0);
@@ -1780,13 +2056,37 @@ static void check_directive_redeclaration(Directive *d1, Directive *d2, char *id
 
 
     if (!!t1 != !!t2) identical = 0;
-    if (!identical) warning("Macro %s redefined", identifier);
+    if (!identical) {
+        cpp_cache_mark_uncacheable();
+        warning("Macro %s redefined", identifier);
+    }
+}
+
+// Update the include guard detection state for a directive. A file is guarded if,
+// apart from whitespace, it consists of a single #ifndef group.
+static void track_include_guard_directive(int kind) {
+    int is_null_directive = kind == CPP_TOK_EOL || kind == CPP_TOK_EOF;
+
+    if (state.include_guard_state == IGS_START && kind != CPP_TOK_IFNDEF && !is_null_directive)
+        state.include_guard_state = IGS_INVALID;
+
+    else if (state.include_guard_state == IGS_IN_GUARD && state.conditional_include_stack == state.include_guard_conditional) {
+        if (kind == CPP_TOK_ELSE || kind == CPP_TOK_ELIF)
+            state.include_guard_state = IGS_INVALID;
+        else if (kind == CPP_TOK_ENDIF)
+            state.include_guard_state = IGS_AFTER_ENDIF;
+    }
+
+    else if (state.include_guard_state == IGS_AFTER_ENDIF && !is_null_directive)
+        state.include_guard_state = IGS_INVALID;
 }
 
 static void parse_directive(void) {
     CppToken *directive_hash_token = state.token;
     cpp_next();
 
+    track_include_guard_directive(state.token->kind);
+
     switch (state.token->kind) {
         case CPP_TOK_INCLUDE:
             cpp_next();
@@ -1808,11 +2108,8 @@ static void parse_directive(void) {
 
                 Directive *existing_directive = strmap_get(directives, identifier);
                 Directive *directive = parse_define_tokens();
-                if (existing_directive) {
-                    check_directive_redeclaration(existing_directive, directive, identifier);
-                    free_directive(existing_directive);
-                }
-                strmap_put(directives, identifier, directive);
+                if (existing_directive) check_directive_redeclaration(existing_directive, directive, identifier);
+                define_directive(identifier, directive);
             }
             else
                 skip_until_eol();
@@ -1824,9 +2121,7 @@ static void parse_directive(void) {
 
             if (!state.conditional_include_stack->skipping) {
                 if (!is_identifier(state.token)) error("Expected identifier");
-                Directive *existing_directive = strmap_get(directives, state.token->str);
-                if (existing_directive) free_directive(existing_directive);
-                strmap_delete(directives, state.token->str);
+                undefine_directive(state.token->str);
                 cpp_next();
 
                 skip_until_eol();
@@ -1840,6 +2135,13 @@ static void parse_directive(void) {
             cpp_next();
             parse_if_defined(negate);
 
+            if (negate && state.include_guard_state == IGS_START) {
+                // This #ifndef may be an include guard
+                state.include_guard_state = IGS_IN_GUARD;
+                state.include_guard = wstrdup(state.token->str);
+                state.include_guard_conditional = state.conditional_include_stack;
+            }
+
             skip_until_eol();
             break;
         }
@@ -1924,7 +2226,15 @@ static void parse_directive(void) {
         }
 
         case CPP_TOK_PRAGMA:
-            // Ignore #pragma
+            // Handle #pragma once and ignore everything else
+            cpp_next();
+
+            if (!state.conditional_include_stack->skipping && state.filename && is_identifier(state.token) && !strcmp(state.token->str, "once")) {
+                char *canonical_path = get_canonical_path(state.filename);
+                IncludeFile *include_file = strmap_get(include_files, canonical_path);
+                wfree(canonical_path);
+                set_include_file_state(state.filename, include_file ? include_file->guard : 0, 1);
+            }
 
             skip_until_eol();
             break;
@@ -1934,7 +2244,8 @@ static void parse_directive(void) {
 
             if (!state.conditional_include_stack->skipping) {
                 StringBuffer *message = new_string_buffer(128);
-                append_tokens_to_string_buffer(message, gather_tokens_until_eol(), 0, 0);
+                append_tokens_to_string_buffer(message, gather_tokens_until_eol(), 0);
+                cpp_cache_mark_uncacheable();
                 warning("%s", message->data);
             }
 
@@ -1945,7 +2256,7 @@ static void parse_directive(void) {
 
             if (!state.conditional_include_stack->skipping) {
                 StringBuffer *message = new_string_buffer(128);
-                append_tokens_to_string_buffer(message, gather_tokens_until_eol(), 0, 0);
+                append_tokens_to_string_buffer(message, gather_tokens_until_eol(), 0);
                 error("%s", message->data);
             }
 
@@ -1976,6 +2287,9 @@ static void cpp_parse() {
             group_tokens = 0;
         }
         else {
+            if (state.token->kind != CPP_TOK_EOL && state.include_guard_state != IGS_IN_GUARD)
+                state.include_guard_state = IGS_INVALID;
+
             if (!state.conditional_include_stack->skipping) {
                 group_tokens = cll_append_token(group_tokens, state.token);
                 new_line = (state.token->kind == CPP_TOK_EOL);
@@ -1988,34 +2302,22 @@ static void cpp_parse() {
 }
 
 void init_cpp(void) {
-    allocated_tokens = new_list(1024);
-    allocated_tokens_duplicates = new_list(1024);
-    allocated_strsets = new_list(1024);
-    allocated_strings = new_list(1024);
+    if (!cpp_tokens_arena) cpp_tokens_arena = new_arena();
 }
 
 void free_cpp_allocated_garbage() {
-    if (!allocated_tokens) return; // CPP has not been initted
-
-    // Free allocated_tokens
-    for (int i = 0; i < allocated_tokens->length; i++)
-        free_cpp_token(allocated_tokens->elements[i]);
-    free_list(allocated_tokens);
-    allocated_tokens = NULL;
+    if (!cpp_tokens_arena) return; // CPP has not been initted
 
-    for (int i = 0; i < allocated_tokens_duplicates->length; i++)
-        wfree(allocated_tokens_duplicates->elements[i]);
-    free_list(allocated_tokens_duplicates);
+    // Free all tokens and their strings
+    free_arena(cpp_tokens_arena);
+    cpp_tokens_arena = NULL;
 
-    // Free any allocated strsets
-    for (int i = 0; i < allocated_strsets->length; i++)
-        free_strset(allocated_strsets->elements[i]);
-    free_list(allocated_strsets);
+    if (whitespace_buffer.data) wfree(whitespace_buffer.data);
+    whitespace_buffer.data = NULL;
+    whitespace_buffer.allocated = 0;
 
-    // Free any allocated strings
-    for (int i = 0; i < allocated_strings->length; i++)
-        wfree(allocated_strings->elements[i]);
-    free_list(allocated_strings);
+    // Free any hide sets made while expanding macros
+    free_hide_sets();
 }
 
 Directive *parse_cli_define(char *string) {
@@ -2080,44 +2382,110 @@ static void free_cli_directives(void) {
 
 }
 
-// Entrypoint for the preprocessor. This handles a top level file. It prepares the
-// output, runs the preprocessor, then prints the output to a file handle.
-char *preprocess(char *filename, List *cli_directive_strings) {    init_cpp();
+// Start the preprocessed include file cache for a translation unit. All include
+// paths are part of the cache key, since they determine which files are found.
+static void init_cpp_cache_with_include_paths(void) {
+    if (!opt_cpp_cache_dir) return;
+
+    StringBuffer *include_paths = new_string_buffer(256);
+
+    for (CliIncludePath *cip = cli_include_paths; cip; cip = cip->next) {
+        append_to_string_buffer(include_paths, cip->path);
+        append_to_string_buffer(include_paths, ":");
+    }
+
+    const char *include_path;
+    for (int i = 0; (include_path = builtin_include_paths[i]); i++) {
+        append_to_string_buffer(include_paths, (char *) include_path);
+        append_to_string_buffer(include_paths, ":");
+    }
+
+    terminate_string_buffer(include_paths);
+    init_cpp_cache(include_paths->data);
+    free_string_buffer(include_paths, 1);
+}
+
+// Run the preprocessor on a top level file, with the output going to the output string
+// buffer, or to token_output if set.
+static void run_preprocessor_on_top_level_file(char *filename, List *cli_directive_strings) {
+    init_cpp();
     parse_cli_directive_strings(cli_directive_strings);
 
     init_directives();
+    include_files = new_strmap();
+    init_cpp_cache_with_include_paths();
 
-    FILE *f = fopen(filename, "r");
-
-    if (f == 0) {
+    if (!init_cpp_from_file(filename)) {
         perror(filename);
         exit(1);
     }
 
-    init_cpp_from_fh(f, filename);
-
-    output = new_string_buffer(state.input_size * 2);
+    output = token_output ? 0 : new_string_buffer(state.input_size * 2);
 
     run_preprocessor_on_file(filename, 1);
 
     if (state.conditional_include_stack->prev) error("Unterminated #if");
 
-    terminate_string_buffer(output);
-
-    char *data = output->data;
-    free_string_buffer(output, 0);
-
+    free_cpp_cache();
     free_directives();
+    free_include_files();
     free_cpp_allocated_garbage();
 
     wfree(state.conditional_include_stack);
     init_cpp(); // For the next round
 
     free_cli_directives();
+}
+
+// Entrypoint for the preprocessor. This handles a top level file. It prepares the
+// output, runs the preprocessor, then returns the output as text.
+char *preprocess(char *filename, List *cli_directive_strings) {
+    run_preprocessor_on_top_level_file(filename, cli_directive_strings);
+
+    terminate_string_buffer(output);
+
+    char *data = output->data;
+    free_string_buffer(output, 0);
+    output = 0;
 
     return data;
 }
 
+// Run the preprocessor on a top level file and return the output tokens for the parser,
+// without rendering them as text. The include file cache stores text, so when it's used,
+// or if integrated preprocessing is disabled, the output is text instead.
+CppOutput *preprocess_to_tokens(char *filename, List *cli_directive_strings) {
+    CppOutput *result = wcalloc(1, sizeof(CppOutput));
+
+    if (!opt_integrated_cpp || opt_cpp_cache_dir) {
+        result->text = preprocess(filename, cli_directive_strings);
+        return result;
+    }
+
+    result->allocated_tokens = 1024;
+    result->tokens = wmalloc(result->allocated_tokens * sizeof(CppOutputToken));
+    result->allocated_lines = 256;
+    result->lines = wmalloc(result->allocated_lines * sizeof(CppOutputLine));
+    result->arena = new_arena();
+
+    token_output = result;
+    run_preprocessor_on_top_level_file(filename, cli_directive_strings);
+
+    // Add an end token with the line number the lexer would have ended up on
+    add_output_token(CPP_TOK_EOF, "");
+    token_output = 0;
+
+    return result;
+}
+
+void free_cpp_output(CppOutput *cpp_output) {
+    if (cpp_output->text) wfree(cpp_output->text);
+    if (cpp_output->tokens) wfree(cpp_output->tokens);
+    if (cpp_output->lines) wfree(cpp_output->lines);
+    if (cpp_output->arena) free_arena(cpp_output->arena);
+    wfree(cpp_output);
+}
+
 // Run preprocessor on a file. If output_filename is '-' or not defined, send output
 // to stdout.
 void preprocess_to_file(char *input_filename, char *output_filename, List *cli_directive_strings) {
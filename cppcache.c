@@ -0,0 +1,569 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wcc.h"
+
+// Persistent cache of preprocessed include files
+//
+// While an include file is preprocessed, everything it does is recorded: its
+// output, the macros it defines or undefines, the include guards and #pragma
+// onces it sets, and the files it reads. At the end, the recording is written to
+// the cache directory. The entry is keyed by the path of the file, the include
+// paths and fingerprints of the macro table and include file state at the point
+// of inclusion, since those determine what preprocessing the file produces.
+//
+// A later inclusion with the same key reads the entry with a single read() and
+// replays it, provided none of the files it depends on have changed.
+
+#define CPP_CACHE_MAGIC "wcc-cpp-cache-1"
+
+// FNV-1a
+#define HASH_OFFSET 14695981039346656037UL
+#define HASH_PRIME 1099511628211UL
+
+typedef struct cache_buffer {
+    char *data;
+    int size;
+    int allocated;
+} CacheBuffer;
+
+typedef struct cache_reader {
+    char *data;
+    int size;
+    int position;
+    int failed;     // Set when reading beyond the end of the data
+} CacheReader;
+
+typedef struct include_file_state {
+    char *guard;
+    int pragma_once;
+} IncludeFileState;
+
+// A recording of the effects of preprocessing an include file
+typedef struct recording {
+    char *key;                  // Cache key
+    StrSet *dependencies;       // Paths of all files that have been read
+    StrSet *macros;             // Identifiers of all macros that have been defined or undefined
+    StrMap *include_files;      // Canonical path => IncludeFileState for all changed include files
+    int output_start;           // Start of the file's preprocessed output
+    int uncacheable;            // Set if the file does something that can't be replayed
+    struct recording *prev;
+} Recording;
+
+static char *include_paths_key;             // All include paths, which determine how #include paths are resolved
+static unsigned long macros_fingerprint;    // XOR of the hashes of all defined macros
+static unsigned long include_files_fingerprint; // XOR of the hashes of all include file states
+static Recording *recordings;               // Stack of recordings in progress
+
+static unsigned long hash_bytes(unsigned long hash, char *data, int size) {
+    for (int i = 0; i < size; i++) hash = (hash ^ (unsigned char) data[i]) * HASH_PRIME;
+    return hash;
+}
+
+static unsigned long hash_string(unsigned long hash, char *string) {
+    if (!string) return hash_bytes(hash, "", 1);
+    return hash_bytes(hash, string, strlen(string) + 1);
+}
+
+static unsigned long hash_long(unsigned long hash, long value) {
+    return hash_bytes(hash, (char *) &value, sizeof(long));
+}
+
+static unsigned long hash_directive(char *identifier, Directive *directive) {
+    unsigned long hash = hash_string(HASH_OFFSET, identifier);
+
+    // Builtins are the same in every translation unit
+    if (directive->renderer) return hash_string(hash, "builtin");
+
+    hash = hash_long(hash, directive->is_function);
+    hash = hash_long(hash, directive->param_count);
+    hash = hash_long(hash, directive->is_variadic);
+
+    if (directive->param_identifiers) {
+        // The parameters are combined in an order independent way, since they
+        // come out of the strmap in an arbitrary order
+        unsigned long params_hash = 0;
+        strmap_foreach(directive->param_identifiers, it) {
+            char *param_identifier = strmap_iterator_key(&it);
+            long index = (long) strmap_get(directive->param_identifiers, param_identifier);
+            params_hash ^= hash_long(hash_string(HASH_OFFSET, param_identifier), index);
+        }
+        hash = hash_long(hash, params_hash);
+    }
+
+    if (directive->tokens) {
+        CppToken *tok = directive->tokens->next;
+        while (1) {
+            hash = hash_long(hash, tok->kind);
+            hash = hash_string(hash, tok->str);
+            hash = hash_string(hash, tok->whitespace);
+            if (tok == directive->tokens) break;
+            tok = tok->next;
+        }
+    }
+
+    return hash;
+}
+
+static unsigned long hash_include_file_state(char *canonical_path, char *guard, int pragma_once) {
+    if (!guard && !pragma_once) return 0;
+    return hash_long(hash_string(hash_string(HASH_OFFSET, canonical_path), guard), pragma_once);
+}
+
+// Add a copy of string to a strset, unless it's already in there
+static void add_to_strset(StrSet *ss, char *string) {
+    if (!strset_in(ss, string)) strset_add(ss, wstrdup(string));
+}
+
+static void free_strset_and_strings(StrSet *ss) {
+    strmap_foreach(ss->strmap, it) wfree(strmap_iterator_key(&it));
+    free_strset(ss);
+}
+
+// Start a new translation unit. include_paths must contain all include paths that
+// are searched.
+void init_cpp_cache(char *include_paths) {
+    if (!opt_cpp_cache_dir) return;
+
+    include_paths_key = wstrdup(include_paths);
+
+    macros_fingerprint = 0;
+    strmap_foreach(directives, it) {
+        char *identifier = strmap_iterator_key(&it);
+        macros_fingerprint ^= hash_directive(identifier, strmap_get(directives, identifier));
+    }
+
+    include_files_fingerprint = 0;
+    recordings = 0;
+}
+
+void free_cpp_cache(void) {
+    if (!opt_cpp_cache_dir) return;
+
+    wfree(include_paths_key);
+    include_paths_key = 0;
+}
+
+// Update the fingerprint and recordings for a macro that is about to be (re)defined
+// or undefined. Either directive can be null.
+void cpp_cache_directive_changed(char *identifier, Directive *old_directive, Directive *new_directive) {
+    if (!opt_cpp_cache_dir) return;
+
+    if (old_directive) macros_fingerprint ^= hash_directive(identifier, old_directive);
+    if (new_directive) macros_fingerprint ^= hash_directive(identifier, new_directive);
+
+    for (Recording *r = recordings; r; r = r->prev) add_to_strset(r->macros, identifier);
+}
+
+// Update the fingerprint and recordings for a change in an include file's guard or #pragma once
+void cpp_cache_include_file_changed(char *canonical_path, char *old_guard, int old_pragma_once, char *guard, int pragma_once) {
+    if (!opt_cpp_cache_dir) return;
+
+    include_files_fingerprint ^= hash_include_file_state(canonical_path, old_guard, old_pragma_once);
+    include_files_fingerprint ^= hash_include_file_state(canonical_path, guard, pragma_once);
+
+    for (Recording *r = recordings; r; r = r->prev) {
+        IncludeFileState *include_file_state = strmap_get(r->include_files, canonical_path);
+        if (!include_file_state) {
+            include_file_state = wcalloc(1, sizeof(IncludeFileState));
+            strmap_put(r->include_files, wstrdup(canonical_path), include_file_state);
+        }
+        include_file_state->guard = guard;
+        include_file_state->pragma_once = pragma_once;
+    }
+}
+
+// Prevent all recordings in progress from being saved
+void cpp_cache_mark_uncacheable(void) {
+    for (Recording *r = recordings; r; r = r->prev) r->uncacheable = 1;
+}
+
+static char *make_key(char *path) {
+    char *key;
+    wasprintf(&key, "%s\n%s\n%016lx\n%016lx\n%d", path, include_paths_key, macros_fingerprint, include_files_fingerprint, opt_enable_trigraphs);
+    return key;
+}
+
+static char *make_cache_filename(char *key, char *suffix) {
+    char *filename;
+    wasprintf(&filename, "%s/%016lx%s", opt_cpp_cache_dir, hash_string(HASH_OFFSET, key), suffix);
+    return filename;
+}
+
+static void write_bytes(CacheBuffer *cb, char *data, int size) {
+    if (cb->size + size > cb->allocated) {
+        while (cb->size + size > cb->allocated) cb->allocated *= 2;
+        cb->data = wrealloc(cb->data, cb->allocated);
+    }
+
+    memcpy(cb->data + cb->size, data, size);
+    cb->size += size;
+}
+
+static void write_long(CacheBuffer *cb, long value) {
+    write_bytes(cb, (char *) &value, sizeof(long));
+}
+
+// Write a possibly null string. It is stored with its terminating zero so that it
+// can be used in place when read.
+static void write_string(CacheBuffer *cb, char *string) {
+    if (!string) {
+        write_long(cb, -1);
+        return;
+    }
+
+    int size = strlen(string);
+    write_long(cb, size);
+    write_bytes(cb, string, size + 1);
+}
+
+static long read_long(CacheReader *cr) {
+    long value = 0;
+    if (cr->position + (int) sizeof(long) > cr->size)
+        cr->failed = 1;
+    else {
+        memcpy(&value, cr->data + cr->position, sizeof(long));
+        cr->position += sizeof(long);
+    }
+    return value;
+}
+
+static char *read_string(CacheReader *cr) {
+    long size = read_long(cr);
+    if (size == -1 || cr->failed) return 0;
+
+    if (size < 0 || cr->position + size + 1 > cr->size || cr->data[cr->position + size]) {
+        cr->failed = 1;
+        return 0;
+    }
+
+    char *result = cr->data + cr->position;
+    cr->position += size + 1;
+    return result;
+}
+
+// Make a copy of a string whose lifetime is tied to the preprocessor's tokens
+static char *make_token_string(char *string) {
+    return new_cpp_token_string(string, strlen(string));
+}
+
+static void write_directive(CacheBuffer *cb, Directive *directive) {
+    write_long(cb, directive->is_function);
+    write_long(cb, directive->param_count);
+    write_long(cb, directive->is_variadic);
+
+    if (directive->param_identifiers) {
+        long count = 0;
+        strmap_foreach(directive->param_identifiers, it) count++;
+        write_long(cb, count);
+
+        strmap_foreach(directive->param_identifiers, it) {
+            char *param_identifier = strmap_iterator_key(&it);
+            write_string(cb, param_identifier);
+            write_long(cb, (long) strmap_get(directive->param_identifiers, param_identifier));
+        }
+    }
+    else
+        write_long(cb, -1);
+
+    long count = 0;
+    if (directive->tokens) {
+        CppToken *tok = directive->tokens;
+        do { count++; tok = tok->next; } while (tok != directive->tokens);
+    }
+    write_long(cb, count);
+
+    if (directive->tokens) {
+        CppToken *tok = directive->tokens->next;
+        while (1) {
+            write_long(cb, tok->kind);
+            write_string(cb, tok->str);
+            write_string(cb, tok->whitespace);
+            write_long(cb, tok->line_number);
+            write_long(cb, tok->line_number_offset);
+            if (tok == directive->tokens) break;
+            tok = tok->next;
+        }
+    }
+}
+
+// Read a directive. If apply is zero, the data is only checked and null is returned.
+static Directive *read_directive(CacheReader *cr, int apply) {
+    Directive *directive = apply ? wcalloc(1, sizeof(Directive)) : 0;
+
+    int is_function = read_long(cr);
+    int param_count = read_long(cr);
+    int is_variadic = read_long(cr);
+
+    if (apply) {
+        directive->is_function = is_function;
+        directive->param_count = param_count;
+        directive->is_variadic = is_variadic;
+    }
+
+    long count = read_long(cr);
+    if (count != -1 && apply) directive->param_identifiers = new_strmap();
+    for (long i = 0; i < count && !cr->failed; i++) {
+        char *param_identifier = read_string(cr);
+        long index = read_long(cr);
+        if (apply) strmap_put(directive->param_identifiers, make_token_string(param_identifier), (void *) index);
+    }
+
+    count = read_long(cr);
+    for (long i = 0; i < count && !cr->failed; i++) {
+        int kind = read_long(cr);
+        char *str = read_string(cr);
+        char *whitespace = read_string(cr);
+        int line_number = read_long(cr);
+        int line_number_offset = read_long(cr);
+
+        if (apply) {
+            CppToken *tok = new_cpp_token(kind);
+            if (str) tok->str = is_identifier(tok) ? intern(str) : make_token_string(str);
+            tok->whitespace = whitespace ? intern(whitespace) : 0;
+            tok->line_number = line_number;
+            tok->line_number_offset = line_number_offset;
+
+            // Append to the circular linked list
+            if (directive->tokens) {
+                tok->next = directive->tokens->next;
+                directive->tokens->next = tok;
+            }
+            directive->tokens = tok;
+        }
+    }
+
+    if (apply) classify_directive(directive);
+
+    return directive;
+}
+
+// Returns 1 if the file has the same modification time and size as when the entry was made
+static int dependency_unchanged(char *path, long mtime_sec, long mtime_nsec, long size) {
+    struct stat st;
+    if (stat(path, &st)) return 0;
+    return st.st_mtim.tv_sec == mtime_sec && st.st_mtim.tv_nsec == mtime_nsec && st.st_size == size;
+}
+
+// Check or replay a cache entry, depending on apply. Returns zero if the entry is
+// invalid or out of date.
+static int replay_entry(CacheReader *cr, char *key, StringBuffer *output, int apply) {
+    cr->position = 0;
+
+    char *magic = read_string(cr);
+    if (!magic || strcmp(magic, CPP_CACHE_MAGIC)) return 0;
+
+    char *entry_key = read_string(cr);
+    if (!entry_key || strcmp(entry_key, key)) return 0;
+
+    long count = read_long(cr);
+    for (long i = 0; i < count && !cr->failed; i++) {
+        char *path = read_string(cr);
+        long mtime_sec = read_long(cr);
+        long mtime_nsec = read_long(cr);
+        long size = read_long(cr);
+
+        if (cr->failed || !path) return 0;
+
+        if (!apply && !dependency_unchanged(path, mtime_sec, mtime_nsec, size)) return 0;
+
+        if (apply)
+            for (Recording *r = recordings; r; r = r->prev) add_to_strset(r->dependencies, path);
+    }
+
+    char *preprocessed_output = read_string(cr);
+    if (!preprocessed_output) return 0;
+    if (apply) append_to_string_buffer(output, preprocessed_output);
+
+    count = read_long(cr);
+    for (long i = 0; i < count && !cr->failed; i++) {
+        char *identifier = read_string(cr);
+        int is_defined = read_long(cr);
+        if (!identifier) return 0;
+
+        if (is_defined) {
+            Directive *directive = read_directive(cr, apply);
+            if (apply) define_directive(make_token_string(identifier), directive);
+        }
+        else if (apply)
+            undefine_directive(identifier);
+    }
+
+    count = read_long(cr);
+    for (long i = 0; i < count && !cr->failed; i++) {
+        char *canonical_path = read_string(cr);
+        char *guard = read_string(cr);
+        int pragma_once = read_long(cr);
+        if (!canonical_path) return 0;
+        if (apply) set_include_file_state(canonical_path, guard, pragma_once);
+    }
+
+    return !cr->failed && cr->position == cr->size;
+}
+
+// Try to replay a cached include file. Returns 1 if the preprocessed output has been
+// appended to output and all macros and include file states have been set.
+int cpp_cache_replay(char *path, StringBuffer *output) {
+    if (!opt_cpp_cache_dir) return 0;
+
+    char *key = make_key(path);
+    char *filename = make_cache_filename(key, ".wcpp");
+
+    int fd = open(filename, O_RDONLY);
+    wfree(filename);
+    if (fd == -1) {
+        wfree(key);
+        return 0;
+    }
+
+    struct stat st;
+    CacheReader cr;
+    cr.data = 0;
+    cr.failed = 0;
+
+    int ok = !fstat(fd, &st);
+    if (ok) {
+        cr.size = st.st_size;
+        cr.data = wmalloc(cr.size + 1);
+        ok = read(fd, cr.data, cr.size) == cr.size;
+    }
+    close(fd);
+
+    // Check everything first, so that a bad entry doesn't leave anything half done
+    ok = ok && replay_entry(&cr, key, output, 0);
+    if (ok) replay_entry(&cr, key, output, 1);
+
+    wfree(cr.data);
+    wfree(key);
+
+    return ok;
+}
+
+// Start recording the preprocessing of an include file, whose preprocessed output starts
+// at the end of output.
+void cpp_cache_start_recording(char *path, StringBuffer *output) {
+    if (!opt_cpp_cache_dir) return;
+
+    Recording *recording = wcalloc(1, sizeof(Recording));
+    recording->key = make_key(path);
+    recording->dependencies = new_strset();
+    recording->macros = new_strset();
+    recording->include_files = new_strmap();
+    recording->output_start = output->position;
+    recording->prev = recordings;
+    recordings = recording;
+
+    for (Recording *r = recordings; r; r = r->prev) add_to_strset(r->dependencies, path);
+}
+
+static void free_recording(Recording *recording) {
+    wfree(recording->key);
+    free_strset_and_strings(recording->dependencies);
+    free_strset_and_strings(recording->macros);
+
+    // Free the keys last, since strmap_get compares against them
+    strmap_foreach(recording->include_files, it) wfree(strmap_get(recording->include_files, strmap_iterator_key(&it)));
+    strmap_foreach(recording->include_files, it) wfree(strmap_iterator_key(&it));
+    free_strmap(recording->include_files);
+
+    wfree(recording);
+}
+
+// Make the contents of a cache entry. Returns 0 if a dependency can't be found.
+static int make_entry(CacheBuffer *cb, Recording *recording, StringBuffer *output) {
+    write_string(cb, CPP_CACHE_MAGIC);
+    write_string(cb, recording->key);
+
+    long count = 0;
+    strmap_foreach(recording->dependencies->strmap, it) count++;
+    write_long(cb, count);
+
+    strmap_foreach(recording->dependencies->strmap, it) {
+        char *path = strmap_iterator_key(&it);
+        struct stat st;
+        if (stat(path, &st)) return 0;
+        write_string(cb, path);
+        write_long(cb, st.st_mtim.tv_sec);
+        write_long(cb, st.st_mtim.tv_nsec);
+        write_long(cb, st.st_size);
+    }
+
+    int size = output->position - recording->output_start;
+    write_long(cb, size);
+    write_bytes(cb, output->data + recording->output_start, size);
+    write_bytes(cb, "", 1);
+
+    count = 0;
+    strmap_foreach(recording->macros->strmap, it) count++;
+    write_long(cb, count);
+
+    strmap_foreach(recording->macros->strmap, it) {
+        char *identifier = strmap_iterator_key(&it);
+        Directive *directive = strmap_get(directives, identifier);
+        write_string(cb, identifier);
+        write_long(cb, !!directive);
+        if (directive) write_directive(cb, directive);
+    }
+
+    count = 0;
+    strmap_foreach(recording->include_files, it) count++;
+    write_long(cb, count);
+
+    strmap_foreach(recording->include_files, it) {
+        char *canonical_path = strmap_iterator_key(&it);
+        IncludeFileState *include_file_state = strmap_get(recording->include_files, canonical_path);
+        write_string(cb, canonical_path);
+        write_string(cb, include_file_state->guard);
+        write_long(cb, include_file_state->pragma_once);
+    }
+
+    return 1;
+}
+
+// Write a cache entry to a temporary file, then rename it, so that concurrent
+// compilations never see a partially written entry.
+static void write_entry(CacheBuffer *cb, char *key) {
+    mkdir(opt_cpp_cache_dir, 0777);
+
+    char *pid_suffix;
+    wasprintf(&pid_suffix, ".%d.tmp", getpid());
+    char *temp_filename = make_cache_filename(key, pid_suffix);
+    char *filename = make_cache_filename(key, ".wcpp");
+    wfree(pid_suffix);
+
+    int fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        int ok = write(fd, cb->data, cb->size) == cb->size;
+        close(fd);
+
+        if (!ok || rename(temp_filename, filename)) unlink(temp_filename);
+    }
+
+    wfree(temp_filename);
+    wfree(filename);
+}
+
+// Finish recording the include file on the top of the stack and save it in the cache
+void cpp_cache_finish_recording(StringBuffer *output) {
+    if (!opt_cpp_cache_dir) return;
+
+    Recording *recording = recordings;
+    recordings = recording->prev;
+
+    if (!recording->uncacheable) {
+        CacheBuffer cb;
+        cb.size = 0;
+        cb.allocated = 4096;
+        cb.data = wmalloc(cb.allocated);
+
+        if (make_entry(&cb, recording, output)) write_entry(&cb, recording->key);
+
+        wfree(cb.data);
+    }
+
+    free_recording(recording);
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcc.h"
+
+// A generic iterative dataflow solver over the control flow graph of a function.
+//
+// The caller provides a transfer function that recalculates the sets of a single
+// block from its neighbours and returns 1 if the block's output changed. The solver
+// keeps a worklist of dirty blocks, seeded in postorder for backward problems and in
+// reverse postorder for forward problems, so that most blocks see their inputs
+// settled before they are processed. When a block changes, only its predecessors
+// (backward) or successors (forward) are added back to the worklist. Apart from the
+// CFG itself, memory use is O(blocks).
+
+// Return the blocks in postorder, starting at the entry block. Unreachable blocks are
+// appended at the end.
+int *make_block_postorder(Graph *cfg) {
+    int block_count = cfg->node_count;
+
+    int *postorder = wmalloc(block_count * sizeof(int));
+    char *visited = wcalloc(block_count, sizeof(char));
+    GraphEdge **stack = wmalloc(block_count * sizeof(GraphEdge *));
+    int *stack_blocks = wmalloc(block_count * sizeof(int));
+    int count = 0;
+
+    for (int root = 0; root < block_count; root++) {
+        if (visited[root]) continue;
+
+        // Iterative DFS. The stack holds the next successor edge to visit for each block.
+        int sp = 0;
+        visited[root] = 1;
+        stack_blocks[sp] = root;
+        stack[sp++] = cfg->nodes[root].succ;
+
+        while (sp) {
+            GraphEdge *e = stack[sp - 1];
+            if (!e) {
+                postorder[count++] = stack_blocks[--sp];
+                continue;
+            }
+
+            stack[sp - 1] = e->next_succ;
+            int successor = e->to->id;
+            if (visited[successor]) continue;
+
+            visited[successor] = 1;
+            stack_blocks[sp] = successor;
+            stack[sp++] = cfg->nodes[successor].succ;
+        }
+    }
+
+    wfree(visited);
+    wfree(stack);
+    wfree(stack_blocks);
+
+    return postorder;
+}
+
+void solve_dataflow(Function *function, int direction, DataflowTransfer transfer, void *context) {
+    Graph *cfg = function->cfg;
+    int block_count = cfg->node_count;
+
+    if (!block_count) return;
+
+    // The worklist is a circular queue. A block is in it at most once.
+    int *worklist = make_block_postorder(cfg);
+
+    if (direction == DATAFLOW_FORWARD) {
+        for (int i = 0; i < block_count / 2; i++) {
+            int block = worklist[i];
+            worklist[i] = worklist[block_count - 1 - i];
+            worklist[block_count - 1 - i] = block;
+        }
+    }
+
+    char *in_worklist = wmalloc(block_count * sizeof(char));
+    memset(in_worklist, 1, block_count * sizeof(char));
+    int head = 0;
+    int length = block_count;
+
+    while (length) {
+        int block = worklist[head];
+        head = (head + 1) % block_count;
+        length--;
+        in_worklist[block] = 0;
+
+        if (!transfer(function, block, context)) continue;
+
+        if (direction == DATAFLOW_BACKWARD) {
+            for (GraphEdge *e = cfg->nodes[block].pred; e; e = e->next_pred) {
+                int predecessor = e->from->id;
+                if (in_worklist[predecessor]) continue;
+
+                in_worklist[predecessor] = 1;
+                worklist[(head + length) % block_count] = predecessor;
+                length++;
+            }
+        }
+        else {
+            for (GraphEdge *e = cfg->nodes[block].succ; e; e = e->next_succ) {
+                int successor = e->to->id;
+                if (in_worklist[successor]) continue;
+
+                in_worklist[successor] = 1;
+                worklist[(head + length) % block_count] = successor;
+                length++;
+            }
+        }
+    }
+
+    wfree(worklist);
+    wfree(in_worklist);
+}
@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcc.h"
+
+// ELF constants taken from elf.h
+#define ELFCLASS64      2
+#define ELFDATA2LSB     1
+#define EV_CURRENT      1
+#define ET_REL          1
+#define EM_X86_64       62
+
+#define SHT_NULL        0
+#define SHT_SYMTAB      2
+#define SHT_STRTAB      3
+#define SHT_RELA        4
+
+#define SHF_INFO_LINK   0x40
+
+#define SHN_UNDEF       0
+#define SHN_ABS         0xfff1
+#define SHN_COMMON      0xfff2
+
+#define STT_SECTION     3
+#define STT_FILE        4
+
+typedef struct elf_header {
+    unsigned char ident[16];
+    unsigned short type;
+    unsigned short machine;
+    unsigned int version;
+    long entry;
+    long phoff;
+    long shoff;
+    unsigned int flags;
+    unsigned short ehsize;
+    unsigned short phentsize;
+    unsigned short phnum;
+    unsigned short shentsize;
+    unsigned short shnum;
+    unsigned short shstrndx;
+} ElfHeader;
+
+typedef struct elf_section_header {
+    unsigned int name;
+    unsigned int type;
+    long flags;
+    long addr;
+    long offset;
+    long size;
+    unsigned int link;
+    unsigned int info;
+    long addralign;
+    long entsize;
+} ElfSectionHeader;
+
+typedef struct elf_symbol_entry {
+    unsigned int name;
+    unsigned char info;
+    unsigned char other;
+    unsigned short shndx;
+    long value;
+    long size;
+} ElfSymbolEntry;
+
+typedef struct elf_relocation_entry {
+    long offset;
+    long info;
+    long addend;
+} ElfRelocationEntry;
+
+// A growable buffer that the object file is assembled in
+typedef struct elf_buffer {
+    char *data;
+    int size;
+    int allocated;
+} ElfBuffer;
+
+static char *elf_source_filename;   // Name of the STT_FILE symbol
+static List *elf_sections;          // Sections in section header order, excluding the null section
+static List *elf_symbols;           // Symbols in creation order
+static StrMap *elf_symbols_map;     // Map of name to symbol
+static int need_global_offset_table_symbol;
+
+// Make a new object file. Sections, symbols and relocations are added to it until it
+// is written out with write_elf_object().
+void init_elf_object(char *source_filename) {
+    elf_source_filename = source_filename;
+    elf_sections = new_list(8);
+    elf_symbols = new_list(1024);
+    elf_symbols_map = new_strmap();
+    need_global_offset_table_symbol = 0;
+}
+
+void free_elf_object(void) {
+    for (int i = 0; i < elf_sections->length; i++) {
+        ElfSection *section = elf_sections->elements[i];
+        for (int j = 0; j < section->relocations->length; j++) wfree(section->relocations->elements[j]);
+        free_list(section->relocations);
+        wfree(section->data);
+        wfree(section);
+    }
+    free_list(elf_sections);
+
+    for (int i = 0; i < elf_symbols->length; i++) {
+        ElfSymbol *symbol = elf_symbols->elements[i];
+        wfree(symbol->name);
+        wfree(symbol);
+    }
+    free_list(elf_symbols);
+    free_strmap(elf_symbols_map);
+}
+
+ElfSection *add_elf_section(char *name, int type, int flags) {
+    ElfSection *section = wcalloc(1, sizeof(ElfSection));
+    section->name = name;
+    section->type = type;
+    section->flags = flags;
+    section->alignment = 1;
+    section->relocations = new_list(0);
+    section->index = elf_sections->length + 1;
+    append_to_list(elf_sections, section);
+
+    return section;
+}
+
+static void ensure_section_allocation(ElfSection *section, int size) {
+    if (section->type == SHT_NOBITS || section->size + size <= section->allocated) return;
+
+    int allocated = section->allocated ? section->allocated * 2 : 1024;
+    while (allocated < section->size + size) allocated *= 2;
+    section->data = wrealloc(section->data, allocated);
+    section->allocated = allocated;
+}
+
+void elf_section_append(ElfSection *section, void *data, int size) {
+    ensure_section_allocation(section, size);
+    if (section->type != SHT_NOBITS) memcpy(section->data + section->size, data, size);
+    section->size += size;
+}
+
+void elf_section_append_zeros(ElfSection *section, int size) {
+    ensure_section_allocation(section, size);
+    if (section->type != SHT_NOBITS) memset(section->data + section->size, 0, size);
+    section->size += size;
+}
+
+// Pad the section with zeros up to alignment and make sure the section itself is aligned
+void elf_section_align(ElfSection *section, int alignment) {
+    if (alignment > section->alignment) section->alignment = alignment;
+    int padding = (alignment - section->size % alignment) % alignment;
+    elf_section_append_zeros(section, padding);
+}
+
+// Find a symbol by name, adding a new undefined local symbol if it doesn't exist.
+ElfSymbol *get_elf_symbol(char *name) {
+    ElfSymbol *symbol = strmap_get(elf_symbols_map, name);
+    if (symbol) return symbol;
+
+    symbol = wcalloc(1, sizeof(ElfSymbol));
+    symbol->name = wstrdup(name);
+    symbol->binding = STB_LOCAL;
+    symbol->type = STT_NOTYPE;
+    symbol->is_temporary = name[0] == '.' && name[1] == 'L';
+    append_to_list(elf_symbols, symbol);
+    strmap_put(elf_symbols_map, symbol->name, symbol);
+
+    return symbol;
+}
+
+void define_elf_symbol(ElfSymbol *symbol, ElfSection *section, long value) {
+    if (symbol->section || symbol->is_common) panic("Symbol %s is already defined", symbol->name);
+    symbol->section = section;
+    symbol->value = value;
+}
+
+void add_elf_relocation(ElfSection *section, long offset, ElfSymbol *symbol, int type, long addend) {
+    ElfRelocation *relocation = wmalloc(sizeof(ElfRelocation));
+    relocation->offset = offset;
+    relocation->symbol = symbol;
+    relocation->type = type;
+    relocation->addend = addend;
+    append_to_list(section->relocations, relocation);
+
+    symbol->is_referenced = 1;
+    if (type == R_X86_64_GOTPCREL || type == R_X86_64_GOTPCRELX || type == R_X86_64_REX_GOTPCRELX)
+        need_global_offset_table_symbol = 1;
+}
+
+// Relocations against local symbols go through the section symbol, the same as the
+// GNU assembler does. Symbols in the GOT must be referenced by the symbol itself.
+static int relocation_uses_section_symbol(ElfRelocation *relocation) {
+    ElfSymbol *symbol = relocation->symbol;
+
+    if (!symbol->section) {
+        if (symbol->is_temporary) panic("Undefined label %s", symbol->name);
+        return 0;
+    }
+
+    if (symbol->binding != STB_LOCAL) return 0;
+
+    if (relocation->type == R_X86_64_GOTPCREL || relocation->type == R_X86_64_GOTPCRELX || relocation->type == R_X86_64_REX_GOTPCRELX) {
+        if (symbol->is_temporary) panic("Unable to load label %s from the GOT", symbol->name);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void buffer_append(ElfBuffer *buffer, void *data, int size) {
+    if (buffer->size + size > buffer->allocated) {
+        int allocated = buffer->allocated ? buffer->allocated * 2 : 4096;
+        while (allocated < buffer->size + size) allocated *= 2;
+        buffer->data = wrealloc(buffer->data, allocated);
+        buffer->allocated = allocated;
+    }
+
+    if (data)
+        memcpy(buffer->data + buffer->size, data, size);
+    else
+        memset(buffer->data + buffer->size, 0, size);
+
+    buffer->size += size;
+}
+
+static void buffer_align(ElfBuffer *buffer, int alignment) {
+    buffer_append(buffer, 0, (alignment - buffer->size % alignment) % alignment);
+}
+
+// Add a string to a string table and return its offset
+static int buffer_append_string(ElfBuffer *buffer, char *string) {
+    int offset = buffer->size;
+    buffer_append(buffer, string, strlen(string) + 1);
+    return offset;
+}
+
+static void add_symbol_entry(ElfBuffer *symtab, int name, int binding, int type, int shndx, long value, long size) {
+    ElfSymbolEntry entry;
+    entry.name = name;
+    entry.info = (binding << 4) + type;
+    entry.other = 0;
+    entry.shndx = shndx;
+    entry.value = value;
+    entry.size = size;
+    buffer_append(symtab, &entry, sizeof(ElfSymbolEntry));
+}
+
+static void add_section_header(ElfBuffer *headers, int name, int type, long flags, long offset, long size, int link, int info, long alignment, long entsize) {
+    ElfSectionHeader header;
+    memset(&header, 0, sizeof(ElfSectionHeader));
+    header.name = name;
+    header.type = type;
+    header.flags = flags;
+    header.offset = offset;
+    header.size = size;
+    header.link = link;
+    header.info = info;
+    header.addralign = alignment;
+    header.entsize = entsize;
+    buffer_append(headers, &header, sizeof(ElfSectionHeader));
+}
+
+static int is_emitted_symbol(ElfSymbol *symbol) {
+    if (symbol->is_temporary) return 0;
+    if (symbol->section || symbol->is_common) return 1;
+    return symbol->is_referenced || symbol->binding != STB_LOCAL;
+}
+
+// Write the object file. The file consists of the ELF header, the section contents,
+// the relocation sections, .symtab, .strtab, .shstrtab and finally the section headers.
+void write_elf_object(char *filename) {
+    if (need_global_offset_table_symbol) {
+        ElfSymbol *got_symbol = get_elf_symbol("_GLOBAL_OFFSET_TABLE_");
+        got_symbol->binding = STB_GLOBAL;
+    }
+
+    // Undefined symbols are resolved by the linker
+    for (int i = 0; i < elf_symbols->length; i++) {
+        ElfSymbol *symbol = elf_symbols->elements[i];
+        if (!symbol->section && !symbol->is_common && !symbol->is_temporary) symbol->binding = STB_GLOBAL;
+    }
+
+    ElfBuffer file = {0, 0, 0};
+    ElfBuffer shstrtab = {0, 0, 0};
+    ElfBuffer strtab = {0, 0, 0};
+    ElfBuffer symtab = {0, 0, 0};
+    ElfBuffer headers = {0, 0, 0};
+
+    buffer_append_string(&shstrtab, "");
+    buffer_append_string(&strtab, "");
+
+    int section_count = elf_sections->length;
+
+    // Symbol table: the null symbol, the file, section symbols, locals and then globals
+    add_symbol_entry(&symtab, 0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF, 0, 0);
+    add_symbol_entry(&symtab, buffer_append_string(&strtab, elf_source_filename), STB_LOCAL, STT_FILE, SHN_ABS, 0, 0);
+
+    int *section_symbol_indexes = wcalloc(section_count + 1, sizeof(int));
+    int symbol_count = 2;
+    for (int i = 0; i < section_count; i++) {
+        ElfSection *section = elf_sections->elements[i];
+        if (!(section->flags & SHF_ALLOC)) continue;
+        add_symbol_entry(&symtab, 0, STB_LOCAL, STT_SECTION, section->index, 0, 0);
+        section_symbol_indexes[section->index] = symbol_count++;
+    }
+
+    // Locals go in the first pass, globals in the second
+    int first_global_symbol = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < elf_symbols->length; i++) {
+            ElfSymbol *symbol = elf_symbols->elements[i];
+            if (!is_emitted_symbol(symbol)) continue;
+            if ((symbol->binding == STB_LOCAL) != (pass == 0)) continue;
+
+            int shndx = symbol->is_common ? SHN_COMMON : symbol->section ? symbol->section->index : SHN_UNDEF;
+            int name = buffer_append_string(&strtab, symbol->name);
+            add_symbol_entry(&symtab, name, symbol->binding, symbol->type, shndx, symbol->value, symbol->size);
+            symbol->index = symbol_count++;
+        }
+
+        if (pass == 0) first_global_symbol = symbol_count;
+    }
+
+    // Header, to be filled in at the end
+    buffer_append(&file, 0, sizeof(ElfHeader));
+
+    // Null section header
+    add_section_header(&headers, 0, SHT_NULL, 0, 0, 0, 0, 0, 0, 0);
+
+    // Section contents
+    for (int i = 0; i < section_count; i++) {
+        ElfSection *section = elf_sections->elements[i];
+        buffer_align(&file, section->alignment);
+        int offset = file.size;
+        if (section->type != SHT_NOBITS) buffer_append(&file, section->data, section->size);
+
+        int name = buffer_append_string(&shstrtab, section->name);
+        add_section_header(&headers, name, section->type, section->flags, offset, section->size, 0, 0, section->alignment, 0);
+    }
+
+    // Relocation sections
+    int relocation_section_count = 0;
+    for (int i = 0; i < section_count; i++) {
+        ElfSection *section = elf_sections->elements[i];
+        if (!section->relocations->length) continue;
+        relocation_section_count++;
+    }
+
+    int symtab_index = section_count + relocation_section_count + 1;
+
+    for (int i = 0; i < section_count; i++) {
+        ElfSection *section = elf_sections->elements[i];
+        if (!section->relocations->length) continue;
+
+        buffer_align(&file, 8);
+        int offset = file.size;
+
+        for (int j = 0; j < section->relocations->length; j++) {
+            ElfRelocation *relocation = section->relocations->elements[j];
+            ElfRelocationEntry entry;
+            long symbol_index;
+            entry.offset = relocation->offset;
+            entry.addend = relocation->addend;
+
+            if (relocation_uses_section_symbol(relocation)) {
+                symbol_index = section_symbol_indexes[relocation->symbol->section->index];
+                entry.addend += relocation->symbol->value;
+            }
+            else
+                symbol_index = relocation->symbol->index;
+
+            entry.info = (symbol_index << 32) + relocation->type;
+            buffer_append(&file, &entry, sizeof(ElfRelocationEntry));
+        }
+
+        char *rela_name = wmalloc(strlen(section->name) + 6);
+        sprintf(rela_name, ".rela%s", section->name);
+        int name = buffer_append_string(&shstrtab, rela_name);
+        wfree(rela_name);
+
+        add_section_header(&headers, name, SHT_RELA, SHF_INFO_LINK, offset, file.size - offset,
+            symtab_index, section->index, 8, sizeof(ElfRelocationEntry));
+    }
+
+    // .symtab
+    buffer_align(&file, 8);
+    add_section_header(&headers, buffer_append_string(&shstrtab, ".symtab"), SHT_SYMTAB, 0,
+        file.size, symtab.size, symtab_index + 1, first_global_symbol, 8, sizeof(ElfSymbolEntry));
+    buffer_append(&file, symtab.data, symtab.size);
+
+    // .strtab
+    add_section_header(&headers, buffer_append_string(&shstrtab, ".strtab"), SHT_STRTAB, 0,
+        file.size, strtab.size, 0, 0, 1, 0);
+    buffer_append(&file, strtab.data, strtab.size);
+
+    // .shstrtab
+    int shstrtab_name = buffer_append_string(&shstrtab, ".shstrtab");
+    add_section_header(&headers, shstrtab_name, SHT_STRTAB, 0, file.size, shstrtab.size, 0, 0, 1, 0);
+    buffer_append(&file, shstrtab.data, shstrtab.size);
+
+    // Section headers
+    buffer_align(&file, 8);
+    int section_headers_offset = file.size;
+    buffer_append(&file, headers.data, headers.size);
+
+    ElfHeader *header = (ElfHeader *) file.data;
+    memcpy(header->ident, "\177ELF", 4);
+    header->ident[4] = ELFCLASS64;
+    header->ident[5] = ELFDATA2LSB;
+    header->ident[6] = EV_CURRENT;
+    header->type = ET_REL;
+    header->machine = EM_X86_64;
+    header->version = EV_CURRENT;
+    header->shoff = section_headers_offset;
+    header->ehsize = sizeof(ElfHeader);
+    header->shentsize = sizeof(ElfSectionHeader);
+    header->shnum = headers.size / sizeof(ElfSectionHeader);
+    header->shstrndx = header->shnum - 1;
+
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    if (fwrite(file.data, 1, file.size, f) != file.size) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
+
+    wfree(section_symbol_indexes);
+    wfree(file.data);
+    wfree(shstrtab.data);
+    wfree(strtab.data);
+    wfree(symtab.data);
+    wfree(headers.data);
+}
+
+// An object file read back in for compare_elf_objects()
+typedef struct elf_file {
+    char *filename;
+    char *data;
+    ElfSectionHeader *headers;
+    int section_count;
+    char *section_names;
+    ElfSymbolEntry *symbols;
+    int symbol_count;
+    char *symbol_names;
+} ElfFile;
+
+static void read_elf_file(ElfFile *elf, char *filename) {
+    memset(elf, 0, sizeof(ElfFile));
+    elf->filename = filename;
+
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    int size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    elf->data = wmalloc(size);
+    if (fread(elf->data, 1, size, f) != size) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
+
+    ElfHeader *header = (ElfHeader *) elf->data;
+    if (size < sizeof(ElfHeader) || memcmp(header->ident, "\177ELF", 4)) simple_error("%s is not an ELF file", filename);
+
+    elf->headers = (ElfSectionHeader *) (elf->data + header->shoff);
+    elf->section_count = header->shnum;
+    elf->section_names = elf->data + elf->headers[header->shstrndx].offset;
+
+    for (int i = 0; i < elf->section_count; i++) {
+        if (elf->headers[i].type != SHT_SYMTAB) continue;
+        elf->symbols = (ElfSymbolEntry *) (elf->data + elf->headers[i].offset);
+        elf->symbol_count = elf->headers[i].size / sizeof(ElfSymbolEntry);
+        elf->symbol_names = elf->data + elf->headers[elf->headers[i].link].offset;
+    }
+}
+
+static ElfSectionHeader *find_elf_file_section(ElfFile *elf, char *name) {
+    for (int i = 0; i < elf->section_count; i++)
+        if (!strcmp(elf->section_names + elf->headers[i].name, name)) return &elf->headers[i];
+
+    return 0;
+}
+
+// Name of a symbol, or the name of the section for section symbols
+static char *elf_file_symbol_name(ElfFile *elf, ElfSymbolEntry *symbol) {
+    if ((symbol->info & 0xf) == STT_SECTION) return elf->section_names + elf->headers[symbol->shndx].name;
+    return elf->symbol_names + symbol->name;
+}
+
+static char *elf_file_symbol_section_name(ElfFile *elf, ElfSymbolEntry *symbol) {
+    if (symbol->shndx == SHN_UNDEF) return "UND";
+    if (symbol->shndx == SHN_COMMON) return "COM";
+    if (symbol->shndx == SHN_ABS) return "ABS";
+    return elf->section_names + elf->headers[symbol->shndx].name;
+}
+
+static int compare_elf_sections(ElfFile *expected, ElfFile *actual, ElfSectionHeader *expected_header) {
+    char *name = expected->section_names + expected_header->name;
+    ElfSectionHeader *actual_header = find_elf_file_section(actual, name);
+
+    if (!actual_header) {
+        printf("Missing section %s\n", name);
+        return 1;
+    }
+
+    if (expected_header->type != actual_header->type || expected_header->flags != actual_header->flags ||
+            expected_header->addralign != actual_header->addralign || expected_header->size != actual_header->size) {
+        printf("Section %s differs: expected type=%d flags=%ld alignment=%ld size=%ld, got type=%d flags=%ld alignment=%ld size=%ld\n",
+            name,
+            expected_header->type, expected_header->flags, expected_header->addralign, expected_header->size,
+            actual_header->type, actual_header->flags, actual_header->addralign, actual_header->size);
+        return 1;
+    }
+
+    if (expected_header->type == SHT_RELA) {
+        ElfRelocationEntry *expected_relocations = (ElfRelocationEntry *) (expected->data + expected_header->offset);
+        ElfRelocationEntry *actual_relocations = (ElfRelocationEntry *) (actual->data + actual_header->offset);
+
+        for (int i = 0; i < expected_header->size / sizeof(ElfRelocationEntry); i++) {
+            ElfRelocationEntry *e = &expected_relocations[i];
+            ElfRelocationEntry *a = &actual_relocations[i];
+            char *expected_symbol = elf_file_symbol_name(expected, &expected->symbols[e->info >> 32]);
+            char *actual_symbol = elf_file_symbol_name(actual, &actual->symbols[a->info >> 32]);
+
+            if (e->offset != a->offset || (e->info & 0xffffffff) != (a->info & 0xffffffff) || e->addend != a->addend || strcmp(expected_symbol, actual_symbol)) {
+                printf("Relocation %d in %s differs: expected offset=%#lx type=%ld %s%+ld, got offset=%#lx type=%ld %s%+ld\n",
+                    i, name,
+                    e->offset, e->info & 0xffffffff, expected_symbol, e->addend,
+                    a->offset, a->info & 0xffffffff, actual_symbol, a->addend);
+                return 1;
+            }
+        }
+    }
+    else if (expected_header->type != SHT_NOBITS) {
+        char *expected_data = expected->data + expected_header->offset;
+        char *actual_data = actual->data + actual_header->offset;
+
+        for (int i = 0; i < expected_header->size; i++) {
+            if (expected_data[i] != actual_data[i]) {
+                printf("Section %s differs at offset %#x: expected %02x, got %02x\n",
+                    name, i, expected_data[i] & 0xff, actual_data[i] & 0xff);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int compare_elf_symbols(ElfFile *expected, ElfFile *actual) {
+    int differences = 0;
+
+    for (int i = 0; i < expected->symbol_count; i++) {
+        ElfSymbolEntry *e = &expected->symbols[i];
+        int type = e->info & 0xf;
+        if (type == STT_SECTION || type == STT_FILE || !e->name) continue;
+
+        char *name = expected->symbol_names + e->name;
+        ElfSymbolEntry *a = 0;
+        for (int j = 0; j < actual->symbol_count; j++) {
+            if (actual->symbols[j].name && !strcmp(actual->symbol_names + actual->symbols[j].name, name)) {
+                a = &actual->symbols[j];
+                break;
+            }
+        }
+
+        if (!a) {
+            printf("Missing symbol %s\n", name);
+            differences++;
+            continue;
+        }
+
+        char *expected_section = elf_file_symbol_section_name(expected, e);
+        char *actual_section = elf_file_symbol_section_name(actual, a);
+
+        if (e->info != a->info || e->value != a->value || e->size != a->size || strcmp(expected_section, actual_section)) {
+            printf("Symbol %s differs: expected info=%#x section=%s value=%#lx size=%ld, got info=%#x section=%s value=%#lx size=%ld\n",
+                name,
+                e->info, expected_section, e->value, e->size,
+                a->info, actual_section, a->value, a->size);
+            differences++;
+        }
+    }
+
+    return differences;
+}
+
+// Compare the sections, relocations and symbols of two object files, print any
+// differences and return the amount of differences. Debug sections and the order of
+// sections and symbols are ignored.
+int compare_elf_objects(char *expected_filename, char *actual_filename) {
+    ElfFile expected;
+    ElfFile actual;
+    read_elf_file(&expected, expected_filename);
+    read_elf_file(&actual, actual_filename);
+
+    int differences = 0;
+    for (int i = 1; i < expected.section_count; i++) {
+        ElfSectionHeader *header = &expected.headers[i];
+        if (header->type != SHT_PROGBITS && header->type != SHT_NOBITS && header->type != SHT_RELA) continue;
+        if (!memcmp(expected.section_names + header->name, ".debug", 6)) continue;
+        if (!memcmp(expected.section_names + header->name, ".rela.debug", 11)) continue;
+        differences += compare_elf_sections(&expected, &actual, header);
+    }
+
+    differences += compare_elf_symbols(&expected, &actual);
+
+    wfree(expected.data);
+    wfree(actual.data);
+
+    return differences;
+}
@@ -16,6 +16,14 @@ int opt_enable_preferred_pregs = 0;         // Enable preferred preg selection i
 int opt_enable_trigraphs = 0;               // Enable trigraph preprocessing
 int opt_enable_common_symbols = 0;          // Enable .comm symbols
 int opt_warnings_are_errors = 0;            // Treat all warnings as errors
+int opt_backend_jobs = 0;                   // Number of worker processes for the per-function compiler phases
+int opt_integrated_assembler = 0;           // Make object files without running an external assembler
+int opt_integrated_cpp = 0;                 // Parse the preprocessor's output tokens instead of its output text
+int opt_verify_against_as = 0;              // Compare object files with the output of the external assembler
+int opt_register_allocator = 0;             // One of REGALLOC_*
+int opt_rematerialize = 0;                  // Recompute spilled constants and addresses instead of using the stack
+int opt_live_range_splitting = 0;           // Split spilled live ranges around loops and function calls
+char *opt_cpp_cache_dir = 0;                // Directory for the preprocessed include file cache
 
 int error_incomptatible_pointer_type = 0;
 int error_int_conversion = 0;
@@ -34,6 +42,7 @@ int debug_ssa_cfg = 0;
 int debug_ssa_dominance = 0;
 int debug_ssa_idom = 0;
 int debug_ssa_dominance_frontiers = 0;
+int debug_ssa_loops = 0;
 int debug_ssa_phi_insertion = 0;
 int debug_ssa_phi_renumbering = 0;
 int debug_ssa_live_range = 0;
@@ -47,7 +56,7 @@ int debug_instsel_tree_merging = 0;
 int debug_instsel_tree_merging_deep = 0;
 int debug_instsel_igraph_simplification = 0;
 int debug_instsel_tiling = 0;
-int debug_instsel_cost_graph = 0;
+int debug_instsel_states = 0;
 int debug_instsel_spilling = 0;
 int debug_stack_frame_layout = 0;
 int debug_exit_after_parser = 0;
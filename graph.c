@@ -5,22 +5,37 @@
 
 #include "wcc.h"
 
-static void allocate_graph_storage(Graph *g) {
-    g->nodes = wcalloc(g->node_count, sizeof(GraphNode));
-    g->edges = wcalloc(g->max_edge_count, sizeof(GraphEdge));
+// If arena is set, the storage is allocated from it, otherwise it's on the heap
+static void allocate_graph_storage(Graph *g, Arena *arena) {
+    if (arena) {
+        g->nodes = arena_alloc(arena, g->node_count * sizeof(GraphNode));
+        g->edges = arena_alloc(arena, g->max_edge_count * sizeof(GraphEdge));
+    }
+    else {
+        g->nodes = wcalloc(g->node_count, sizeof(GraphNode));
+        g->edges = wcalloc(g->max_edge_count, sizeof(GraphEdge));
+    }
 }
 
-static void init_graph(Graph *g, int node_count, int edge_count) {
+static void init_graph(Graph *g, int node_count, int edge_count, Arena *arena) {
     g->node_count = node_count;
     g->max_edge_count = edge_count ? edge_count : MAX_GRAPH_EDGE_COUNT;
-    allocate_graph_storage(g);
+    allocate_graph_storage(g, arena);
 
     for (int i = 0; i < node_count; i++) g->nodes[i].id = i;
 }
 
 Graph *new_graph(int node_count, int edge_count) {
     Graph *g = wcalloc(1, sizeof(Graph));
-    init_graph(g, node_count, edge_count);
+    init_graph(g, node_count, edge_count, 0);
+
+    return g;
+}
+
+// Allocate a graph from an arena. It's freed together with the arena.
+Graph *new_graph_in_arena(Arena *arena, int node_count, int edge_count) {
+    Graph *g = arena_alloc(arena, sizeof(Graph));
+    init_graph(g, node_count, edge_count, arena);
 
     return g;
 }
@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcc.h"
+
+// Hide sets of macro identifiers, used when expanding macros. Hide sets are immutable
+// and hash consed, so that each distinct set is stored once and sets can be compared
+// by pointer. The empty set is NULL. The identifiers must be interned and are sorted
+// by address.
+//
+// Unions and intersections are memoized, since the same few sets are combined over and
+// over again while expanding nested macros. All hide sets live until free_hide_sets()
+// is called at the end of preprocessing.
+
+enum {
+    INITIAL_SIZE    = 1024,
+    MAX_LOAD_FACTOR = 500,  // 0.5 * 1000
+};
+
+enum {
+    HS_UNION = 1,
+    HS_INTERSECTION,
+};
+
+// A memoized union or intersection of two hide sets
+typedef struct hide_set_operation {
+    int operation;
+    HideSet *hs1;
+    HideSet *hs2;
+    HideSet *result;
+} HideSetOperation;
+
+static Arena *hide_sets_arena;
+static HideSet **hide_sets;                     // Open addressed hash table of all hide sets
+static int hide_sets_size;
+static int hide_sets_count;
+static HideSetOperation *operations;            // Open addressed hash table of memoized operations
+static int operations_size;
+static int operations_count;
+
+static void init_hide_sets(void) {
+    hide_sets_arena = new_arena();
+    hide_sets_size = INITIAL_SIZE;
+    hide_sets = wcalloc(INITIAL_SIZE, sizeof(HideSet *));
+    hide_sets_count = 0;
+    operations_size = INITIAL_SIZE;
+    operations = wcalloc(INITIAL_SIZE, sizeof(HideSetOperation));
+    operations_count = 0;
+}
+
+void free_hide_sets(void) {
+    if (!hide_sets) return;
+
+    free_arena(hide_sets_arena);
+    wfree(hide_sets);
+    wfree(operations);
+    hide_sets_arena = 0;
+    hide_sets = 0;
+    operations = 0;
+}
+
+static unsigned int hash_identifiers(char **identifiers, int count) {
+    unsigned int hash = 2166136261;
+    for (int i = 0; i < count; i++) hash = (hash ^ interned_string_hash(identifiers[i])) * 16777619;
+
+    return hash;
+}
+
+static void grow_hide_sets(void) {
+    int new_size = hide_sets_size * 2;
+    int mask = new_size - 1;
+    HideSet **new_hide_sets = wcalloc(new_size, sizeof(HideSet *));
+
+    for (int i = 0; i < hide_sets_size; i++) {
+        HideSet *hs = hide_sets[i];
+        if (!hs) continue;
+
+        unsigned int pos = hs->hash & mask;
+        while (new_hide_sets[pos]) pos = (pos + 1) & mask;
+        new_hide_sets[pos] = hs;
+    }
+
+    wfree(hide_sets);
+    hide_sets = new_hide_sets;
+    hide_sets_size = new_size;
+}
+
+// Return the hide set with the sorted identifiers, making it if it doesn't exist yet
+static HideSet *make_hide_set(char **identifiers, int count) {
+    if (!count) return 0;
+    if (!hide_sets) init_hide_sets();
+
+    unsigned int hash = hash_identifiers(identifiers, count);
+    unsigned int mask = hide_sets_size - 1;
+    unsigned int pos = hash & mask;
+
+    HideSet *hs;
+    while ((hs = hide_sets[pos])) {
+        if (hs->hash == hash && hs->count == count && !memcmp(hs->identifiers, identifiers, count * sizeof(char *))) return hs;
+        pos = (pos + 1) & mask;
+    }
+
+    hs = arena_alloc(hide_sets_arena, sizeof(HideSet));
+    hs->id = hide_sets_count + 1;
+    hs->hash = hash;
+    hs->count = count;
+    hs->identifiers = arena_alloc(hide_sets_arena, count * sizeof(char *));
+    memcpy(hs->identifiers, identifiers, count * sizeof(char *));
+
+    hide_sets[pos] = hs;
+    hide_sets_count++;
+    if (hide_sets_count * 1000 >= hide_sets_size * MAX_LOAD_FACTOR) grow_hide_sets();
+
+    return hs;
+}
+
+static unsigned int hash_operation(int operation, HideSet *hs1, HideSet *hs2) {
+    unsigned int hash = 2166136261;
+    hash = (hash ^ operation) * 16777619;
+    hash = (hash ^ hs1->id) * 16777619;
+    hash = (hash ^ hs2->id) * 16777619;
+
+    return hash;
+}
+
+static void grow_operations(void) {
+    int new_size = operations_size * 2;
+    int mask = new_size - 1;
+    HideSetOperation *new_operations = wcalloc(new_size, sizeof(HideSetOperation));
+
+    for (int i = 0; i < operations_size; i++) {
+        HideSetOperation *o = &operations[i];
+        if (!o->operation) continue;
+
+        unsigned int pos = hash_operation(o->operation, o->hs1, o->hs2) & mask;
+        while (new_operations[pos].operation) pos = (pos + 1) & mask;
+        new_operations[pos] = *o;
+    }
+
+    wfree(operations);
+    operations = new_operations;
+    operations_size = new_size;
+}
+
+// Return the memoized operation on two non-empty hide sets. If it's not there, a slot
+// for it is returned with operation set to zero.
+static HideSetOperation *lookup_operation(int operation, HideSet *hs1, HideSet *hs2) {
+    unsigned int mask = operations_size - 1;
+    unsigned int pos = hash_operation(operation, hs1, hs2) & mask;
+
+    HideSetOperation *o;
+    while ((o = &operations[pos])->operation) {
+        if (o->operation == operation && o->hs1 == hs1 && o->hs2 == hs2) return o;
+        pos = (pos + 1) & mask;
+    }
+
+    return o;
+}
+
+static void add_operation(HideSetOperation *o, int operation, HideSet *hs1, HideSet *hs2, HideSet *result) {
+    o->operation = operation;
+    o->hs1 = hs1;
+    o->hs2 = hs2;
+    o->result = result;
+
+    operations_count++;
+    if (operations_count * 1000 >= operations_size * MAX_LOAD_FACTOR) grow_operations();
+}
+
+// Merge the sorted identifiers of two non-empty hide sets
+static HideSet *merge_hide_sets(int operation, HideSet *hs1, HideSet *hs2) {
+    char **identifiers = wmalloc((hs1->count + hs2->count) * sizeof(char *));
+    int count = 0;
+
+    int i = 0;
+    int j = 0;
+    while (i < hs1->count || j < hs2->count) {
+        if (j == hs2->count || (i < hs1->count && hs1->identifiers[i] < hs2->identifiers[j])) {
+            if (operation == HS_UNION) identifiers[count++] = hs1->identifiers[i];
+            i++;
+        }
+        else if (i == hs1->count || hs2->identifiers[j] < hs1->identifiers[i]) {
+            if (operation == HS_UNION) identifiers[count++] = hs2->identifiers[j];
+            j++;
+        }
+        else {
+            identifiers[count++] = hs1->identifiers[i];
+            i++;
+            j++;
+        }
+    }
+
+    HideSet *result = make_hide_set(identifiers, count);
+    wfree(identifiers);
+
+    return result;
+}
+
+static HideSet *hide_set_operation(int operation, HideSet *hs1, HideSet *hs2) {
+    // Both operations are commutative
+    if (hs1->id > hs2->id) {
+        HideSet *t = hs1;
+        hs1 = hs2;
+        hs2 = t;
+    }
+
+    HideSetOperation *o = lookup_operation(operation, hs1, hs2);
+    if (o->operation) return o->result;
+
+    HideSet *result = merge_hide_sets(operation, hs1, hs2);
+    add_operation(o, operation, hs1, hs2, result);
+
+    return result;
+}
+
+HideSet *hide_set_union(HideSet *hs1, HideSet *hs2) {
+    if (!hs1) return hs2;
+    if (!hs2 || hs1 == hs2) return hs1;
+
+    return hide_set_operation(HS_UNION, hs1, hs2);
+}
+
+HideSet *hide_set_intersection(HideSet *hs1, HideSet *hs2) {
+    if (!hs1 || !hs2) return 0;
+    if (hs1 == hs2) return hs1;
+
+    return hide_set_operation(HS_INTERSECTION, hs1, hs2);
+}
+
+// Add an interned identifier to a hide set
+HideSet *hide_set_add(HideSet *hs, char *identifier) {
+    return hide_set_union(hs, make_hide_set(&identifier, 1));
+}
+
+// Is an interned identifier in a hide set?
+int hide_set_in(HideSet *hs, char *identifier) {
+    if (!hs) return 0;
+
+    for (int i = 0; i < hs->count; i++)
+        if (hs->identifiers[i] == identifier) return 1;
+
+    return 0;
+}
+
+// Number of distinct hide sets that have been made
+int hide_set_count(void) {
+    return hide_sets_count;
+}
@@ -3,6 +3,47 @@
 
 #include "wcc.h"
 
+static void print_short_array(char *name, short *values, int count) {
+    printf("static short %s[] = {", name);
+    for (int i = 0; i < count; i++) printf("%s%d,", i % 16 ? " " : "\n    ", values[i]);
+    printf("\n};\n\n");
+}
+
+static void print_int_array(char *name, int *values, int count) {
+    printf("static int %s[] = {", name);
+    for (int i = 0; i < count; i++) printf("%s%d,", i % 16 ? " " : "\n    ", values[i]);
+    printf("\n};\n\n");
+}
+
+// Print the tables for labelling instruction trees, see burs.c
+static void print_burs_tables(void) {
+    BursTables *t = make_burs_tables();
+    int item_count = t->state_items[t->state_count];
+
+    print_int_array("burs_state_items", t->state_items, t->state_count + 1);
+    print_short_array("burs_item_non_terminals", t->item_non_terminals, item_count);
+    print_short_array("burs_item_rules", t->item_rules, item_count);
+    print_short_array("burs_item_costs", t->item_costs, item_count);
+    print_short_array("burs_leaf_states", t->leaf_states, AUTO_NON_TERMINAL_START * VTC_COUNT);
+    print_int_array("burs_constant_masks", t->constant_masks, t->constant_count);
+    print_short_array("burs_constant_states", t->constant_states, t->constant_count);
+    print_short_array("burs_operandless_states", t->operandless_states, t->operation_limit);
+    print_short_array("burs_context_classes", t->context_classes, 1 + 2 * AUTO_NON_TERMINAL_START * VTC_COUNT);
+    print_short_array("burs_operation_contexts", t->operation_contexts, t->operation_count * t->context_class_count);
+    print_int_array("burs_context_starts", t->context_starts, t->operation_count + 1);
+    print_int_array("burs_context_dst_starts", t->context_dst_starts, t->context_count + 1);
+    print_short_array("burs_context_dsts", t->context_dsts, t->context_dst_starts[t->context_count]);
+
+    printf("static BursTables local_burs_tables = {\n");
+    printf("    %d, burs_state_items, burs_item_non_terminals, burs_item_rules, burs_item_costs,\n", t->state_count);
+    printf("    burs_leaf_states, %d, burs_constant_masks, burs_constant_states,\n", t->constant_count);
+    printf("    %d, burs_operandless_states, %d, %d, burs_context_classes, burs_operation_contexts,\n", t->operation_limit, t->operation_count, t->context_class_count);
+    printf("    %d, burs_context_starts, burs_context_dst_starts, burs_context_dsts,\n", t->context_count);
+    printf("};\n\n");
+
+    free_burs_tables(t);
+}
+
 // Dynamically defined rules in instrrules.c and dump the result out to a .c file with
 // global declarations. That file is then compiled & linked into compiler.
 int main(int argc, char **argv) {
@@ -73,9 +114,12 @@ int main(int argc, char **argv) {
     }
     printf("};\n\n");
 
+    print_burs_tables();
+
     printf("void init_generated_instruction_selection_rules(void) {\n");
     printf("    instr_rule_count = %d;\n", instr_rule_count);
     printf("    instr_rules = local_instr_rules;\n");
+    printf("    burs_tables = &local_burs_tables;\n");
     printf("}\n");
 
     free_longmap(operation_counts);
@@ -407,7 +407,7 @@ static void add_long_double_integer_move_rule(int dst, int type, char *conv_temp
     }
 
     add_op(r, X_MOVC, 0,   0,   SV1, "fnstcw %v2");         // Backup control word into allocated stack entry
-    add_op(r, X_MOVZ, 0,   SV2, SV1, "movzwl %v2w, %v1l");  // Move control word into register
+    add_op(r, X_MOVZ, SV2, SV1, 0,   "movzwl %v1w, %vdl");  // Move control word into register
     add_op(r, X_BOR,  0,   SV2, 0,   "orl $3072, %v1l");    // Set rounding and precision control bits
     add_op(r, X_MOVC, SV3, SV2, SV3, "movw %v1w, %v2w");    // Move control word into allocated stack
     add_op(r, X_MOVC, 0,   0,   SV3, "fldcw %v2w");         // Load control word from allocated stack
@@ -1708,6 +1708,17 @@ void define_rules(void) {
     // Jump rules
     r = add_rule(0, IR_JMP, LAB, 0,1);  add_op(r, X_JMP, 0, SRC1, 0, "jmp %v1"); fin_rule(r);
 
+    // Jump table. The entries are 32 bit offsets of the targets relative to the start
+    // of the table, so that no relocations are needed when compiling with -fPIC.
+    r = add_rule(0, IR_JMP_TABLE, RU4, LAB, 5);
+    add_allocate_register_in_slot(r, 1, TYPE_LONG);  // Table address
+    add_allocate_register_in_slot(r, 2, TYPE_LONG);  // Target address
+    add_op(r, X_LEA,                 SV1, SRC2, 0,    "leaq %v1(%%rip), %vdq");
+    add_op(r, X_MOV_FROM_SCALED_IND, SV2, SV1,  SRC1, "movslq (%v1q,%v2q,4), %vdq");
+    add_op(r, X_ADD,                 SV2, SV1,  SV2,  "addq %v1q, %v2q");
+    add_op(r, X_JMP_TABLE,           0,   SV2,  SRC2, "jmp *%v1q");
+    fin_rule(r);
+
     add_conditional_zero_jump_rule(IR_JZ,  XR,  LAB, 3, X_TEST, "test%s %v1, %v1",  "jz %v1",   1);
     add_conditional_zero_jump_rule(IR_JZ,  XRP, LAB, 3, X_TEST, "testq %v1q, %v1q", "jz %v1",   1);
     add_conditional_zero_jump_rule(IR_JZ,  XMI, LAB, 3, X_CMPZ, "cmp%s $0, %v1",    "jz %v1",   1);
@@ -6,37 +6,26 @@
 
 enum {
     MAX_INSTRUCTION_GRAPH_EDGE_COUNT = 128,
-    MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT = 1024,
-    MAX_INSTRUCTION_GRAPH_CHOICE_EDGE_COUNT = 1024,
-    MAX_CHOICE_TRAIL_COUNT = 32,
     MAX_SAVED_REGISTERS = 8,
 };
 
 IGraph *igraphs;                // The current block's igraphs
 int instr_count;                // The current block's instruction count
 
-Graph *cost_graph;              // Graph of all possible options when tiling
-int cost_graph_node_count;      // Number of nodes in cost graph
-int *cost_to_igraph_map;        // Mapping of a cost graph node back to the instruction graph node
-int *cost_rules;                // Mapping of cost graph node id to x86 instruction rule id
-int *accumulated_cost;          // Total cost of sub tree of a cost graph node
-LongSet **igraph_labels;        // Matched instruction rule ids for a igraph node id
+int *igraph_states;             // BURS state for a igraph node id
 Rule **igraph_rules;            // Matched lowest cost rule id for a igraph node id
 
-List *allocated_graphs;         // Track Graph allocations
-List *allocated_igraphs;        // Track IGraph allocations
-List *allocated_igraph_nodes;   // Track IGraphNode allocations
+Arena *igraph_arena;            // Graph, IGraph and IGraphNode allocations for the current block
 List *allocated_things;         // Track anything that can be freed with a simple wfree()
 
 int instr_rule_count;
 Rule *instr_rules;
 int disable_merge_constants;
-LongMap *instr_rules_by_operation;
 Value **saved_values;
 char *rule_coverage_file;
 Set *rule_coverage;
 
-static int recursive_tile_igraphs(IGraph *igraph, int node_id);
+static int recursive_label_igraphs(IGraph *igraph, int node_id);
 
 
 void init_instrsel() {
@@ -131,6 +120,7 @@ static void recursive_dump_igraph(IGraph *ig, int node, int indent, int include_
             case IR_JZ:                   c += printf("jz"); break;
             case IR_JNZ:                  c += printf("jnz"); break;
             case IR_JMP:                  c += printf("jmp"); break;
+            case IR_JMP_TABLE:            c += printf("jmp table"); break;
             case IR_EQ:                   c += printf("=="); break;
             case IR_NE:                   c += printf("!="); break;
             case IR_LT:                   c += printf("<"); break;
@@ -192,16 +182,13 @@ static IGraph *merge_igraphs(IGraph *g1, IGraph *g2, int vreg) {
         printf("\n");
     }
 
-    IGraph *g = wcalloc(1, sizeof(IGraph));
-    append_to_list(allocated_igraphs, g);
+    IGraph *g = arena_alloc(igraph_arena, sizeof(IGraph));
 
     int node_count = g1->node_count + g2->node_count;
-    IGraphNode *inodes = wcalloc(node_count, sizeof(IGraphNode));
-    append_to_list(allocated_igraph_nodes, inodes);
+    IGraphNode *inodes = arena_alloc(igraph_arena, node_count * sizeof(IGraphNode));
 
     g->nodes = inodes;
-    g->graph = new_graph(node_count, MAX_INSTRUCTION_GRAPH_EDGE_COUNT);
-    append_to_list(allocated_graphs, g->graph);
+    g->graph = new_graph_in_arena(igraph_arena, node_count, MAX_INSTRUCTION_GRAPH_EDGE_COUNT);
     g->node_count = node_count;
     int join_from = -1;
     int join_to = -1;
@@ -316,9 +303,7 @@ static int igraphs_are_neighbors(IGraph *igraphs, int i1, int i2) {
 }
 
 static void make_igraphs(Function *function, int block_id) {
-    allocated_graphs = new_list(1024);
-    allocated_igraphs = new_list(1024);
-    allocated_igraph_nodes = new_list(1024);
+    igraph_arena = new_arena();
 
     Block *blocks = function->blocks;
 
@@ -340,7 +325,7 @@ static void make_igraphs(Function *function, int block_id) {
     }
 
     // Allocate global igraphs
-    igraphs = wmalloc(instr_count * sizeof(IGraph));
+    igraphs = arena_alloc(igraph_arena, instr_count * sizeof(IGraph));
 
     int i = 0;
     tac = blocks[block_id].start;
@@ -350,11 +335,8 @@ static void make_igraphs(Function *function, int block_id) {
         if (tac->src1) node_count++;
         if (tac->src2) node_count++;
 
-        IGraphNode *nodes = wcalloc(node_count, sizeof(IGraphNode));
-        append_to_list(allocated_igraph_nodes, nodes);
-
-        Graph *graph = new_graph(node_count, MAX_INSTRUCTION_GRAPH_EDGE_COUNT);
-        append_to_list(allocated_graphs, graph);
+        IGraphNode *nodes = arena_alloc(igraph_arena, node_count * sizeof(IGraphNode));
+        Graph *graph = new_graph_in_arena(igraph_arena, node_count, MAX_INSTRUCTION_GRAPH_EDGE_COUNT);
 
         nodes[0].tac = tac;
         node_count = 1;
@@ -373,20 +355,16 @@ static void make_igraphs(Function *function, int block_id) {
     }
 
     // Mark liveouts as off-limits for merging
-    LongSet *liveout = function->liveout[block_id];
+    Set *liveout = function->liveout[block_id];
 
     int liveout_vreg_count = 0;
-    for (LongSetIterator it = longset_iterator(liveout); !longset_iterator_finished(&it); longset_iterator_next(&it)) {
-        int vreg = longset_iterator_element(&it);
-        if (vreg > liveout_vreg_count) liveout_vreg_count = vreg;
-    }
+    set_foreach(liveout, vreg) liveout_vreg_count = vreg;
 
     if (liveout_vreg_count > vreg_count) vreg_count = liveout_vreg_count;
 
     VregIGraph* vreg_igraphs = wcalloc(vreg_count + 1, sizeof(VregIGraph));
 
-    for (LongSetIterator it = longset_iterator(liveout); !longset_iterator_finished(&it); longset_iterator_next(&it)) {
-        int vreg = longset_iterator_element(&it);
+    set_foreach(liveout, vreg) {
         vreg_igraphs[vreg].count++;
         vreg_igraphs[vreg].igraph_id = -1;
     }
@@ -496,19 +474,8 @@ static void make_igraphs(Function *function, int block_id) {
 }
 
 static void free_igraphs(Function *function) {
-    for (int i = 0; i < allocated_graphs->length; i++)
-        free_graph(allocated_graphs->elements[i]);
-    free_list(allocated_graphs);
-
-    for (int i = 0; i < allocated_igraphs->length; i++)
-        wfree(allocated_igraphs->elements[i]);
-    free_list(allocated_igraphs);
-
-    for (int i = 0; i < allocated_igraph_nodes->length; i++)
-        wfree(allocated_igraph_nodes->elements[i]);
-    free_list(allocated_igraph_nodes);
-
-    wfree(igraphs); // Free global igraphs
+    free_arena(igraph_arena); // Also frees the global igraphs
+    igraph_arena = 0;
 }
 
 // Recurse down src igraph, copying nodes to dst igraph and adding edges
@@ -546,16 +513,13 @@ static void recursive_simplify_igraph(IGraph *src, IGraph *dst, int src_node_id,
 // Remove sequences of moves from the instruction graph. A new graph is created by
 // recursing through the src.
 static IGraph *simplify_igraph(IGraph *src) {
-    IGraph *dst = wcalloc(1, sizeof(IGraph));
-    append_to_list(allocated_igraphs, dst);
+    IGraph *dst = arena_alloc(igraph_arena, sizeof(IGraph));
 
     int node_count = src->node_count;
-    IGraphNode *inodes = wcalloc(node_count, sizeof(IGraphNode));
-    append_to_list(allocated_igraph_nodes, inodes);
+    IGraphNode *inodes = arena_alloc(igraph_arena, node_count * sizeof(IGraphNode));
 
     dst->nodes = inodes;
-    dst->graph = new_graph(node_count, MAX_INSTRUCTION_GRAPH_EDGE_COUNT);
-    append_to_list(allocated_graphs, dst->graph);
+    dst->graph = new_graph_in_arena(igraph_arena, node_count, MAX_INSTRUCTION_GRAPH_EDGE_COUNT);
     dst->node_count = node_count;
 
     if (debug_instsel_igraph_simplification) {
@@ -697,189 +661,38 @@ static void merge_constants(Function *function) {
     }
 }
 
-// Print the cost graph, only showing choices where parent src and child dst match
-static void recursive_print_cost_graph(Graph *cost_graph, int *cost_rules, int *accumulated_cost, int node_id, int parent_node_id, int parent_src, int indent) {
-    GraphEdge *choice_edge = cost_graph->nodes[node_id].succ;
-    while (choice_edge) {
-        int choice_node_id = choice_edge->to->id;
-        GraphNode *choice_node = &(cost_graph->nodes[choice_node_id]);
-
-        int match = 1;
-        if (parent_node_id != -1) {
-            Rule *parent_rule = &(instr_rules[cost_rules[parent_node_id]]);
-            int src = (parent_src == 1) ? parent_rule->src1 : parent_rule->src2;
-            match = (src == instr_rules[cost_rules[choice_node_id]].dst);
-            if (match) {
-                printf("%-3d ", choice_node_id);
-                for (int i = 0; i < indent; i++) printf("  ");
-                printf("%d ", cost_rules[choice_node_id]);
-            }
-        }
-        else
-            printf("%d ", cost_rules[choice_node_id]);
-
-        if (match) {
-            printf(" (%d)\n", accumulated_cost[choice_node_id]);
-
-            GraphEdge *e = choice_node->succ;
-            int j = 1;
-            while (e) {
-                printf("%-3d ", choice_node_id);
-                for (int i = 0; i < indent + 1; i++) printf("  ");
-                printf("src%d\n", j);
-                recursive_print_cost_graph(cost_graph, cost_rules, accumulated_cost, e->to->id, choice_node_id, j, indent + 2);
-
-                e = e->next_succ;
-                j++;
-            }
-        }
-
-        choice_edge = choice_edge->next_succ;
+// Print the states of all nodes in an instruction tree
+static void print_igraph_states(IGraph *igraph) {
+    for (int i = 0; i < igraph->node_count; i++) {
+        printf("node %d ", i);
+        print_burs_state(igraph_states[i]);
     }
 }
 
-static void print_cost_graph(Graph *cost_graph, int *cost_rules, int *accumulated_cost) {
-    recursive_print_cost_graph(cost_graph, cost_rules, accumulated_cost, 0, -1, -1, 0);
-}
-
-static int new_cost_graph_node(void) {
-    if (cost_graph_node_count == MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT)
-        panic("MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT");
-    return cost_graph_node_count++;
-}
-
-static void calculate_accumulated_cost_for_new_cost_node(Rule *r, int src1_cost_graph_node_id, int src2_cost_graph_node_id, int choice_node_id) {
-    // Do some on the fly accounting, find the minimal cost sub trees
-    int min_cost_src1 = 100000000;
-    int min_cost_src2 = 100000000;
-
-    // Loop over src1 and src2 if there is one
-    for (int i = 1; i <= 2; i++) {
-        if (!src2_cost_graph_node_id && i == 2) continue; // Unary operation
-
-        int src = i == 1 ? r->src1 : r->src2;
-        GraphEdge *e = i == 1
-            ? cost_graph->nodes[src1_cost_graph_node_id].succ
-            : cost_graph->nodes[src2_cost_graph_node_id].succ;
-
-        // Find the lowest cost from all the edges
-        int min_cost = 100000000;
-        while (e) {
-            Rule *child_rule = &(instr_rules[cost_rules[e->to->id]]);
-
-            if (src == child_rule->dst) {
-                int cost = accumulated_cost[e->to->id];
-                if (cost < min_cost) min_cost = cost;
-            }
-
-            e = e->next_succ;
-        }
-
-        if (i == 1)
-            min_cost_src1 = min_cost;
-        else
-            min_cost_src2 = min_cost;
-    }
-
-    if (!src2_cost_graph_node_id) min_cost_src2 = 0;
-
-    accumulated_cost[choice_node_id] = min_cost_src1 + min_cost_src2 + r->cost;
-}
-
-// Tile a graph node that has an operation but no operands.
-// These are used e.g. in a parameterless return statement.
-static int tile_igraph_operand_less_node(IGraph *igraph, int node_id) {
-    if (debug_instsel_tiling) printf("tile_igraph_operand_less_node on node=%d\n", node_id);
-
-    int cost_graph_node_id = new_cost_graph_node();
-    cost_to_igraph_map[cost_graph_node_id] = node_id;
-
-    Tac *tac = igraph->nodes[node_id].tac;
-
-    List *rules = longmap_get(instr_rules_by_operation, tac->operation);
-    for (int i = 0; i < rules->length; i++) {
-        Rule *r = rules->elements[i];
-
-        if (debug_instsel_tiling) {
-            printf("matched rule %d:\n", r->index);
-            print_rule(r, 0, 0);
-        }
-
-        int choice_node_id = new_cost_graph_node();
-        cost_to_igraph_map[choice_node_id] = node_id;
-        cost_rules[choice_node_id] = r->index;
-        accumulated_cost[choice_node_id] = r->cost;
-
-        add_graph_edge(cost_graph, cost_graph_node_id, choice_node_id);
-
-        return cost_graph_node_id;
-        }
-
-    dump_igraph(igraph, 0);
-    panic("Did not match any rules");
-}
-
-// Tile a leaf node in the instruction tree. Rules for leaf nodes all have a zero
+// Label a leaf node in the instruction tree. Rules for leaf nodes all have a zero
 // operation. This is simply a case of matching the value to the rule src1.
-static int tile_igraph_leaf_node(IGraph *igraph, int node_id) {
+static int label_igraph_leaf_node(IGraph *igraph, int node_id) {
     if (debug_instsel_tiling) dump_igraph(igraph, 0);
 
-    int cost_graph_node_id = new_cost_graph_node();
-    cost_to_igraph_map[cost_graph_node_id] = node_id;
-
-    Value *v = igraph->nodes[node_id].value;
+    int state = burs_leaf_state(igraph->nodes[node_id].value);
 
-    // Find a matching instruction
-    int matched = 0;
-    List *rules = longmap_get(instr_rules_by_operation, 0); // Rules without an operation
-    for (int i = 0; i < rules->length; i++) {
-        Rule *r = rules->elements[i];
-
-        if (!match_value_to_rule_src(v, r->src1)) continue;
-        if (!v->is_constant && !v->label && v->type->type != TYPE_FUNCTION && !match_value_type_to_rule_dst(v, r->dst)) continue;
-
-        if (debug_instsel_tiling) {
-            printf("matched rule %d:\n", r->index);
-            print_rule(r, 0, 0);
-        }
-        longset_add(igraph_labels[node_id], r->index);
-
-        int choice_node_id = new_cost_graph_node();
-        cost_to_igraph_map[choice_node_id] = node_id;
-        cost_rules[choice_node_id] = r->index;
-        accumulated_cost[choice_node_id] = r->cost;
-
-        add_graph_edge(cost_graph, cost_graph_node_id, choice_node_id);
-
-        matched = 1;
-    }
-
-    if (!matched) {
+    if (!state) {
         dump_igraph(igraph, 0);
         panic("Did not match any rules");
     }
 
-    return cost_graph_node_id;
-}
-
-// Check if the dst for any label in the child tree for src_id matches rule_src.
-static int match_subtree_labels_to_rule(int src_id, int rule_src) {
-    longset_foreach(igraph_labels[src_id], it) {
-        int rule = longset_iterator_element(&it);
-        if (rule_src == instr_rules[rule].dst) return 1;
-    }
+    if (debug_instsel_tiling) print_burs_state(state);
 
-    return 0;
+    return state;
 }
 
-// Tile an instruction graph node that has an operation with 0, 1 or 2 operands.
-static int tile_igraph_operation_node(IGraph *igraph, int node_id) {
+// Label an instruction graph node that has an operation with 0, 1 or 2 operands.
+static int label_igraph_operation_node(IGraph *igraph, int node_id) {
     IGraphNode *inode = &(igraph->nodes[node_id]);
     Tac *tac = inode->tac;
-    int operation = tac->operation;
 
     if (debug_instsel_tiling) {
-        printf("tile_igraph_operation_node on node=%d\n", node_id);
+        printf("label_igraph_operation_node on node=%d\n", node_id);
         print_instruction(stdout, tac, 0);
         dump_igraph(igraph, 0);
     }
@@ -894,92 +707,33 @@ static int tile_igraph_operation_node(IGraph *igraph, int node_id) {
         if (e) src2_id = e->to->id;
     }
 
-    // Special case: no operands
-    if (!src1_id) return tile_igraph_operand_less_node(igraph, node_id);
-
-    // Create the root cost instruction graph node
-    int cost_graph_node_id = new_cost_graph_node();
-    cost_to_igraph_map[cost_graph_node_id] = node_id;
-
     // Recurse down the src1 and src2 trees
-    int src1_cost_graph_node_id = recursive_tile_igraphs(igraph, src1_id);
-
-    int src2_cost_graph_node_id;
-    if (src2_id)
-        src2_cost_graph_node_id = recursive_tile_igraphs(igraph, src2_id);
-    else
-        src2_cost_graph_node_id = 0;
-
-    if (debug_instsel_tiling) {
-        printf("back from recursing at node=%d\n\n", node_id);
-        printf("src1 labels: "); print_longset(igraph_labels[src1_id]); printf(" ");
-        printf("\n");
-
-        if (src2_id) {
-            printf("src2 labels: ");
-            print_longset(igraph_labels[src2_id]);
-            printf("\n");
-        }
+    int operand_count = 0;
+    int src1_state = 0;
+    int src2_state = 0;
+    if (src1_id) {
+        operand_count++;
+        src1_state = recursive_label_igraphs(igraph, src1_id);
+    }
+    if (src2_id) {
+        operand_count++;
+        src2_state = recursive_label_igraphs(igraph, src2_id);
     }
 
+    if (debug_instsel_tiling) printf("back from recursing at node=%d\n\n", node_id);
+
     if (debug_instsel_tiling && tac->dst)
         printf("Want dst %s\n", value_to_non_terminal_string(tac->dst));
 
-    // Loop over all rules and gather matches in the cost graph
-    int matched = 0;
-    List *rules = longmap_get(instr_rules_by_operation, operation);
-    for (int i = 0; i < rules->length; i++) {
-        Rule *r = rules->elements[i];
-
-        if (src2_id && !r->src2 || !src2_id && r->src2) continue; // Filter rules requiring src2
-
-        // If this is the top level or a rule requires it, ensure the dst matches.
-        int match_dst = tac->dst && node_id == 0;
-
-        // IR_MOVE_TO_PTR is a special case since it doesn't have a dst. The dst is actually
-        // src1, which isn't modified.
-        if (match_dst) {
-            if (tac->operation != IR_MOVE_TO_PTR && !match_value_to_rule_dst(tac->dst, r->dst)) continue;
-            if (tac->operation == IR_MOVE_TO_PTR && !match_value_to_rule_dst(tac->src1, r->dst)) continue;
-        }
-
-        if (tac->operation == IR_MOVE_TO_PTR && !match_value_type_to_rule_dst(tac->src1, r->dst)) continue;
-        else if (tac->dst && !match_value_type_to_rule_dst(tac->dst, r->dst)) continue;
-
-        // Check dst of the subtree tile matches what is needed
-        int matched_src = match_subtree_labels_to_rule(src1_id, r->src1);
-        if (!matched_src) continue;
-
-        if (src2_id) {
-            matched_src = match_subtree_labels_to_rule(src2_id, r->src2);
-            if (!matched_src) continue;
-        }
-
-        // We have a winner
-        matched = 1;
+    int state = burs_operation_state(tac, node_id == 0, operand_count, src1_state, src2_state);
 
-        if (debug_instsel_tiling) {
-            printf("matched rule %d:\n", r->index);
-            print_rule(r, 1, 0);
+    // If there are no matches, we have a problem, bail with an error.
+    if (!state) {
+        if (!operand_count) {
+            dump_igraph(igraph, 0);
+            panic("Did not match any rules");
         }
 
-        longset_add(igraph_labels[node_id], r->index); // Add a label
-
-        // Add cost graph nodes for src1 and potentially src2
-        int choice_node_id = new_cost_graph_node();
-        cost_rules[choice_node_id] = r->index;
-        cost_to_igraph_map[choice_node_id] = node_id;
-
-        add_graph_edge(cost_graph, cost_graph_node_id, choice_node_id);
-        add_graph_edge(cost_graph, choice_node_id, src1_cost_graph_node_id);
-        if (src2_id) add_graph_edge(cost_graph, choice_node_id, src2_cost_graph_node_id);
-
-        calculate_accumulated_cost_for_new_cost_node(r, src1_cost_graph_node_id, src2_cost_graph_node_id, choice_node_id);
-    }
-
-    // All rules have been visited, if there are no matches, we have a problem, bail
-    // with an error.
-    if (!matched) {
         printf("\nNo rules matched\n");
         if (tac->dst) printf("Want dst %s\n", value_to_non_terminal_string(tac->dst));
         print_instruction(stdout, tac, 0);
@@ -987,53 +741,25 @@ static int tile_igraph_operation_node(IGraph *igraph, int node_id) {
         exit(1);
     }
 
-    return cost_graph_node_id;
+    if (debug_instsel_tiling) print_burs_state(state);
+
+    return state;
 }
 
-// Algorithm from page 618 of Engineering a compiler
-// with additional minimal cost tiling determination as suggested on page 619.
-static int recursive_tile_igraphs(IGraph *igraph, int node_id) {
-    if (debug_instsel_tiling) printf("\nrecursive_tile_igraphs on node=%d\n", node_id);
+// Label each node in the tree with a BURS state, which has the lowest cost rules for
+// the subtree, see burs.c.
+static int recursive_label_igraphs(IGraph *igraph, int node_id) {
+    if (debug_instsel_tiling) printf("\nrecursive_label_igraphs on node=%d\n", node_id);
 
+    int state;
     if (!igraph->nodes[node_id].tac)
-        return tile_igraph_leaf_node(igraph, node_id);
+        state = label_igraph_leaf_node(igraph, node_id);
     else
-        return tile_igraph_operation_node(igraph, node_id);
-}
-
-// find the lowest cost successor in the cost graph at node_id
-static int get_least_expensive_choice_node_id(int node_id, int parent_node_id, int parent_src) {
-    int min_cost = 100000000;
-    int least_expensive_choice_node_id = -1;
-    GraphEdge *choice_edge = cost_graph->nodes[node_id].succ;
-    while (choice_edge) {
-        int choice_node_id = choice_edge->to->id;
-        int match;
-
-        if (parent_node_id != -1) {
-            // Ensure src and dst match for non-root nodes
-            Rule *parent_rule = &(instr_rules[cost_rules[parent_node_id]]);
-            int pv = (parent_src == 1) ? parent_rule->src1 : parent_rule->src2;
-            match = (pv == instr_rules[cost_rules[choice_node_id]].dst);
-        }
-        else
-            match = 1;
-
-        if (match) {
-            int cost = accumulated_cost[choice_node_id];
-            if (cost < min_cost) {
-                min_cost = cost;
-                least_expensive_choice_node_id = choice_node_id;
-            }
-        }
+        state = label_igraph_operation_node(igraph, node_id);
 
-        choice_edge = choice_edge->next_succ;
-    }
-
-    if (least_expensive_choice_node_id == -1)
-        panic("No matched choices in recursive_make_intermediate_representation");
+    igraph_states[node_id] = state;
 
-    return least_expensive_choice_node_id;
+    return state;
 }
 
 static Value *load_value_from_slot(int slot, char *arg) {
@@ -1231,35 +957,34 @@ static Value *generate_instructions(Function *function, IGraphNode *ign, int is_
     return dst;
 }
 
-// Add instructions to the intermediate representation by doing a post-order walk over the cost tree, picking the matching rules with lowest cost
-static Value *recursive_make_intermediate_representation(Function *function, IGraph *igraph, int node_id, int parent_node_id, int parent_src) {
-    int least_expensive_choice_node_id = get_least_expensive_choice_node_id(node_id, parent_node_id, parent_src);
-    int igraph_node_id = cost_to_igraph_map[least_expensive_choice_node_id];
-    IGraphNode *ign = &(igraph->nodes[igraph_node_id]);
+// Add instructions to the intermediate representation by doing a post-order walk over the tree, picking the lowest cost rules from the node states
+static Value *recursive_make_intermediate_representation(Function *function, IGraph *igraph, int node_id, Rule *rule) {
+    IGraphNode *ign = &(igraph->nodes[node_id]);
 
-    Rule *rule = &(instr_rules[cost_rules[least_expensive_choice_node_id]]);
-    igraph_rules[igraph_node_id] = rule;
+    igraph_rules[node_id] = rule;
     add_to_set(rule_coverage, rule->index);
 
-    GraphEdge *e = cost_graph->nodes[least_expensive_choice_node_id].succ;
-    int child_src = 1;
     Value *src1 = ign->value;
     Value *src2 = 0;
 
-    while (e) {
-        Value *src = recursive_make_intermediate_representation(function, igraph, e->to->id, least_expensive_choice_node_id, child_src);
+    GraphEdge *e = igraph->graph->nodes[node_id].succ;
+    for (int child_src = 1; e && child_src <= 2; child_src++) {
+        int child_node_id = e->to->id;
+
+        // Ensure src and dst match
+        Rule *child_rule = burs_state_rule(igraph_states[child_node_id], child_src == 1 ? rule->src1 : rule->src2);
+        if (!child_rule) panic("No matched choices in recursive_make_intermediate_representation");
+
+        Value *src = recursive_make_intermediate_representation(function, igraph, child_node_id, child_rule);
         if (child_src == 1)
             src1 = src;
         else
             src2 = src;
 
         e = e->next_succ;
-        child_src++;
     }
 
-    int is_root = parent_node_id == -1;
-
-    return generate_instructions(function, ign, is_root, rule, src1, src2);
+    return generate_instructions(function, ign, node_id == 0, rule, src1, src2);
 }
 
 static void make_intermediate_representation(Function *function, IGraph *igraph) {
@@ -1270,7 +995,7 @@ static void make_intermediate_representation(Function *function, IGraph *igraph)
     }
 
     saved_values = wmalloc((MAX_SAVED_REGISTERS + 1) * sizeof(Value *));
-    recursive_make_intermediate_representation(function, igraph, 0, -1, -1);
+    recursive_make_intermediate_representation(function, igraph, 0, burs_root_rule(igraph_states[0]));
     wfree(saved_values);
 
     if (debug_instsel_tiling) {
@@ -1317,23 +1042,14 @@ static void tile_igraphs(Function *function) {
             continue;
         }
 
-        igraph_labels = wmalloc(igraphs[i].node_count * sizeof(LongSet *));
-        for (int j = 0; j < igraphs[i].node_count; j++) igraph_labels[j] = new_longset();
-
+        igraph_states = wcalloc(igraphs[i].node_count, sizeof(int));
         igraph_rules = wcalloc(igraphs[i].node_count, sizeof(Rule *));
 
         if (debug_instsel_tiling)
             printf("\nTiling\n-----------------------------------------------------\n");
 
-        cost_graph = new_graph(MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT, MAX_INSTRUCTION_GRAPH_CHOICE_EDGE_COUNT);
-        cost_rules = wcalloc(MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT, sizeof(int));
-        accumulated_cost = wcalloc(MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT, sizeof(int));
-
-        cost_graph_node_count = 0;
-        cost_to_igraph_map = wcalloc(MAX_INSTRUCTION_GRAPH_CHOICE_NODE_COUNT, sizeof(int));
-
-        recursive_tile_igraphs(&(igraphs[i]), 0);
-        if (debug_instsel_cost_graph) print_cost_graph(cost_graph, cost_rules, accumulated_cost);
+        recursive_label_igraphs(&(igraphs[i]), 0);
+        if (debug_instsel_states) print_igraph_states(&(igraphs[i]));
 
         if (tac && tac->label) {
             add_instruction(IR_NOP, 0, 0, 0);
@@ -1348,13 +1064,8 @@ static void tile_igraphs(Function *function) {
             print_ir(f, 0, 0);
         }
 
-        for (int j = 0; j < igraphs[i].node_count; j++) free_longset(igraph_labels[j]);
-        wfree(igraph_labels);
+        wfree(igraph_states);
         wfree(igraph_rules);
-        free_graph(cost_graph);
-        wfree(cost_rules);
-        wfree(accumulated_cost);
-        wfree(cost_to_igraph_map);
     }
 
     if (debug_instsel_tiling) {
@@ -1472,23 +1183,41 @@ static Tac *make_spill_instruction(Value *v) {
     return tac;
 }
 
-static void add_spill_load(Tac *ir, int src, int preg) {
+// Repeat the definition of a rematerialized value, with the spill register as dst
+static Tac *make_rematerialization_instruction(Tac *definition, int preg) {
+    Tac *tac = new_instruction(definition->operation);
+    tac->x86_template = definition->x86_template;
+    tac->src1 = dup_value(definition->src1);
+    tac->dst = dup_value(definition->dst);
+    tac->dst->vreg = -1000;   // Dummy value
+    tac->dst->preg = preg;
+    tac->dst->spilled = 0;
+
+    return tac;
+}
+
+static void add_spill_load(Function *function, Tac *ir, int src, int preg) {
     Value *v = src == 1 ? ir->src1 : ir->src2;
+    Tac *tac;
 
-    Tac *tac = make_spill_instruction(v);
-    tac->src1 = v;
-    tac->dst = new_value();
+    if (!v->stack_index)
+        tac = make_rematerialization_instruction(function->rematerializations[v->vreg], preg);
+    else {
+        tac = make_spill_instruction(v);
+        tac->src1 = v;
+        tac->dst = new_value();
 
-    // Codegen needs to know if this is a function; in all other cases the spill is
-    // done on a full 64 bit register.
-    if (v->type->type == TYPE_FUNCTION)
-        tac->dst->type = new_type(TYPE_FUNCTION);
-    else
-        tac->dst->type = new_type(TYPE_LONG);
+        // Codegen needs to know if this is a function; in all other cases the spill is
+        // done on a full 64 bit register.
+        if (v->type->type == TYPE_FUNCTION)
+            tac->dst->type = new_type(TYPE_FUNCTION);
+        else
+            tac->dst->type = new_type(TYPE_LONG);
 
-    tac->dst->x86_size = 4;
-    tac->dst->vreg = -1000;   // Dummy value
-    tac->dst->preg = preg;
+        tac->dst->x86_size = 4;
+        tac->dst->vreg = -1000;   // Dummy value
+        tac->dst->preg = preg;
+    }
 
     if (src == 1)
         ir->src1 = dup_value(tac->dst);
@@ -1555,6 +1284,14 @@ void add_spill_code(Function *function) {
     for (Tac *tac = function->ir; tac; tac = tac->next) {
         if (debug_instsel_spilling) print_instruction(stdout, tac, 0);
 
+        // A dst can carry the offset of an indirect use of the same value elsewhere, e.g.
+        // r1 = r2 followed by 8(r1) = r3. The dst is written to its stack slot, not to
+        // the slot plus the offset, so the offset is dropped.
+        if (tac->dst && tac->dst->spilled && tac->dst->offset) {
+            tac->dst = dup_value(tac->dst);
+            tac->dst->offset = 0;
+        }
+
         // Allow all moves where either dst is a register and src is on the stack
         if (tac->operation == X_MOV || tac->operation == X_MOVS || tac->operation == X_MOVZ)
             if (tac->dst && tac->dst->preg != -1 && tac->src1 && tac->src1->stack_index) continue;
@@ -1562,11 +1299,14 @@ void add_spill_code(Function *function) {
         // Allow non sign-extends moves if the dst is on the stack and the src is a register
         if (tac->operation == X_MOV && tac->dst && tac->dst->stack_index && tac->src1 && tac->src1->preg != -1) continue;
 
+        // A rematerialized value is recomputed before each use, its definition is removed below
+        if (tac->dst && tac->dst->spilled && !tac->dst->stack_index) continue;
+
         int dst_eq_src1 = (tac->dst && tac->src1 && tac->dst->vreg == tac->src1->vreg);
 
         if (tac->src1 && tac->src1->spilled)  {
             if (debug_instsel_spilling) printf("Adding spill load\n");
-            add_spill_load(tac, 1, get_spill_register(tac->src1, 1));
+            add_spill_load(function, tac, 1, get_spill_register(tac->src1, 1));
             if (dst_eq_src1) {
                 // Special case where src1 is the same as dst, in that case, r10/xmm14 contains the result.
                 int spill_register = get_spill_register(tac->dst, 1);
@@ -1577,7 +1317,7 @@ void add_spill_code(Function *function) {
 
         if (tac->src2 && tac->src2->spilled) {
             if (debug_instsel_spilling) printf("Adding spill load\n");
-            add_spill_load(tac, 2, get_spill_register(tac->src2, 2));
+            add_spill_load(function, tac, 2, get_spill_register(tac->src2, 2));
         }
 
         if (tac->dst && tac->dst->spilled) {
@@ -1587,4 +1327,8 @@ void add_spill_code(Function *function) {
             tac = tac->next;
         }
     }
+
+    // The definitions of rematerialized values are no longer needed
+    for (Tac *tac = function->ir; tac; tac = tac->next)
+        if (tac->dst && tac->dst->spilled && !tac->dst->stack_index) tac->operation = IR_NOP;
 }
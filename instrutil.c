@@ -24,27 +24,6 @@ char size_to_x86_size(int size) {
     }
 }
 
-void init_rules_by_operation(void) {
-    instr_rules_by_operation = new_longmap();
-
-    for (int i = 0; i < instr_rule_count; i++) {
-        Rule *r = &(instr_rules[i]);
-        List *list = longmap_get(instr_rules_by_operation, r->operation);
-        if (!list) {
-            list = new_list(128);
-            longmap_put(instr_rules_by_operation, r->operation, list);
-        }
-        append_to_list(list, r);
-    }
-}
-
-void free_rules_by_operation(void) {
-    longmap_foreach(instr_rules_by_operation, it)
-        free_list(longmap_get(instr_rules_by_operation, longmap_iterator_key(&it)));
-
-    free_longmap(instr_rules_by_operation);
-}
-
 // Make a textual representation of a non terminal
 char *non_terminal_string(int nt) {
     char *buf = wmalloc(6);
@@ -208,6 +187,7 @@ char *operation_string(int operation) {
         case IR_JMP:                 return "IR_JMP";
         case IR_JZ:                  return "IR_JZ";
         case IR_JNZ:                 return "IR_JNZ";
+        case IR_JMP_TABLE:           return "IR_JMP_TABLE";
         case IR_ADD:                 return "IR_ADD";
         case IR_SUB:                 return "IR_SUB";
         case IR_RSUB:                return "IR_RSUB";
@@ -240,6 +220,7 @@ char *operation_string(int operation) {
         case X_TEST:                 return "test";
         case X_CMPZ:                 return "cmpz";
         case X_JMP:                  return "jmp";
+        case X_JMP_TABLE:            return "jmp table";
         case X_JZ:                   return "jz";
         case X_JNZ:                  return "jnz";
         case X_JE:                   return "je";
@@ -392,45 +373,58 @@ int match_value_to_rule_src(Value *v, int src) {
         return non_terminal_for_value(v) == src;
 }
 
+// Classify a value's type for matching it to rule dst non terminals. The class
+// determines which non terminals, other than the value's own, the type matches.
+int value_type_class(Value *v) {
+    if (!v->type) return VTC_OTHER; // Labels and functions
+
+    int type = v->type->type;
+
+    if (type >= TYPE_CHAR && type <= TYPE_LONG)
+        return (v->type->is_unsigned ? VTC_U1 : VTC_I1) + type - TYPE_CHAR;
+    else if (type == TYPE_FLOAT)
+        return VTC_S3;
+    else if (type == TYPE_DOUBLE)
+        return VTC_S4;
+    else if (is_pointer_to_function_type(v->type))
+        return VTC_PF;
+    else if (type == TYPE_PTR) {
+        int ptr_size = value_ptr_target_x86_size(v);
+        return ptr_size == 8 ? VTC_P5 : VTC_P1 + ptr_size - 1;
+    }
+    else
+        return VTC_OTHER;
+}
+
+// Return a bitmask of the non terminals that values of a type class match as a rule dst
+long type_class_non_terminals(int type_class) {
+    switch (type_class) {
+        case VTC_I1: return (1L << RI1) | (1L << MI1);
+        case VTC_I2: return (1L << RI2) | (1L << MI2);
+        case VTC_I3: return (1L << RI3) | (1L << MI3);
+        case VTC_I4: return (1L << RI4) | (1L << MI4);
+        case VTC_U1: return (1L << RU1) | (1L << MU1);
+        case VTC_U2: return (1L << RU2) | (1L << MU2);
+        case VTC_U3: return (1L << RU3) | (1L << MU3);
+        case VTC_U4: return (1L << RU4) | (1L << MU4);
+        case VTC_S3: return (1L << RS3) | (1L << MS3);
+        case VTC_S4: return (1L << RS4) | (1L << MS4);
+        case VTC_P1: return 1L << RP1;
+        case VTC_P2: return 1L << RP2;
+        case VTC_P3: return 1L << RP3;
+        case VTC_P4: return 1L << RP4;
+        case VTC_P5: return 1L << RP5;
+        case VTC_PF: return (1L << RP4) | (1L << RPF);
+        default:     return 0;
+    }
+}
+
 // Match a value type to a non terminal rule type. This is necessary to ensure that
 // non-root nodes have matching types while tree matching.
 int match_value_type_to_rule_dst(Value *v, int dst) {
-    int vnt = non_terminal_for_value(v);
-    int is_ptr = v->type->type == TYPE_PTR;
-
-    int ptr_size;
-    if (is_ptr) ptr_size = value_ptr_target_x86_size(v);
-    int is_ptr_to_function = is_pointer_to_function_type(v->type);
-
-    if (dst == vnt) return 1;
+    if (dst == non_terminal_for_value(v)) return 1;
     else if (dst >= AUTO_NON_TERMINAL_START) return 1;
-    else if (dst == RI1  && v->type->type == TYPE_CHAR  && !v->type->is_unsigned) return 1;
-    else if (dst == RI2  && v->type->type == TYPE_SHORT && !v->type->is_unsigned) return 1;
-    else if (dst == RI3  && v->type->type == TYPE_INT   && !v->type->is_unsigned) return 1;
-    else if (dst == RI4  && v->type->type == TYPE_LONG  && !v->type->is_unsigned) return 1;
-    else if (dst == RU1  && v->type->type == TYPE_CHAR  &&  v->type->is_unsigned) return 1;
-    else if (dst == RU2  && v->type->type == TYPE_SHORT &&  v->type->is_unsigned) return 1;
-    else if (dst == RU3  && v->type->type == TYPE_INT   &&  v->type->is_unsigned) return 1;
-    else if (dst == RU4  && v->type->type == TYPE_LONG  &&  v->type->is_unsigned) return 1;
-    else if (dst == MI1  && v->type->type == TYPE_CHAR  && !v->type->is_unsigned) return 1;
-    else if (dst == MI2  && v->type->type == TYPE_SHORT && !v->type->is_unsigned) return 1;
-    else if (dst == MI3  && v->type->type == TYPE_INT   && !v->type->is_unsigned) return 1;
-    else if (dst == MI4  && v->type->type == TYPE_LONG  && !v->type->is_unsigned) return 1;
-    else if (dst == MU1  && v->type->type == TYPE_CHAR  &&  v->type->is_unsigned) return 1;
-    else if (dst == MU2  && v->type->type == TYPE_SHORT &&  v->type->is_unsigned) return 1;
-    else if (dst == MU3  && v->type->type == TYPE_INT   &&  v->type->is_unsigned) return 1;
-    else if (dst == MU4  && v->type->type == TYPE_LONG  &&  v->type->is_unsigned) return 1;
-    else if (dst == RS3  && v->type->type == TYPE_FLOAT)                          return 1;
-    else if (dst == RS4  && v->type->type == TYPE_DOUBLE)                         return 1;
-    else if (dst == MS3  && v->type->type == TYPE_FLOAT)                          return 1;
-    else if (dst == MS4  && v->type->type == TYPE_DOUBLE)                         return 1;
-    else if (dst == RP1  && is_ptr && ptr_size == 1)                              return 1;
-    else if (dst == RP2  && is_ptr && ptr_size == 2)                              return 1;
-    else if (dst == RP3  && is_ptr && ptr_size == 3)                              return 1;
-    else if (dst == RP4  && is_ptr && ptr_size == 4)                              return 1;
-    else if (dst == RP5  && is_ptr && ptr_size == 8)                              return 1;
-    else if (dst == RPF  && is_ptr_to_function)                                   return 1;
-    else return 0;
+    else return (type_class_non_terminals(value_type_class(v)) >> dst) & 1;
 }
 
 // Return how many bytes a dereferenced pointer takes up
@@ -487,8 +481,7 @@ int make_x86_size_from_non_terminal(int nt) {
 void write_rule_coverage_file(void) {
     void *f = fopen(rule_coverage_file, "a");
 
-    for (int i = 0; i <= rule_coverage->max_value; i++)
-        if (rule_coverage->elements[i] == 1) fprintf(f, "%d\n", i);
+    set_foreach(rule_coverage, i) fprintf(f, "%d\n", i);
 
     fclose(f);
 }
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "wcc.h"
+
+// Interned strings. Each distinct string is stored once, so interned strings can be
+// compared by pointer. The hash and length are stored right before the string data.
+// The hash is the same FNV hash that strmaps use, so that a strmap keyed by
+// interned strings doesn't have to hash them again.
+//
+// Interned strings live until free_interned_strings() is called at the end of the
+// compilation, they must never be freed individually.
+
+enum {
+    INITIAL_SIZE    = 4096,
+    MAX_LOAD_FACTOR = 500,  // 0.5 * 1000
+};
+
+typedef struct interned_string {
+    unsigned int hash;
+    int length;
+} InternedString; // The string data follows the header
+
+static Arena *interned_strings_arena;
+static InternedString **interned_strings; // Open addressed hash table
+static int interned_strings_size;
+static int interned_strings_count;
+
+static void init_interned_strings(void) {
+    interned_strings_arena = new_arena();
+    interned_strings_size = INITIAL_SIZE;
+    interned_strings = wcalloc(INITIAL_SIZE, sizeof(InternedString *));
+    interned_strings_count = 0;
+}
+
+void free_interned_strings(void) {
+    if (!interned_strings) return;
+
+    free_arena(interned_strings_arena);
+    wfree(interned_strings);
+    interned_strings_arena = 0;
+    interned_strings = 0;
+}
+
+static void grow_interned_strings(void) {
+    int new_size = interned_strings_size * 2;
+    int mask = new_size - 1;
+    InternedString **new_interned_strings = wcalloc(new_size, sizeof(InternedString *));
+
+    for (int i = 0; i < interned_strings_size; i++) {
+        InternedString *is = interned_strings[i];
+        if (!is) continue;
+
+        unsigned int pos = is->hash & mask;
+        while (new_interned_strings[pos]) pos = (pos + 1) & mask;
+        new_interned_strings[pos] = is;
+    }
+
+    wfree(interned_strings);
+    interned_strings = new_interned_strings;
+    interned_strings_size = new_size;
+}
+
+// Intern the first length characters of str, which doesn't need to be null terminated
+char *intern_string(char *str, int length) {
+    if (!interned_strings) init_interned_strings();
+
+    // FNV hash function, the same as in strmap.c
+    unsigned int hash = 2166136261;
+    for (int i = 0; i < length; i++) hash = (hash ^ str[i]) * 16777619;
+
+    unsigned int mask = interned_strings_size - 1;
+    unsigned int pos = hash & mask;
+
+    InternedString *is;
+    while ((is = interned_strings[pos])) {
+        char *data = (char *) (is + 1);
+        if (is->hash == hash && is->length == length && !memcmp(data, str, length)) return data;
+        pos = (pos + 1) & mask;
+    }
+
+    is = arena_alloc(interned_strings_arena, sizeof(InternedString) + length + 1);
+    is->hash = hash;
+    is->length = length;
+    char *data = (char *) (is + 1);
+    memcpy(data, str, length);
+    data[length] = 0;
+
+    interned_strings[pos] = is;
+    interned_strings_count++;
+    if (interned_strings_count * 1000 >= interned_strings_size * MAX_LOAD_FACTOR) grow_interned_strings();
+
+    return data;
+}
+
+char *intern(char *str) {
+    return intern_string(str, strlen(str));
+}
+
+// Return the precomputed hash of an interned string
+unsigned int interned_string_hash(char *str) {
+    return ((InternedString *) str - 1)->hash;
+}
+
+// Return the precomputed length of an interned string
+int interned_string_length(char *str) {
+    return ((InternedString *) str - 1)->length;
+}
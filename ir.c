@@ -4,18 +4,6 @@
 
 #include "wcc.h"
 
-static List *allocated_tacs;
-static List *allocated_values;
-
-void init_ir(void) {
-    allocated_tacs = new_list(1024);
-}
-
-void free_ir(void) {
-    for (int i = 0; i < allocated_tacs->length; i++) wfree(allocated_tacs->elements[i]);
-    free_list(allocated_tacs);
-}
-
 // Allocate a new local variable or tempoary
 static int new_local_index(Function *function) {
     return -1 - function->local_symbol_count++;
@@ -28,22 +16,8 @@ void init_value(Value *v) {
     v->live_range = -1;
 }
 
-void init_value_allocations(void) {
-    allocated_values = new_list(1024);
-}
-
-void free_values(void) {
-    for (int i = 0; i < allocated_values->length; i++) {
-        Value *v = allocated_values->elements[i];
-        wfree(v);
-    }
-
-    free_list(allocated_values);
-}
-
 Value *new_value(void) {
-    Value *v = wcalloc(1, sizeof(Value));
-    append_to_list(allocated_values, v);
+    Value *v = arena_alloc(translation_unit_arena, sizeof(Value));
     init_value(v);
 
     return v;
@@ -91,8 +65,7 @@ void add_tac_to_ir(Tac *tac) {
 }
 
 Tac *new_instruction(int operation) {
-    Tac *tac = wcalloc(1, sizeof(Tac));
-    append_to_list(allocated_tacs, tac);
+    Tac *tac = arena_alloc(translation_unit_arena, sizeof(Tac));
     tac->operation = operation;
 
     return tac;
@@ -283,6 +256,14 @@ void print_instruction(void *f, Tac *tac, int expect_preg) {
     else if (o == IR_JMP)
         fprintf(f, "jmp l%d", tac->src1->label);
 
+    else if (o == IR_JMP_TABLE || o == X_JMP_TABLE) {
+        fprintf(f, "jmp table ");
+        print_value(f, tac->src1, 1);
+        fprintf(f, ", l%d [", tac->src2->label);
+        for (int i = 0; i < tac->src2->jump_table->count; i++) fprintf(f, "%sl%d", i ? ", " : "", tac->src2->jump_table->labels[i]);
+        fprintf(f, "]");
+    }
+
     else if (o == IR_PHI_FUNCTION) {
         fprintf(f, "Φ(");
         Value *v = tac->phi_values;
@@ -580,6 +561,12 @@ void renumber_labels(Function *function) {
         if (tac->src1 && tac->src1->label && !tac->src1->int_value) { tac->src1->label = mapping[tac->src1->label]; tac->src1->int_value = 1; }
         if (tac->src2 && tac->src2->label && !tac->src2->int_value) { tac->src2->label = mapping[tac->src2->label]; tac->src2->int_value = 1; }
         if (tac->label) tac->label = mapping[tac->label];
+
+        // The table value is shared by the instructions that use it, only rename the entries once
+        if (tac->operation == IR_JMP_TABLE || tac->operation == X_JMP_TABLE) {
+            JumpTable *jump_table = tac->src2->jump_table;
+            for (int i = 0; i < jump_table->count; i++) jump_table->labels[i] = mapping[jump_table->labels[i]];
+        }
     }
 
     for (Tac *tac = function->ir; tac; tac = tac->next) {
@@ -625,6 +612,14 @@ void merge_consecutive_labels(Function *function) {
         renumber_value(tac->dst);
         renumber_value(tac->src1);
         renumber_value(tac->src2);
+
+        if (tac->operation == IR_JMP_TABLE) {
+            JumpTable *jump_table = tac->src2->jump_table;
+            for (int i = 0; i < jump_table->count; i++) {
+                int replacement = (long) longmap_get(renumbers, jump_table->labels[i]);
+                if (replacement) jump_table->labels[i] = replacement;
+            }
+        }
     }
 
     free_longmap(renumbers);
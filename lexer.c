@@ -6,11 +6,21 @@
 #include "wcc.h"
 
 static char *input;             // Input file data
-static char input_is_freeable;  // Does the inut need to be freed when done?
+static char input_is_mapped;    // Does the input need to be unmapped when done?
 static int input_size;          // Size of the input file
 static int ip;                  // Offset into *input
+static char *identifier_buffer; // Scratch space for lexing identifiers
+static CppOutput *cpp_output;   // Preprocessor output tokens, when not lexing text
+static int cpp_output_index;    // Index of the next preprocessor output token
+static int cpp_output_line;     // Index of the line of the current preprocessor output token
+static StrMap *punctuators;     // Map of interned punctuators to their tokens, for preprocessor output tokens
 
 // Copies
+static char*         old_input;
+static int           old_input_size;
+static int           old_cpp_output_index;
+static int           old_cpp_output_line;
+static char*         old_cur_filename;
 static int           old_ip;
 static int           old_cur_line;
 static int           old_cur_token;
@@ -21,14 +31,14 @@ static long double   old_cur_long_double;
 static StringLiteral old_cur_string_literal;
 
 int cur_token;                     // Current token
-char *cur_identifier;              // Current identifier if the token is an identifier
+char *cur_identifier;              // Current identifier if the token is an identifier, interned
 char *cur_type_identifier;         // Identifier of the last parsed declarator
 Type *cur_lexer_type;              // A type determined by the lexer
 long cur_long;                     // Current long if the token is an integral type
 long double cur_long_double;       // Current long double if the token is a floating point type
 StringLiteral cur_string_literal;  // Current string literal if the token is a string literal
 
-char *cur_filename;             // Current filename being lexed
+char *cur_filename;             // Current filename being lexed, interned
 int cur_line;                   // Current line number being lexed
 
 static void init_lexer(void) {
@@ -36,7 +46,8 @@ static void init_lexer(void) {
 
     ip = 0;
     cur_line = 1;
-    cur_identifier = wmalloc(MAX_IDENTIFIER_SIZE);
+    cur_identifier = 0;
+    identifier_buffer = wmalloc(MAX_IDENTIFIER_SIZE);
     cur_string_literal.data = wmalloc(initial_size);
     cur_string_literal.allocated = initial_size;
 
@@ -44,36 +55,29 @@ static void init_lexer(void) {
 }
 
 void free_lexer(void) {
-    free_and_null(cur_filename);
-    free_and_null(cur_identifier);
-    if (input_is_freeable) wfree(input);
+    cur_filename = 0;
+    free_and_null(identifier_buffer);
+    cur_identifier = 0;
+    if (input_is_mapped) unmap_file(input, input_size);
+    input_is_mapped = 0;
+    cpp_output = 0;
+    if (punctuators) free_strmap(punctuators);
+    punctuators = 0;
     free_and_null(cur_string_literal.data);
 }
 
 void init_lexer_from_filename(char *filename) {
-    FILE *f  = fopen(filename, "r");
+    input = map_file(filename, &input_size);
 
-    if (f == 0) {
+    if (!input) {
         perror(filename);
         exit(1);
     }
 
-    fseek(f, 0, SEEK_END);
-    input_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    input = wmalloc(input_size + 1);
-    input_is_freeable = 1;
-    int read = fread(input, 1, input_size, f);
-    if (read != input_size) {
-        printf("Unable to read input file\n");
-        exit(1);
-    }
+    input_is_mapped = 1;
+    cpp_output = 0;
 
-    input[input_size] = 0;
-    fclose(f);
-
-    cur_filename = wstrdup(filename);
+    cur_filename = intern(filename);
 
     init_lexer();
 }
@@ -81,13 +85,136 @@ void init_lexer_from_filename(char *filename) {
 void init_lexer_from_string(char *string) {
     input = string;
     input_size = strlen(string);
-    input_is_freeable = 0;
+    input_is_mapped = 0;
+    cpp_output = 0;
+
+    cur_filename = 0;
+
+    init_lexer();
+}
+
+// Map the interned punctuator strings in preprocessor output tokens to their tokens
+static void init_punctuators(void) {
+    static struct { char *str; int token; } punctuator_tokens[] = {
+        {"(",   TOK_LPAREN},         {")",   TOK_RPAREN},            {"[",   TOK_LBRACKET},
+        {"]",   TOK_RBRACKET},       {"{",   TOK_LCURLY},            {"}",   TOK_RCURLY},
+        {",",   TOK_COMMA},          {";",   TOK_SEMI},              {"?",   TOK_TERNARY},
+        {":",   TOK_COLON},          {"&&",  TOK_AND},               {"||",  TOK_OR},
+        {"==",  TOK_DBL_EQ},         {"!=",  TOK_NOT_EQ},            {"<=",  TOK_LE},
+        {">=",  TOK_GE},             {"++",  TOK_INC},               {"--",  TOK_DEC},
+        {"+=",  TOK_PLUS_EQ},        {"-=",  TOK_MINUS_EQ},          {"*=",  TOK_MULTIPLY_EQ},
+        {"/=",  TOK_DIVIDE_EQ},      {"%=",  TOK_MOD_EQ},            {"&=",  TOK_BITWISE_AND_EQ},
+        {"|=",  TOK_BITWISE_OR_EQ},  {"^=",  TOK_BITWISE_XOR_EQ},    {"->",  TOK_ARROW},
+        {">>=", TOK_BITWISE_RIGHT_EQ}, {"<<=", TOK_BITWISE_LEFT_EQ}, {"...", TOK_ELLIPSES},
+        {">>",  TOK_BITWISE_RIGHT},  {"<<",  TOK_BITWISE_LEFT},      {"+",   TOK_PLUS},
+        {"-",   TOK_MINUS},          {"*",   TOK_MULTIPLY},          {"/",   TOK_DIVIDE},
+        {"%",   TOK_MOD},            {"=",   TOK_EQ},                {"<",   TOK_LT},
+        {">",   TOK_GT},             {"!",   TOK_LOGICAL_NOT},       {"~",   TOK_BITWISE_NOT},
+        {"&",   TOK_AMPERSAND},      {"|",   TOK_BITWISE_OR},        {"^",   TOK_XOR},
+        {".",   TOK_DOT},
+    };
+
+    punctuators = new_strmap();
+    for (int i = 0; i < sizeof(punctuator_tokens) / sizeof(punctuator_tokens[0]); i++)
+        strmap_put_interned(punctuators, intern(punctuator_tokens[i].str), (void *) (long) punctuator_tokens[i].token);
+}
+
+// Lex the preprocessor's output tokens, or its output text if it isn't tokens
+void init_lexer_from_cpp_output(CppOutput *output) {
+    if (output->text) {
+        init_lexer_from_string(output->text);
+        return;
+    }
+
+    if (!punctuators) init_punctuators();
+
+    input = "";
+    input_size = 0;
+    input_is_mapped = 0;
+    cpp_output = output;
+    cpp_output_index = 0;
+    cpp_output_line = 0;
 
     cur_filename = 0;
 
     init_lexer();
 }
 
+// Move on to the next preprocessor output token and set the filename and line number
+static CppOutputToken *advance_cpp_output_token(void) {
+    while (cpp_output_line + 1 < cpp_output->line_count && cpp_output->lines[cpp_output_line + 1].token_index <= cpp_output_index)
+        cpp_output_line++;
+
+    CppOutputLine *line = &cpp_output->lines[cpp_output_line];
+    cur_filename = line->filename;
+    cur_line = line->line_number;
+
+    return &cpp_output->tokens[cpp_output_index++];
+}
+
+// Continue lexing with the next preprocessor output token. Returns zero if there are
+// no more tokens. The token's string is lexed as text, with nothing in between.
+static int next_cpp_output_token(void) {
+    if (!cpp_output || cpp_output_index == cpp_output->token_count) return 0;
+
+    input = advance_cpp_output_token()->str;
+    input_size = strlen(input);
+    ip = 0;
+
+    return 1;
+}
+
+// Set the current token for an interned identifier, which can also be a keyword or a typedef
+static void finish_identifier(char *identifier) {
+    cur_token = lookup_keyword(identifier, interned_string_length(identifier));
+    cur_identifier = identifier;
+
+    if (cur_token == TOK_IDENTIFIER) {
+        // Lookup typedef by first going through the short list of known typedefs
+        // and if found, searching through the symbol table for it
+        for (int i = 0; i < all_typedefs_count; i++) {
+            if (all_typedefs[i]->identifier == cur_identifier) {
+                Symbol *symbol = lookup_symbol(cur_identifier, cur_scope, 1);
+                if (symbol && symbol->type->type == TYPE_TYPEDEF) {
+                    cur_token = TOK_TYPEDEF_TYPE;
+                    cur_lexer_type = dup_type(symbol->type->target);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// If the next preprocessor output token is an identifier or punctuator, make it the
+// current token. Their strings are interned, so they are looked up without lexing them
+// as text. Returns zero for other tokens, such as numbers and literals, which are lexed
+// as text.
+static int lex_cpp_output_token(void) {
+    if (!cpp_output || cpp_output_index == cpp_output->token_count) return 0;
+
+    CppOutputToken *token = &cpp_output->tokens[cpp_output_index];
+    if (token->kind == CPP_TOK_IDENTIFIER) {
+        advance_cpp_output_token();
+        finish_identifier(token->str);
+    }
+    else {
+        if (token->kind == CPP_TOK_NUMBER || token->kind == CPP_TOK_STRING_LITERAL || token->kind == CPP_TOK_EOF) return 0;
+
+        // Tokens glued with ## aren't necessarily punctuators
+        int punctuator = (long) strmap_get_interned(punctuators, token->str);
+        if (!punctuator) return 0;
+
+        advance_cpp_output_token();
+        cur_token = punctuator;
+    }
+
+    input = "";
+    input_size = 0;
+    ip = 0;
+
+    return 1;
+}
+
 static void skip_whitespace(void) {
     char *i = input;
 
@@ -271,6 +398,17 @@ void lex_single_string_literal(int *size) {
     cur_string_literal.data = (char *) data;
 }
 
+// If the current preprocessor output token has been lexed and the next one is a string
+// literal, continue with it, so that it's concatenated with the current string literal.
+static void next_cpp_output_string_literal(void) {
+    if (!cpp_output || ip < input_size || cpp_output_index == cpp_output->token_count) return;
+
+    // Character literals are string literal tokens too
+    CppOutputToken *token = &cpp_output->tokens[cpp_output_index];
+    char *str = token->str;
+    if (token->kind == CPP_TOK_STRING_LITERAL && (str[0] == '"' || (str[0] == 'L' && str[1] == '"'))) next_cpp_output_token();
+}
+
 void lex_string_literal(void) {
     char *i = input;
 
@@ -286,6 +424,8 @@ void lex_string_literal(void) {
         ip += 1;
         lex_single_string_literal(&size);
         skip_whitespace();
+        next_cpp_output_string_literal();
+        i = input;
     }
 
     finish_string_literal(size, is_wide_char);
@@ -293,8 +433,11 @@ void lex_string_literal(void) {
 
 // Lexer. Lex a next token or TOK_EOF if the file is ended
 void next(void) {
-    char *i = input;
-
+    old_input              = input;
+    old_input_size         = input_size;
+    old_cpp_output_index   = cpp_output_index;
+    old_cpp_output_line    = cpp_output_line;
+    old_cur_filename       = cur_filename;
     old_ip                 = ip;
     old_cur_line           = cur_line;
     old_cur_token          = cur_token;
@@ -304,11 +447,15 @@ void next(void) {
     old_cur_long_double    = cur_long_double;
     old_cur_string_literal = cur_string_literal;
 
-    while (ip < input_size) {
+    while (1) {
+        if (ip >= input_size && lex_cpp_output_token()) return;
+        if (ip >= input_size && !next_cpp_output_token()) break;
+
         skip_whitespace();
 
-        if (ip >= input_size) break;
+        if (ip >= input_size) continue;
 
+        char *i = input;
         int left = input_size - ip;
         char c1 = i[ip];
         char c2 = i[ip + 1];
@@ -377,7 +524,7 @@ void next(void) {
             cur_token = TOK_DOT;
         }
 
-        else if (i[ip] == '#') {
+        else if (i[ip] == '#' && !cpp_output) {
             // Lex # <num> "filename" ...
 
             ip++;
@@ -391,8 +538,7 @@ void next(void) {
             lex_single_string_literal(&size);
             finish_string_literal(size, 0);
 
-            if (cur_filename) free_and_null(cur_filename);
-            cur_filename = wstrdup(cur_string_literal.data);
+            cur_filename = intern(cur_string_literal.data);
             cur_line = cur_long - 1;
 
             while (ip < input_size && i[ip] != '\n') ip++; // Skip non-whitespace
@@ -464,75 +610,15 @@ void next(void) {
 
         // Identifier or keyword
         else if ((c1 >= 'a' && c1 <= 'z') || (c1 >= 'A' && c1 <= 'Z') || c1 == '_') {
-            cur_token = TOK_IDENTIFIER;
-
             int j = 0;
-            while (((i[ip] >= 'a' && i[ip] <= 'z') || (i[ip] >= 'A' && i[ip] <= 'Z') || (i[ip] >= '0' && i[ip] <= '9') || (i[ip] == '_')) && ip < input_size) {
+            while (ip < input_size && ((i[ip] >= 'a' && i[ip] <= 'z') || (i[ip] >= 'A' && i[ip] <= 'Z') || (i[ip] >= '0' && i[ip] <= '9') || (i[ip] == '_'))) {
                 if (j == MAX_IDENTIFIER_SIZE) panic("Exceeded maximum identifier size %d", MAX_IDENTIFIER_SIZE);
-                cur_identifier[j] = i[ip];
+                identifier_buffer[j] = i[ip];
                 j++; ip++;
             }
-            cur_identifier[j] = 0;
-
-                 if (!strcmp(cur_identifier, "if"           )) { cur_token = TOK_IF;        }
-            else if (!strcmp(cur_identifier, "else"         )) { cur_token = TOK_ELSE;      }
-            else if (!strcmp(cur_identifier, "signed"       )) { cur_token = TOK_SIGNED;    }
-            else if (!strcmp(cur_identifier, "__signed__"   )) { cur_token = TOK_SIGNED;    }
-            else if (!strcmp(cur_identifier, "unsigned"     )) { cur_token = TOK_UNSIGNED;  }
-            else if (!strcmp(cur_identifier, "char"         )) { cur_token = TOK_CHAR;      }
-            else if (!strcmp(cur_identifier, "short"        )) { cur_token = TOK_SHORT;     }
-            else if (!strcmp(cur_identifier, "int"          )) { cur_token = TOK_INT;       }
-            else if (!strcmp(cur_identifier, "long"         )) { cur_token = TOK_LONG;      }
-            else if (!strcmp(cur_identifier, "float"        )) { cur_token = TOK_FLOAT;     }
-            else if (!strcmp(cur_identifier, "double"       )) { cur_token = TOK_DOUBLE;    }
-            else if (!strcmp(cur_identifier, "void"         )) { cur_token = TOK_VOID;      }
-            else if (!strcmp(cur_identifier, "struct"       )) { cur_token = TOK_STRUCT;    }
-            else if (!strcmp(cur_identifier, "union"        )) { cur_token = TOK_UNION;     }
-            else if (!strcmp(cur_identifier, "typedef"      )) { cur_token = TOK_TYPEDEF;   }
-            else if (!strcmp(cur_identifier, "do"           )) { cur_token = TOK_DO;        }
-            else if (!strcmp(cur_identifier, "while"        )) { cur_token = TOK_WHILE;     }
-            else if (!strcmp(cur_identifier, "for"          )) { cur_token = TOK_FOR;       }
-            else if (!strcmp(cur_identifier, "continue"     )) { cur_token = TOK_CONTINUE;  }
-            else if (!strcmp(cur_identifier, "break"        )) { cur_token = TOK_BREAK;     }
-            else if (!strcmp(cur_identifier, "switch"       )) { cur_token = TOK_SWITCH;    }
-            else if (!strcmp(cur_identifier, "case"         )) { cur_token = TOK_CASE;      }
-            else if (!strcmp(cur_identifier, "default"      )) { cur_token = TOK_DEFAULT;   }
-            else if (!strcmp(cur_identifier, "return"       )) { cur_token = TOK_RETURN;    }
-            else if (!strcmp(cur_identifier, "enum"         )) { cur_token = TOK_ENUM;      }
-            else if (!strcmp(cur_identifier, "sizeof"       )) { cur_token = TOK_SIZEOF;    }
-            else if (!strcmp(cur_identifier, "__attribute__")) { cur_token = TOK_ATTRIBUTE; }
-            else if (!strcmp(cur_identifier, "packed"       )) { cur_token = TOK_PACKED;    }
-            else if (!strcmp(cur_identifier, "__packed__"   )) { cur_token = TOK_PACKED;    }
-            else if (!strcmp(cur_identifier, "aligned"      )) { cur_token = TOK_ALIGNED;   }
-            else if (!strcmp(cur_identifier, "__aligned__"  )) { cur_token = TOK_ALIGNED;   }
-            else if (!strcmp(cur_identifier, "__restrict"   )) { cur_token = TOK_RESTRICT;  }
-            else if (!strcmp(cur_identifier, "restrict"     )) { cur_token = TOK_RESTRICT;  }
-            else if (!strcmp(cur_identifier, "__asm__"      )) { cur_token = TOK_ASM;       }
-            else if (!strcmp(cur_identifier, "__extension__")) { cur_token = TOK_EXTENSION; }
-            else if (!strcmp(cur_identifier, "inline"       )) { cur_token = TOK_INLINE;    }
-            else if (!strcmp(cur_identifier, "__inline"     )) { cur_token = TOK_INLINE;    }
-            else if (!strcmp(cur_identifier, "auto"         )) { cur_token = TOK_AUTO;      }
-            else if (!strcmp(cur_identifier, "register"     )) { cur_token = TOK_REGISTER;  }
-            else if (!strcmp(cur_identifier, "static"       )) { cur_token = TOK_STATIC;    }
-            else if (!strcmp(cur_identifier, "extern"       )) { cur_token = TOK_EXTERN;    }
-            else if (!strcmp(cur_identifier, "const"        )) { cur_token = TOK_CONST;     }
-            else if (!strcmp(cur_identifier, "volatile"     )) { cur_token = TOK_VOLATILE;  }
-            else if (!strcmp(cur_identifier, "goto"         )) { cur_token = TOK_GOTO;      }
-
-            else {
-                // Lookup typedef by first going through the short list of known typedefs
-                // and if found, searching through the symbol table for it
-                for (j = 0; j < all_typedefs_count; j++) {
-                    if (!strcmp(all_typedefs[j]->identifier, cur_identifier)) {
-                        Symbol *symbol = lookup_symbol(cur_identifier, cur_scope, 1);
-                        if (symbol && symbol->type->type == TYPE_TYPEDEF) {
-                            cur_token = TOK_TYPEDEF_TYPE;
-                            cur_lexer_type = dup_type(symbol->type->target);
-                            break;
-                        }
-                    }
-                }
-            }
+            identifier_buffer[j] = 0;
+
+            finish_identifier(intern_string(identifier_buffer, j));
         }
 
         else
@@ -545,6 +631,11 @@ void next(void) {
 }
 
 void rewind_lexer(void) {
+    input              = old_input;
+    input_size         = old_input_size;
+    cpp_output_index   = old_cpp_output_index;
+    cpp_output_line    = old_cpp_output_line;
+    cur_filename       = old_cur_filename;
     ip                 = old_ip;
     cur_line           = old_cur_line;
     cur_token          = old_cur_token;
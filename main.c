@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/wait.h>
 
 #include "wcc.h"
 
@@ -18,11 +19,6 @@ void get_debug_env_value(char *key, int *val) {
     if ((env_value = getenv(key)) && !strcmp(env_value, "1")) *val = 1;
 }
 
-static char *get_as_binary(void) {
-    char *env_value = getenv("AS");
-    return env_value ? env_value : DEFAULT_AS_COMMAND;
-}
-
 static char *get_ld_binary(void) {
     char *env_value = getenv("LD");
     return env_value ? env_value : DEFAULT_LD_COMMAND;
@@ -156,6 +152,134 @@ static void add_library(char *library, List *cli_libraries, List *linker_inputs)
     append_to_list(cli_libraries, library);
 }
 
+// Assemble a .s file into an object file and return the result of system()
+static int run_assembler_command(char *command, char *input_filename, char *output_filename, int verbose) {
+    sprintf(command, "%s -64 %s -o %s", get_as_binary(), input_filename, output_filename);
+    if (verbose) {
+        sprintf(command, "%s %s", command, "-v");
+        printf("*%s\n", command);
+    }
+
+    return system(command);
+}
+
+// A compile and/or assemble job for one input file, run in a worker process
+typedef struct driver_job {
+    char *input_filename;
+    char *compiler_output_filename;     // Zero if the input is an assembly file
+    char *assembler_output_filename;    // Zero if the assembler isn't run
+    int output_object_file;             // The compiler makes the object file, without the assembler
+    int pid;                            // Zero if not started, -1 when finished
+    int exit_code;
+    FILE *stdout_log;                   // Captured stdout of the worker
+    FILE *stderr_log;                   // Captured stderr of the worker
+} DriverJob;
+
+static void copy_log(FILE *log, FILE *f) {
+    char buffer[4096];
+    fseek(log, 0, SEEK_SET);
+
+    int count;
+    while ((count = fread(buffer, 1, sizeof(buffer), log)) > 0) fwrite(buffer, 1, count, f);
+
+    fclose(log);
+}
+
+// Run the preprocessor, compiler and assembler for all jobs in up to job_count worker
+// processes. The output of each worker is captured and printed in input order once the
+// worker has finished, so that diagnostics don't interleave. Returns the exit code of
+// the first failing job, in input order.
+static int run_driver_jobs(
+        DriverJob *jobs, int count, int job_count, List *directive_cli_strings, char *command,
+        int print_filenames, int print_symbols, int print_stack_register_count, int verbose) {
+
+    int running = 0;
+    int started = 0;
+    int printed = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    while (printed < count) {
+        // Start as many jobs as allowed
+        while (started < count && running < job_count) {
+            DriverJob *job = &jobs[started++];
+
+            job->stdout_log = tmpfile();
+            job->stderr_log = tmpfile();
+            if (!job->stdout_log || !job->stderr_log) {
+                perror("in run_driver_jobs");
+                exit(1);
+            }
+
+            job->pid = fork();
+            if (job->pid == -1) {
+                perror("in run_driver_jobs");
+                exit(1);
+            }
+
+            if (!job->pid) {
+                dup2(fileno(job->stdout_log), 1);
+                dup2(fileno(job->stderr_log), 2);
+
+                if (job->compiler_output_filename || job->output_object_file) {
+                    char *compiler_output_filename = job->output_object_file ? job->assembler_output_filename : job->compiler_output_filename;
+                    init_memory_management_for_translation_unit();
+                    CppOutput *preprocessor_output = preprocess_to_tokens(job->input_filename, directive_cli_strings);
+                    if (print_filenames) printf("Compiling %s to %s\n", job->input_filename, compiler_output_filename);
+                    compile(preprocessor_output, job->input_filename, compiler_output_filename, job->output_object_file);
+                    if (print_symbols) dump_symbols();
+                    if (print_stack_register_count) printf("stack_register_count=%d\n", total_stack_register_count);
+                }
+
+                int result = 0;
+                if (job->assembler_output_filename && !job->output_object_file) {
+                    char *assembler_input_filename = job->compiler_output_filename ? job->compiler_output_filename : job->input_filename;
+                    if (print_filenames) printf("Assembling %s to %s\n", assembler_input_filename, job->assembler_output_filename);
+                    fflush(stdout);
+                    result = run_assembler_command(command, assembler_input_filename, job->assembler_output_filename, verbose);
+                }
+
+                fflush(stdout);
+                fflush(stderr);
+                _exit(result ? ((result >> 8) ? (result >> 8) : 1) : 0);
+            }
+
+            running++;
+        }
+
+        // Wait for a job to finish
+        int status;
+        int pid = wait(&status);
+        if (pid == -1) {
+            perror("in run_driver_jobs");
+            exit(1);
+        }
+
+        for (int i = 0; i < started; i++) {
+            if (jobs[i].pid != pid) continue;
+            jobs[i].pid = -1;
+            jobs[i].exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+            running--;
+        }
+
+        // Print the output of all finished jobs, in input order
+        while (printed < started && jobs[printed].pid == -1) {
+            copy_log(jobs[printed].stdout_log, stdout);
+            copy_log(jobs[printed].stderr_log, stderr);
+            printed++;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    for (int i = 0; i < count; i++)
+        if (jobs[i].exit_code) return jobs[i].exit_code;
+
+    return 0;
+}
+
 int main(int argc, char **argv) {
     print_ir1 = 0;
     print_ir2 = 0;
@@ -167,7 +291,11 @@ int main(int argc, char **argv) {
     opt_enable_live_range_coalescing = 1;
     opt_spill_furthest_liveness_end = 0;
     opt_short_lr_infinite_spill_costs = 1;
+    opt_rematerialize = 1;
+    opt_live_range_splitting = 1;
     opt_optimize_arithmetic_operations = 1;
+    opt_integrated_assembler = 1;
+    opt_integrated_cpp = 1;
     warn_integer_constant_too_large = 1;
     warn_assignment_types_incompatible = 1;
     warn_extern_initializer = 1;
@@ -187,6 +315,7 @@ int main(int argc, char **argv) {
     int is_shared = 0;
     int is_static = 0;
     int use_musl = 0;
+    int job_count = 1;      // Number of input files to compile in parallel
     const LibcConfig *libc = &GLIBC_CONFIG;
 
     char *output_filename = 0;
@@ -221,9 +350,25 @@ int main(int argc, char **argv) {
             else if (argc > 0 && !strcmp(argv[0], "-fno-live-range-coalescing"        )) { opt_enable_live_range_coalescing = 0;     argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "-fspill-furthest-liveness-end"     )) { opt_spill_furthest_liveness_end = 1;      argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "-fno-dont-spill-short-live-ranges" )) { opt_short_lr_infinite_spill_costs = 0;    argc--; argv++; }
+            else if (argc > 0 && !strcmp(argv[0], "-fno-rematerialize"                )) { opt_rematerialize = 0;                    argc--; argv++; }
+            else if (argc > 0 && !strcmp(argv[0], "-fno-live-range-splitting"         )) { opt_live_range_splitting = 0;             argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "-fno-optimize-arithmetic"          )) { opt_optimize_arithmetic_operations = 0;   argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "-fno-vreg-renumbering"             )) { opt_enable_vreg_renumbering = 0;          argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "-fcommon"                          )) { opt_enable_common_symbols = 1;            argc--; argv++; }
+            else if (argc > 0 && !strcmp(argv[0], "-fno-integrated-as"                )) { opt_integrated_assembler = 0;             argc--; argv++; }
+            else if (argc > 0 && !strcmp(argv[0], "-fno-integrated-cpp"               )) { opt_integrated_cpp = 0;                   argc--; argv++; }
+            else if (argc > 0 && !strncmp(argv[0], "-fregalloc=", 11)) {
+                if (!strcmp(argv[0] + 11, "graph-coloring"))
+                    opt_register_allocator = REGALLOC_GRAPH_COLORING;
+                else if (!strcmp(argv[0] + 11, "linear-scan"))
+                    opt_register_allocator = REGALLOC_LINEAR_SCAN;
+                else if (!strcmp(argv[0] + 11, "irc"))
+                    opt_register_allocator = REGALLOC_IRC;
+                else
+                    simple_error("Unknown register allocator %s", argv[0] + 11);
+                argc--; argv++;
+            }
+            else if (argc > 0 && !strcmp(argv[0], "--verify-against-as"               )) { opt_verify_against_as = 1;                argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--trigraphs"                       )) { opt_enable_trigraphs = 1;                 argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--print-rules"                     )) { print_instr_rules = 1;                    argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--print-filenames"                 )) { print_filenames = 1;                      argc--; argv++; }
@@ -260,6 +405,7 @@ int main(int argc, char **argv) {
             else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-dominance"                   )) { debug_ssa_dominance = 1;                    argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-idom"                        )) { debug_ssa_idom = 1;                         argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-dominance-frontiers"         )) { debug_ssa_dominance_frontiers = 1;          argc--; argv++; }
+            else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-loops"                       )) { debug_ssa_loops = 1;                        argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-phi-insertion"               )) { debug_ssa_phi_insertion = 1;                argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-phi-renumbering"             )) { debug_ssa_phi_renumbering = 1;              argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-ssa-live-range"                  )) { debug_ssa_live_range = 1;                   argc--; argv++; }
@@ -273,7 +419,7 @@ int main(int argc, char **argv) {
             else if (argc > 0 && !strcmp(argv[0], "--debug-instsel-tree-merging-deep"       )) { debug_instsel_tree_merging_deep = 1;        argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-instsel-igraph-simplification"   )) { debug_instsel_igraph_simplification = 1;    argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-instsel-tiling"                  )) { debug_instsel_tiling = 1;                   argc--; argv++; }
-            else if (argc > 0 && !strcmp(argv[0], "--debug-instsel-cost-graph"              )) { debug_instsel_cost_graph = 1;               argc--; argv++; }
+            else if (argc > 0 && !strcmp(argv[0], "--debug-instsel-states"                  )) { debug_instsel_states = 1;                   argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-instsel-spilling"                )) { debug_instsel_spilling = 1;                 argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-stack-frame-layout"              )) { debug_stack_frame_layout = 1;               argc--; argv++; }
             else if (argc > 0 && !strcmp(argv[0], "--debug-exit-after-parser"               )) { debug_exit_after_parser = 1;                argc--; argv++; }
@@ -314,6 +460,12 @@ int main(int argc, char **argv) {
                 argc -= 2;
                 argv += 2;
             }
+            else if (argc > 1 && !strcmp(argv[0], "-j")) {
+                job_count = atoi(argv[1]);
+                if (job_count < 1) simple_error("Invalid job count %s", argv[1]);
+                argc -= 2;
+                argv += 2;
+            }
             else if (argc > 1 && !strcmp(argv[0], "-D")) {
                 // -D ...
                 append_to_list(directive_cli_strings, argv[1]);
@@ -367,6 +519,17 @@ int main(int argc, char **argv) {
                 argc -= 1;
                 argv += 1;
             }
+            else if (argc > 1 && !strcmp(argv[0], "--backend-jobs")) {
+                opt_backend_jobs = atoi(argv[1]);
+                if (opt_backend_jobs < 1) simple_error("Invalid backend jobs count %s", argv[1]);
+                argc -= 2;
+                argv += 2;
+            }
+            else if (argc > 1 && !strcmp(argv[0], "--cpp-cache-dir")) {
+                opt_cpp_cache_dir = argv[1];
+                argc -= 2;
+                argv += 2;
+            }
             else if (argc > 1 && !strcmp(argv[0], "--rule-coverage-file")) {
                 rule_coverage_file = argv[1];
                 argc -= 2;
@@ -411,10 +574,14 @@ int main(int argc, char **argv) {
         printf("-L <path>                                   Pass library path to the linker\n");
         printf("-l <library>                                Pass library to the linker\n");
         printf("-v                                          Display the programs invoked by the compiler\n");
+        printf("-j <n>                                      Compile and assemble up to n input files in parallel\n");
         printf("-g                                          Add debugging information\n");
         printf("-O<n>                                       Set optimization level (ignored)\n");
         printf("-s                                          Output symbol table\n");
         printf("-fPIC                                       Make position independent code\n");
+        printf("-fno-integrated-as                          Assemble with the external assembler instead of making object files directly\n");
+        printf("-fno-integrated-cpp                         Lex the preprocessor's output as text instead of parsing its tokens directly\n");
+        printf("--verify-against-as                         Check that object files are the same as the external assembler's\n");
         printf("-static                                     Make a statically linked executable\n");
         printf("-shared                                     Make a shared library\n");
         printf("--libc glibc|musl                           Select the C library configuration\n");
@@ -435,9 +602,15 @@ int main(int argc, char **argv) {
         printf("-fno-live-range-coalescing                  Disable SSA live range coalescing\n");
         printf("-fspill-furthest-liveness-end               Spill liveness intervals that have the greatest end liveness interval\n");
         printf("-fno-dont-spill-short-live-ranges           Disable infinite spill costs for short live ranges\n");
+        printf("-fno-rematerialize                          Spill constants and addresses to the stack instead of recomputing them\n");
+        printf("-fno-live-range-splitting                   Spill live ranges everywhere instead of splitting them around loops and calls\n");
         printf("-fno-optimize-arithmetic                    Disable arithmetic optimizations\n");
         printf("-fno-vreg-renumbering                       Disable renumbering of vregs before live range coalesces\n");
+        printf("-fregalloc=graph-coloring|linear-scan|irc   Select the register allocator. Linear scan compiles faster,\n");
+        printf("                                            iterated register coalescing makes fewer spills and moves\n");
         printf("--trigraphs                                 Enable preprocessing of trigraphs\n");
+        printf("--cpp-cache-dir <dir>                       Cache preprocessed include files in dir\n");
+        printf("--backend-jobs <n>                          Compile functions in n parallel worker processes\n");
         printf("\n");
         printf("Warning and error flags:\n");
         printf("-Werror                                     Treat all warnings as errors\n");
@@ -457,6 +630,7 @@ int main(int argc, char **argv) {
         printf("--debug-ssa-cfg\n");
         printf("--debug-ssa-dominance\n");
         printf("--debug-ssa-dominance-frontiers\n");
+        printf("--debug-ssa-loops\n");
         printf("--debug-ssa-phi-insertion\n");
         printf("--debug-ssa-phi-renumbering\n");
         printf("--debug-ssa-live-range\n");
@@ -470,7 +644,7 @@ int main(int argc, char **argv) {
         printf("--debug-instsel-tree-merging-deep\n");
         printf("--debug-instsel-igraph-simplification\n");
         printf("--debug-instsel-tiling\n");
-        printf("--debug-instsel-cost-graph\n");
+        printf("--debug-instsel-states\n");
         printf("--debug-instsel-spilling\n");
         printf("--debug-stack-frame-layout\n");
         printf("--debug-exit-after-parser\n");
@@ -489,6 +663,7 @@ int main(int argc, char **argv) {
     get_debug_env_value("DEBUG_SSA_DOMINANCE", &debug_ssa_dominance);
     get_debug_env_value("DEBUG_SSA_IDOM", &debug_ssa_idom);
     get_debug_env_value("DEBUG_SSA_DOMINANCE_FRONTIERS", &debug_ssa_dominance_frontiers);
+    get_debug_env_value("DEBUG_SSA_LOOPS", &debug_ssa_loops);
     get_debug_env_value("DEBUG_SSA_PHI_INSERTION", &debug_ssa_phi_insertion);
     get_debug_env_value("DEBUG_SSA_PHI_RENUMBERING", &debug_ssa_phi_renumbering);
     get_debug_env_value("DEBUG_SSA_LIVE_RANGE", &debug_ssa_live_range);
@@ -502,7 +677,7 @@ int main(int argc, char **argv) {
     get_debug_env_value("DEBUG_INSTSEL_TREE_MERGING_DEEP", &debug_instsel_tree_merging_deep);
     get_debug_env_value("DEBUG_INSTSEL_IGRAPH_SIMPLIFICATION", &debug_instsel_igraph_simplification);
     get_debug_env_value("DEBUG_INSTSEL_TILING", &debug_instsel_tiling);
-    get_debug_env_value("DEBUG_INSTSEL_COST_GRAPH", &debug_instsel_cost_graph);
+    get_debug_env_value("DEBUG_INSTSEL_STATES", &debug_instsel_states);
     get_debug_env_value("DEBUG_INSTSEL_SPILLING", &debug_instsel_spilling);
     get_debug_env_value("DEBUG_STACK_FRAME_LAYOUT", &debug_stack_frame_layout);
 
@@ -556,6 +731,10 @@ int main(int argc, char **argv) {
 
     char *command = wmalloc(1024 * 100);
 
+    // Object files are made directly, except with debug symbols, which need the
+    // external assembler for the line number table
+    int use_integrated_assembler = run_assembler && opt_integrated_assembler && !opt_debug_symbols;
+
     List *compiler_input_filenames = new_list(input_filenames->length);
     char **assembler_input_filenames = wcalloc(input_filenames->length, sizeof(char *));
     char **linker_input_filenames = wcalloc(input_filenames->length, sizeof(char *));
@@ -573,6 +752,55 @@ int main(int argc, char **argv) {
         goto exit_main;
     }
 
+    // Preprocessing, compilation and assembly of all input files in parallel
+    if (job_count > 1 && input_filenames->length > 1 && !debug_exit_after_parser) {
+        DriverJob *jobs = wcalloc(input_filenames->length, sizeof(DriverJob));
+        int count = 0;
+
+        for (int i = 0; i < input_filenames->length; i++) {
+            char *input_filename = input_filenames->elements[i];
+
+            // Object files need to be at the end
+            if (is_object_file(input_filename)) continue;
+            if (is_assembly_file(input_filename) && !run_assembler) continue;
+
+            DriverJob *job = &jobs[count++];
+            job->input_filename = input_filename;
+
+            if (!is_assembly_file(input_filename)) {
+                if (use_integrated_assembler)
+                    job->output_object_file = 1;
+                else
+                    job->compiler_output_filename =
+                        !run_assembler && !run_linker ? replace_extension(input_filename, "s")
+                        : make_temp_filename("/tmp/XXXXXX.s");
+            }
+
+            if (run_assembler) {
+                job->assembler_output_filename =
+                    !run_linker ? replace_extension(input_filename, "o")
+                    : make_temp_filename("/tmp/XXXXXX.o");
+            }
+
+            assembler_input_filenames[i] = job->compiler_output_filename ? job->compiler_output_filename : wstrdup(input_filename);
+            if (run_linker)
+                linker_input_filenames[i] = job->assembler_output_filename;
+            else if (job->assembler_output_filename)
+                append_to_list(compiler_input_filenames, job->assembler_output_filename);
+        }
+
+        exit_code = run_driver_jobs(
+            jobs, count, job_count, directive_cli_strings, command,
+            print_filenames, print_symbols, print_stack_register_count, verbose);
+
+        for (int i = 0; i < compiler_input_filenames->length; i++) wfree(compiler_input_filenames->elements[i]);
+        wfree(jobs);
+
+        if (exit_code) goto exit_main;
+
+        goto link;
+    }
+
     // Preprocessing + compilation phase
     for (int i = 0; i < input_filenames->length; i++) {
         char *input_filename = input_filenames->elements[i];
@@ -586,17 +814,25 @@ int main(int argc, char **argv) {
         if (is_object_file(input_filename)) continue;
 
         init_memory_management_for_translation_unit();
-        char *preprocessor_output = preprocess(input_filename, directive_cli_strings);
+        CppOutput *preprocessor_output = preprocess_to_tokens(input_filename, directive_cli_strings);
 
-        char *compiler_output_filename =
-            !run_assembler && !run_linker ? (output_filename ? wstrdup(output_filename) : replace_extension(input_filename, "s"))
-            : make_temp_filename("/tmp/XXXXXX.s");
+        char *compiler_output_filename;
+        if (use_integrated_assembler)
+            compiler_output_filename =
+                !run_linker ? (output_filename ? wstrdup(output_filename) : replace_extension(input_filename, "o"))
+                : make_temp_filename("/tmp/XXXXXX.o");
+        else
+            compiler_output_filename =
+                !run_assembler && !run_linker ? (output_filename ? wstrdup(output_filename) : replace_extension(input_filename, "s"))
+                : make_temp_filename("/tmp/XXXXXX.s");
 
         if (print_filenames) printf("Compiling %s to %s\n", input_filename, compiler_output_filename);
 
-        compile(preprocessor_output, input_filename, compiler_output_filename);
+        compile(preprocessor_output, input_filename, compiler_output_filename, use_integrated_assembler);
 
-        if (run_assembler)
+        if (use_integrated_assembler && run_linker)
+            linker_input_filenames[i] = compiler_output_filename;
+        else if (run_assembler && !use_integrated_assembler)
             assembler_input_filenames[i] = compiler_output_filename;
         else
             wfree(compiler_output_filename);
@@ -605,7 +841,7 @@ int main(int argc, char **argv) {
         if (print_stack_register_count) printf("stack_register_count=%d\n", total_stack_register_count);
 
         free_memory_for_translation_unit();
-        wfree(preprocessor_output);
+        free_cpp_output(preprocessor_output);
         free_cpp_allocated_garbage();
 
         if (debug_exit_after_parser) goto exit_main;
@@ -618,17 +854,12 @@ int main(int argc, char **argv) {
             if (!input_filename) continue;
 
             char *assembler_output_filename =
-                !run_linker ? (output_filename ? wstrdup(output_filename) : replace_extension(single_target ? input_filenames->elements[0] : input_filename, "o"))
+                !run_linker ? (output_filename ? wstrdup(output_filename) : replace_extension(input_filenames->elements[i], "o"))
                 : make_temp_filename("/tmp/XXXXXX.o");
 
             if (print_filenames) printf("Assembling %s to %s\n", input_filename, assembler_output_filename);
 
-            sprintf(command, "%s -64 %s -o %s", get_as_binary(), input_filename, assembler_output_filename);
-            if (verbose) {
-                sprintf(command, "%s %s", command, "-v");
-                printf("*%s\n", command);
-            }
-            int result = system(command);
+            int result = run_assembler_command(command, input_filename, assembler_output_filename, verbose);
 
             if (result != 0) exit(result >> 8);
 
@@ -639,6 +870,7 @@ int main(int argc, char **argv) {
         }
     }
 
+link:
     // Preprocessing + compilation phase
     for (int i = 0; i < input_filenames->length; i++) {
         char *input_filename = input_filenames->elements[i];
@@ -711,6 +943,7 @@ exit_main:
     free_instruction_selection_rules();
 
     free_cpp_allocated_garbage();
+    free_interned_strings();
     free_list(compiler_input_filenames);
 
     for (int i = 0; i < input_filenames->length; i++) if (assembler_input_filenames[i])
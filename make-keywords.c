@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generate a perfect hash table for the keywords recognized by the lexer. The
+// hash is made out of the length and the first, middle and last characters of
+// an identifier. Coefficients are searched for until all keywords land in separate
+// slots, so that a lookup is a single probe followed by one string compare.
+
+typedef struct keyword {
+    char *identifier;
+    char *token;
+} Keyword;
+
+static Keyword keywords[] = {
+    { "if",            "TOK_IF"        },
+    { "else",          "TOK_ELSE"      },
+    { "signed",        "TOK_SIGNED"    },
+    { "__signed__",    "TOK_SIGNED"    },
+    { "unsigned",      "TOK_UNSIGNED"  },
+    { "char",          "TOK_CHAR"      },
+    { "short",         "TOK_SHORT"     },
+    { "int",           "TOK_INT"       },
+    { "long",          "TOK_LONG"      },
+    { "float",         "TOK_FLOAT"     },
+    { "double",        "TOK_DOUBLE"    },
+    { "void",          "TOK_VOID"      },
+    { "struct",        "TOK_STRUCT"    },
+    { "union",         "TOK_UNION"     },
+    { "typedef",       "TOK_TYPEDEF"   },
+    { "do",            "TOK_DO"        },
+    { "while",         "TOK_WHILE"     },
+    { "for",           "TOK_FOR"       },
+    { "continue",      "TOK_CONTINUE"  },
+    { "break",         "TOK_BREAK"     },
+    { "switch",        "TOK_SWITCH"    },
+    { "case",          "TOK_CASE"      },
+    { "default",       "TOK_DEFAULT"   },
+    { "return",        "TOK_RETURN"    },
+    { "enum",          "TOK_ENUM"      },
+    { "sizeof",        "TOK_SIZEOF"    },
+    { "__attribute__", "TOK_ATTRIBUTE" },
+    { "packed",        "TOK_PACKED"    },
+    { "__packed__",    "TOK_PACKED"    },
+    { "aligned",       "TOK_ALIGNED"   },
+    { "__aligned__",   "TOK_ALIGNED"   },
+    { "__restrict",    "TOK_RESTRICT"  },
+    { "restrict",      "TOK_RESTRICT"  },
+    { "__asm__",       "TOK_ASM"       },
+    { "__extension__", "TOK_EXTENSION" },
+    { "inline",        "TOK_INLINE"    },
+    { "__inline",      "TOK_INLINE"    },
+    { "auto",          "TOK_AUTO"      },
+    { "register",      "TOK_REGISTER"  },
+    { "static",        "TOK_STATIC"    },
+    { "extern",        "TOK_EXTERN"    },
+    { "const",         "TOK_CONST"     },
+    { "volatile",      "TOK_VOLATILE"  },
+    { "goto",          "TOK_GOTO"      },
+    { 0, 0 },
+};
+
+#define MAX_COEFFICIENT 64
+
+static int hash(char *identifier, int first_coefficient, int middle_coefficient, int last_coefficient, int size) {
+    int length = strlen(identifier);
+    return (length + identifier[0] * first_coefficient + identifier[length >> 1] * middle_coefficient + identifier[length - 1] * last_coefficient) & (size - 1);
+}
+
+// Try a set of coefficients. Returns 1 and fills slots if there are no collisions.
+static int try_coefficients(int first_coefficient, int middle_coefficient, int last_coefficient, int size, Keyword **slots) {
+    memset(slots, 0, size * sizeof(Keyword *));
+
+    for (Keyword *k = keywords; k->identifier; k++) {
+        int h = hash(k->identifier, first_coefficient, middle_coefficient, last_coefficient, size);
+        if (slots[h]) return 0;
+        slots[h] = k;
+    }
+
+    return 1;
+}
+
+static void output_table(int first_coefficient, int middle_coefficient, int last_coefficient, int size, Keyword **slots) {
+    printf("// Generated by make-keywords\n\n");
+    printf("#include <string.h>\n\n");
+    printf("#include \"wcc.h\"\n\n");
+
+    printf("static char *keyword_identifiers[%d] = {\n", size);
+    for (int i = 0; i < size; i++) {
+        if (slots[i])
+            printf("    \"%s\",\n", slots[i]->identifier);
+        else
+            printf("    0,\n");
+    }
+    printf("};\n\n");
+
+    printf("static int keyword_tokens[%d] = {\n", size);
+    for (int i = 0; i < size; i++) printf("    %s,\n", slots[i] ? slots[i]->token : "TOK_IDENTIFIER");
+    printf("};\n\n");
+
+    printf("// Return the token for a keyword, or TOK_IDENTIFIER if identifier isn't one\n");
+    printf("int lookup_keyword(char *identifier, int length) {\n");
+    printf("    int hash = (length + identifier[0] * %d + identifier[length >> 1] * %d + identifier[length - 1] * %d) & %d;\n",
+        first_coefficient, middle_coefficient, last_coefficient, size - 1);
+    printf("    char *keyword = keyword_identifiers[hash];\n");
+    printf("    if (keyword && !strcmp(keyword, identifier)) return keyword_tokens[hash];\n");
+    printf("    return TOK_IDENTIFIER;\n");
+    printf("}\n");
+}
+
+int main(int argc, char **argv) {
+    for (int size = 64; size <= 1024; size *= 2) {
+        Keyword **slots = malloc(size * sizeof(Keyword *));
+
+        for (int a = 1; a < MAX_COEFFICIENT; a++)
+            for (int b = 1; b < MAX_COEFFICIENT; b++)
+                for (int c = 1; c < MAX_COEFFICIENT; c++)
+                    if (try_coefficients(a, b, c, size, slots)) {
+                        output_table(a, b, c, size, slots);
+                        exit(0);
+                    }
+
+        free(slots);
+    }
+
+    fprintf(stderr, "Unable to find a perfect hash for the keywords\n");
+    exit(1);
+}
@@ -12,10 +12,14 @@ static long peak_allocation = 0;
 static long current_allocation = 0;
 static int allocation_count = 0;
 static int free_count = 0;
+static long arena_allocation_count = 0;
+static long arena_chunk_count = 0;
 
 int print_heap_usage;
 int fail_on_leaked_memory;
 
+Arena *translation_unit_arena;
+
 #ifndef __linux__
 // malloc_usable_size is linux specific
 size_t malloc_usable_size(void * ptr) {
@@ -105,6 +109,73 @@ void wfree(void *ptr) {
     free(ptr);
 }
 
+// Arenas hand out memory from large chunks by bumping a pointer. Individual
+// allocations can't be freed, the whole arena is released at once with free_arena().
+// Chunks come from wcalloc(), so they are included in the heap usage stats and the
+// leak check.
+Arena *new_arena(void) {
+    return wcalloc(1, sizeof(Arena));
+}
+
+static ArenaChunk *new_arena_chunk(long size) {
+    ArenaChunk *chunk = wcalloc(1, sizeof(ArenaChunk) + size);
+    chunk->data = (char *) chunk + sizeof(ArenaChunk);
+    chunk->size = size;
+    arena_chunk_count++;
+
+    return chunk;
+}
+
+// Allocate zeroed memory from an arena
+void *arena_alloc(Arena *arena, size_t size) {
+    if (!size) return NULL;
+
+    // Keep everything 16 byte aligned, as malloc does
+    size = (size + 15) & ~15;
+    arena_allocation_count++;
+
+    ArenaChunk *chunk = arena->chunks;
+    if (chunk && chunk->used + size <= chunk->size) {
+        void *result = chunk->data + chunk->used;
+        chunk->used += size;
+        return result;
+    }
+
+    // Large allocations get their own chunk, which goes behind the current one, so
+    // that the space left in the current one isn't wasted.
+    if (size > ARENA_CHUNK_SIZE / 4) {
+        ArenaChunk *large_chunk = new_arena_chunk(size);
+        large_chunk->used = size;
+
+        if (chunk) {
+            large_chunk->next = chunk->next;
+            chunk->next = large_chunk;
+        }
+        else
+            arena->chunks = large_chunk;
+
+        return large_chunk->data;
+    }
+
+    chunk = new_arena_chunk(ARENA_CHUNK_SIZE);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    chunk->used = size;
+
+    return chunk->data;
+}
+
+void free_arena(Arena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        wfree(chunk);
+        chunk = next;
+    }
+
+    wfree(arena);
+}
+
 static void print_human_readable_value(long value) {
     if (value < 0) {
         printf("-");
@@ -131,6 +202,10 @@ void process_memory_allocation_stats(void) {
         print_human_readable_value(free_count);       printf(" frees, ");
         print_human_readable_value(total_allocation); printf(" bytes allocated, ");
         print_human_readable_value(peak_allocation); printf(" bytes peak usage\n");
+
+        printf("Arena usage: ");
+        print_human_readable_value(arena_allocation_count); printf(" allocs in ");
+        print_human_readable_value(arena_chunk_count);      printf(" chunks\n");
     }
 
    if (fail_on_leaked_memory && current_allocation) {
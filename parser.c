@@ -7,11 +7,20 @@
 
 #define INITIAL_INITALIZERS_COUNT 32
 
+#define SWITCH_LINEAR_CASE_COUNT  4 // Switches with fewer cases are a linear chain of comparisons
+#define SWITCH_JUMP_TABLE_DENSITY 3 // Max jump table entries per case
+
 typedef struct base_type {
     Type *type;
     int storage_class;
 } BaseType;
 
+typedef struct switch_case {
+    Value *value; // Case constant
+    long key;     // Case constant converted to the promoted type of the controlling expression
+    Value *label; // Destination of the case
+} SwitchCase;
+
 typedef struct goto_backpatch {
     char *identifier;
     Tac *ir;
@@ -34,8 +43,7 @@ Symbol *memset_symbol;
 
 Value *controlling_case_value;  // Controlling value for the current switch statement
 LongMap *case_values;           // Already seen case value in current switch statement
-Tac *case_ir_start;             // Start of IR for current switch case conditional & jump statements
-Tac *case_ir;                   // IR for current switch case conditional & jump statements
+List *switch_cases;             // SwitchCase entries of the current switch statement
 Value *case_default_label;      // Label for curren't switch's statement default case, if present
 int seen_switch_default;        // Set to 1 if a default label has been seen within the current switch statement
 
@@ -695,7 +703,7 @@ static Type *parse_function_type(void) {
             }
             else {
                 type = new_type(TYPE_INT);
-                cur_type_identifier = parser_wstrdup(cur_identifier);
+                cur_type_identifier = cur_identifier;
                 next();
             }
 
@@ -803,7 +811,7 @@ Type *parse_direct_declarator(void) {
         // Set cur_type_identifier only once. The caller is expected to set
         // cur_type_identifier to zero. This way, the first parsed identifier
         // is kept.
-        if (!cur_type_identifier) cur_type_identifier = parser_wstrdup(cur_identifier);
+        if (!cur_type_identifier) cur_type_identifier = cur_identifier;
         next();
     }
 
@@ -929,7 +937,7 @@ static Type *parse_struct_or_union_type_specifier(void) {
     // A typedef identifier be the same as a struct tag, in this context, the lexer
     // sees a typedef tag, but really it's a struct tag.
     if (cur_token == TOK_IDENTIFIER || cur_token == TOK_TYPEDEF_TYPE) {
-        identifier = parser_wstrdup(cur_identifier);
+        identifier = cur_identifier;
         next();
     }
 
@@ -1025,7 +1033,7 @@ static Type *parse_struct_or_union_type_specifier(void) {
 
         // Didn't find a struct, but that's ok, create a incomplete one
         // to be populated later when it's defined.
-        type = new_struct_or_union(parser_wstrdup(identifier));
+        type = new_struct_or_union(identifier);
         StructOrUnion *s = type->struct_or_union_desc;
         s->is_incomplete = 1;
 
@@ -1046,9 +1054,9 @@ static Type *parse_enum_type_specifier(void) {
     // A typedef identifier be the same as a struct tag, in this context, the lexer
     // sees a typedef tag, but really it's a struct tag.
     if (cur_token == TOK_IDENTIFIER || cur_token == TOK_TYPEDEF_TYPE) {
-        identifier = parser_wstrdup(cur_identifier);
+        identifier = cur_identifier;
 
-        Tag *tag = new_tag(parser_wstrdup(cur_identifier));
+        Tag *tag = new_tag(cur_identifier);
         tag->type = type;
         type->tag = tag;
 
@@ -1067,14 +1075,14 @@ static Type *parse_enum_type_specifier(void) {
 
         while (cur_token != TOK_RCURLY) {
             expect(TOK_IDENTIFIER, "identifier");
-            char *enum_value_identifier = parser_wstrdup(cur_identifier);
+            char *enum_value_identifier = cur_identifier;
             next();
             if (cur_token == TOK_EQ) {
                 next();
                 value = parse_constant_integer_expression(0)->int_value;
             }
 
-            Symbol *s = new_symbol(parser_wstrdup(enum_value_identifier));
+            Symbol *s = new_symbol(enum_value_identifier);
             s->is_enum_value = 1;
             s->type = new_type(TYPE_INT);
             s->value = value++;
@@ -1148,13 +1156,12 @@ static void indirect(void) {
     push(dst);
 }
 
-// Search for a struct member. Panics if it doesn't exist
+// Search for a struct member by its interned identifier. Panics if it doesn't exist
 StructOrUnionMember *lookup_struct_or_union_member(Type *type, char *identifier) {
     StructOrUnionMember **pmember = type->struct_or_union_desc->members;
 
     while (*pmember) {
-        char *member_identifier = (*pmember)->identifier;
-        if (member_identifier && !strcmp(member_identifier, identifier)) return *pmember;
+        if ((*pmember)->identifier == identifier) return *pmember;
         pmember++;
     }
 
@@ -2399,7 +2406,7 @@ static void parse_function_call(void) {
 static Value *parse_va_list() {
     parse_expression(TOK_EQ);
     Value *va_list = pop();
-    Type *struct_or_union = find_struct_or_union("__va_list", 0, 1);
+    Type *struct_or_union = find_struct_or_union(intern("__va_list"), 0, 1);
     Type *wcc_va_list_array_type = make_array(struct_or_union, 1);
     Type *wcc_va_list_pointer_type = make_pointer(struct_or_union);
     if (!types_are_compatible(va_list->type, wcc_va_list_array_type) && !types_are_compatible(va_list->type, wcc_va_list_pointer_type))
@@ -3236,6 +3243,115 @@ static void parse_compound_statement(void) {
     consume(TOK_RCURLY, "}");
 }
 
+// Convert a case value to the promoted type of the controlling expression.
+static long promote_case_value(long value, Type *type) {
+    if (type->type != TYPE_INT) return value;
+    if (type->is_unsigned) return (unsigned int) value;
+    return (int) value;
+}
+
+static int signed_switch_case_cmpfunc(const void *a, const void *b) {
+    long key1 = (*((SwitchCase **) a))->key;
+    long key2 = (*((SwitchCase **) b))->key;
+
+    return key1 < key2 ? -1 : key1 > key2;
+}
+
+static int unsigned_switch_case_cmpfunc(const void *a, const void *b) {
+    unsigned long key1 = (*((SwitchCase **) a))->key;
+    unsigned long key2 = (*((SwitchCase **) b))->key;
+
+    return key1 < key2 ? -1 : key1 > key2;
+}
+
+static Value *new_switch_constant(Type *type, long value) {
+    Value *v = new_integral_constant(type->type, type->type == TYPE_INT && type->is_unsigned ? (unsigned int) value : value);
+    v->type = dup_type(type);
+
+    return v;
+}
+
+// Compare the controlling value with each case in turn
+static void add_switch_linear_jumps(SwitchCase **cases, int count) {
+    for (int i = 0; i < count; i++) {
+        push(cases[i]->value);
+        push(controlling_case_value);
+        arithmetic_operation(IR_EQ, controlling_case_value->type);
+        add_conditional_jump(IR_JNZ, cases[i]->label);
+    }
+}
+
+// Jump through a table indexed by the controlling value minus the lowest case value.
+// Values outside of the table's range go to default_label, as do the holes in the table.
+static void add_switch_jump_table(SwitchCase **cases, int count, Value *promoted_value, Value *default_label) {
+    Type *index_type = dup_type(promoted_value->type);
+    index_type->is_unsigned = 1;
+
+    long min = cases[0]->key;
+    int size = (unsigned long) cases[count - 1]->key - min + 1;
+
+    Value *index = promoted_value;
+    if (min) {
+        push(index);
+        push(new_switch_constant(promoted_value->type, min));
+        arithmetic_operation(IR_SUB, 0);
+        index = pl();
+    }
+
+    // Unsigned comparison, so that values below min end up above the range as well
+    index = integer_type_change(index, index_type);
+    push(index);
+    push(new_switch_constant(index_type, size - 1));
+    arithmetic_operation(IR_GT, new_type(TYPE_INT));
+    add_conditional_jump(IR_JNZ, default_label);
+
+    if (index_type->type != TYPE_LONG) {
+        Type *long_index_type = new_type(TYPE_LONG);
+        long_index_type->is_unsigned = 1;
+        index = integer_type_change(index, long_index_type);
+    }
+
+    JumpTable *jump_table = arena_alloc(translation_unit_arena, sizeof(JumpTable));
+    jump_table->count = size;
+    jump_table->labels = arena_alloc(translation_unit_arena, size * sizeof(int));
+    for (int i = 0; i < size; i++) jump_table->labels[i] = default_label->label;
+    for (int i = 0; i < count; i++) jump_table->labels[cases[i]->key - min] = cases[i]->label->label;
+
+    Value *table = new_label_dst();
+    table->jump_table = jump_table;
+    add_parser_instruction(IR_JMP_TABLE, 0, index, table);
+}
+
+// Lower sorted cases to a jump table if they are dense enough. Otherwise, split them
+// in two halves with a comparison, recursing into each half. Small sets of cases are
+// compared one by one. Falls through if none of the cases match.
+static void add_switch_case_jumps(SwitchCase **cases, int count, Value *promoted_value, Value *default_label) {
+    if (count < SWITCH_LINEAR_CASE_COUNT) {
+        add_switch_linear_jumps(cases, count);
+        return;
+    }
+
+    unsigned long range = (unsigned long) cases[count - 1]->key - cases[0]->key;
+    if (range < (unsigned long) count * SWITCH_JUMP_TABLE_DENSITY) {
+        add_switch_jump_table(cases, count, promoted_value, default_label);
+        return;
+    }
+
+    int mid = count / 2;
+    Value *lower_label = new_label_dst();
+
+    push(promoted_value);
+    push(new_switch_constant(promoted_value->type, cases[mid]->key));
+    arithmetic_operation(IR_LT, new_type(TYPE_INT));
+    add_conditional_jump(IR_JNZ, lower_label);
+
+    add_switch_case_jumps(&cases[mid], count - mid, promoted_value, default_label);
+    add_parser_instruction(IR_JMP, 0, default_label, 0);
+
+    add_jmp_target_instruction(lower_label);
+    add_switch_case_jumps(cases, mid, promoted_value, default_label);
+}
+
 static void parse_switch_statement(void) {
     next();
 
@@ -3243,16 +3359,14 @@ static void parse_switch_statement(void) {
     parse_expression(TOK_COMMA);
     consume(TOK_RPAREN, ")");
 
-    // Maintain two IRs:
-    // - ir has all the statement code and is used as normal
-    // - case_ir has all the case comparison and jump statements
+    // The statement code is parsed first, recording the cases. The case comparison
+    // and jump instructions are then added before the statement code.
 
-    Tac *old_case_ir_start            = case_ir_start;
-    Tac *old_case_ir                  = case_ir;
     Value *old_case_default_label     = case_default_label;
     Value *old_loop_break_dst         = cur_loop_break_dst;
     Value *old_controlling_case_value = controlling_case_value;
     LongMap *old_case_values          = case_values;
+    List *old_switch_cases            = switch_cases;
     int old_seen_switch_default       = seen_switch_default;
 
     controlling_case_value = pl();
@@ -3261,12 +3375,11 @@ static void parse_switch_statement(void) {
         error("The controlling expression of a switch statement is not an integral type");
 
     // Add an entry to the implicit switch stack
-    case_ir_start = new_instruction(IR_NOP);
-    case_ir = case_ir_start;
     Tac *root = ir;
     case_default_label = 0;
     cur_loop_break_dst = new_label_dst();
     case_values = new_longmap();
+    switch_cases = new_list(16);
     seen_switch_default = 0;
 
     parse_statement();
@@ -3276,13 +3389,26 @@ static void parse_switch_statement(void) {
 
     // Make root -> case_ir
     Tac *statement_ir_start = root->next;
+    Tac *case_ir_start = new_instruction(IR_NOP);
     root->next = case_ir_start;
     case_ir_start->prev = root;
     ir = case_ir_start;
-    while (ir->next) ir = ir->next;
+
+    Value *default_label = case_default_label ? case_default_label : cur_loop_break_dst;
+    SwitchCase **cases = (SwitchCase **) switch_cases->elements;
+    int case_count = switch_cases->length;
+
+    if (case_count < SWITCH_LINEAR_CASE_COUNT || controlling_case_value->is_constant)
+        // Keep the source order
+        add_switch_linear_jumps(cases, case_count);
+    else {
+        Value *promoted_value = integer_promote(controlling_case_value);
+        qsort(cases, case_count, sizeof(SwitchCase *), promoted_value->type->is_unsigned ? unsigned_switch_case_cmpfunc : signed_switch_case_cmpfunc);
+        add_switch_case_jumps(cases, case_count, promoted_value, default_label);
+    }
 
     // Add jump to default label, if present, otherwise to the break label
-    add_parser_instruction(IR_JMP, 0, case_default_label ? case_default_label : cur_loop_break_dst, 0);
+    add_parser_instruction(IR_JMP, 0, default_label, 0);
 
     // Add statement IR
     ir->next = statement_ir_start;
@@ -3293,14 +3419,15 @@ static void parse_switch_statement(void) {
     add_jmp_target_instruction(cur_loop_break_dst);
 
     free_longmap(case_values);
+    for (int i = 0; i < case_count; i++) wfree(cases[i]);
+    free_list(switch_cases);
 
     // Pop the old switch state back, if any
     cur_loop_break_dst      = old_loop_break_dst;
     case_default_label      = old_case_default_label;
-    case_ir                 = old_case_ir;
-    case_ir_start           = old_case_ir_start;
     controlling_case_value  = old_controlling_case_value;
     case_values             = old_case_values;
+    switch_cases            = old_switch_cases;
     seen_switch_default     = old_seen_switch_default;
 }
 
@@ -3327,19 +3454,16 @@ static void parse_case_statement(void) {
         v->int_value = value;
     }
 
-    push(v);
-    push(controlling_case_value);
     consume(TOK_COLON, ":");
 
     Value *ldst = new_label_dst();
 
-    // Add comparison & jump to current switch's case IR
-    Tac *org_ir = ir;
-    ir = case_ir;
-    arithmetic_operation(IR_EQ, controlling_case_value->type);
-    add_conditional_jump(IR_JNZ, ldst);
-    case_ir = ir;
-    ir = org_ir;
+    // The comparisons & jumps are added at the end of the switch statement
+    SwitchCase *switch_case = wmalloc(sizeof(SwitchCase));
+    switch_case->value = v;
+    switch_case->key = promote_case_value(value, integer_promote_type(controlling_case_value->type));
+    switch_case->label = ldst;
+    append_to_list(switch_cases, switch_case);
 
     add_jmp_target_instruction(ldst);
     if (cur_token != TOK_CASE && cur_token != TOK_RCURLY) parse_statement();
@@ -3421,9 +3545,9 @@ static void parse_label_statement(char *identifier) {
         next();
         Value *ldst = new_label_dst();
         add_jmp_target_instruction(ldst);
-        Value *dst = strmap_get(cur_function_symbol->function->labels, identifier);
+        Value *dst = strmap_get_interned(cur_function_symbol->function->labels, identifier);
         if (dst) error("Duplicate label %s", identifier);
-        strmap_put(cur_function_symbol->function->labels, parser_wstrdup(identifier), ldst);
+        strmap_put_interned(cur_function_symbol->function->labels, identifier, ldst);
     }
     else {
         rewind_lexer();
@@ -3438,13 +3562,13 @@ static void parse_goto_statement(void) {
     // A typedef an also be used as an identifier in a goto statement
     if (cur_token != TOK_TYPEDEF_TYPE && cur_token != TOK_IDENTIFIER) panic_with_line_number("Expected an identifier");
 
-    Value *ldst = strmap_get(cur_function_symbol->function->labels, cur_identifier);
+    Value *ldst = strmap_get_interned(cur_function_symbol->function->labels, cur_identifier);
     if (ldst)
         add_parser_instruction(IR_JMP, 0, ldst, 0);
     else {
         Tac *ir = add_parser_instruction(IR_JMP, 0, 0, 0);
         GotoBackPatch *gbp = wmalloc(sizeof(GotoBackPatch));
-        gbp->identifier = parser_wstrdup(cur_identifier);
+        gbp->identifier = cur_identifier;
         gbp->ir = ir;
         append_to_cll(cur_function_symbol->function->goto_backpatches, gbp);
     }
@@ -3461,7 +3585,7 @@ static void backpatch_gotos(void) {
     do {
         GotoBackPatch *gbp = gbp_cll->target;
 
-        Value *ldst = strmap_get(cur_function_symbol->function->labels, gbp->identifier);
+        Value *ldst = strmap_get_interned(cur_function_symbol->function->labels, gbp->identifier);
         if (!ldst) error("Unknown label %s", gbp->identifier);
         gbp->ir->src1 = ldst;
         wfree(gbp);
@@ -3473,7 +3597,7 @@ static void backpatch_gotos(void) {
 }
 
 static void add_va_register_save_area(void) {
-    Type *type = find_struct_or_union("__wcc_register_save_area", 0, 1);
+    Type *type = find_struct_or_union(intern("__wcc_register_save_area"), 0, 1);
     if (!type) panic_with_line_number("Unable to find __wcc_register_save_area");
     Value *v = new_value();
     v->type = type;
@@ -3492,7 +3616,7 @@ static void parse_statement(void) {
 
     if (cur_token_is_type()) {
         int is_typedef = cur_token == TOK_TYPEDEF_TYPE;
-        char *identifier = parser_wstrdup(cur_identifier);
+        char *identifier = cur_identifier;
 
         if (base_type) wfree(base_type);
         base_type = parse_declaration_specifiers();
@@ -3555,7 +3679,7 @@ static void parse_statement(void) {
             break;
 
         case TOK_IDENTIFIER: {
-            char *identifier = parser_wstrdup(cur_identifier);
+            char *identifier = cur_identifier;
             next();
             parse_label_statement(identifier);
             break;
@@ -9,6 +9,11 @@ typedef struct vreg_cost {
     int cost;
 } VregCost;
 
+typedef struct vreg_start {
+    int vreg;
+    int start;
+} VregStart;
+
 int preg_map[PHYSICAL_REGISTER_COUNT]; // Map from reserved register 0-11 to physical register 0-15
 
 int callee_saved_registers[PHYSICAL_REGISTER_COUNT + 1]; // Set to 1 for registers that must be preserved in function calls.
@@ -90,16 +95,29 @@ static int *make_original_stack_indexes(Function *function) {
     return result;
 }
 
-static int graph_node_degree(char *ig, int vreg_count, int node) {
-    int result = 0;
-    int offset = node * vreg_count;
-    for (int i = 1; i <= vreg_count; i++)
-        if ((i < node && ig[i * vreg_count + node]) || ig[offset + i]) result++;
+// Put a vreg on the stack. Function parameters that are passed on the stack stay where they are.
+// Rematerializable vregs don't need a stack slot, they are recomputed by add_spill_code()
+// before each use.
+static void spill_vreg(Function *function, VregLocation *vreg_locations, int *stack_register_count, int vreg, int *original_stack_indexes) {
+    if (function->rematerializations && function->rematerializations[vreg]) {
+        vreg_locations[vreg].preg = -1;
+        vreg_locations[vreg].stack_index = 0;
+        return;
+    }
 
-    return result;
+    int stack_index;
+    if (original_stack_indexes[vreg])
+        stack_index = original_stack_indexes[vreg];
+    else {
+        stack_index = -*stack_register_count - 1;
+        (*stack_register_count)++;
+    }
+
+    vreg_locations[vreg].preg = -1;
+    vreg_locations[vreg].stack_index = stack_index;
 }
 
-static void color_vreg(char *ig, int vreg_count, VregLocation *vreg_locations,
+static void color_vreg(Function *function, InterferenceGraph *ig, VregLocation *vreg_locations,
     int physical_register_count, int *stack_register_count, int vreg, int *original_stack_indexes,
     int preferred_live_range_preg_index,
     int preg_live_range_start, int preg_live_range_end) {
@@ -109,15 +127,15 @@ static void color_vreg(char *ig, int vreg_count, VregLocation *vreg_locations,
 
     if (debug_graph_coloring) printf("Allocating register for vreg %d, live range %d-%d\n", vreg, preg_live_range_start, preg_live_range_end);
 
-    int offset = vreg * vreg_count;
-    for (int i = 1; i <= vreg_count; i++) {
+    int degree = ig->degrees[vreg];
+    int *neighbors = ig->neighbors[vreg];
+    for (int j = 0; j < degree; j++) {
+        int i = neighbors[j];
         if (i <= live_range_reserved_pregs_offset && (i < preg_live_range_start || i > preg_live_range_end)) continue;
 
-        if ((i < vreg && ig[i * vreg_count + vreg]) || ig[offset + i]) {
-            int preg = vreg_locations[i].preg;
-            if (preg != -1)
-                add_to_set(neighbor_colors, preg);
-        }
+        int preg = vreg_locations[i].preg;
+        if (preg != -1)
+            add_to_set(neighbor_colors, preg);
     }
 
     if (debug_graph_coloring) {
@@ -127,16 +145,8 @@ static void color_vreg(char *ig, int vreg_count, VregLocation *vreg_locations,
     }
 
     if (set_len(neighbor_colors) >= physical_register_count) {
-        int stack_index;
-        if (original_stack_indexes[vreg])
-            stack_index = original_stack_indexes[vreg];
-        else {
-            stack_index = -*stack_register_count - 1;
-            (*stack_register_count)++;
-        }
-        vreg_locations[vreg].stack_index = stack_index;
-
-        if (debug_graph_coloring) printf("  spilled vreg %d to stack index %d\n", vreg, stack_index);
+        spill_vreg(function, vreg_locations, stack_register_count, vreg, original_stack_indexes);
+        if (debug_graph_coloring) printf("  spilled vreg %d to stack index %d\n", vreg, vreg_locations[vreg].stack_index);
     }
     else {
         if (debug_graph_coloring && preferred_live_range_preg_index) printf("  searching for preferred preg live range index %d\n", preferred_live_range_preg_index);
@@ -166,7 +176,7 @@ exit_color_vreg:;
 
 // Allocate/spill registers for all vregs of class preg_class.
 void allocate_registers_top_down(Function *function, int live_range_start, int physical_register_count, int preg_class) {
-    char *interference_graph = function->interference_graph;
+    InterferenceGraph *interference_graph = function->interference_graph;
     VregLocation *vreg_locations = function->vreg_locations;
     int vreg_count = function->vreg_count;
     int *spill_cost = function->spill_cost;
@@ -196,7 +206,7 @@ void allocate_registers_top_down(Function *function, int live_range_start, int p
         if (vreg > live_range_reserved_pregs_offset && function->vreg_preg_classes[vreg] != preg_class) continue;
         if (!function->vreg_preg_classes[vreg]) panic("Unexpected zero preg class for vreg %d", i);
 
-        int degree = graph_node_degree(interference_graph, vreg_count, vreg);
+        int degree = interference_graph->degrees[vreg];
         if (degree < physical_register_count)
             if (opt_enable_preferred_pregs && preferred_live_range_preg_indexes[vreg])
                 add_to_set(preferred_pregs, vreg);
@@ -209,7 +219,7 @@ void allocate_registers_top_down(Function *function, int live_range_start, int p
     if (debug_register_allocation) {
         printf("Nodes in order of decreasing cost:\n");
         for (int i = 1; i <= vreg_count; i++)
-            printf("%d: cost=%d degree=%d\n", ordered_nodes[i].vreg, ordered_nodes[i].cost, graph_node_degree(interference_graph, vreg_count, ordered_nodes[i].vreg));
+            printf("%d: cost=%d degree=%d\n", ordered_nodes[i].vreg, ordered_nodes[i].cost, interference_graph->degrees[ordered_nodes[i].vreg]);
 
         printf("\nPriority sets:\n");
         printf("constrained:     "); print_set(constrained); printf("\n");
@@ -232,25 +242,25 @@ void allocate_registers_top_down(Function *function, int live_range_start, int p
     // Color constrained nodes first
     for (int i = 1; i <= vreg_count; i++) {
         int vreg = ordered_nodes[i].vreg;
-        if (!constrained->elements[vreg]) continue;
+        if (!in_set(constrained, vreg)) continue;
         if (live_range_reserved_pregs_offset > 0 && vreg <= live_range_reserved_pregs_offset) continue;
-        color_vreg(interference_graph, vreg_count, vreg_locations, physical_register_count, &stack_register_count, vreg, original_stack_indexes, 0, live_range_start, live_range_end);
+        color_vreg(function, interference_graph, vreg_locations, physical_register_count, &stack_register_count, vreg, original_stack_indexes, 0, live_range_start, live_range_end);
     }
 
     // Color preferred preg nodes next
     for (int i = 1; i <= vreg_count; i++) {
         int vreg = ordered_nodes[i].vreg;
-        if (!preferred_pregs->elements[vreg]) continue;
+        if (!in_set(preferred_pregs, vreg)) continue;
         if (live_range_reserved_pregs_offset > 0 && vreg <= live_range_reserved_pregs_offset) continue;
-        color_vreg(interference_graph, vreg_count, vreg_locations, physical_register_count, &stack_register_count, vreg, original_stack_indexes, preferred_live_range_preg_indexes[vreg], live_range_start, live_range_end);
+        color_vreg(function, interference_graph, vreg_locations, physical_register_count, &stack_register_count, vreg, original_stack_indexes, preferred_live_range_preg_indexes[vreg], live_range_start, live_range_end);
     }
 
     // Color unconstrained nodes lsat
     for (int i = 1; i <= vreg_count; i++) {
         int vreg = ordered_nodes[i].vreg;
-        if (!unconstrained->elements[vreg]) continue;
+        if (!in_set(unconstrained, vreg)) continue;
         if (live_range_reserved_pregs_offset > 0 && vreg <= live_range_reserved_pregs_offset) continue;
-        color_vreg(interference_graph, vreg_count, vreg_locations, physical_register_count, &stack_register_count, vreg, original_stack_indexes, 0, live_range_start, live_range_end);
+        color_vreg(function, interference_graph, vreg_locations, physical_register_count, &stack_register_count, vreg, original_stack_indexes, 0, live_range_start, live_range_end);
     }
 
     if (debug_register_allocation) {
@@ -273,6 +283,740 @@ void allocate_registers_top_down(Function *function, int live_range_start, int p
     wfree(original_stack_indexes);
 }
 
+static int vreg_start_cmpfunc(const void *void_a, const void *void_b) {
+    const VregStart *a = void_a;
+    const VregStart *b = void_b;
+
+    if (a->start < b->start) return -1;
+    if (a->start > b->start) return 1;
+
+    // Sort by vreg for a deterministic order
+    if (a->vreg < b->vreg) return -1;
+    if (a->vreg > b->vreg) return 1;
+
+    return 0;
+}
+
+// Returns 1 if start-end overlaps any of the count intervals in starts/max_ends. The intervals
+// are sorted by start and max_ends[i] is the greatest end of intervals 0 to i.
+static int overlaps_intervals(int *starts, int *max_ends, int count, int start, int end) {
+    // Find the number of intervals that start at or before end
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (starts[middle] <= end)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low > 0 && max_ends[low - 1] >= start;
+}
+
+// Returns 1 if vreg1 should be spilled rather than vreg2
+static int spill_first(LiveIntervals *li, int *spill_cost, int vreg1, int vreg2) {
+    if (!opt_spill_furthest_liveness_end && spill_cost[vreg1] != spill_cost[vreg2])
+        return spill_cost[vreg1] < spill_cost[vreg2];
+
+    return li->ends[vreg1] > li->ends[vreg2];
+}
+
+// Add vreg2 to the vregs that vreg1 is copied from or to. The lists grow in powers of two.
+static void add_copy(int **copies, int *copy_counts, int vreg1, int vreg2) {
+    int count = copy_counts[vreg1];
+    if (!(count & (count - 1))) copies[vreg1] = wrealloc(copies[vreg1], (count ? count * 2 : 1) * sizeof(int));
+    copies[vreg1][count] = vreg2;
+    copy_counts[vreg1]++;
+}
+
+// Allocate/spill registers for all vregs of class preg_class using the live intervals.
+// See Poletto & Sarkar, Linear Scan Register Allocation, 1999. The vregs are visited
+// in order of the start of their interval. Vregs with a live_range_preg get their
+// physical register, which no other vreg overlapping them can have. The others get
+// their preferred register if it's free, or else any free register they aren't
+// constrained from. If there are none, the vreg with the lowest spill cost out of
+// this one and the ones occupying its usable registers is spilled.
+// Live ranges aren't coalesced for linear scan. Instead, a vreg that is copied from or
+// to another vreg gets the other's register if it's free, so that the copy is removed
+// as a self move. If the other vreg comes later, the vreg gets a register the other
+// one can also have.
+void allocate_registers_linear_scan(Function *function, int live_range_start, int physical_register_count, int preg_class) {
+    LiveIntervals *li = function->live_intervals;
+    VregLocation *vreg_locations = function->vreg_locations;
+    int vreg_count = function->vreg_count;
+    int *spill_cost = function->spill_cost;
+    char *preferred_live_range_preg_indexes = function->preferred_live_range_preg_indexes;
+    int *original_stack_indexes = make_original_stack_indexes(function);
+    int live_range_end = live_range_start + physical_register_count - 1;
+
+    if (debug_register_allocation) {
+        printf("Linear scan allocating registers for live_range_start=%d, live_range_end=%d physical_register_count=%d\n", live_range_start, live_range_end, physical_register_count);
+        print_ir(function, 0, 0);
+    }
+
+    // Pre-color reserved registers. Vregs start at one, pregs start at 0.
+    if (live_range_reserved_pregs_offset > 0)
+        for (int i = 0; i < live_range_reserved_pregs_offset; i++) vreg_locations[i + 1].preg = i;
+
+    VregStart *intervals = wmalloc((vreg_count + 1) * sizeof(VregStart));
+    int interval_count = 0;
+    for (int vreg = live_range_reserved_pregs_offset + 1; vreg <= vreg_count; vreg++) {
+        if (function->vreg_preg_classes[vreg] != preg_class || li->starts[vreg] == -1) continue;
+        intervals[interval_count].vreg = vreg;
+        intervals[interval_count].start = li->starts[vreg];
+        interval_count++;
+    }
+
+    qsort(intervals, interval_count, sizeof(VregStart), vreg_start_cmpfunc);
+
+    // The vregs that each vreg is copied from or to
+    int **copies = wcalloc(vreg_count + 1, sizeof(int *));
+    int *copy_counts = wcalloc(vreg_count + 1, sizeof(int));
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (tac->operation != X_MOV || !tac->dst || !tac->dst->vreg || !tac->src1 || !tac->src1->vreg) continue;
+        add_copy(copies, copy_counts, tac->dst->vreg, tac->src1->vreg);
+        add_copy(copies, copy_counts, tac->src1->vreg, tac->dst->vreg);
+    }
+
+    // Make sorted lists of the intervals of the vregs that must be in each physical register
+    int *fixed_counts = wcalloc(physical_register_count + 1, sizeof(int));
+    for (int i = 0; i < interval_count; i++) {
+        int fixed_preg = li->fixed_pregs[intervals[i].vreg];
+        if (!fixed_preg) continue;
+        if (fixed_preg < live_range_start || fixed_preg > live_range_end)
+            panic("Live range preg %d of vreg %d is not in %d-%d", fixed_preg, intervals[i].vreg, live_range_start, live_range_end);
+        fixed_counts[fixed_preg - live_range_start]++;
+    }
+
+    int **fixed_starts = wmalloc((physical_register_count + 1) * sizeof(int *));
+    int **fixed_max_ends = wmalloc((physical_register_count + 1) * sizeof(int *));
+    for (int j = 0; j < physical_register_count; j++) {
+        fixed_starts[j] = wmalloc((fixed_counts[j] + 1) * sizeof(int));
+        fixed_max_ends[j] = wmalloc((fixed_counts[j] + 1) * sizeof(int));
+        fixed_counts[j] = 0;
+    }
+
+    for (int i = 0; i < interval_count; i++) {
+        int vreg = intervals[i].vreg;
+        if (!li->fixed_pregs[vreg]) continue;
+
+        int j = li->fixed_pregs[vreg] - live_range_start;
+        int count = fixed_counts[j];
+        int end = li->ends[vreg];
+        if (count && fixed_max_ends[j][count - 1] > end) end = fixed_max_ends[j][count - 1];
+        fixed_starts[j][count] = li->starts[vreg];
+        fixed_max_ends[j][count] = end;
+        fixed_counts[j]++;
+    }
+
+    int *active = wcalloc(physical_register_count + 1, sizeof(int)); // The vreg in each register, zero if free
+    char *usable = wmalloc(physical_register_count + 1);
+    int stack_register_count = function->stack_register_count;
+
+    for (int i = 0; i < interval_count; i++) {
+        int vreg = intervals[i].vreg;
+        int start = li->starts[vreg];
+        int end = li->ends[vreg];
+
+        // Free the registers of vregs that are no longer live
+        for (int j = 0; j < physical_register_count; j++)
+            if (active[j] && li->ends[active[j]] < start) active[j] = 0;
+
+        if (li->fixed_pregs[vreg]) {
+            vreg_locations[vreg].preg = li->fixed_pregs[vreg] - 1;
+            if (debug_register_allocation) printf("vreg %d %d-%d: fixed preg %d\n", vreg, start, end, vreg_locations[vreg].preg);
+            continue;
+        }
+
+        for (int j = 0; j < physical_register_count; j++)
+            usable[j] =
+                !(li->preg_constraints[vreg] & (1 << (live_range_start + j - 1))) &&
+                !overlaps_intervals(fixed_starts[j], fixed_max_ends[j], fixed_counts[j], start, end);
+
+        int chosen = -1;
+
+        int preferred_live_range_preg_index = opt_enable_preferred_pregs ? preferred_live_range_preg_indexes[vreg] : 0;
+        if (preferred_live_range_preg_index >= live_range_start && preferred_live_range_preg_index <= live_range_end) {
+            int j = preferred_live_range_preg_index - live_range_start;
+            if (usable[j] && !active[j]) chosen = j;
+        }
+
+        // Take the register of a vreg it's copied from or to, or else one that a vreg it's
+        // copied to or from that isn't allocated yet can also have
+        for (int k = 0; chosen == -1 && k < copy_counts[vreg]; k++) {
+            int j = vreg_locations[copies[vreg][k]].preg - live_range_start + 1;
+            if (j >= 0 && j < physical_register_count && usable[j] && !active[j]) chosen = j;
+        }
+
+        for (int k = 0; chosen == -1 && k < copy_counts[vreg]; k++) {
+            int copy = copies[vreg][k];
+            if (copy <= live_range_reserved_pregs_offset || li->starts[copy] <= start) continue;
+
+            for (int j = 0; chosen == -1 && j < physical_register_count; j++)
+                if (usable[j] && !active[j] &&
+                        !(li->preg_constraints[copy] & (1 << (live_range_start + j - 1))) &&
+                        !overlaps_intervals(fixed_starts[j], fixed_max_ends[j], fixed_counts[j], li->starts[copy], li->ends[copy]))
+                    chosen = j;
+        }
+
+        for (int j = 0; chosen == -1 && j < physical_register_count; j++)
+            if (usable[j] && !active[j]) chosen = j;
+
+        if (chosen == -1) {
+            // All usable registers are taken. Spill either this vreg or one of the vregs in them.
+            int spilled_vreg = vreg;
+            for (int j = 0; j < physical_register_count; j++) {
+                if (usable[j] && spill_first(li, spill_cost, active[j], spilled_vreg)) {
+                    spilled_vreg = active[j];
+                    chosen = j;
+                }
+            }
+
+            spill_vreg(function, vreg_locations, &stack_register_count, spilled_vreg, original_stack_indexes);
+            if (debug_register_allocation) printf("vreg %d %d-%d: spilled vreg %d to stack index %d\n", vreg, start, end, spilled_vreg, vreg_locations[spilled_vreg].stack_index);
+            if (spilled_vreg == vreg) continue;
+        }
+
+        active[chosen] = vreg;
+        vreg_locations[vreg].preg = live_range_start + chosen - 1;
+        if (debug_register_allocation) printf("vreg %d %d-%d: allocated preg %d\n", vreg, start, end, vreg_locations[vreg].preg);
+    }
+
+    function->stack_register_count = stack_register_count;
+
+    for (int j = 0; j < physical_register_count; j++) {
+        wfree(fixed_starts[j]);
+        wfree(fixed_max_ends[j]);
+    }
+    wfree(fixed_starts);
+    wfree(fixed_max_ends);
+    wfree(fixed_counts);
+    wfree(active);
+    wfree(usable);
+    wfree(intervals);
+    for (int i = 0; i <= vreg_count; i++) wfree(copies[i]);
+    wfree(copies);
+    wfree(copy_counts);
+    wfree(original_stack_indexes);
+}
+
+// Iterated register coalescing, see George & Appel, Iterated Register Coalescing, 1996
+// and chapter 11 of Modern Compiler Implementation in C. Nodes are simplified, moves
+// are coalesced with the Briggs and George tests, move related nodes are frozen and
+// potential spills are picked by spill cost squared / degree. Colors are assigned
+// optimistically, so a potential spill only gets spilled if its neighbors use all registers.
+//
+// The physical register nodes in the interference graph and vregs with a live_range_preg
+// are precolored. Nodes and moves are kept in doubly linked lists, one for each state.
+
+enum {
+    IRC_NODE_PRECOLORED = 1,
+    IRC_NODE_INITIAL,
+    IRC_NODE_SIMPLIFY,
+    IRC_NODE_FREEZE,
+    IRC_NODE_SPILL,
+    IRC_NODE_SPILLED,
+    IRC_NODE_COALESCED,
+    IRC_NODE_COLORED,
+    IRC_NODE_SELECT,
+    IRC_NODE_STATE_COUNT,
+};
+
+enum {
+    IRC_MOVE_WORKLIST = 1,
+    IRC_MOVE_ACTIVE,
+    IRC_MOVE_COALESCED,
+    IRC_MOVE_CONSTRAINED,
+    IRC_MOVE_FROZEN,
+    IRC_MOVE_STATE_COUNT,
+};
+
+#define IRC_PRECOLORED_DEGREE (1 << 30)
+
+typedef struct irc_move {
+    int dst;
+    int src;
+    int state;
+    int next;
+    int prev;
+} IrcMove;
+
+typedef struct irc {
+    InterferenceGraph *ig;
+    int node_count;
+    int physical_register_count;
+    int first_preg;                             // Color of the first physical register in the class
+    char *node_states;                          // IRC_NODE_* or zero if the node isn't in the register class
+    int *node_next;
+    int *node_prev;
+    int node_heads[IRC_NODE_STATE_COUNT];
+    int *degrees;                               // Number of neighbors in the register class
+    int *aliases;                               // For coalesced nodes, the node it was coalesced with
+    long *spill_costs;                          // Spill costs, including those of the nodes coalesced with it
+    int *colors;                                // Physical register, -1 if none
+    IrcMove *moves;                             // Moves, starting at 1
+    int move_count;
+    int move_heads[IRC_MOVE_STATE_COUNT];
+    int **node_moves;                           // The moves each node is involved in
+    int *node_move_counts;
+    int *allocated_node_moves;
+    int *select_stack;
+    int select_stack_count;
+    int *marks;                                 // For removing duplicates in the Briggs test
+    int mark;
+} Irc;
+
+static void irc_set_node_state(Irc *irc, int node, int state) {
+    int old_state = irc->node_states[node];
+    if (old_state) {
+        int next = irc->node_next[node];
+        int prev = irc->node_prev[node];
+        if (prev) irc->node_next[prev] = next; else irc->node_heads[old_state] = next;
+        if (next) irc->node_prev[next] = prev;
+    }
+
+    irc->node_states[node] = state;
+    int head = irc->node_heads[state];
+    irc->node_next[node] = head;
+    irc->node_prev[node] = 0;
+    if (head) irc->node_prev[head] = node;
+    irc->node_heads[state] = node;
+}
+
+static void irc_set_move_state(Irc *irc, int move, int state) {
+    IrcMove *moves = irc->moves;
+
+    int old_state = moves[move].state;
+    if (old_state) {
+        int next = moves[move].next;
+        int prev = moves[move].prev;
+        if (prev) moves[prev].next = next; else irc->move_heads[old_state] = next;
+        if (next) moves[next].prev = prev;
+    }
+
+    moves[move].state = state;
+    int head = irc->move_heads[state];
+    moves[move].next = head;
+    moves[move].prev = 0;
+    if (head) moves[head].prev = move;
+    irc->move_heads[state] = move;
+}
+
+static void irc_add_node_move(Irc *irc, int node, int move) {
+    if (irc->node_move_counts[node] == irc->allocated_node_moves[node]) {
+        irc->allocated_node_moves[node] = irc->allocated_node_moves[node] ? irc->allocated_node_moves[node] * 2 : 4;
+        irc->node_moves[node] = wrealloc(irc->node_moves[node], irc->allocated_node_moves[node] * sizeof(int));
+    }
+
+    irc->node_moves[node][irc->node_move_counts[node]++] = move;
+}
+
+// A node is adjacent if it's in the register class and hasn't been removed from the graph
+static int irc_is_adjacent(Irc *irc, int node) {
+    int state = irc->node_states[node];
+    return state && state != IRC_NODE_SELECT && state != IRC_NODE_COALESCED;
+}
+
+static int irc_is_precolored(Irc *irc, int node) {
+    return irc->node_states[node] == IRC_NODE_PRECOLORED;
+}
+
+// Returns 1 if the node is involved in a move that may still be coalesced
+static int irc_is_move_related(Irc *irc, int node) {
+    for (int i = 0; i < irc->node_move_counts[node]; i++) {
+        int state = irc->moves[irc->node_moves[node][i]].state;
+        if (state == IRC_MOVE_WORKLIST || state == IRC_MOVE_ACTIVE) return 1;
+    }
+
+    return 0;
+}
+
+static int irc_get_alias(Irc *irc, int node) {
+    while (irc->node_states[node] == IRC_NODE_COALESCED) node = irc->aliases[node];
+    return node;
+}
+
+static void irc_enable_moves(Irc *irc, int node) {
+    for (int i = 0; i < irc->node_move_counts[node]; i++) {
+        int move = irc->node_moves[node][i];
+        if (irc->moves[move].state == IRC_MOVE_ACTIVE) irc_set_move_state(irc, move, IRC_MOVE_WORKLIST);
+    }
+}
+
+static void irc_decrement_degree(Irc *irc, int node) {
+    if (irc_is_precolored(irc, node)) return;
+
+    int degree = irc->degrees[node]--;
+    if (degree != irc->physical_register_count) return;
+
+    irc_enable_moves(irc, node);
+    InterferenceGraph *ig = irc->ig;
+    for (int i = 0; i < ig->degrees[node]; i++) {
+        int neighbor = ig->neighbors[node][i];
+        if (irc_is_adjacent(irc, neighbor)) irc_enable_moves(irc, neighbor);
+    }
+
+    if (irc->node_states[node] == IRC_NODE_SPILL)
+        irc_set_node_state(irc, node, irc_is_move_related(irc, node) ? IRC_NODE_FREEZE : IRC_NODE_SIMPLIFY);
+}
+
+static void irc_add_edge(Irc *irc, int node1, int node2) {
+    if (node1 == node2 || ig_lookup(irc->ig, node1, node2)) return;
+
+    add_ig_edge(irc->ig, node1, node2);
+    if (!irc_is_precolored(irc, node1)) irc->degrees[node1]++;
+    if (!irc_is_precolored(irc, node2)) irc->degrees[node2]++;
+}
+
+static void irc_simplify(Irc *irc) {
+    int node = irc->node_heads[IRC_NODE_SIMPLIFY];
+    irc_set_node_state(irc, node, IRC_NODE_SELECT);
+    irc->select_stack[irc->select_stack_count++] = node;
+
+    InterferenceGraph *ig = irc->ig;
+    for (int i = 0; i < ig->degrees[node]; i++) {
+        int neighbor = ig->neighbors[node][i];
+        if (irc_is_adjacent(irc, neighbor)) irc_decrement_degree(irc, neighbor);
+    }
+}
+
+static void irc_add_worklist(Irc *irc, int node) {
+    if (irc->node_states[node] == IRC_NODE_FREEZE && !irc_is_move_related(irc, node) && irc->degrees[node] < irc->physical_register_count)
+        irc_set_node_state(irc, node, IRC_NODE_SIMPLIFY);
+}
+
+// George test: coalescing node with precolored is safe if all of node's neighbors either
+// already interfere with precolored or have an insignificant degree. Precolored nodes
+// with the same color are the same register, so a neighbor like that prevents coalescing.
+static int irc_george_test(Irc *irc, int precolored, int node) {
+    InterferenceGraph *ig = irc->ig;
+    for (int i = 0; i < ig->degrees[node]; i++) {
+        int neighbor = ig->neighbors[node][i];
+        if (!irc_is_adjacent(irc, neighbor)) continue;
+
+        if (irc_is_precolored(irc, neighbor)) {
+            if (irc->colors[neighbor] == irc->colors[precolored]) return 0;
+            continue;
+        }
+
+        if (irc->degrees[neighbor] < irc->physical_register_count) continue;
+        if (ig_lookup(ig, neighbor, precolored)) continue;
+
+        return 0;
+    }
+
+    return 1;
+}
+
+// Briggs test: coalescing is safe if the combined node has fewer than K neighbors of significant degree
+static int irc_briggs_test(Irc *irc, int node1, int node2) {
+    InterferenceGraph *ig = irc->ig;
+    int significant_count = 0;
+    irc->mark++;
+
+    int nodes[2] = {node1, node2};
+    for (int j = 0; j < 2; j++) {
+        int node = nodes[j];
+        for (int i = 0; i < ig->degrees[node]; i++) {
+            int neighbor = ig->neighbors[node][i];
+            if (!irc_is_adjacent(irc, neighbor) || irc->marks[neighbor] == irc->mark) continue;
+            irc->marks[neighbor] = irc->mark;
+            if (irc->degrees[neighbor] >= irc->physical_register_count) significant_count++;
+        }
+    }
+
+    return significant_count < irc->physical_register_count;
+}
+
+static void irc_combine(Irc *irc, int node1, int node2) {
+    irc_set_node_state(irc, node2, IRC_NODE_COALESCED);
+    irc->aliases[node2] = node1;
+    irc->spill_costs[node1] += irc->spill_costs[node2];
+
+    for (int i = 0; i < irc->node_move_counts[node2]; i++) irc_add_node_move(irc, node1, irc->node_moves[node2][i]);
+    irc_enable_moves(irc, node2);
+
+    // Adding edges may grow the adjacency vectors, so don't hold on to pointers to them
+    InterferenceGraph *ig = irc->ig;
+    for (int i = 0; i < ig->degrees[node2]; i++) {
+        int neighbor = ig->neighbors[node2][i];
+        if (!irc_is_adjacent(irc, neighbor)) continue;
+        irc_add_edge(irc, neighbor, node1);
+        irc_decrement_degree(irc, neighbor);
+    }
+
+    if (irc->degrees[node1] >= irc->physical_register_count && irc->node_states[node1] == IRC_NODE_FREEZE)
+        irc_set_node_state(irc, node1, IRC_NODE_SPILL);
+}
+
+static void irc_coalesce(Irc *irc) {
+    int move = irc->move_heads[IRC_MOVE_WORKLIST];
+    int x = irc_get_alias(irc, irc->moves[move].dst);
+    int y = irc_get_alias(irc, irc->moves[move].src);
+
+    int u = x;
+    int v = y;
+    if (irc_is_precolored(irc, y)) { u = y; v = x; }
+
+    if (u == v) {
+        irc_set_move_state(irc, move, IRC_MOVE_COALESCED);
+        irc_add_worklist(irc, u);
+    }
+    else if (irc_is_precolored(irc, v) || ig_lookup(irc->ig, u, v)) {
+        irc_set_move_state(irc, move, IRC_MOVE_CONSTRAINED);
+        irc_add_worklist(irc, u);
+        irc_add_worklist(irc, v);
+    }
+    else if (irc_is_precolored(irc, u) ? irc_george_test(irc, u, v) : irc_briggs_test(irc, u, v)) {
+        irc_set_move_state(irc, move, IRC_MOVE_COALESCED);
+        irc_combine(irc, u, v);
+        irc_add_worklist(irc, u);
+    }
+    else
+        irc_set_move_state(irc, move, IRC_MOVE_ACTIVE);
+}
+
+static void irc_freeze_moves(Irc *irc, int node) {
+    for (int i = 0; i < irc->node_move_counts[node]; i++) {
+        int move = irc->node_moves[node][i];
+        int state = irc->moves[move].state;
+        if (state != IRC_MOVE_WORKLIST && state != IRC_MOVE_ACTIVE) continue;
+
+        int x = irc_get_alias(irc, irc->moves[move].dst);
+        int y = irc_get_alias(irc, irc->moves[move].src);
+        int other = y == irc_get_alias(irc, node) ? x : y;
+
+        irc_set_move_state(irc, move, IRC_MOVE_FROZEN);
+
+        if (irc->node_states[other] == IRC_NODE_FREEZE && !irc_is_move_related(irc, other) && irc->degrees[other] < irc->physical_register_count)
+            irc_set_node_state(irc, other, IRC_NODE_SIMPLIFY);
+    }
+}
+
+static void irc_freeze(Irc *irc) {
+    int node = irc->node_heads[IRC_NODE_FREEZE];
+    irc_set_node_state(irc, node, IRC_NODE_SIMPLIFY);
+    irc_freeze_moves(irc, node);
+}
+
+// Returns 1 if node1 is a better spill candidate than node2. The spill cost is squared, since
+// the loop depth weights make costs differ by orders of magnitude, and cost / degree would
+// pick a hot vreg that is live across a loop over a cold one with fewer neighbors. The sign
+// is kept, so that rematerializable vregs with a negative cost are still preferred. The
+// squared costs of deep loop nests don't fit in a long, so this is done in doubles.
+static int irc_spill_first(Irc *irc, int node1, int node2) {
+    double cost1 = (double) irc->spill_costs[node1] * labs(irc->spill_costs[node1]) / irc->degrees[node1];
+    double cost2 = (double) irc->spill_costs[node2] * labs(irc->spill_costs[node2]) / irc->degrees[node2];
+
+    return cost1 < cost2 || (cost1 == cost2 && node1 < node2);
+}
+
+// Pick the potential spill with the lowest spill cost squared / degree. Spilling a node spills
+// all the nodes coalesced with it, so their costs are included.
+static void irc_select_spill(Irc *irc) {
+    int node = 0;
+    for (int n = irc->node_heads[IRC_NODE_SPILL]; n; n = irc->node_next[n])
+        if (!node || irc_spill_first(irc, n, node)) node = n;
+
+    if (debug_register_allocation) printf("Potential spill of vreg %d\n", node);
+
+    irc_set_node_state(irc, node, IRC_NODE_SIMPLIFY);
+    irc_freeze_moves(irc, node);
+}
+
+static void irc_assign_colors(Irc *irc, char *preferred_live_range_preg_indexes) {
+    InterferenceGraph *ig = irc->ig;
+
+    while (irc->select_stack_count) {
+        int node = irc->select_stack[--irc->select_stack_count];
+
+        int ok_colors = (1 << irc->physical_register_count) - 1;
+        for (int i = 0; i < ig->degrees[node]; i++) {
+            int neighbor = irc_get_alias(irc, ig->neighbors[node][i]);
+            int state = irc->node_states[neighbor];
+            if (state == IRC_NODE_COLORED || state == IRC_NODE_PRECOLORED) {
+                int j = irc->colors[neighbor] - irc->first_preg;
+                if (j >= 0 && j < irc->physical_register_count) ok_colors &= ~(1 << j);
+            }
+        }
+
+        if (!ok_colors) {
+            irc_set_node_state(irc, node, IRC_NODE_SPILLED);
+            if (debug_register_allocation) printf("Spilled vreg %d\n", node);
+            continue;
+        }
+
+        irc_set_node_state(irc, node, IRC_NODE_COLORED);
+
+        int preferred_color = -1;
+        if (opt_enable_preferred_pregs && preferred_live_range_preg_indexes[node])
+            preferred_color = preferred_live_range_preg_indexes[node] - 1 - irc->first_preg;
+
+        if (preferred_color >= 0 && preferred_color < irc->physical_register_count && (ok_colors & (1 << preferred_color)))
+            irc->colors[node] = irc->first_preg + preferred_color;
+        else {
+            int j = 0;
+            while (!(ok_colors & (1 << j))) j++;
+            irc->colors[node] = irc->first_preg + j;
+        }
+
+        if (debug_register_allocation) printf("Colored vreg %d with preg %d\n", node, irc->colors[node]);
+    }
+}
+
+// Allocate/spill registers for all vregs of class preg_class with iterated register coalescing
+void allocate_registers_irc(Function *function, int live_range_start, int physical_register_count, int preg_class) {
+    InterferenceGraph *ig = function->interference_graph;
+    VregLocation *vreg_locations = function->vreg_locations;
+    int vreg_count = function->vreg_count;
+    int live_range_end = live_range_start + physical_register_count - 1;
+    int *original_stack_indexes = make_original_stack_indexes(function);
+
+    if (debug_register_allocation) {
+        printf("IRC allocating registers for live_range_start=%d, live_range_end=%d physical_register_count=%d\n", live_range_start, live_range_end, physical_register_count);
+        print_ir(function, 0, 0);
+    }
+
+    // Pre-color reserved registers. Vregs start at one, pregs start at 0.
+    if (live_range_reserved_pregs_offset > 0)
+        for (int i = 0; i < live_range_reserved_pregs_offset; i++) vreg_locations[i + 1].preg = i;
+
+    Irc *irc = wcalloc(1, sizeof(Irc));
+    irc->ig = ig;
+    irc->node_count = vreg_count;
+    irc->physical_register_count = physical_register_count;
+    irc->first_preg = live_range_start - 1;
+    irc->node_states = wcalloc(vreg_count + 1, sizeof(char));
+    irc->node_next = wcalloc(vreg_count + 1, sizeof(int));
+    irc->node_prev = wcalloc(vreg_count + 1, sizeof(int));
+    irc->degrees = wcalloc(vreg_count + 1, sizeof(int));
+    irc->aliases = wcalloc(vreg_count + 1, sizeof(int));
+    irc->spill_costs = wmalloc((vreg_count + 1) * sizeof(long));
+    irc->colors = wmalloc((vreg_count + 1) * sizeof(int));
+    irc->node_moves = wcalloc(vreg_count + 1, sizeof(int *));
+    irc->node_move_counts = wcalloc(vreg_count + 1, sizeof(int));
+    irc->allocated_node_moves = wcalloc(vreg_count + 1, sizeof(int));
+    irc->select_stack = wmalloc((vreg_count + 1) * sizeof(int));
+    irc->marks = wcalloc(vreg_count + 1, sizeof(int));
+    for (int i = 0; i <= vreg_count; i++) irc->colors[i] = -1;
+    for (int i = 0; i <= vreg_count; i++) irc->spill_costs[i] = function->spill_cost[i];
+
+    // The physical registers in the class and vregs that must be in a particular physical register are precolored
+    for (int i = live_range_start; i <= live_range_end && i <= vreg_count; i++) {
+        irc_set_node_state(irc, i, IRC_NODE_PRECOLORED);
+        irc->colors[i] = i - 1;
+    }
+
+    for (int vreg = live_range_reserved_pregs_offset + 1; vreg <= vreg_count; vreg++)
+        if (function->vreg_preg_classes[vreg] == preg_class) irc_set_node_state(irc, vreg, IRC_NODE_INITIAL);
+
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        Value *values[3] = {tac->dst, tac->src1, tac->src2};
+        for (int i = 0; i < 3; i++) {
+            Value *v = values[i];
+            if (v && v->vreg && v->live_range_preg && irc->node_states[v->vreg] == IRC_NODE_INITIAL) {
+                irc_set_node_state(irc, v->vreg, IRC_NODE_PRECOLORED);
+                irc->colors[v->vreg] = v->live_range_preg - 1;
+            }
+        }
+    }
+
+    for (int node = 1; node <= vreg_count; node++) {
+        if (irc->node_states[node] == IRC_NODE_PRECOLORED) irc->degrees[node] = IRC_PRECOLORED_DEGREE;
+        if (irc->node_states[node] != IRC_NODE_INITIAL) continue;
+
+        for (int i = 0; i < ig->degrees[node]; i++)
+            if (irc->node_states[ig->neighbors[node][i]]) irc->degrees[node]++;
+    }
+
+    // Find register to register moves that may be coalesced
+    int allocated_moves = 16;
+    irc->moves = wmalloc(allocated_moves * sizeof(IrcMove));
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (tac->operation != X_MOV || !tac->dst || !tac->dst->vreg || !tac->src1 || !tac->src1->vreg) continue;
+
+        int dst = tac->dst->vreg;
+        int src = tac->src1->vreg;
+        if (dst == src || !irc->node_states[dst] || !irc->node_states[src]) continue;
+        if (irc_is_precolored(irc, dst) && irc_is_precolored(irc, src)) continue;
+
+        if (irc->move_count + 1 == allocated_moves) {
+            allocated_moves *= 2;
+            irc->moves = wrealloc(irc->moves, allocated_moves * sizeof(IrcMove));
+        }
+
+        int move = ++irc->move_count;
+        irc->moves[move].dst = dst;
+        irc->moves[move].src = src;
+        irc->moves[move].state = 0;
+        irc_set_move_state(irc, move, IRC_MOVE_WORKLIST);
+        irc_add_node_move(irc, dst, move);
+        irc_add_node_move(irc, src, move);
+    }
+
+    while (irc->node_heads[IRC_NODE_INITIAL]) {
+        int node = irc->node_heads[IRC_NODE_INITIAL];
+        if (irc->degrees[node] >= physical_register_count)
+            irc_set_node_state(irc, node, IRC_NODE_SPILL);
+        else if (irc_is_move_related(irc, node))
+            irc_set_node_state(irc, node, IRC_NODE_FREEZE);
+        else
+            irc_set_node_state(irc, node, IRC_NODE_SIMPLIFY);
+    }
+
+    while (1) {
+        if (irc->node_heads[IRC_NODE_SIMPLIFY]) irc_simplify(irc);
+        else if (irc->move_heads[IRC_MOVE_WORKLIST]) irc_coalesce(irc);
+        else if (irc->node_heads[IRC_NODE_FREEZE]) irc_freeze(irc);
+        else if (irc->node_heads[IRC_NODE_SPILL]) irc_select_spill(irc);
+        else break;
+    }
+
+    irc_assign_colors(irc, function->preferred_live_range_preg_indexes);
+
+    int stack_register_count = function->stack_register_count;
+
+    for (int node = live_range_reserved_pregs_offset + 1; node <= vreg_count; node++) {
+        int state = irc->node_states[node];
+        if (state == IRC_NODE_COLORED || state == IRC_NODE_PRECOLORED)
+            vreg_locations[node].preg = irc->colors[node];
+        else if (state == IRC_NODE_SPILLED)
+            spill_vreg(function, vreg_locations, &stack_register_count, node, original_stack_indexes);
+    }
+
+    // Coalesced nodes share the location of the node they were coalesced with. A
+    // rematerialized node has no location to share, it gets its own instead.
+    for (int node = live_range_reserved_pregs_offset + 1; node <= vreg_count; node++) {
+        if (irc->node_states[node] != IRC_NODE_COALESCED) continue;
+        VregLocation *alias_location = &vreg_locations[irc_get_alias(irc, node)];
+        if (alias_location->preg == -1 && !alias_location->stack_index)
+            spill_vreg(function, vreg_locations, &stack_register_count, node, original_stack_indexes);
+        else
+            vreg_locations[node] = *alias_location;
+        if (debug_register_allocation) printf("Coalesced vreg %d with vreg %d\n", node, irc_get_alias(irc, node));
+    }
+
+    function->stack_register_count = stack_register_count;
+
+    for (int i = 0; i <= vreg_count; i++) wfree(irc->node_moves[i]);
+    wfree(irc->node_moves);
+    wfree(irc->node_move_counts);
+    wfree(irc->allocated_node_moves);
+    wfree(irc->node_states);
+    wfree(irc->node_next);
+    wfree(irc->node_prev);
+    wfree(irc->degrees);
+    wfree(irc->aliases);
+    wfree(irc->spill_costs);
+    wfree(irc->colors);
+    wfree(irc->moves);
+    wfree(irc->select_stack);
+    wfree(irc->marks);
+    wfree(irc);
+    wfree(original_stack_indexes);
+}
+
 // Called once at startup
 void init_allocate_registers(void) {
     // Which registers are preserved across function calls
@@ -330,52 +1074,28 @@ void init_allocate_registers(void) {
     live_range_reserved_pregs_offset = PHYSICAL_INT_REGISTER_COUNT + PHYSICAL_SSE_REGISTER_COUNT;
 }
 
-static void assign_vreg_locations(Function *function) {
-    VregLocation *vl;
-    VregLocation *function_vl = function->vreg_locations;
-
-    for (Tac *tac = function->ir; tac; tac = tac->next) {
-        if (tac->dst && tac->dst->vreg) {
-            vl = &function_vl[tac->dst->vreg];
-            if (vl->stack_index) {
-                if (tac->dst->live_range_preg)
-                    panic("Unexpectedly spilled a register for preg %s vreg %d in tac->dst",
-                        register_name(preg_map[tac->dst->live_range_preg - 1]), tac->dst->vreg);
-
-                tac->dst->stack_index = vl->stack_index;
-                tac->dst->spilled = 1;
-            }
-            else
-                tac->dst->preg = vl->preg;
-        }
-
-        if (tac->src1 && tac->src1->vreg) {
-            vl = &function_vl[tac->src1->vreg];
-            if (vl->stack_index) {
-                if (tac->src1->live_range_preg)
-                    panic("Unexpectedly spilled a register for preg %s vreg %d in tac->src1",
-                        register_name(preg_map[tac->src1->live_range_preg - 1]), tac->src1->vreg);
+// Set the preg or stack index of a value from its vreg's location. A value without either
+// is rematerialized: it's marked spilled with a zero stack index.
+static void assign_vreg_location(Function *function, Value *v, char *name) {
+    VregLocation *vl = &function->vreg_locations[v->vreg];
 
-                tac->src1->stack_index = vl->stack_index;
-                tac->src1->spilled = 1;
-            }
-            else
-                tac->src1->preg = vl->preg;
-        }
+    if (vl->stack_index || (vl->preg == -1 && function->rematerializations && function->rematerializations[v->vreg])) {
+        if (v->live_range_preg)
+            panic("Unexpectedly spilled a register for preg %s vreg %d in %s",
+                register_name(preg_map[v->live_range_preg - 1]), v->vreg, name);
 
-        if (tac->src2 && tac->src2->vreg) {
-            vl = &function_vl[tac->src2->vreg];
-            if (vl->stack_index) {
-                if (tac->src2->live_range_preg)
-                    panic("Unexpectedly spilled a register for preg %s vreg %d in tac->src2",
-                        register_name(preg_map[tac->src2->live_range_preg - 1]), tac->src2->vreg);
+        v->stack_index = vl->stack_index;
+        v->spilled = 1;
+    }
+    else
+        v->preg = vl->preg;
+}
 
-                tac->src2->stack_index = vl->stack_index;
-                tac->src2->spilled = 1;
-            }
-            else
-                tac->src2->preg = vl->preg;
-        }
+static void assign_vreg_locations(Function *function) {
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (tac->dst  && tac->dst ->vreg) assign_vreg_location(function, tac->dst,  "tac->dst");
+        if (tac->src1 && tac->src1->vreg) assign_vreg_location(function, tac->src1, "tac->src1");
+        if (tac->src2 && tac->src2->vreg) assign_vreg_location(function, tac->src2, "tac->src2");
     }
 
     function->local_symbol_count = 0; // This nukes ancient code that assumes local vars are on the stack
@@ -405,16 +1125,472 @@ void free_vreg_locations(Function *function) {
     wfree(function->vreg_locations);
 
 }
-void allocate_registers(Function *function) {
+// Returns 1 if the instruction computes its dst without reading any registers or memory
+// that can change. These are loads of integer constants and addresses of globals, string
+// literals and stack variables.
+static int is_rematerializable(Tac *tac) {
+    if (!tac->dst || !tac->dst->vreg || tac->dst->live_range_preg) return 0;
+    if (!tac->src1 || tac->src2) return 0;
+
+    if (tac->operation == X_MOV)
+        return tac->src1->is_constant && !is_floating_point_type(tac->src1->type);
+    else if (tac->operation == X_LEA)
+        return !tac->src1->vreg;
+    else
+        return 0;
+}
+
+// Find vregs with a single definition that is cheaper to repeat at each use than to store
+// on the stack and load again. The definition of a spilled rematerializable vreg is deleted,
+// so its contribution to the spill cost is removed, making these vregs preferred spill
+// candidates.
+static void make_rematerializations(Function *function) {
+    int vreg_count = function->vreg_count;
+    Tac **rematerializations = wcalloc(vreg_count + 1, sizeof(Tac *));
+    char *definition_counts = wcalloc(vreg_count + 1, sizeof(char));
+
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (!tac->dst || !tac->dst->vreg) continue;
+        int vreg = tac->dst->vreg;
+        if (definition_counts[vreg] < 2) definition_counts[vreg]++;
+        if (is_rematerializable(tac)) rematerializations[vreg] = tac;
+    }
+
+    int *spill_cost = function->spill_cost;
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (!tac->dst || !tac->dst->vreg) continue;
+        int vreg = tac->dst->vreg;
+        if (definition_counts[vreg] != 1) rematerializations[vreg] = 0;
+        else if (rematerializations[vreg] == tac && spill_cost) spill_cost[vreg] -= ten_power(tac->loop_depth);
+    }
+
+    wfree(definition_counts);
+
+    function->rematerializations = rematerializations;
+}
+
+void free_rematerializations(Function *function) {
+    free_and_null(function->rematerializations);
+}
+
+// Make an instruction that copies vreg src to a new vreg dst. The copy is 64 bits wide
+// for integers, so that pointers used as lvalues are copied in full.
+static Tac *make_split_copy(Value *v, int src, int dst) {
+    Tac *tac = new_instruction(X_MOV);
+    tac->src1 = new_value();
+    tac->src1->vreg = src;
+
+    if (is_sse_floating_point_type(v->type)) {
+        tac->src1->type = dup_type(v->type);
+        tac->x86_template = v->type->type == TYPE_FLOAT ? "movss %v1q, %vdq" : "movsd %v1q, %vdq";
+    }
+    else {
+        tac->src1->type = new_type(TYPE_LONG);
+        tac->x86_template = "movq %v1q, %vdq";
+    }
+
+    tac->src1->x86_size = 4;
+    tac->dst = dup_value(tac->src1);
+    tac->dst->vreg = dst;
+
+    return tac;
+}
+
+// Replace the uses of vreg from with vreg to in an instruction
+static void rename_split_uses(Tac *tac, int from, int to) {
+    if (tac->src1 && tac->src1->vreg == from) {
+        tac->src1 = dup_value(tac->src1);
+        tac->src1->vreg = to;
+    }
+
+    if (tac->src2 && tac->src2->vreg == from) {
+        tac->src2 = dup_value(tac->src2);
+        tac->src2->vreg = to;
+    }
+}
+
+static int uses_vreg(Tac *tac, int vreg) {
+    return (tac->src1 && tac->src1->vreg == vreg) || (tac->src2 && tac->src2->vreg == vreg);
+}
+
+// Returns the last instruction of a block, skipping the IR_NOPs of unreachable code after a jump
+static Tac *last_block_instruction(Block *block) {
+    Tac *tac = block->end;
+    while (tac != block->start && tac->operation == IR_NOP) tac = tac->prev;
+
+    return tac;
+}
+
+// Returns the block that a loop is entered from, or -1 if there isn't a single one that only
+// goes to the loop header. The split copies are added at the end of the block, so that they
+// are done once before the loop.
+static int loop_preheader(Function *function, Loop *loop) {
+    Graph *cfg = function->cfg;
+
+    int preheader = -1;
+    for (GraphEdge *e = cfg->nodes[loop->header].pred; e; e = e->next_pred) {
+        int pred = e->from->id;
+        if (in_set(loop->body, pred)) continue;
+        if (preheader != -1) return -1;
+        preheader = pred;
+    }
+
+    if (preheader == -1) return -1;
+
+    // Conditional jumps have two successors. A jump table can't have anything added after it.
+    int operation = last_block_instruction(&function->blocks[preheader])->operation;
+    if (cfg->nodes[preheader].succ->next_succ || operation == X_JMP_TABLE || operation == IR_JMP_TABLE) return -1;
+
+    return preheader;
+}
+
+// Add a copy at the end of a block, before its jump if it has one
+static void add_copy_to_end_of_block(Block *block, Tac *copy) {
+    Tac *last = last_block_instruction(block);
+    copy->loop_depth = last->loop_depth;
+
+    if (last->operation == X_JMP || last->operation == IR_JMP) {
+        insert_instruction(last, copy, 1);
+        if (block->start == last) block->start = copy;
+    }
+    else {
+        insert_instruction_after(last, copy);
+        if (block->end == last) block->end = copy;
+    }
+}
+
+// Split the live ranges of spilled vregs that are used in a loop but not assigned in it. The
+// value is copied into a new vreg before the loop, which is used instead inside the loop.
+// The new vreg gets the loop's higher spill cost, so it can stay in a register in the loop
+// while the original is spilled outside of it. spilled has spilled_vreg_count + 1 entries,
+// the vregs made by splitting are above it.
+// The loops are the natural loops of the loop nesting forest, so loops made with goto are
+// split too. Outer loops are split first. The new vregs aren't spilled, so a vreg is
+// only split once, in the outermost loop that uses it.
+static int split_live_ranges_around_loops(Function *function, char *spilled, int spilled_vreg_count, int *vreg_count) {
+    Block *blocks = function->blocks;
+    LoopForest *forest = function->loop_forest;
+    int count = 0;
+    char *assigned = wmalloc(spilled_vreg_count + 1);
+    char *used = wmalloc(spilled_vreg_count + 1);
+
+    int max_depth = 0;
+    for (int i = 0; i < forest->loop_count; i++)
+        if (forest->loops[i].depth > max_depth) max_depth = forest->loops[i].depth;
+
+    for (int depth = 1; depth <= max_depth; depth++) {
+        for (int i = 0; i < forest->loop_count; i++) {
+            Loop *loop = &forest->loops[i];
+            if (loop->depth != depth) continue;
+
+            int preheader = loop_preheader(function, loop);
+            if (preheader == -1) continue;
+
+            memset(assigned, 0, spilled_vreg_count + 1);
+            memset(used, 0, spilled_vreg_count + 1);
+
+            set_foreach(loop->body, block) {
+                for (Tac *tac = blocks[block].start; tac; tac = tac->next) {
+                    if (tac->dst && tac->dst->vreg && tac->dst->vreg <= spilled_vreg_count) assigned[tac->dst->vreg] = 1;
+                    if (tac->src1 && tac->src1->vreg && tac->src1->vreg <= spilled_vreg_count) used[tac->src1->vreg] = 1;
+                    if (tac->src2 && tac->src2->vreg && tac->src2->vreg <= spilled_vreg_count) used[tac->src2->vreg] = 1;
+                    if (tac == blocks[block].end) break;
+                }
+            }
+
+            for (int vreg = 1; vreg <= spilled_vreg_count; vreg++) {
+                if (!spilled[vreg] || !used[vreg] || assigned[vreg]) continue;
+
+                int new_vreg = ++*vreg_count;
+                Tac *copy = 0;
+                set_foreach(loop->body, block) {
+                    for (Tac *tac = blocks[block].start; tac; tac = tac->next) {
+                        if (uses_vreg(tac, vreg)) {
+                            if (!copy) {
+                                copy = make_split_copy(tac->src1 && tac->src1->vreg == vreg ? tac->src1 : tac->src2, vreg, new_vreg);
+                                add_copy_to_end_of_block(&blocks[preheader], copy);
+                            }
+
+                            rename_split_uses(tac, vreg, new_vreg);
+                        }
+
+                        if (tac == blocks[block].end) break;
+                    }
+                }
+
+                if (debug_register_allocation) printf("Split vreg %d into vreg %d in the loop with header block %d\n", vreg, new_vreg, loop->header);
+                count++;
+            }
+        }
+    }
+
+    wfree(assigned);
+    wfree(used);
+
+    return count;
+}
+
+// Split the live ranges of spilled vregs that are used more than once after a function call in
+// the same block. The value is copied into a new vreg before the first use. The new vreg isn't
+// live across the call, so it can use a caller saved register, and the spilled value is
+// loaded only once.
+static int split_live_ranges_around_calls(Function *function, char *spilled, int spilled_vreg_count, int *vreg_count) {
+    Block *blocks = function->blocks;
+    int block_count = function->cfg->node_count;
+    int count = 0;
+
+    Tac **first_uses = wcalloc(spilled_vreg_count + 1, sizeof(Tac *));
+    int *new_vregs = wcalloc(spilled_vreg_count + 1, sizeof(int));
+    int *active_vregs = wmalloc((spilled_vreg_count + 1) * sizeof(int));
+
+    for (int i = 0; i < block_count; i++) {
+        int active_vreg_count = 0;
+        int after_call = 0;
+
+        for (Tac *tac = blocks[i].start; tac; tac = tac->next) {
+            if (tac->operation == X_CALL) {
+                // End all runs of uses
+                for (int j = 0; j < active_vreg_count; j++) {
+                    first_uses[active_vregs[j]] = 0;
+                    new_vregs[active_vregs[j]] = 0;
+                }
+                active_vreg_count = 0;
+                after_call = 1;
+            }
+
+            for (int j = 1; after_call && j <= 2; j++) {
+                Value *v = j == 1 ? tac->src1 : tac->src2;
+                if (!v || !v->vreg || v->vreg > spilled_vreg_count || !spilled[v->vreg]) continue;
+                if (tac->dst && tac->dst->vreg == v->vreg) continue;
+                int vreg = v->vreg;
+
+                if (new_vregs[vreg]) {
+                    rename_split_uses(tac, vreg, new_vregs[vreg]);
+                }
+                else if (!first_uses[vreg]) {
+                    first_uses[vreg] = tac;
+                    active_vregs[active_vreg_count++] = vreg;
+                }
+                else {
+                    // Second use, split
+                    int new_vreg = ++*vreg_count;
+                    new_vregs[vreg] = new_vreg;
+                    insert_instruction(first_uses[vreg], make_split_copy(v, vreg, new_vreg), 1);
+                    rename_split_uses(first_uses[vreg], vreg, new_vreg);
+                    rename_split_uses(tac, vreg, new_vreg);
+                    if (debug_register_allocation) printf("Split vreg %d into vreg %d after a function call\n", vreg, new_vreg);
+                    count++;
+                }
+            }
+
+            // An assignment ends the run of uses
+            if (tac->dst && tac->dst->vreg && tac->dst->vreg <= spilled_vreg_count) {
+                first_uses[tac->dst->vreg] = 0;
+                new_vregs[tac->dst->vreg] = 0;
+            }
+
+            if (tac == blocks[i].end) break;
+        }
+
+        for (int j = 0; j < active_vreg_count; j++) {
+            first_uses[active_vregs[j]] = 0;
+            new_vregs[active_vregs[j]] = 0;
+        }
+    }
+
+    wfree(first_uses);
+    wfree(new_vregs);
+    wfree(active_vregs);
+
+    return count;
+}
+
+// Split the live ranges of vregs that were spilled to the stack, so that the new live ranges can
+// be allocated registers in the loops and after the function calls where they are used.
+// Returns the amount of splits.
+static int split_live_ranges(Function *function) {
+    int vreg_count = function->vreg_count;
+    char *spilled = wcalloc(vreg_count + 1, sizeof(char));
+
+    int spilled_count = 0;
+    for (int i = live_range_reserved_pregs_offset + 1; i <= vreg_count; i++) {
+        if (function->vreg_locations[i].stack_index) {
+            spilled[i] = 1;
+            spilled_count++;
+        }
+    }
+
+    int count = 0;
+    if (spilled_count) {
+        make_control_flow_graph(function);
+        make_block_dominance(function);
+        make_loop_nesting_forest(function);
+        int spilled_vreg_count = vreg_count;
+        count += split_live_ranges_around_loops(function, spilled, spilled_vreg_count, &vreg_count);
+        count += split_live_ranges_around_calls(function, spilled, spilled_vreg_count, &vreg_count);
+        free_loop_nesting_forest(function);
+        free_block_dominance(function);
+        free_control_flow_graph(function);
+    }
+
+    wfree(spilled);
+
+    return count;
+}
+
+// Estimate the cost of the spill code for the current allocation: the loads and stores of
+// vregs on the stack and the copies made by live range splitting, weighted by loop depth.
+// Vregs above original_vreg_count are made by live range splitting.
+static long spill_code_cost(Function *function, int original_vreg_count) {
+    VregLocation *vreg_locations = function->vreg_locations;
+    long cost = 0;
+
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        int weight = ten_power(tac->loop_depth);
+        if (tac->dst  && tac->dst ->vreg && vreg_locations[tac->dst ->vreg].stack_index) cost += weight;
+        if (tac->src1 && tac->src1->vreg && vreg_locations[tac->src1->vreg].stack_index) cost += weight;
+        if (tac->src2 && tac->src2->vreg && vreg_locations[tac->src2->vreg].stack_index) cost += weight;
+        if (tac->dst  && tac->dst ->vreg > original_vreg_count) cost += weight;
+    }
+
+    return cost;
+}
+
+// Remove the copies made by live range splitting and rename the new vregs back. If
+// spilled_only is set, only the splits of new vregs that didn't get a register are undone
+// and the remaining new vregs are renumbered to follow the original ones. Returns the
+// number of splits that are kept.
+static int undo_live_range_splits(Function *function, int original_vreg_count, int spilled_only) {
+    int vreg_count = function->vreg_count;
+    int *original_vregs = wcalloc(vreg_count + 1, sizeof(int));
+    int *new_vregs = wcalloc(vreg_count + 1, sizeof(int));
+    int kept = 0;
+
+    // Keep the order of the new vregs, so that nothing is renamed if all splits are kept
+    if (spilled_only)
+        for (int vreg = original_vreg_count + 1; vreg <= vreg_count; vreg++)
+            if (function->vreg_locations[vreg].preg != -1) new_vregs[vreg] = original_vreg_count + ++kept;
+
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (!tac->dst || tac->dst->vreg <= original_vreg_count || new_vregs[tac->dst->vreg]) continue;
+
+        original_vregs[tac->dst->vreg] = tac->src1->vreg;
+        tac->operation = IR_NOP;
+        tac->dst = 0;
+        tac->src1 = 0;
+        tac->src2 = 0;
+        tac->x86_template = 0;
+    }
+
+    // A split copy before a loop can itself have a use that was split around a call
+    for (int vreg = original_vreg_count + 1; vreg <= vreg_count; vreg++) {
+        if (new_vregs[vreg]) continue;
+        while (original_vregs[vreg] > original_vreg_count && !new_vregs[original_vregs[vreg]])
+            original_vregs[vreg] = original_vregs[original_vregs[vreg]];
+        if (original_vregs[vreg] > original_vreg_count) original_vregs[vreg] = new_vregs[original_vregs[vreg]];
+    }
+
+    for (int vreg = original_vreg_count + 1; vreg <= vreg_count; vreg++)
+        if (new_vregs[vreg]) original_vregs[vreg] = new_vregs[vreg];
+
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        if (tac->dst && tac->dst->vreg > original_vreg_count) tac->dst->vreg = original_vregs[tac->dst->vreg];
+        if (tac->src1 && tac->src1->vreg > original_vreg_count) tac->src1->vreg = original_vregs[tac->src1->vreg];
+        if (tac->src2 && tac->src2->vreg > original_vreg_count) tac->src2->vreg = original_vregs[tac->src2->vreg];
+    }
+
+    wfree(original_vregs);
+    wfree(new_vregs);
+    function->vreg_count = original_vreg_count + kept;
+
+    return kept;
+}
+
+static void allocate_vreg_locations(Function *function) {
     init_vreg_locations(function);
+    if (opt_rematerialize) make_rematerializations(function);
 
     // Allocate integer registers
     int physical_int_register_count = live_range_reserved_pregs_offset == 0 ? 0 : PHYSICAL_INT_REGISTER_COUNT;
-    allocate_registers_top_down(function, 1, physical_int_register_count, PC_INT);
+    if (opt_register_allocator == REGALLOC_LINEAR_SCAN)
+        allocate_registers_linear_scan(function, 1, physical_int_register_count, PC_INT);
+    else if (opt_register_allocator == REGALLOC_IRC)
+        allocate_registers_irc(function, 1, physical_int_register_count, PC_INT);
+    else
+        allocate_registers_top_down(function, 1, physical_int_register_count, PC_INT);
 
     // Allocate floating point xmm* registers
     int physical_sse_register_count = live_range_reserved_pregs_offset == 0 ? 0 : PHYSICAL_SSE_REGISTER_COUNT;
-    allocate_registers_top_down(function, 13, physical_sse_register_count, PC_SSE);
+    if (opt_register_allocator == REGALLOC_LINEAR_SCAN)
+        allocate_registers_linear_scan(function, 13, physical_sse_register_count, PC_SSE);
+    else if (opt_register_allocator == REGALLOC_IRC)
+        allocate_registers_irc(function, 13, physical_sse_register_count, PC_SSE);
+    else
+        allocate_registers_top_down(function, 13, physical_sse_register_count, PC_SSE);
+}
+
+// Split the live ranges of spilled vregs and allocate again. The new allocation is only kept
+// if it has cheaper spill code, otherwise the splits are undone.
+static void split_live_ranges_and_allocate(Function *function, int local_stack_register_count) {
+    int vreg_count = function->vreg_count;
+    long cost = spill_code_cost(function, vreg_count);
+
+    if (!split_live_ranges(function)) return;
+
+    VregLocation *vreg_locations = function->vreg_locations;
+    Tac **rematerializations = function->rematerializations;
+    int stack_register_count = function->stack_register_count;
+    function->vreg_locations = 0;
+    function->rematerializations = 0;
+    function->stack_register_count = local_stack_register_count;
+
+    remake_register_allocation_graph(function);
+    allocate_vreg_locations(function);
+
+    // A new vreg that is spilled anyway only adds a copy and a stack slot. Undo those splits
+    // and allocate again with the others, until all new vregs get a register.
+    while (1) {
+        int split_vreg_count = function->vreg_count;
+        int kept = undo_live_range_splits(function, vreg_count, 1);
+        if (kept == split_vreg_count - vreg_count) break;
+
+        free_vreg_locations(function);
+        free_rematerializations(function);
+        function->stack_register_count = local_stack_register_count;
+
+        if (!kept) {
+            function->vreg_locations = vreg_locations;
+            function->rematerializations = rematerializations;
+            function->stack_register_count = stack_register_count;
+            return;
+        }
+
+        remake_register_allocation_graph(function);
+        allocate_vreg_locations(function);
+    }
+
+    long split_cost = spill_code_cost(function, vreg_count);
+    if (debug_register_allocation) printf("Spill code cost %ld without and %ld with live range splitting\n", cost, split_cost);
+
+    if (split_cost < cost) {
+        wfree(vreg_locations);
+        wfree(rematerializations);
+        return;
+    }
+
+    undo_live_range_splits(function, vreg_count, 0);
+    free_vreg_locations(function);
+    free_rematerializations(function);
+    function->vreg_locations = vreg_locations;
+    function->rematerializations = rematerializations;
+    function->stack_register_count = stack_register_count;
+}
+
+void allocate_registers(Function *function) {
+    int local_stack_register_count = function->stack_register_count;
+
+    allocate_vreg_locations(function);
+    if (opt_live_range_splitting) split_live_ranges_and_allocate(function, local_stack_register_count);
 
     // Remap SSA pregs which run from 0 to live_range_reserved_pregs_offset -1 to the actual
     // x86_64 physical register numbers.
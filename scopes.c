@@ -76,40 +76,51 @@ void exit_scope(void) {
     if (!cur_scope) panic("Attempt to exit the global scope");
 }
 
-// Add a symbol to the current scope
+// Add a symbol to the current scope. The symbol and tag maps are keyed by interned
+// identifiers, so that lookups through nested scopes hash the name only once.
 Symbol *new_symbol(char *identifier) {
     Symbol *symbol = wcalloc(1, sizeof(Symbol));
+    identifier = intern(identifier);
     symbol->identifier = identifier;
     append_to_list(cur_scope->symbol_list, symbol);
-    strmap_put(cur_scope->symbols, identifier, symbol);
+    strmap_put_interned(cur_scope->symbols, identifier, symbol);
     symbol->scope = cur_scope;
 
     return symbol;
 }
 
-// Search for a symbol in a scope and recurse to parents if not found.
-// Returns zero if not found in any parents
+// Search for a symbol in a scope and recurse to parents if not found. The name must be
+// interned. Returns zero if not found in any parents
 Symbol *lookup_symbol(char *name, Scope *scope, int recurse) {
-    Symbol *symbol = strmap_get(scope->symbols, name);
-    if (symbol) return symbol;
-    else if (recurse && scope->parent) return lookup_symbol(name, scope->parent, recurse);
-    else return 0;
+    while (scope) {
+        Symbol *symbol = strmap_get_interned(scope->symbols, name);
+        if (symbol) return symbol;
+        if (!recurse) return 0;
+        scope = scope->parent;
+    }
+
+    return 0;
 }
 
 Tag *new_tag(char *identifier) {
     Tag *tag = wcalloc(1, sizeof(Tag));
     append_to_list(allocated_tags, tag);
+    identifier = intern(identifier);
     tag->identifier = identifier;
-    strmap_put(cur_scope->tags, identifier, tag);
+    strmap_put_interned(cur_scope->tags, identifier, tag);
 
     return tag;
 }
 
-// Search for a tag in a scope and recurse to parents if not found.
-// Returns zero if not found in any parents
+// Search for a tag in a scope and recurse to parents if not found. The name must be
+// interned. Returns zero if not found in any parents
 Tag *lookup_tag(char *name, Scope *scope, int recurse) {
-    Tag *tag = strmap_get(scope->tags, name);
-    if (tag) return tag;
-    else if (recurse && scope->parent) return lookup_tag(name, scope->parent, recurse);
-    else return 0;
+    while (scope) {
+        Tag *tag = strmap_get_interned(scope->tags, name);
+        if (tag) return tag;
+        if (!recurse) return 0;
+        scope = scope->parent;
+    }
+
+    return 0;
 }
@@ -4,10 +4,27 @@
 
 #include "wcc.h"
 
+// Sets are bit vectors, packed into 64-bit words. Bits above max_value are always zero,
+// so the word-at-a-time operations don't need to mask the last word.
+
+static int popcount(unsigned long x) {
+    x = x - ((x >> 1) & 0x5555555555555555UL);
+    x = (x & 0x3333333333333333UL) + ((x >> 2) & 0x3333333333333333UL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+
+    return (x * 0x0101010101010101UL) >> 56;
+}
+
+// Count trailing zeros. x must be non-zero.
+static int ctz(unsigned long x) {
+    return popcount((x & -x) - 1);
+}
+
 Set *new_set(int max_value) {
     Set *result = wmalloc(sizeof(Set));
     result->max_value = max_value;
-    result->elements = wcalloc(max_value + 1, sizeof(char));
+    result->word_count = SET_WORD_COUNT(max_value);
+    result->elements = wcalloc(result->word_count, sizeof(unsigned long));
     result->cached_element_count = 0;
     result->cached_elements = 0;
 
@@ -21,18 +38,34 @@ void free_set(Set *s) {
 }
 
 void empty_set(Set *s) {
-    memset(s->elements, 0, (s->max_value + 1) * sizeof(char));
+    memset(s->elements, 0, s->word_count * sizeof(unsigned long));
 }
 
 Set *copy_set(Set *s) {
     Set *result = new_set(s->max_value);
-    memcpy(result->elements, s->elements, (s->max_value + 1) * sizeof(char));
+    memcpy(result->elements, s->elements, s->word_count * sizeof(unsigned long));
 
     return result;
 }
 
 void copy_set_to(Set *dst, Set *src) {
-    memcpy(dst->elements, src->elements, (src->max_value + 1) * sizeof(char));
+    memcpy(dst->elements, src->elements, src->word_count * sizeof(unsigned long));
+}
+
+// Return the smallest element > value, or -1 if there is none
+int set_next(Set *s, int value) {
+    value++;
+    if (value > s->max_value) return -1;
+
+    int word = value >> 6;
+    unsigned long bits = s->elements[word] & (~0UL << (value & 63));
+
+    while (1) {
+        if (bits) return (word << 6) + ctz(bits);
+        word++;
+        if (word == s->word_count) return -1;
+        bits = s->elements[word];
+    }
 }
 
 void cache_set_elements(Set *s) {
@@ -40,17 +73,17 @@ void cache_set_elements(Set *s) {
     int *cached_elements = s->cached_elements;
 
     int count = 0;
-    for (int i = 0; i <= s->max_value; i++)
-        if (s->elements[i]) cached_elements[count++] = i;
+    set_foreach(s, i) cached_elements[count++] = i;
 
     s->cached_element_count = count;
 }
 
 int set_len(Set *s) {
-    int max_value = s->max_value;
-    char *elements = s->elements;
+    int word_count = s->word_count;
+    unsigned long *elements = s->elements;
     int result = 0;
-    for (int i = 0; i <= max_value; i++) result += elements[i];
+    for (int i = 0; i < word_count; i++)
+        if (elements[i]) result += popcount(elements[i]);
 
     return result;
 }
@@ -58,38 +91,36 @@ int set_len(Set *s) {
 void print_set(Set *s) {
     int first = 1;
     printf("{");
-    for (int i = 0; i <= s->max_value; i++) {
-        if (s->elements[i]) {
-            if (!first) { printf(", "); }
-            printf("%d", i);
-            first = 0;
-        }
+    set_foreach(s, i) {
+        if (!first) { printf(", "); }
+        printf("%d", i);
+        first = 0;
     }
     printf("}");
 }
 
 void delete_from_set(Set *s, int value) {
     if (value > s->max_value) panic("Max set value of %d exceeded with %d in delete_from_set", s->max_value, value);
-    s->elements[value] = 0;
+    s->elements[value >> 6] &= ~(1UL << (value & 63));
 }
 
 int in_set(Set *s, int value) {
     if (value > s->max_value) panic("Max set value of %d exceeded with %d in in_set", s->max_value, value);
-    return s->elements[value] == 1;
+    return (s->elements[value >> 6] >> (value & 63)) & 1;
 }
 
 int set_eq(Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_eq");
 
-    return memcmp(s1->elements, s2->elements, (s1->max_value + 1) * sizeof(char)) ? 0 : 1;
+    return memcmp(s1->elements, s2->elements, s1->word_count * sizeof(unsigned long)) ? 0 : 1;
 }
 
 Set *set_intersection(Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_intersection");
 
     Set *result = new_set(s1->max_value);
-    for (int i = 0; i <= s1->max_value; i++)
-        result->elements[i] = s1->elements[i] && s2->elements[i];
+    for (int i = 0; i < s1->word_count; i++)
+        result->elements[i] = s1->elements[i] & s2->elements[i];
 
     return result;
 }
@@ -98,16 +129,16 @@ void set_intersection_to(Set *dst, Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_intersection_to");
     if (s1->max_value != dst->max_value) panic("Unequal set sizes in set_intersection_to");
 
-    for (int i = 0; i <= s1->max_value; i++)
-        dst->elements[i] = s1->elements[i] && s2->elements[i];
+    for (int i = 0; i < s1->word_count; i++)
+        dst->elements[i] = s1->elements[i] & s2->elements[i];
 }
 
 Set *set_union(Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_union");
 
     Set *result = new_set(s1->max_value);
-    for (int i = 0; i <= s1->max_value; i++)
-        result->elements[i] = s1->elements[i] || s2->elements[i];
+    for (int i = 0; i < s1->word_count; i++)
+        result->elements[i] = s1->elements[i] | s2->elements[i];
 
     return result;
 }
@@ -117,16 +148,16 @@ void set_union_to(Set *dst, Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_union_to");
     if (s1->max_value != dst->max_value) panic("Unequal set sizes in set_union_to");
 
-    for (int i = 0; i <= s1->max_value; i++)
-        dst->elements[i] = s1->elements[i] || s2->elements[i];
+    for (int i = 0; i < s1->word_count; i++)
+        dst->elements[i] = s1->elements[i] | s2->elements[i];
 }
 
 Set *set_difference(Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_difference");
 
     Set *result = new_set(s1->max_value);
-    for (int i = 0; i <= s1->max_value; i++)
-        result->elements[i] = s1->elements[i] && !s2->elements[i];
+    for (int i = 0; i < s1->word_count; i++)
+        result->elements[i] = s1->elements[i] & ~s2->elements[i];
 
     return result;
 }
@@ -135,6 +166,15 @@ void set_difference_to(Set *dst, Set *s1, Set *s2) {
     if (s1->max_value != s2->max_value) panic("Unequal set sizes in set_difference_to");
     if (s1->max_value != dst->max_value) panic("Unequal set sizes in set_difference_to");
 
-    for (int i = 0; i <= s1->max_value; i++)
-        dst->elements[i] = s1->elements[i] && !s2->elements[i];
+    for (int i = 0; i < s1->word_count; i++)
+        dst->elements[i] = s1->elements[i] & ~s2->elements[i];
+}
+
+// dst = dst U s1 U (s2 - s3)
+void set_union_difference_to(Set *dst, Set *s1, Set *s2, Set *s3) {
+    if (s1->max_value != s2->max_value || s2->max_value != s3->max_value) panic("Unequal set sizes in set_union_difference_to");
+    if (s1->max_value != dst->max_value) panic("Unequal set sizes in set_union_difference_to");
+
+    for (int i = 0; i < s1->word_count; i++)
+        dst->elements[i] |= s1->elements[i] | (s2->elements[i] & ~s3->elements[i]);
 }
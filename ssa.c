@@ -4,8 +4,6 @@
 
 #include "wcc.h"
 
-static List *allocated_phi_values;
-
 static void make_live_range_spill_cost(Function *function);
 
 int live_range_reserved_pregs_offset;
@@ -202,7 +200,7 @@ void make_control_flow_graph(Function *function) {
         // instructions later on will mess with the liveness analysis, leading to
         // incorrect live ranges for the code that _is_ executed, so they need to get
         // excluded.
-        if ((tac->operation == IR_JMP || tac->operation == X_JMP) && tac->next && !tac->next->label) {
+        if ((tac->operation == IR_JMP || tac->operation == X_JMP || tac->operation == IR_JMP_TABLE || tac->operation == X_JMP_TABLE) && tac->next && !tac->next->label) {
             while (tac->next && !tac->next->label) {
                 tac = tac->next;
 
@@ -239,6 +237,19 @@ void make_control_flow_graph(Function *function) {
                     if (blocks[j].start->label == label)
                         add_graph_edge(cfg, i, j);
             }
+            else if (tac->operation == IR_JMP_TABLE || tac->operation == X_JMP_TABLE) {
+                JumpTable *jump_table = tac->src2->jump_table;
+                for (int j = 0; j < block_count; j++) {
+                    int label = blocks[j].start->label;
+                    if (!label) continue;
+                    for (int k = 0; k < jump_table->count; k++) {
+                        if (jump_table->labels[k] == label) {
+                            add_graph_edge(cfg, i, j);
+                            break;
+                        }
+                    }
+                }
+            }
             else if (tac->operation != IR_RETURN && tac->next && tac->next->label)
                 // For normal instructions, check if the next instruction is a label, if so it's an edge
                 add_graph_edge(cfg, i, i + 1);
@@ -247,7 +258,7 @@ void make_control_flow_graph(Function *function) {
                 add_graph_edge(cfg, i, i + 1);
 
             if (tac == blocks[i].end) break;
-            if (tac->operation == IR_JMP || tac->operation == X_JMP) break;
+            if (tac->operation == IR_JMP || tac->operation == X_JMP || tac->operation == IR_JMP_TABLE || tac->operation == X_JMP_TABLE) break;
 
             tac = tac->next;
         }
@@ -503,6 +514,131 @@ static void free_block_dominance_frontiers(Function *function) {
     wfree(function->dominance_frontiers);
 }
 
+// Find the natural loops and nest them. An edge from a block to one of its dominators is a back
+// edge, and the loop body is the header plus all blocks that reach the latch without passing
+// through the header. Natural loops with different headers are either disjoint or nested, so
+// the parent of a loop is the smallest other loop that contains its header.
+// The loop depth of each block is also set on its instructions.
+void make_loop_nesting_forest(Function *function) {
+    Graph *cfg = function->cfg;
+    Set **dominance = function->dominance;
+    int block_count = cfg->node_count;
+
+    LoopForest *forest = wcalloc(1, sizeof(LoopForest));
+    Loop *loops = wcalloc(block_count, sizeof(Loop));
+    int *header_loops = wmalloc(block_count * sizeof(int));
+    int *stack = wmalloc(block_count * sizeof(int));
+    int loop_count = 0;
+
+    for (int i = 0; i < block_count; i++) header_loops[i] = -1;
+
+    for (int i = 0; i < cfg->edge_count; i++) {
+        int latch = cfg->edges[i].from->id;
+        int header = cfg->edges[i].to->id;
+        if (!in_set(dominance[latch], header)) continue;
+
+        if (header_loops[header] == -1) {
+            header_loops[header] = loop_count;
+            Loop *loop = &loops[loop_count++];
+            loop->header = header;
+            loop->body = new_set(block_count);
+            loop->latches = new_set(block_count);
+            add_to_set(loop->body, header);
+        }
+
+        Loop *loop = &loops[header_loops[header]];
+        add_to_set(loop->latches, latch);
+
+        // Walk the predecessors backwards from the latch until the header is reached
+        int stack_size = 0;
+        if (!in_set(loop->body, latch)) {
+            add_to_set(loop->body, latch);
+            stack[stack_size++] = latch;
+        }
+
+        while (stack_size) {
+            int block = stack[--stack_size];
+            for (GraphEdge *e = cfg->nodes[block].pred; e; e = e->next_pred) {
+                int pred = e->from->id;
+                if (in_set(loop->body, pred) || !in_set(dominance[pred], header)) continue;
+                add_to_set(loop->body, pred);
+                stack[stack_size++] = pred;
+            }
+        }
+    }
+
+    int *body_sizes = wmalloc((loop_count + 1) * sizeof(int));
+    for (int i = 0; i < loop_count; i++) body_sizes[i] = set_len(loops[i].body);
+
+    for (int i = 0; i < loop_count; i++) {
+        loops[i].parent = -1;
+        for (int j = 0; j < loop_count; j++) {
+            if (i == j || !in_set(loops[j].body, loops[i].header)) continue;
+            if (loops[i].parent == -1 || body_sizes[j] < body_sizes[loops[i].parent]) loops[i].parent = j;
+        }
+    }
+
+    for (int i = 0; i < loop_count; i++)
+        for (int j = i; j != -1; j = loops[j].parent) loops[i].depth++;
+
+    int *block_loops = wmalloc(block_count * sizeof(int));
+    int *block_depths = wcalloc(block_count, sizeof(int));
+    for (int i = 0; i < block_count; i++) block_loops[i] = -1;
+
+    for (int i = 0; i < loop_count; i++) {
+        set_foreach(loops[i].body, block) {
+            if (loops[i].depth > block_depths[block]) {
+                block_loops[block] = i;
+                block_depths[block] = loops[i].depth;
+            }
+        }
+    }
+
+    Block *blocks = function->blocks;
+    for (int i = 0; i < block_count; i++) {
+        for (Tac *tac = blocks[i].start; tac; tac = tac->next) {
+            tac->loop_depth = block_depths[i];
+            if (tac == blocks[i].end) break;
+        }
+    }
+
+    forest->loop_count = loop_count;
+    forest->loops = loops;
+    forest->block_loops = block_loops;
+    forest->block_depths = block_depths;
+    function->loop_forest = forest;
+
+    wfree(header_loops);
+    wfree(stack);
+    wfree(body_sizes);
+
+    if (debug_ssa_loops) {
+        printf("\nLoops:\n");
+        for (int i = 0; i < loop_count; i++) {
+            printf("%d: header=%d parent=%d depth=%d body=", i, loops[i].header, loops[i].parent, loops[i].depth);
+            print_set(loops[i].body);
+            printf(" latches=");
+            print_set(loops[i].latches);
+            printf("\n");
+        }
+    }
+}
+
+void free_loop_nesting_forest(Function *function) {
+    LoopForest *forest = function->loop_forest;
+    if (!forest) return;
+
+    for (int i = 0; i < forest->loop_count; i++) {
+        free_set(forest->loops[i].body);
+        free_set(forest->loops[i].latches);
+    }
+
+    wfree(forest->loops);
+    wfree(forest->block_loops);
+    wfree(forest->block_depths);
+    free_and_null(function->loop_forest);
+}
+
 void analyze_dominance(Function *function) {
     sanity_test_ir_linkage(function);
     make_vreg_count(function, 0);
@@ -510,9 +646,11 @@ void analyze_dominance(Function *function) {
     make_block_dominance(function);
     make_block_immediate_dominators(function);
     make_block_dominance_frontiers(function);
+    make_loop_nesting_forest(function);
 }
 
 void free_dominance(Function *function) {
+    free_loop_nesting_forest(function);
     free_block_dominance_frontiers(function);
     free_block_immediate_dominators(function);
     free_block_dominance(function);
@@ -536,20 +674,23 @@ void make_uevar_and_varkill(Function *function) {
     Block *blocks = function->blocks;
     int block_count = function->cfg->node_count;
 
-    function->uevar = wcalloc(block_count, sizeof(LongSet *));
-    function->varkill = wcalloc(block_count, sizeof(LongSet *));
+    make_vreg_count(function, 0);
+    int vreg_count = function->vreg_count;
+
+    function->uevar = wcalloc(block_count, sizeof(Set *));
+    function->varkill = wcalloc(block_count, sizeof(Set *));
 
     for (int i = 0; i < block_count; i++) {
-        LongSet *uevar = new_longset();
-        LongSet *varkill = new_longset();
+        Set *uevar = new_set(vreg_count);
+        Set *varkill = new_set(vreg_count);
         function->uevar[i] = uevar;
         function->varkill[i] = varkill;
 
         Tac *tac = blocks[i].start;
         while (1) {
-            if (tac->src1 && tac->src1->vreg && !longset_in(varkill, tac->src1->vreg)) longset_add(uevar, tac->src1->vreg);
-            if (tac->src2 && tac->src2->vreg && !longset_in(varkill, tac->src2->vreg)) longset_add(uevar, tac->src2->vreg);
-            if (tac->dst && tac->dst->vreg) longset_add(varkill, tac->dst->vreg);
+            if (tac->src1 && tac->src1->vreg && !in_set(varkill, tac->src1->vreg)) add_to_set(uevar, tac->src1->vreg);
+            if (tac->src2 && tac->src2->vreg && !in_set(varkill, tac->src2->vreg)) add_to_set(uevar, tac->src2->vreg);
+            if (tac->dst && tac->dst->vreg) add_to_set(varkill, tac->dst->vreg);
 
             if (tac == blocks[i].end) break;
             tac = tac->next;
@@ -560,9 +701,9 @@ void make_uevar_and_varkill(Function *function) {
         printf("\nuevar & varkills:\n");
         for (int i = 0; i < block_count; i++) {
             printf("%d: uevar=", i);
-            print_longset(function->uevar[i]);
+            print_set(function->uevar[i]);
             printf(" varkill=");
-            print_longset(function->varkill[i]);
+            print_set(function->varkill[i]);
             printf("\n");
         }
     }
@@ -572,142 +713,64 @@ void free_uevar_and_varkill(Function *function) {
     int block_count = function->cfg->node_count;
 
     for (int i = 0; i < block_count; i++) {
-        free_longset(function->uevar[i]);
-        free_longset(function->varkill[i]);
+        free_set(function->uevar[i]);
+        free_set(function->varkill[i]);
     }
 
     wfree(function->uevar);
     wfree(function->varkill);
 }
 
-// Page 447 of Engineering a compiler
-void make_liveout(Function *function) {
-    Graph *cfg = function->cfg;
-    int block_count = cfg->node_count;
-
-    function->liveout = wcalloc(block_count, sizeof(LongSet *));
+// Recalculate the liveout of a block from its successors.
+// liveout(b) = U (uevar(s) U (liveout(s) - varkill(s))) for all successors s of b
+static int liveout_transfer(Function *function, int block, void *context) {
+    Set *unions = context;
 
-    make_vreg_count(function, 0);
-    int vreg_count = function->vreg_count;
-    int **block_uevars = wmalloc(block_count * sizeof(int *));
+    empty_set(unions);
+    for (GraphEdge *e = function->cfg->nodes[block].succ; e; e = e->next_succ) {
+        int successor_block = e->to->id;
+        set_union_difference_to(unions, function->uevar[successor_block], function->liveout[successor_block], function->varkill[successor_block]);
+    }
 
-    // Keep track of versions of liveouts. Everytime a block liveout changes, the
-    // version number is incremented. This is used to avoid recalculating the liveouts
-    // repeatedly.
-    int *liveout_versions = wcalloc(block_count, sizeof(int));
+    if (set_eq(function->liveout[block], unions)) return 0;
 
-    int **successor_liveout_versions = wcalloc(block_count, sizeof(int *));
+    copy_set_to(function->liveout[block], unions);
 
-    for (int i = 0; i < block_count; i++) {
-        block_uevars[i] = wcalloc(vreg_count + 1, sizeof(int));
+    return 1;
+}
 
-        successor_liveout_versions[i] = wcalloc(block_count, sizeof(int));
+// Page 447 of Engineering a compiler
+void make_liveout(Function *function) {
+    Graph *cfg = function->cfg;
+    int block_count = cfg->node_count;
+    int vreg_count = function->vreg_count;
 
-        liveout_versions[i] = 1;
-        int j = 0;
-        int *bue = block_uevars[i];
-        LongSet *uevar = function->uevar[i];
-        for (LongSetIterator it = longset_iterator(uevar); !longset_iterator_finished(&it); longset_iterator_next(&it), j++)
-            bue[j] = longset_iterator_element(&it);
-    }
+    function->liveout = wcalloc(block_count, sizeof(Set *));
 
     // Set all liveouts to {0}
     for (int i = 0; i < block_count; i++)
-        function->liveout[i] = new_longset();
+        function->liveout[i] = new_set(vreg_count);
 
     if (debug_ssa_liveout) printf("Doing liveout on %d blocks\n", block_count);
 
-    LongSet *unions = new_longset();
-
-    int changed = 1;
-    while (changed) {
-        changed = 0;
-
-        for (int i = 0; i < block_count; i++) {
-            int *block_successor_liveout_versions = successor_liveout_versions[i];
-
-            // Check to see if any of the successor liveouts have changed. If they
-            // haven't, the entire calculation can be skipped for this block.
-            int successor = 0;
-            int match = 1;
-            GraphEdge *e = cfg->nodes[i].succ;
-            while (e) {
-                int successor_block = e->to->id;
-
-                if (block_successor_liveout_versions[successor] != liveout_versions[successor_block]) {
-                    match = 0;
-                    break;
-                }
-
-                e = e->next_succ;
-                successor++;
-            }
-
-            if (match) continue;
-
-            successor = 0;
-            e = cfg->nodes[i].succ;
-            while (e) {
-                // Got a successor edge from i -> successor_block
-                int successor_block = e->to->id;
-                LongSet *successor_block_liveout = function->liveout[successor_block];
-                LongSet *successor_block_varkill = function->varkill[successor_block];
-                int *successor_block_uevars = block_uevars[successor_block];
-                block_successor_liveout_versions[successor] = liveout_versions[successor_block];
-
-                for (int *i = successor_block_uevars; *i; i++)
-                    longset_add(unions, *i);
-
-                longset_foreach(successor_block_liveout, it) {
-                    long vreg = longset_iterator_element(&it);
-                    if (!longset_in(successor_block_varkill, vreg))
-                        longset_add(unions, vreg);
-
-                }
-
-                e = e->next_succ;
-                successor++;
-            }
-            block_successor_liveout_versions[successor] = 0;
-
-            // Ensure unions has been emptied before the next iteration
-            if (!longset_eq(function->liveout[i], unions)) {
-                liveout_versions[i]++;
-                free_longset(function->liveout[i]);
-                function->liveout[i] = unions;
-                unions = new_longset();
-                changed = 1;
-            }
-            else
-                longset_empty(unions);
-        }
-    }
-
-    free_longset(unions);
+    Set *unions = new_set(vreg_count);
+    solve_dataflow(function, DATAFLOW_BACKWARD, liveout_transfer, unions);
+    free_set(unions);
 
     if (debug_ssa_liveout) {
         printf("\nLiveouts:\n");
         for (int i = 0; i < block_count; i++) {
             printf("%d: ", i);
-            print_longset(function->liveout[i]);
+            print_set(function->liveout[i]);
             printf("\n");
         }
     }
-
-    for (int i = 0; i < block_count; i++) {
-        wfree(block_uevars[i]);
-        wfree(successor_liveout_versions[i]);
-    }
-    wfree(block_uevars);
-
-    wfree(liveout_versions);
-    wfree(successor_liveout_versions);
 }
 
 void free_liveout(Function *function) {
     int block_count = function->cfg->node_count;
     for (int i = 0; i < block_count; i++)
-        free_longset(function->liveout[i]);
+        free_set(function->liveout[i]);
 
     wfree(function->liveout);
 }
@@ -772,8 +835,6 @@ void free_globals_and_var_blocks(Function *function) {
 
 // Algorithm on page 501 of engineering a compiler
 void insert_phi_functions(Function *function) {
-    allocated_phi_values = new_list(1024);
-
     Block *blocks = function->blocks;
     Graph *cfg = function->cfg;
     int block_count = cfg->node_count;
@@ -783,20 +844,15 @@ void insert_phi_functions(Function *function) {
     Set **phi_functions = wmalloc(block_count * sizeof(Set *));
     for (int i = 0; i < block_count; i++) phi_functions[i] = new_set(vreg_count);
 
-    for (int global = 0; global <= globals->max_value; global++) {
-        if (!globals->elements[global]) continue;
-
+    set_foreach(globals, global) {
         Set *work_list = copy_set(function->var_blocks[global]);
 
         while (set_len(work_list)) {
-            for (int b = 0; b <= work_list->max_value; b++) {
-                if (!work_list->elements[b]) continue;
+            set_foreach(work_list, b) {
                 delete_from_set(work_list, b);
 
                 Set *df = function->dominance_frontiers[b];
-                for (int d = 0; d <= df->max_value; d++) {
-                    if (!df->elements[d]) continue;
-
+                set_foreach(df, d) {
                     if (!in_set(phi_functions[d], global)) {
                         add_to_set(phi_functions[d], global);
                         add_to_set(work_list, d);
@@ -823,9 +879,10 @@ void insert_phi_functions(Function *function) {
 
         Set *vars = phi_functions[b];
         for (int v = vreg_count; v >= 0; v--) {
-            if (!vars->elements[v]) continue;
+            if (!in_set(vars, v)) continue;
 
             Tac *tac = new_instruction(IR_PHI_FUNCTION);
+            tac->loop_depth = blocks[b].start->loop_depth;
             tac->dst  = new_value();
             tac->dst ->type = new_type(TYPE_LONG);
             tac->dst-> vreg = v;
@@ -834,8 +891,7 @@ void insert_phi_functions(Function *function) {
             GraphEdge *e = cfg->nodes[b].pred;
             while (e) { predecessor_count++; e = e->next_pred; }
 
-            Value *phi_values = wcalloc(predecessor_count + 1, sizeof(Value));
-            append_to_list(allocated_phi_values, phi_values);
+            Value *phi_values = arena_alloc(function->arena, (predecessor_count + 1) * sizeof(Value));
 
             for (int i = 0; i < predecessor_count; i++) {
                 init_value(&phi_values[i]);
@@ -865,13 +921,6 @@ void free_phi_functions(Function *function) {
     int block_count = function->cfg->node_count;
     for (int i = 0; i < block_count; i++) free_set(function->phi_functions[i]);
     wfree(function->phi_functions);
-
-
-    for (int i = 0; i < allocated_phi_values->length; i++) {
-        wfree(allocated_phi_values->elements[i]);
-    }
-
-    free_list(allocated_phi_values);
 }
 
 static int new_subscript(Stack **stack, int *counters, int n) {
@@ -1266,24 +1315,80 @@ void free_vreg_preg_classes(Function *function) {
     free_and_null(function->vreg_preg_classes);
 }
 
+InterferenceGraph *new_ig(int node_count) {
+    InterferenceGraph *ig = wmalloc(sizeof(InterferenceGraph));
+    ig->node_count = node_count;
+
+    long matrix_size = (long) (node_count + 1) * (node_count + 2) / 2;
+    ig->matrix = wcalloc((matrix_size >> 6) + 1, sizeof(unsigned long));
+    ig->neighbors = wcalloc(node_count + 1, sizeof(int *));
+    ig->degrees = wcalloc(node_count + 1, sizeof(int));
+    ig->allocated_neighbors = wcalloc(node_count + 1, sizeof(int));
+
+    return ig;
+}
+
+void free_ig(InterferenceGraph *ig) {
+    for (int i = 0; i <= ig->node_count; i++)
+        if (ig->neighbors[i]) wfree(ig->neighbors[i]);
+
+    wfree(ig->matrix);
+    wfree(ig->neighbors);
+    wfree(ig->degrees);
+    wfree(ig->allocated_neighbors);
+    wfree(ig);
+}
+
+static void append_ig_neighbor(InterferenceGraph *ig, int node, int neighbor) {
+    if (ig->degrees[node] == ig->allocated_neighbors[node]) {
+        ig->allocated_neighbors[node] = ig->allocated_neighbors[node] ? ig->allocated_neighbors[node] * 2 : 8;
+        ig->neighbors[node] = wrealloc(ig->neighbors[node], ig->allocated_neighbors[node] * sizeof(int));
+    }
+
+    ig->neighbors[node][ig->degrees[node]++] = neighbor;
+}
+
+void ig_add_edge(InterferenceGraph *ig, int to, int from) {
+    // In functions with few vregs, the physical register live range indexes can
+    // exceed the node count. There are no vregs to constrain, so the edges can be ignored.
+    if (to > ig->node_count || from > ig->node_count) return;
+
+    long index = IG_MATRIX_INDEX(to, from);
+    unsigned long bit = 1UL << (index & 63);
+    if (ig->matrix[index >> 6] & bit) return;
+    ig->matrix[index >> 6] |= bit;
+
+    append_ig_neighbor(ig, to, from);
+    if (to != from) append_ig_neighbor(ig, from, to);
+}
+
+// Prevent a vreg from getting allocated the physical register preg_reg_index. The constraint
+// is either an interference graph edge or, if ig is null, a bit in the live intervals.
+static void add_preg_constraint(InterferenceGraph *ig, LiveIntervals *li, int preg_reg_index, int vreg) {
+    if (ig)
+        add_ig_edge(ig, preg_reg_index, vreg);
+    else if (vreg > live_range_reserved_pregs_offset)
+        li->preg_constraints[vreg] |= 1 << (preg_reg_index - 1);
+}
+
 // Add edges to a physical register for all live variables, preventing the physical register from
 // getting used.
-static void clobber_livenow(char *ig, int vreg_count, LongSet *livenow, Tac *tac, int preg_reg_index) {
+static void clobber_livenow(InterferenceGraph *ig, LiveIntervals *li, Set *livenow, Tac *tac, int preg_reg_index) {
     if (debug_ssa_interference_graph) printf("Clobbering livenow for pri=%d\n", preg_reg_index);
 
-    longset_foreach(livenow, it)
-        add_ig_edge(ig, vreg_count, preg_reg_index, longset_iterator_element(&it));
+    set_foreach(livenow, it_vreg)
+        add_preg_constraint(ig, li, preg_reg_index, it_vreg);
 }
 
 // Add edges to a physical register for all live variables and all values in an instruction
-static void clobber_tac_and_livenow(char *ig, int vreg_count, LongSet *livenow, Tac *tac, int preg_reg_index) {
+static void clobber_tac_and_livenow(InterferenceGraph *ig, LiveIntervals *li, Set *livenow, Tac *tac, int preg_reg_index) {
     if (debug_ssa_interference_graph) printf("Adding edges for pri=%d\n", preg_reg_index);
 
-    clobber_livenow(ig, vreg_count, livenow, tac, preg_reg_index);
+    clobber_livenow(ig, li, livenow, tac, preg_reg_index);
 
-    if (tac->dst  && tac->dst ->vreg) add_ig_edge(ig, vreg_count, preg_reg_index, tac->dst->vreg );
-    if (tac->src1 && tac->src1->vreg) add_ig_edge(ig, vreg_count, preg_reg_index, tac->src1->vreg);
-    if (tac->src2 && tac->src2->vreg) add_ig_edge(ig, vreg_count, preg_reg_index, tac->src2->vreg);
+    if (tac->dst  && tac->dst ->vreg) add_preg_constraint(ig, li, preg_reg_index, tac->dst->vreg );
+    if (tac->src1 && tac->src1->vreg) add_preg_constraint(ig, li, preg_reg_index, tac->src1->vreg);
+    if (tac->src2 && tac->src2->vreg) add_preg_constraint(ig, li, preg_reg_index, tac->src2->vreg);
 }
 
 static void print_physical_register_name_for_lr_reg_index(int preg_reg_index) {
@@ -1318,45 +1423,110 @@ static void print_physical_register_name_for_lr_reg_index(int preg_reg_index) {
     }
 }
 
-// Force a physical register to be assigned to vreg by the graph coloring by adding edges to all other pregs
-static void force_physical_register(char *ig, int vreg_count, LongSet *livenow, int vreg, int preg_reg_index, int preg_class) {
+// Force a physical register to be assigned to vreg by the graph coloring by adding edges to all other pregs.
+// The linear scan allocator assigns the physical register directly.
+static void force_physical_register(InterferenceGraph *ig, LiveIntervals *li, Set *livenow, int vreg, int preg_reg_index, int preg_class) {
     if (debug_ssa_interference_graph || debug_register_allocation) {
         printf("Forcing ");
         print_physical_register_name_for_lr_reg_index(preg_reg_index);
         printf(" onto vreg %d\n", vreg);
     }
 
-    longset_foreach(livenow, it) {
-        int it_vreg = longset_iterator_element(&it);
-        if (it_vreg != vreg) add_ig_edge(ig, vreg_count, preg_reg_index, it_vreg);
+    set_foreach(livenow, it_vreg) {
+        if (it_vreg != vreg) add_preg_constraint(ig, li, preg_reg_index, it_vreg);
+    }
+
+    if (!ig) {
+        li->fixed_pregs[vreg] = preg_reg_index;
+        return;
     }
 
     // Add edges to all non reserved physical registers
     int start = preg_class == PC_INT ? 1 : PHYSICAL_INT_REGISTER_COUNT + 1;
     int size = preg_class == PC_INT ? PHYSICAL_INT_REGISTER_COUNT : PHYSICAL_SSE_REGISTER_COUNT;
     for (int i = start; i < start + size; i++)
-        if (preg_reg_index != i) add_ig_edge(ig, vreg_count, vreg, i);
+        if (preg_reg_index != i) add_ig_edge(ig, vreg, i);
 }
 
-static void enforce_live_range_preg_for_preg(char *interference_graph, int vreg_count, LongSet *livenow, Value *value, int preg_class, int *arg_registers) {
+static void enforce_live_range_preg_for_preg(InterferenceGraph *interference_graph, LiveIntervals *li, Set *livenow, Value *value, int preg_class, int *arg_registers) {
     if (value && value && value->preg_class == preg_class && value->live_range_preg)
-        force_physical_register(interference_graph, vreg_count, livenow, value->vreg, value->live_range_preg, preg_class);
+        force_physical_register(interference_graph, li, livenow, value->vreg, value->live_range_preg, preg_class);
 }
 
 // For values that have live_range_preg set, add interference graph edges for all live ranges except live_range_preg
-static void enforce_live_range_preg(char *interference_graph, int vreg_count, LongSet *livenow, Value *value) {
-    enforce_live_range_preg_for_preg(interference_graph, vreg_count, livenow, value, PC_INT, int_arg_registers);
-    enforce_live_range_preg_for_preg(interference_graph, vreg_count, livenow, value, PC_SSE, sse_arg_registers);
+static void enforce_live_range_preg(InterferenceGraph *interference_graph, LiveIntervals *li, Set *livenow, Value *value) {
+    enforce_live_range_preg_for_preg(interference_graph, li, livenow, value, PC_INT, int_arg_registers);
+    enforce_live_range_preg_for_preg(interference_graph, li, livenow, value, PC_SSE, sse_arg_registers);
+}
+
+// Add the physical register constraints of an instruction: live_range_preg values, call clobbers and
+// instructions that use specific registers. livenow is the set of vregs live after the instruction.
+// The constraints go into either the interference graph or, if it's null, the live intervals.
+static void add_register_constraints(InterferenceGraph *interference_graph, LiveIntervals *li, Set *livenow, Tac *tac, int include_clobbers) {
+    enforce_live_range_preg(interference_graph, li, livenow, tac->dst);
+    enforce_live_range_preg(interference_graph, li, livenow, tac->src1);
+    enforce_live_range_preg(interference_graph, li, livenow, tac->src2);
+
+    if (include_clobbers && tac->operation == IR_CALL || tac->operation == X_CALL) {
+        // Integer arguments are clobbered
+        for (int j = 0; j < 6; j++) {
+            if (j == 2) continue; // RDX is a special case, see below
+            clobber_livenow(interference_graph, li, livenow, tac, int_arg_registers[j]);
+        }
+
+        // Unless the function returns something in rax, clobber rax
+        if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_RAX_INDEX))
+            clobber_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RAX_INDEX);
+
+        // Unless the function returns something in rdx, clobber rdx
+        if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_RDX_INDEX))
+            clobber_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RDX_INDEX);
+
+        // All SSE registers xmm2, xmm3, ... are clobbered
+        for (int j = 2; j < PHYSICAL_SSE_REGISTER_COUNT; j++)
+            clobber_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_XMM00_INDEX + j);
+
+        // Unless the function returns something in xmm0, clobber xmm0
+        if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_XMM00_INDEX))
+            clobber_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_XMM00_INDEX);
+        // Unless the function returns something in xmm1, clobber xmm1
+        if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_XMM01_INDEX))
+            clobber_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_XMM01_INDEX);
+
+        // If it's a function call from a pointer in a vreg, ensure it doesn't reside in RAX
+        if (tac->src1->vreg)
+            add_preg_constraint(interference_graph, li, LIVE_RANGE_PREG_RAX_INDEX, tac->src1->vreg);
+    }
+
+    if (tac->operation == IR_DIV || tac->operation == IR_MOD || tac->operation == X_IDIV) {
+        if (include_clobbers) {
+            clobber_tac_and_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RAX_INDEX);
+            clobber_tac_and_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RDX_INDEX);
+        }
+    }
+
+    if (include_clobbers && tac->operation == IR_BSHL || tac->operation == IR_BSHR) {
+        clobber_tac_and_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RCX_INDEX);
+    }
+
+    // Works together with the instruction rules. Ensure the shift value cannot be in rcx.
+    if (tac->operation == X_SHR && tac->prev->dst && tac->prev->dst->vreg && tac->prev->src1 && tac->prev->src1->vreg) {
+        clobber_tac_and_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RCX_INDEX);
+        add_preg_constraint(interference_graph, li, LIVE_RANGE_PREG_RCX_INDEX, tac->prev->dst->vreg);
+        add_preg_constraint(interference_graph, li, LIVE_RANGE_PREG_RCX_INDEX, tac->prev->src1->vreg);
+    }
+
+    if (tac->operation == X_LD_EQ_CMP)
+        clobber_tac_and_livenow(interference_graph, li, livenow, tac, LIVE_RANGE_PREG_RDX_INDEX);
 }
 
 static void print_interference_graph(Function *function) {
-    char *interference_graph = function->interference_graph;
+    InterferenceGraph *interference_graph = function->interference_graph;
     int vreg_count = function->vreg_count;
 
     for (int from = 1; from <= vreg_count; from++) {
-        int from_offset = from * vreg_count;
         for (int to = from + 1; to <= vreg_count; to++) {
-            if (interference_graph[from_offset + to])
+            if (ig_lookup(interference_graph, from, to))
                 printf("%-4d    %d\n", to, from);
         }
     }
@@ -1376,80 +1546,26 @@ void make_interference_graph(Function *function, int include_clobbers, int inclu
     int vreg_count = function->vreg_count;
     char *vreg_preg_classes = function->vreg_preg_classes;
 
-    char *interference_graph = wcalloc((vreg_count + 1) * (vreg_count + 1), sizeof(int));
+    InterferenceGraph *interference_graph = new_ig(vreg_count);
 
     Block *blocks = function->blocks;
     int block_count = function->cfg->node_count;
 
     for (int i = block_count - 1; i >= 0; i--) {
-        LongSet *livenow = longset_copy(function->liveout[i]);
+        Set *livenow = copy_set(function->liveout[i]);
 
         Tac *tac = blocks[i].end;
         while (tac) {
             if (debug_ssa_interference_graph) print_instruction(stdout, tac, 0);
 
-            enforce_live_range_preg(interference_graph, vreg_count, livenow, tac->dst);
-            enforce_live_range_preg(interference_graph, vreg_count, livenow, tac->src1);
-            enforce_live_range_preg(interference_graph, vreg_count, livenow, tac->src2);
-
-            if (include_clobbers && tac->operation == IR_CALL || tac->operation == X_CALL) {
-                // Integer arguments are clobbered
-                for (int j = 0; j < 6; j++) {
-                    if (j == 2) continue; // RDX is a special case, see below
-                    clobber_livenow(interference_graph, vreg_count, livenow, tac, int_arg_registers[j]);
-                }
-
-                // Unless the function returns something in rax, clobber rax
-                if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_RAX_INDEX))
-                    clobber_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RAX_INDEX);
-
-                // Unless the function returns something in rdx, clobber rdx
-                if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_RDX_INDEX))
-                    clobber_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RDX_INDEX);
-
-                // All SSE registers xmm2, xmm3, ... are clobbered
-                for (int j = 2; j < PHYSICAL_SSE_REGISTER_COUNT; j++)
-                    clobber_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_XMM00_INDEX + j);
-
-                // Unless the function returns something in xmm0, clobber xmm0
-                if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_XMM00_INDEX))
-                    clobber_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_XMM00_INDEX);
-                // Unless the function returns something in xmm1, clobber xmm1
-                if (!tac->src1->return_value_live_ranges || !in_set(tac->src1->return_value_live_ranges, LIVE_RANGE_PREG_XMM01_INDEX))
-                    clobber_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_XMM01_INDEX);
-
-                // If it's a function call from a pointer in a vreg, ensure it doesn't reside in RAX
-                if (tac->src1->vreg)
-                    add_ig_edge(interference_graph, vreg_count, LIVE_RANGE_PREG_RAX_INDEX, tac->src1->vreg);
-            }
-
-            if (tac->operation == IR_DIV || tac->operation == IR_MOD || tac->operation == X_IDIV) {
-                if (include_clobbers) {
-                    clobber_tac_and_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RAX_INDEX);
-                    clobber_tac_and_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RDX_INDEX);
-                }
-            }
-
-            if (include_clobbers && tac->operation == IR_BSHL || tac->operation == IR_BSHR) {
-                clobber_tac_and_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RCX_INDEX);
-            }
-
-            // Works together with the instruction rules. Ensure the shift value cannot be in rcx.
-            if (tac->operation == X_SHR && tac->prev->dst && tac->prev->dst->vreg && tac->prev->src1 && tac->prev->src1->vreg) {
-                clobber_tac_and_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RCX_INDEX);
-                add_ig_edge(interference_graph, vreg_count, tac->prev->dst->vreg, LIVE_RANGE_PREG_RCX_INDEX);
-                add_ig_edge(interference_graph, vreg_count, tac->prev->src1->vreg, LIVE_RANGE_PREG_RCX_INDEX);
-            }
-
-            if (tac->operation == X_LD_EQ_CMP)
-                clobber_tac_and_livenow(interference_graph, vreg_count, livenow, tac, LIVE_RANGE_PREG_RDX_INDEX);
+            add_register_constraints(interference_graph, 0, livenow, tac, include_clobbers);
 
             if (tac->dst && tac->dst->vreg) {
                 if (tac->operation == IR_RSUB && tac->src1->vreg) {
                     // Ensure that dst and src1 don't reside in the same preg.
                     // This allows codegen to generate code with just one operation while
                     // ensuring the other registers preserve their values.
-                    add_ig_edge(interference_graph, vreg_count, tac->src1->vreg, tac->dst->vreg);
+                    add_ig_edge(interference_graph, tac->src1->vreg, tac->dst->vreg);
                     if (debug_ssa_interference_graph) printf("added src1 <-> dst %d <-> %d\n", tac->src1->vreg, tac->dst->vreg);
                 }
 
@@ -1457,13 +1573,11 @@ void make_interference_graph(Function *function, int include_clobbers, int inclu
                     // Ensure that dst and src2 don't reside in the same preg.
                     // This allows codegen to generate code with just one mov and sub while
                     // ensuring the other registers preserve their values.
-                    add_ig_edge(interference_graph, vreg_count, tac->src2->vreg, tac->dst->vreg);
+                    add_ig_edge(interference_graph, tac->src2->vreg, tac->dst->vreg);
                     if (debug_ssa_interference_graph) printf("added src2 <-> dst %d <-> %d\n", tac->src2->vreg, tac->dst->vreg);
                 }
 
-                longset_foreach(livenow, it) {
-                    int it_vreg = longset_iterator_element(&it);
-
+                set_foreach(livenow, it_vreg) {
                     if (it_vreg == tac->dst->vreg) continue; // Ignore self assignment
                     if (tac->dst->preg_class != vreg_preg_classes[it_vreg]) continue;
 
@@ -1475,7 +1589,7 @@ void make_interference_graph(Function *function, int include_clobbers, int inclu
                         tac->operation == X_MOVS ||
                         tac->operation == X_MOVC
                        ) && tac->src1 && tac->src1->vreg && tac->src1->vreg == it_vreg) continue;
-                    add_ig_edge(interference_graph, vreg_count, tac->dst->vreg, it_vreg);
+                    add_ig_edge(interference_graph, tac->dst->vreg, it_vreg);
                     if (debug_ssa_interference_graph) printf("added dst <-> lr %d <-> %d\n", tac->dst->vreg, it_vreg);
                 }
             }
@@ -1483,37 +1597,37 @@ void make_interference_graph(Function *function, int include_clobbers, int inclu
             if (include_instrsel_constraints && tac->operation != IR_MOVE) {
                 // Add edges necessary for instruction selection constraints:
                 // dst != src1, dst != src2, src1 != src2,
-                if (tac-> dst && tac-> dst->vreg && tac->src1 && tac->src1->vreg) add_ig_edge(interference_graph, vreg_count, tac-> dst->vreg, tac->src1->vreg);
-                if (tac-> dst && tac-> dst->vreg && tac->src2 && tac->src2->vreg) add_ig_edge(interference_graph, vreg_count, tac-> dst->vreg, tac->src2->vreg);
-                if (tac->src1 && tac->src1->vreg && tac->src2 && tac->src2->vreg) add_ig_edge(interference_graph, vreg_count, tac->src1->vreg, tac->src2->vreg);
+                if (tac-> dst && tac-> dst->vreg && tac->src1 && tac->src1->vreg) add_ig_edge(interference_graph, tac-> dst->vreg, tac->src1->vreg);
+                if (tac-> dst && tac-> dst->vreg && tac->src2 && tac->src2->vreg) add_ig_edge(interference_graph, tac-> dst->vreg, tac->src2->vreg);
+                if (tac->src1 && tac->src1->vreg && tac->src2 && tac->src2->vreg) add_ig_edge(interference_graph, tac->src1->vreg, tac->src2->vreg);
             }
 
             if (tac->dst && tac->dst->vreg) {
                 if (debug_ssa_interference_graph)
                     printf("livenow: -= %d -> ", tac->dst->vreg);
-                longset_delete(livenow, tac->dst->vreg);
-                if (debug_ssa_interference_graph) { print_longset(livenow); printf("\n"); }
+                delete_from_set(livenow, tac->dst->vreg);
+                if (debug_ssa_interference_graph) { print_set(livenow); printf("\n"); }
             }
 
             if (tac->src1 && tac->src1->vreg) {
                 if (debug_ssa_interference_graph)
                     printf("livenow: += (src1) %d -> ", tac->src1->vreg);
-                longset_add(livenow, tac->src1->vreg);
-                if (debug_ssa_interference_graph) { print_longset(livenow); printf("\n"); }
+                add_to_set(livenow, tac->src1->vreg);
+                if (debug_ssa_interference_graph) { print_set(livenow); printf("\n"); }
             }
 
             if (tac->src2 && tac->src2->vreg) {
                 if (debug_ssa_interference_graph)
                     printf("livenow: += (src2) %d -> ", tac->src2->vreg);
-                longset_add(livenow, tac->src2->vreg);
-                if (debug_ssa_interference_graph) { print_longset(livenow); printf("\n"); }
+                add_to_set(livenow, tac->src2->vreg);
+                if (debug_ssa_interference_graph) { print_set(livenow); printf("\n"); }
             }
 
             if (tac == blocks[i].start) break;
             tac = tac->prev;
         }
 
-        free_longset(livenow);
+        free_set(livenow);
     }
 
     function->interference_graph = interference_graph;
@@ -1526,16 +1640,108 @@ void make_interference_graph(Function *function, int include_clobbers, int inclu
 
 void free_interference_graph(Function *function) {
     if (function->interference_graph) {
-        wfree(function->interference_graph);
+        free_ig(function->interference_graph);
         function->interference_graph = 0;
     }
 }
 
-// Copy all edges in the lower triangular interference graph matrics from src to dst
-static void copy_interference_graph_edges(char *interference_graph, int vreg_count, int src, int dst) {
-    for (int i = 1; i <= vreg_count; i++)
-        if (ig_lookup(interference_graph, vreg_count, i, src))
-            ig_lookup(interference_graph, vreg_count, i, dst) = 1;
+static void extend_live_interval(LiveIntervals *li, int vreg, int position) {
+    if (li->starts[vreg] == -1 || position < li->starts[vreg]) li->starts[vreg] = position;
+    if (position > li->ends[vreg]) li->ends[vreg] = position;
+}
+
+// Make the live intervals used by the linear scan register allocator. Instruction i has
+// two positions: its operands are read at 2i and its dst is written at 2i + 1. The
+// interval of a vreg spans all positions where it's live, so two vregs with overlapping
+// intervals are assumed to interfere. The physical register constraints are the same
+// as the ones added to the interference graph with include_clobbers set.
+void make_live_intervals(Function *function) {
+    int vreg_count = function->vreg_count;
+
+    LiveIntervals *li = wmalloc(sizeof(LiveIntervals));
+    li->starts = wmalloc((vreg_count + 1) * sizeof(int));
+    li->ends = wcalloc(vreg_count + 1, sizeof(int));
+    li->preg_constraints = wcalloc(vreg_count + 1, sizeof(int));
+    li->fixed_pregs = wcalloc(vreg_count + 1, sizeof(char));
+    for (int i = 0; i <= vreg_count; i++) li->starts[i] = -1;
+
+    // Instructions may have been added since the CFG was made
+    index_tac(function->ir);
+
+    Block *blocks = function->blocks;
+    int block_count = function->cfg->node_count;
+
+    for (int i = block_count - 1; i >= 0; i--) {
+        Set *livenow = copy_set(function->liveout[i]);
+
+        int block_end = blocks[i].end->index * 2 + 1;
+        set_foreach(livenow, it_vreg) extend_live_interval(li, it_vreg, block_end);
+
+        Tac *tac = blocks[i].end;
+        while (tac) {
+            int position = tac->index * 2;
+
+            add_register_constraints(0, li, livenow, tac, 1);
+
+            if (tac->dst && tac->dst->vreg) {
+                extend_live_interval(li, tac->dst->vreg, position + 1);
+
+                // Ensure that dst doesn't share a preg with src1 for IR_RSUB and src2 for X_SUB,
+                // see make_interference_graph.
+                if (tac->operation == IR_RSUB && tac->src1->vreg) extend_live_interval(li, tac->src1->vreg, position + 1);
+                if (tac->operation == X_SUB && tac->src2->vreg) extend_live_interval(li, tac->src2->vreg, position + 1);
+
+                delete_from_set(livenow, tac->dst->vreg);
+            }
+
+            if (tac->src1 && tac->src1->vreg) {
+                extend_live_interval(li, tac->src1->vreg, position);
+                add_to_set(livenow, tac->src1->vreg);
+            }
+
+            if (tac->src2 && tac->src2->vreg) {
+                extend_live_interval(li, tac->src2->vreg, position);
+                add_to_set(livenow, tac->src2->vreg);
+            }
+
+            if (tac == blocks[i].start) break;
+            tac = tac->prev;
+        }
+
+        // Extend the intervals of vregs that are live at the start of the block
+        int block_start = blocks[i].start->index * 2;
+        set_foreach(livenow, it_vreg) extend_live_interval(li, it_vreg, block_start);
+
+        free_set(livenow);
+    }
+
+    function->live_intervals = li;
+
+    if (debug_ssa_interference_graph) {
+        printf("Live intervals:\n");
+        for (int i = live_range_reserved_pregs_offset + 1; i <= vreg_count; i++)
+            if (li->starts[i] != -1) printf("%-4d %d-%d\n", i, li->starts[i], li->ends[i]);
+    }
+}
+
+void free_live_intervals(Function *function) {
+    LiveIntervals *li = function->live_intervals;
+    if (!li) return;
+
+    wfree(li->starts);
+    wfree(li->ends);
+    wfree(li->preg_constraints);
+    wfree(li->fixed_pregs);
+    wfree(li);
+    function->live_intervals = 0;
+}
+
+// Copy all edges of src to dst
+static void copy_interference_graph_edges(InterferenceGraph *interference_graph, int src, int dst) {
+    // Adding edges may grow the src adjacency vector, so don't hold on to a pointer to it
+    int degree = interference_graph->degrees[src];
+    for (int i = 0; i < degree; i++)
+        ig_add_edge(interference_graph, interference_graph->neighbors[src][i], dst);
 }
 
 #define move_coalesced_vreg(coalesces, v) { \
@@ -1585,10 +1791,10 @@ static void coalesce_pending_coalesces(Function *function, LongMap *coalesces, i
 
         int block_count = function->cfg->node_count;
         for (int i = 0; i < block_count; i++) {
-            LongSet *l = function->liveout[i];
-            if (longset_in(l, src)) {
-                longset_delete(l, src);
-                longset_add(l, dst);
+            Set *l = function->liveout[i];
+            if (in_set(l, src)) {
+                delete_from_set(l, src);
+                add_to_set(l, dst);
             }
         }
     }
@@ -1631,7 +1837,7 @@ static void coalesce_live_ranges_for_preg(Function *function, int check_register
         free_interference_graph(function);
         make_interference_graph(function, 0, 1);
 
-        char *interference_graph = function->interference_graph;
+        InterferenceGraph *interference_graph = function->interference_graph;
 
         // A lower triangular matrix of all register copy operations and instrsel blockers
         memset(clobbers, 0, (vreg_count + 1) * sizeof(char));
@@ -1695,7 +1901,7 @@ static void coalesce_live_ranges_for_preg(Function *function, int check_register
 
             if (clobbers[src] || clobbers[dst]) continue;
 
-            if (ig_lookup(interference_graph, vreg_count, src, dst)) continue;
+            if (ig_lookup(interference_graph, src, dst)) continue;
 
             // Collect done_srcs in the pending_coalesces since we will used to modify the
             // map.
@@ -1713,7 +1919,7 @@ static void coalesce_live_ranges_for_preg(Function *function, int check_register
             wfree(done_srcs);
 
             // Update constraints, moving all from src -> dst
-            copy_interference_graph_edges(function->interference_graph, vreg_count, src, dst);
+            copy_interference_graph_edges(function->interference_graph, src, dst);
 
             clobbers[dst] |= clobbers[src];
 
@@ -1749,6 +1955,14 @@ void coalesce_live_ranges(Function *function, int check_register_constraints) {
     free_vreg_preg_classes(function);
     make_vreg_preg_classes(function);
 
+    // Linear scan doesn't build an interference graph, so coalescing, which needs one, is
+    // skipped. Copies are instead hinted when the live intervals are allocated.
+    if (opt_register_allocator == REGALLOC_LINEAR_SCAN) {
+        make_live_range_spill_cost(function);
+
+        return;
+    }
+
     if (!opt_enable_live_range_coalescing) {
         make_live_range_spill_cost(function);
         make_interference_graph(function, 0, 0);
@@ -1764,7 +1978,7 @@ void coalesce_live_ranges(Function *function, int check_register_constraints) {
 }
 
 // 10^p
-static int ten_power(int p) {
+int ten_power(int p) {
     int result = 1;
     for (int i = 0; i < p; i++) result = result * 10;
 
@@ -1782,7 +1996,7 @@ static void add_infinite_spill_costs(Function *function) {
     int block_count = function->cfg->node_count;
 
     for (int i = block_count - 1; i >= 0; i--) {
-        LongSet *livenow = longset_copy(function->liveout[i]);
+        Set *livenow = copy_set(function->liveout[i]);
 
         Tac *tac = blocks[i].end;
         while (tac) {
@@ -1790,19 +2004,19 @@ static void add_infinite_spill_costs(Function *function) {
                 if ((tac->src1 && tac->src1->vreg && tac->src1->vreg == tac->prev->dst->vreg) ||
                     (tac->src2 && tac->src2->vreg && tac->src2->vreg == tac->prev->dst->vreg)) {
 
-                    if (!longset_in(livenow, tac->prev->dst->vreg))
+                    if (!in_set(livenow, tac->prev->dst->vreg))
                         spill_cost[tac->prev->dst->vreg] = 2 << 15;
                 }
             }
-            if (tac->dst && tac->dst->vreg) longset_delete(livenow, tac->dst->vreg);
-            if (tac->src1 && tac->src1->vreg) longset_add(livenow, tac->src1->vreg);
-            if (tac->src2 && tac->src2->vreg) longset_add(livenow, tac->src2->vreg);
+            if (tac->dst && tac->dst->vreg) delete_from_set(livenow, tac->dst->vreg);
+            if (tac->src1 && tac->src1->vreg) add_to_set(livenow, tac->src1->vreg);
+            if (tac->src2 && tac->src2->vreg) add_to_set(livenow, tac->src2->vreg);
 
             if (tac == blocks[i].start) break;
             tac = tac->prev;
         }
 
-        free_longset(livenow);
+        free_set(livenow);
     }
 }
 
@@ -1810,14 +2024,11 @@ static void make_live_range_spill_cost(Function *function) {
     int vreg_count = function->vreg_count;
     int *spill_cost = wcalloc(vreg_count + 1, sizeof(int));
 
-    int for_loop_depth = 0;
     for (Tac *tac = function->ir; tac; tac = tac->next) {
-        if (tac->operation == IR_START_LOOP) for_loop_depth++;
-        if (tac->operation == IR_END_LOOP) for_loop_depth--;
-
-        if (tac->dst  && tac->dst ->vreg) spill_cost[tac->dst ->vreg] += ten_power(for_loop_depth);
-        if (tac->src1 && tac->src1->vreg) spill_cost[tac->src1->vreg] += ten_power(for_loop_depth);
-        if (tac->src2 && tac->src2->vreg) spill_cost[tac->src2->vreg] += ten_power(for_loop_depth);
+        int weight = ten_power(tac->loop_depth);
+        if (tac->dst  && tac->dst ->vreg) spill_cost[tac->dst ->vreg] += weight;
+        if (tac->src1 && tac->src1->vreg) spill_cost[tac->src1->vreg] += weight;
+        if (tac->src2 && tac->src2->vreg) spill_cost[tac->src2->vreg] += weight;
     }
 
     function->spill_cost = spill_cost;
@@ -1849,6 +2060,32 @@ void make_preferred_live_range_preg_indexes(Function *function) {
     function->preferred_live_range_preg_indexes = preferred_live_range_preg_indexes;
 }
 
+// Redo the liveness analysis after live range splitting, and remake the interference graph or
+// live intervals for the register allocator.
+void remake_register_allocation_graph(Function *function) {
+    free_interference_graph(function);
+    free_live_intervals(function);
+    free_live_range_spill_cost(function);
+    free_vreg_preg_classes(function);
+    free_preferred_live_range_preg_indexes(function);
+
+    analyze_dominance(function);
+    make_vreg_count(function, live_range_reserved_pregs_offset);
+    make_uevar_and_varkill(function);
+    make_liveout(function);
+    make_preferred_live_range_preg_indexes(function);
+    make_vreg_preg_classes(function);
+    make_live_range_spill_cost(function);
+
+    if (opt_register_allocator == REGALLOC_LINEAR_SCAN)
+        make_live_intervals(function);
+    else
+        make_interference_graph(function, 1, 0);
+
+    free_liveout(function);
+    free_dominance(function);
+}
+
 void free_preferred_live_range_preg_indexes(Function *function) {
     free_and_null(function->preferred_live_range_preg_indexes);
 }
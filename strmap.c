@@ -82,6 +82,47 @@ void strmap_put(StrMap *map, char *key, void *value) {
     }
 }
 
+// Put a value for an interned key. Keys that are already in the map are found by
+// pointer comparison, so all keys in the map must be interned.
+void strmap_put_interned(StrMap *map, char *key, void *value) {
+    maybe_rehash(map);
+
+    unsigned int mask = map->size - 1;
+    unsigned int pos = interned_string_hash(key) & mask;
+
+    char *k;
+    while (1) {
+        k = map->keys[pos];
+        if (!k || k == (char *) TOMBSTONE) {
+            map->keys[pos] = key;
+            map->values[pos] = value;
+            map->element_count++;
+            if (!k) map->used_count++;
+            return;
+        }
+
+        if (k == key) {
+            map->values[pos] = value;
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+// Get a value for an interned key using its precomputed hash. All keys in the map
+// must be interned.
+void *strmap_get_interned(StrMap *map, char *key) {
+    unsigned int mask = map->size - 1;
+    unsigned int pos = interned_string_hash(key) & mask;
+
+    char *k;
+    while ((k = map->keys[pos])) {
+        if (k == key) return map->values[pos];
+        pos = (pos + 1) & mask;
+    }
+    return 0;
+}
+
 void *strmap_get(StrMap *map, char *key) {
     unsigned int mask = map->size - 1;
     unsigned int pos = hash(key) & mask;
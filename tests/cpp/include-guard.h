@@ -0,0 +1,9 @@
+// Guarded header, the comment and blank lines don't matter
+
+#ifndef INCLUDE_GUARD_H
+#define INCLUDE_GUARD_H
+
+int guarded;
+
+#endif
+
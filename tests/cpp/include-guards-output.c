@@ -0,0 +1,37 @@
+# 1 "include-guards.c"
+# 1 "include-guard.h" 1
+
+
+
+
+
+int guarded;
+# 2 "include-guards.c" 2
+# 1 "include-pragma-once.h" 1
+
+
+int once;
+# 5 "include-guards.c" 2
+# 1 "include-not-guarded.h" 1
+
+
+int not_guarded;
+
+int after_endif;
+# 7 "include-guards.c" 2
+# 1 "include-not-guarded.h" 1
+
+
+
+
+int after_endif;
+# 8 "include-guards.c" 2
+# 1 "include-guard.h" 1
+
+
+
+
+
+int guarded;
+# 10 "include-guards.c" 2
+int main;
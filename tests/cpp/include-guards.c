@@ -0,0 +1,10 @@
+#include "include-guard.h"
+#include "include-guard.h"
+#include "./include-guard.h"
+#include "include-pragma-once.h"
+#include "include-pragma-once.h"
+#include "include-not-guarded.h"
+#include "include-not-guarded.h"
+#undef INCLUDE_GUARD_H
+#include "include-guard.h"
+int main;
@@ -0,0 +1,5 @@
+#ifndef INCLUDE_NOT_GUARDED_H
+#define INCLUDE_NOT_GUARDED_H
+int not_guarded;
+#endif
+int after_endif;
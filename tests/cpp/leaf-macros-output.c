@@ -0,0 +1,27 @@
+# 1 "leaf-macros.c"
+
+
+
+
+
+0x10UL unsigned int target;
+
+
+
+42
+
+target
+
+1 + 1
+
+target(1)
+
+
+
+
+0x20UL
+
+
+
+0x20UL unsigned int
+target
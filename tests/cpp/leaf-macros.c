@@ -0,0 +1,26 @@
+// Macros whose replacement lists can't be expanded any further
+#define CONST 0x10UL
+#define KEYWORD unsigned int
+#define ALIAS target
+#define EMPTY
+CONST KEYWORD ALIAS EMPTY;
+
+// A leaf stops being one once one of its identifiers is defined as a macro
+#define target 42
+ALIAS
+#undef target
+ALIAS
+#define target(x) x + 1
+ALIAS(1)
+#undef target
+ALIAS(1)
+
+// Redefinition
+#undef CONST
+#define CONST 0x20UL
+CONST
+
+// Leaf macros in function-like macro arguments
+#define F(a, b) a b
+F(CONST, KEYWORD)
+F(ALIAS, EMPTY)
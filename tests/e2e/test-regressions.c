@@ -115,6 +115,96 @@ void test_spilling_locals_to_stack_bug() {
     r10++; // This forces a spill of r10
 }
 
+long rematerialization_globals[4];
+
+// Keep more constants and addresses alive across a loop than there are registers.
+// The spilled ones are recomputed before each use instead of being loaded from the stack.
+void test_spilling_rematerialized_values() {
+    int i, local;
+    long s1, s2, s3, s4, s5, s6, s7, s8;
+    long k1, k2, k3, k4;
+    long *p1, *p2, *p3, *p4;
+    char *str;
+    int *plocal;
+
+    s1 = s2 = s3 = s4 = s5 = s6 = s7 = s8 = 0;
+    k1 = 0x100000001; k2 = 0x200000002; k3 = 3; k4 = -4;
+    p1 = &rematerialization_globals[0]; p2 = &rematerialization_globals[1];
+    p3 = &rematerialization_globals[2]; p4 = &rematerialization_globals[3];
+    str = "rematerialized";
+    local = 5;
+    plocal = &local;
+    memset(rematerialization_globals, 0, sizeof(rematerialization_globals));
+
+    for (i = 0; i < 10; i++) {
+        s1 += i ^ k1; s2 += i ^ k2; s3 += i * k3; s4 += i * k4;
+        s5 += *p1 + i; s6 += *p2 + i; s7 += str[i] + *plocal; s8 += *p4;
+        *p1 += s1; *p2 += s2; *p3 += s3; *p4 += 1;
+    }
+
+    assert_long(42949673005,   s1, "Rematerialization 1");
+    assert_long(85899345969,   s2, "Rematerialization 2");
+    assert_long(135,           s3, "Rematerialization 3");
+    assert_long(-180,          s4, "Rematerialization 4");
+    assert_long(708669604240,  s5, "Rematerialization 5");
+    assert_long(1417339208153, s6, "Rematerialization 6");
+    assert_long(1112,          s7, "Rematerialization 7");
+    assert_long(45,            s8, "Rematerialization 8");
+    assert_long(236223201450,  rematerialization_globals[0], "Rematerialization 9");
+    assert_long(472446402747,  rematerialization_globals[1], "Rematerialization 10");
+    assert_long(495,           rematerialization_globals[2], "Rematerialization 11");
+    assert_long(10,            rematerialization_globals[3], "Rematerialization 12");
+}
+
+double split_half(double x) { return x * 0.5; }
+long split_inc(long x) { return x + 1; }
+
+// All xmm registers are caller saved, so a, b and c are split around the calls
+double split_doubles_around_calls(double a, double b, double c) {
+    double r = split_half(a);
+    r += a * b + a * c + b * c + a * a + b * b;
+    r += split_half(b);
+    r += a * b + a * c + b * c + a * a + b * b;
+    r += split_half(c);
+    r += a * b + a * c + b * c + a * a + b * b;
+    return r;
+}
+
+// v1 to v13 are live across the loop but only used outside it
+long split_longs_around_loop(long *a, int n, long x) {
+    long v1 = split_inc(1), v2 = split_inc(2), v3 = split_inc(3), v4 = split_inc(4), v5 = split_inc(5);
+    long v6 = split_inc(6), v7 = split_inc(7), v8 = split_inc(8), v9 = split_inc(9), v10 = split_inc(10);
+    long v11 = split_inc(11), v12 = split_inc(12), v13 = split_inc(13);
+    long s = 0;
+    for (int i = 0; i < n; i++) s += a[i] * x + x;
+    return s + v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10 + v11 + v12 + v13 + x;
+}
+
+// A loop made with goto. The values used in the loop are spilled because of the calls,
+// and are split around the loop.
+long split_longs_around_goto_loop(long *a, int n, long x) {
+    long v1 = split_inc(1), v2 = split_inc(2), v3 = split_inc(3), v4 = split_inc(4), v5 = split_inc(5);
+    long v6 = split_inc(6), v7 = split_inc(7), v8 = split_inc(8), v9 = split_inc(9), v10 = split_inc(10);
+    long s = 0;
+    int i = 0;
+loop:
+    s += a[i] + v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10;
+    i++;
+    if (i < n) goto loop;
+
+    s += split_inc(s);
+    return s + v1 + v2 + v3 + v4 + v5 + v6 + v7 + v8 + v9 + v10 + x;
+}
+
+void test_live_range_splitting() {
+    long a[10];
+
+    for (int i = 0; i < 10; i++) a[i] = i;
+    assert_double(82.5, split_doubles_around_calls(1.5, 2.5, 3.5), "Live range splitting around calls");
+    assert_long(272, split_longs_around_loop(a, 10, 3), "Live range splitting around a loop");
+    assert_long(1459, split_longs_around_goto_loop(a, 10, 3), "Live range splitting around a goto loop");
+}
+
 int sa0()                                                               { assert_int(0, check_stack_alignment(), "SA 0"); }
 int sa1(int i1)                                                         { assert_int(0, check_stack_alignment(), "SA 1"); }
 int sa2(int i1, int i2)                                                 { assert_int(0, check_stack_alignment(), "SA 2"); }
@@ -322,6 +412,23 @@ int test_double_offset_bug() {
     _test_double_offset_bug(sl);
 }
 
+// A global with a 1020 character identifier. Instructions using it are longer than the
+// space that used to be reserved for a rendered instruction.
+#define CAT(a, b) a##b
+#define EXPANDED_CAT(a, b) CAT(a, b)
+#define DOUBLE(x) CAT(x, x)
+#define LONG_IDENTIFIER EXPANDED_CAT(DOUBLE(DOUBLE(DOUBLE(DOUBLE(DOUBLE(DOUBLE(long_identifier)))))), _padded_out_to_a_total_of_one_thousand_and_twenty_characters)
+
+int LONG_IDENTIFIER = 41;
+
+int long_identifier_plus_one(void) {
+    return LONG_IDENTIFIER + 1;
+}
+
+void test_long_global_identifier() {
+    assert_int(42, long_identifier_plus_one(), "Long global identifier");
+}
+
 int main(int argc, char **argv) {
     passes = 0;
     failures = 0;
@@ -334,6 +441,8 @@ int main(int argc, char **argv) {
     test_backwards_jumps();
     test_first_declaration_in_if_in_for_liveness();
     test_spilling_locals_to_stack_bug();
+    test_spilling_rematerialized_values();
+    test_live_range_splitting();
     test_local_var_stack_alignment();
     test_function_call_stack_alignment();
     test_return_statement_stack_alignment();
@@ -348,6 +457,7 @@ int main(int argc, char **argv) {
     test_unary_precedence();
     test_register_reuse_in_function_calls();
     test_double_offset_bug();
+    test_long_global_identifier();
 
     finalize();
 }
@@ -103,3 +103,15 @@ void test_address_of() {
 int add_one(int i) {
     return i + 1;
 }
+
+// Dense enough for a jump table, which must be position independent
+int jump_table_switch(int i) {
+    switch (i) {
+        case 1: return 10;
+        case 2: return 20;
+        case 3: return 30;
+        case 5: return 50;
+        case 6: return 60;
+        default: return -1;
+    }
+}
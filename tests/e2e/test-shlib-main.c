@@ -53,6 +53,12 @@ void test_direct_access() {
     int (*x)(int);
     x = (int (*)(int)) add_one;
     assert_int(3, x(2), "&address in the shared library after a cast");
+
+    assert_int(-1, jump_table_switch(0), "Jump table in the shared library 0");
+    assert_int(10, jump_table_switch(1), "Jump table in the shared library 1");
+    assert_int(-1, jump_table_switch(4), "Jump table in the shared library 4");
+    assert_int(60, jump_table_switch(6), "Jump table in the shared library 6");
+    assert_int(-1, jump_table_switch(7), "Jump table in the shared library 7");
 }
 
 int main(int argc, char **argv) {
@@ -50,3 +50,4 @@ int inc_ia();
 void test_address_of();
 
 int add_one(int i);
+int jump_table_switch(int i);
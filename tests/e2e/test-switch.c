@@ -192,6 +192,209 @@ int test_multiple_cases(int i) {
     }
 }
 
+// Dense cases, lowered to a jump table
+static int jump_table_switch(int i) {
+    switch (i) {
+        case -2: return 1;
+        case -1: return 2;
+        case 0:  return 3;
+        case 1:
+        case 2:  return 4;
+        case 4:  return 5;
+        case 5:  return 6;
+        default: return 0;
+    }
+}
+
+// A jump table without a default goes to the end of the switch for holes and
+// values outside the range.
+static int jump_table_switch_without_default(unsigned int i) {
+    int result = 100;
+
+    switch (i) {
+        case 10: result = 1; break;
+        case 11: result = 2; break;
+        case 13: result = 3; break;
+        case 14: result = 4; break;
+        case 0xfffffffe: result = 5; break;
+    }
+
+    return result;
+}
+
+static int char_jump_table_switch(char c) {
+    switch (c) {
+        case 'a': return 1;
+        case 'b': return 2;
+        case 'c': return 3;
+        case 'e': return 4;
+        case 200: return 5; // Never matches, since c is promoted to int
+        default:  return 0;
+    }
+}
+
+static int unsigned_char_jump_table_switch(unsigned char c) {
+    switch (c) {
+        case 253: return 1;
+        case 254: return 2;
+        case 255: return 3;
+        case 0:   return 4;
+        case 1:   return 5;
+        default:  return 0;
+    }
+}
+
+static int long_jump_table_switch(long l) {
+    switch (l) {
+        case 0x100000000: return 1;
+        case 0x100000001: return 2;
+        case 0x100000002: return 3;
+        case 0x100000004: return 4;
+        default:          return 0;
+    }
+}
+
+// Sparse cases, lowered to a binary search, with dense clusters lowered to jump tables
+static int sparse_switch(int i) {
+    switch (i) {
+        case -1000000: return 1;
+        case -100:     return 2;
+        case 1:        return 3;
+        case 2:        return 4;
+        case 3:        return 5;
+        case 4:        return 6;
+        case 5:        return 7;
+        case 100:      return 8;
+        case 1000:     return 9;
+        case 10000:    return 10;
+        case 100000:   return 11;
+        case 1000000:  return 12;
+        default:       return 0;
+    }
+}
+
+static int unsigned_long_sparse_switch(unsigned long l) {
+    switch (l) {
+        case 0:                  return 1;
+        case 1000:               return 2;
+        case 0x7fffffffffffffff: return 3;
+        case 0x8000000000000000: return 4;
+        case 0xffffffffffffffff: return 5;
+        default:                 return 0;
+    }
+}
+
+static int signed_long_sparse_switch(long l) {
+    switch (l) {
+        case -0x7fffffffffffffff:     return 1;
+        case -1000:                   return 2;
+        case 0:                       return 3;
+        case 1000:                    return 4;
+        case 0x7fffffffffffffff:      return 5;
+        default:                      return 0;
+    }
+}
+
+static int large_jump_table_switch(int i) {
+    int result = 0;
+
+    switch (i) {
+        case 0:  result += 1;
+        case 1:  result += 1;
+        case 2:  result += 1;
+        case 3:  result += 1;
+        case 4:  result += 1;
+        case 5:  result += 1;
+        case 6:  result += 1;
+        case 7:  result += 1;
+        case 8:  result += 1;
+        case 9:  result += 1;
+        case 10: result += 1;
+        case 11: result += 1;
+        case 12: result += 1;
+        case 13: result += 1;
+        case 14: result += 1;
+        case 15: result += 1;
+    }
+
+    return result;
+}
+
+static void test_switch_lowering() {
+    assert_int(0, jump_table_switch(-3), "Jump table -3");
+    assert_int(1, jump_table_switch(-2), "Jump table -2");
+    assert_int(2, jump_table_switch(-1), "Jump table -1");
+    assert_int(3, jump_table_switch(0),  "Jump table 0");
+    assert_int(4, jump_table_switch(1),  "Jump table 1");
+    assert_int(4, jump_table_switch(2),  "Jump table 2");
+    assert_int(0, jump_table_switch(3),  "Jump table 3");
+    assert_int(5, jump_table_switch(4),  "Jump table 4");
+    assert_int(6, jump_table_switch(5),  "Jump table 5");
+    assert_int(0, jump_table_switch(6),  "Jump table 6");
+    assert_int(0, jump_table_switch(0x7fffffff), "Jump table int max");
+    assert_int(0, jump_table_switch(-0x7fffffff - 1), "Jump table int min");
+
+    assert_int(100, jump_table_switch_without_default(0),          "Jump table without default 0");
+    assert_int(1,   jump_table_switch_without_default(10),         "Jump table without default 10");
+    assert_int(2,   jump_table_switch_without_default(11),         "Jump table without default 11");
+    assert_int(100, jump_table_switch_without_default(12),         "Jump table without default 12");
+    assert_int(4,   jump_table_switch_without_default(14),         "Jump table without default 14");
+    assert_int(100, jump_table_switch_without_default(15),         "Jump table without default 15");
+    assert_int(5,   jump_table_switch_without_default(0xfffffffe), "Jump table without default 0xfffffffe");
+    assert_int(100, jump_table_switch_without_default(0xffffffff), "Jump table without default 0xffffffff");
+
+    assert_int(1, char_jump_table_switch('a'),  "Char jump table a");
+    assert_int(3, char_jump_table_switch('c'),  "Char jump table c");
+    assert_int(0, char_jump_table_switch('d'),  "Char jump table d");
+    assert_int(4, char_jump_table_switch('e'),  "Char jump table e");
+    assert_int(0, char_jump_table_switch(-56),  "Char jump table -56");
+
+    assert_int(1, unsigned_char_jump_table_switch(253), "Unsigned char switch 253");
+    assert_int(3, unsigned_char_jump_table_switch(255), "Unsigned char switch 255");
+    assert_int(4, unsigned_char_jump_table_switch(0),   "Unsigned char switch 0");
+    assert_int(5, unsigned_char_jump_table_switch(1),   "Unsigned char switch 1");
+    assert_int(0, unsigned_char_jump_table_switch(2),   "Unsigned char switch 2");
+
+    assert_int(1, long_jump_table_switch(0x100000000), "Long jump table 1");
+    assert_int(3, long_jump_table_switch(0x100000002), "Long jump table 3");
+    assert_int(0, long_jump_table_switch(0x100000003), "Long jump table 4");
+    assert_int(4, long_jump_table_switch(0x100000004), "Long jump table 5");
+    assert_int(0, long_jump_table_switch(0),           "Long jump table 0");
+    assert_int(0, long_jump_table_switch(1),           "Long jump table 0x1");
+
+    assert_int(1,  sparse_switch(-1000000), "Sparse switch -1000000");
+    assert_int(2,  sparse_switch(-100),     "Sparse switch -100");
+    assert_int(0,  sparse_switch(0),        "Sparse switch 0");
+    assert_int(3,  sparse_switch(1),        "Sparse switch 1");
+    assert_int(7,  sparse_switch(5),        "Sparse switch 5");
+    assert_int(0,  sparse_switch(6),        "Sparse switch 6");
+    assert_int(8,  sparse_switch(100),      "Sparse switch 100");
+    assert_int(9,  sparse_switch(1000),     "Sparse switch 1000");
+    assert_int(10, sparse_switch(10000),    "Sparse switch 10000");
+    assert_int(11, sparse_switch(100000),   "Sparse switch 100000");
+    assert_int(12, sparse_switch(1000000),  "Sparse switch 1000000");
+    assert_int(0,  sparse_switch(1000001),  "Sparse switch 1000001");
+
+    assert_int(1, unsigned_long_sparse_switch(0),                  "Unsigned long sparse switch 0");
+    assert_int(2, unsigned_long_sparse_switch(1000),               "Unsigned long sparse switch 1000");
+    assert_int(3, unsigned_long_sparse_switch(0x7fffffffffffffff), "Unsigned long sparse switch 0x7fffffffffffffff");
+    assert_int(4, unsigned_long_sparse_switch(0x8000000000000000), "Unsigned long sparse switch 0x8000000000000000");
+    assert_int(5, unsigned_long_sparse_switch(0xffffffffffffffff), "Unsigned long sparse switch 0xffffffffffffffff");
+    assert_int(0, unsigned_long_sparse_switch(1),                  "Unsigned long sparse switch 1");
+
+    assert_int(1, signed_long_sparse_switch(-0x7fffffffffffffff),     "Signed long sparse switch min");
+    assert_int(2, signed_long_sparse_switch(-1000),                   "Signed long sparse switch -1000");
+    assert_int(3, signed_long_sparse_switch(0),                       "Signed long sparse switch 0");
+    assert_int(4, signed_long_sparse_switch(1000),                    "Signed long sparse switch 1000");
+    assert_int(5, signed_long_sparse_switch(0x7fffffffffffffff),      "Signed long sparse switch max");
+    assert_int(0, signed_long_sparse_switch(-1),                      "Signed long sparse switch -1");
+
+    assert_int(16, large_jump_table_switch(0),  "Large jump table 0");
+    assert_int(6,  large_jump_table_switch(10), "Large jump table 10");
+    assert_int(1,  large_jump_table_switch(15), "Large jump table 15");
+    assert_int(0,  large_jump_table_switch(16), "Large jump table 16");
+}
+
 static void test_switch() {
     assert_int(-10, run_switch_without_default(0), "Test switch without default 1");
     assert_int(-18, run_switch_without_default(1), "Test switch without default 2");
@@ -268,6 +471,7 @@ int main(int argc, char **argv) {
     parse_args(argc, argv, &verbose);
 
     test_switch();
+    test_switch_lowering();
 
     finalize();
 }
@@ -65,15 +65,32 @@ Tac *si(Function *function, int label, int operation, Value *dst, Value *src1, V
     return tac;
 }
 
+Rule *nuked_rules[16];
+int nuked_operations[16];
+int nuked_rule_count;
+
 void nuke_rule(int dst, int operation, int src1, int src2) {
     int i;
     Rule *r;
 
     for (i = 0; i < instr_rule_count; i++) {
         r = &(instr_rules[i]);
-        if (r->operation == operation && r->dst == dst && r->src1 == src1 && r->src2 == src2)
+        if (r->operation == operation && r->dst == dst && r->src1 == src1 && r->src2 == src2) {
+            nuked_rules[nuked_rule_count] = r;
+            nuked_operations[nuked_rule_count++] = r->operation;
             r->operation = -1;
+        }
     }
+
+    remake_burs_tables();
+}
+
+// Undo nuke_rule() and go back to the generated rules
+void restore_rules() {
+    for (int i = 0; i < nuked_rule_count; i++) nuked_rules[i]->operation = nuked_operations[i];
+    nuked_rule_count = 0;
+
+    init_instruction_selection_rules();
 }
 
 void test_instrsel_tree_merging_type_merges() {
@@ -241,7 +258,7 @@ void test_less_than_with_conditional_jmp(Function *function, Value *src1, Value
     finish_ir(function);
     assert_x86_op(template1);
     assert_x86_op(template2);
-    init_instruction_selection_rules();
+    restore_rules();
 }
 
 void test_cmp_with_assignment(Function *function, int cmp_operation, char *set_instruction) {
@@ -407,7 +424,7 @@ void test_instrsel_expr() {
     i(0, IR_MOVE, g(1), c(1), 0);
     finish_ir(function);
     assert_x86_op("movq        $1, g1(%rip)");
-    init_instruction_selection_rules();
+    restore_rules();
 
     // Store v1 in g using IR_MOVE
     start_ir();
@@ -464,7 +481,7 @@ void test_instrsel_expr() {
     i(0, IR_MOVE, S(-2), c(0), 0);
     finish_ir(function);
     assert_x86_op("movq        $0, -8(%rbp)");
-    init_instruction_selection_rules();
+    restore_rules();
 
     // jz with r1
     start_ir();
@@ -482,7 +499,7 @@ void test_instrsel_expr() {
     finish_ir(function);
     assert_x86_op("testq       r1q, r1q");
     assert_x86_op("jz          .L1");
-    init_instruction_selection_rules();
+    restore_rules();
 
     // jz with a1 *void
     start_ir();
@@ -524,7 +541,7 @@ void test_instrsel_expr() {
     finish_ir(function);
     assert_x86_op("testq       r1q, r1q");
     assert_x86_op("jnz         .L1");
-    init_instruction_selection_rules();
+    restore_rules();
 
     // jnz with a1 *void
     start_ir();
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../wcc.h"
+
+void assert_int(int expected, int actual, char *message) {
+    if (expected != actual) {
+        printf("%s: expected %d, got %d\n", message, expected, actual);
+        exit(1);
+    }
+}
+
+int count_chunks(Arena *arena) {
+    int count = 0;
+    for (ArenaChunk *chunk = arena->chunks; chunk; chunk = chunk->next) count++;
+    return count;
+}
+
+void test_small_allocations(void) {
+    Arena *arena = new_arena();
+
+    char *p1 = arena_alloc(arena, 1);
+    char *p2 = arena_alloc(arena, 17);
+    char *p3 = arena_alloc(arena, 16);
+    assert_int(1, count_chunks(arena), "Small allocations share a chunk");
+    assert_int(16, p2 - p1, "Allocations are 16 byte aligned 1");
+    assert_int(32, p3 - p2, "Allocations are 16 byte aligned 2");
+
+    // Memory is zeroed
+    for (int i = 0; i < 17; i++) assert_int(0, p2[i], "Zeroed memory");
+
+    // Fill the first chunk and spill into a second one
+    for (int i = 0; i < ARENA_CHUNK_SIZE / 1024; i++) memset(arena_alloc(arena, 1024), 1, 1024);
+    assert_int(2, count_chunks(arena), "Overflowing a chunk allocates a new one");
+
+    free_arena(arena);
+}
+
+void test_large_allocations(void) {
+    Arena *arena = new_arena();
+
+    char *small1 = arena_alloc(arena, 16);
+    char *large = arena_alloc(arena, ARENA_CHUNK_SIZE * 2);
+    char *small2 = arena_alloc(arena, 16);
+
+    assert_int(2, count_chunks(arena), "Large allocation gets its own chunk");
+    assert_int(16, small2 - small1, "Head chunk is still used after a large allocation");
+    memset(large, 1, ARENA_CHUNK_SIZE * 2);
+
+    free_arena(arena);
+}
+
+int main() {
+    test_small_allocations();
+    test_large_allocations();
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../wcc.h"
+
+void assert_int(int expected, int actual, char *message) {
+    if (expected != actual) {
+        printf("%s: expected %d, got %d\n", message, expected, actual);
+        exit(1);
+    }
+}
+
+void test_add_and_in(void) {
+    char *foo = intern("foo");
+    char *bar = intern("bar");
+    char *baz = intern("baz");
+
+    assert_int(0, hide_set_in(0, foo), "Nothing is in the empty set");
+
+    HideSet *hs1 = hide_set_add(0, foo);
+    assert_int(1, hide_set_in(hs1, foo), "foo in {foo}");
+    assert_int(0, hide_set_in(hs1, bar), "bar not in {foo}");
+
+    HideSet *hs2 = hide_set_add(hs1, bar);
+    assert_int(1, hide_set_in(hs2, foo), "foo in {foo, bar}");
+    assert_int(1, hide_set_in(hs2, bar), "bar in {foo, bar}");
+    assert_int(0, hide_set_in(hs2, baz), "baz not in {foo, bar}");
+    assert_int(1, hide_set_in(hs1, foo), "Adding doesn't change the original set");
+    assert_int(0, hide_set_in(hs1, bar), "Adding doesn't change the original set");
+
+    assert_int(1, hs2 == hide_set_add(hs2, foo), "Adding an existing identifier returns the same set");
+}
+
+void test_hash_consing(void) {
+    char *foo = intern("foo");
+    char *bar = intern("bar");
+
+    HideSet *hs1 = hide_set_add(hide_set_add(0, foo), bar);
+    HideSet *hs2 = hide_set_add(hide_set_add(0, bar), foo);
+    assert_int(1, hs1 == hs2, "Equal sets made in a different order are the same set");
+
+    int count = hide_set_count();
+    hide_set_add(hide_set_add(0, foo), bar);
+    assert_int(count, hide_set_count(), "Making an existing set doesn't make a new one");
+}
+
+void test_union_and_intersection(void) {
+    char *a = intern("a");
+    char *b = intern("b");
+    char *c = intern("c");
+
+    HideSet *ab = hide_set_add(hide_set_add(0, a), b);
+    HideSet *bc = hide_set_add(hide_set_add(0, b), c);
+    HideSet *abc = hide_set_add(ab, c);
+
+    assert_int(1, hide_set_union(ab, bc) == abc, "{a, b} ∪ {b, c}");
+    assert_int(1, hide_set_union(bc, ab) == abc, "{b, c} ∪ {a, b}");
+    assert_int(1, hide_set_union(ab, 0) == ab, "{a, b} ∪ {}");
+    assert_int(1, hide_set_union(0, ab) == ab, "{} ∪ {a, b}");
+    assert_int(1, hide_set_union(0, 0) == 0, "{} ∪ {}");
+
+    HideSet *i = hide_set_intersection(ab, bc);
+    assert_int(1, i == hide_set_add(0, b), "{a, b} ∩ {b, c}");
+    assert_int(1, hide_set_intersection(bc, ab) == i, "{b, c} ∩ {a, b}");
+    assert_int(1, hide_set_intersection(ab, abc) == ab, "{a, b} ∩ {a, b, c}");
+    assert_int(1, hide_set_intersection(hide_set_add(0, a), hide_set_add(0, c)) == 0, "{a} ∩ {c}");
+    assert_int(1, hide_set_intersection(ab, 0) == 0, "{a, b} ∩ {}");
+    assert_int(1, hide_set_intersection(0, ab) == 0, "{} ∩ {a, b}");
+}
+
+void test_many_sets(void) {
+    int COUNT = 1000;
+    char buffer[16];
+    HideSet *hs = 0;
+
+    // Sets {m0}, {m0, m1}, ..., {m0, ..., m999}
+    for (int i = 0; i < COUNT; i++) {
+        sprintf(buffer, "m%d", i);
+        hs = hide_set_add(hs, intern(buffer));
+    }
+
+    assert_int(COUNT, hs->count, "Identifier count");
+
+    for (int i = 0; i < COUNT; i++) {
+        sprintf(buffer, "m%d", i);
+        assert_int(1, hide_set_in(hs, intern(buffer)), "Identifier in a large set");
+    }
+
+    HideSet *hs2 = 0;
+    for (int i = COUNT - 1; i >= 0; i--) {
+        sprintf(buffer, "m%d", i);
+        hs2 = hide_set_add(hs2, intern(buffer));
+    }
+
+    assert_int(1, hs == hs2, "Large sets made in a different order are the same set");
+}
+
+int main() {
+    test_add_and_in();
+    test_hash_consing();
+    test_union_and_intersection();
+    test_many_sets();
+
+    free_hide_sets();
+    free_interned_strings();
+}
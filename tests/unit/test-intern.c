@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../wcc.h"
+
+void assert_int(int expected, int actual, char *message) {
+    if (expected != actual) {
+        printf("%s: expected %d, got %d\n", message, expected, actual);
+        exit(1);
+    }
+}
+
+void test_interning(void) {
+    char buffer[16];
+
+    char *foo1 = intern("foo");
+    strcpy(buffer, "foo");
+    char *foo2 = intern(buffer);
+    assert_int(1, foo1 == foo2, "Same string interns to the same pointer");
+    assert_int(0, foo1 == buffer, "Interned string is a copy");
+    assert_int(0, strcmp(foo1, "foo"), "Interned string has the right contents");
+
+    char *foo3 = intern_string("foobar", 3);
+    assert_int(1, foo1 == foo3, "Interning part of a string");
+
+    char *bar = intern("bar");
+    assert_int(0, foo1 == bar, "Different strings intern to different pointers");
+
+    char *empty = intern("");
+    assert_int(0, strcmp(empty, ""), "Empty string");
+}
+
+void test_many_strings(void) {
+    int COUNT = 10000;
+    char **strings = malloc(COUNT * sizeof(char *));
+    char buffer[16];
+
+    for (int i = 0; i < COUNT; i++) {
+        sprintf(buffer, "foo %d", i);
+        strings[i] = intern(buffer);
+    }
+
+    // The table has been grown a few times, all strings must still be found
+    for (int i = 0; i < COUNT; i++) {
+        sprintf(buffer, "foo %d", i);
+        assert_int(1, strings[i] == intern(buffer), "Lookup after growing");
+    }
+
+    free(strings);
+}
+
+void test_strmap(void) {
+    StrMap *map = new_strmap();
+
+    // Interned strings have the same hash as strmap uses, so both APIs can be mixed
+    char buffer[16];
+    for (int i = 0; i < 1000; i++) {
+        sprintf(buffer, "key %d", i);
+        strmap_put_interned(map, intern(buffer), (void *) (long) (i + 1));
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        sprintf(buffer, "key %d", i);
+        assert_int(i + 1, (long) strmap_get_interned(map, intern(buffer)), "strmap_get_interned");
+        assert_int(i + 1, (long) strmap_get(map, buffer), "strmap_get on an interned map");
+    }
+
+    assert_int(0, (long) strmap_get_interned(map, intern("nothing")), "Missing key");
+
+    free_strmap(map);
+}
+
+int main() {
+    test_interning();
+    test_many_strings();
+    test_strmap();
+    free_interned_strings();
+}
@@ -160,6 +160,69 @@ void test_floating_point_constants() {
     test_numeric_floating_point_literal("100000000000000000000.1L", 100000000000000000000.1L, TYPE_LONG_DOUBLE);
 }
 
+void test_cpp_output() {
+    CppOutputToken tokens[] = {
+        {CPP_TOK_IDENTIFIER,     intern("a")},
+        {CPP_TOK_OTHER,          intern("+")},
+        {CPP_TOK_IDENTIFIER,     intern("int")},
+        {CPP_TOK_STRING_LITERAL, "\"x\""},
+        {CPP_TOK_STRING_LITERAL, "L\"y\""},
+        {CPP_TOK_NUMBER,         intern("1")},
+        {CPP_TOK_OTHER,          intern("xy")}, // Glued with ##
+        {CPP_TOK_EOF,            ""},
+    };
+    CppOutputLine lines[] = {
+        {0, 1, "f.c"},
+        {3, 3, "f.c"},
+        {4, 4, "g.c"},
+        {7, 6, "g.c"},
+    };
+
+    CppOutput cpp_output = {0};
+    cpp_output.tokens = tokens;
+    cpp_output.token_count = 8;
+    cpp_output.lines = lines;
+    cpp_output.line_count = 4;
+
+    init_lexer_from_cpp_output(&cpp_output);
+    assert_int(TOK_IDENTIFIER, cur_token, "Output token a");
+    assert_int(1, cur_line, "Output token a line");
+    assert_int(0, strcmp(cur_filename, "f.c"), "Output token a filename");
+
+    next();
+    assert_int(TOK_PLUS, cur_token, "Output token +");
+    assert_int(1, cur_line, "Output token + line");
+
+    next();
+    assert_int(TOK_INT, cur_token, "Output token int");
+
+    next();
+    assert_int(TOK_STRING_LITERAL, cur_token, "Adjacent output string literals");
+    assert_int(1, cur_string_literal.is_wide_char, "Adjacent output string literals are wide");
+    assert_int(3, cur_string_literal.size, "Adjacent output string literals are concatenated");
+    assert_int(4, cur_line, "Adjacent output string literals line");
+    assert_int(0, strcmp(cur_filename, "g.c"), "Adjacent output string literals filename");
+
+    next();
+    assert_int(TOK_INTEGER, cur_token, "Output token 1");
+    assert_int(1, cur_long, "Output token 1 value");
+    assert_int(4, cur_line, "Output token 1 line");
+
+    next();
+    assert_int(TOK_IDENTIFIER, cur_token, "Glued output token xy");
+    assert_int(1, cur_identifier == intern("xy"), "Glued output token xy identifier");
+
+    next();
+    assert_int(TOK_EOF, cur_token, "End of output tokens");
+    assert_int(6, cur_line, "End of output tokens line");
+
+    rewind_lexer();
+    assert_int(TOK_IDENTIFIER, cur_token, "Rewound to output token xy");
+    assert_int(4, cur_line, "Rewound to output token xy line");
+
+    free_lexer();
+}
+
 int main() {
     failures = 0;
 
@@ -168,6 +231,7 @@ int main() {
     test_decimal_constants();
     test_hex_constants();
     test_floating_point_constants();
+    test_cpp_output();
 
     if (failures) {
         printf("%d tests failed\n", failures);
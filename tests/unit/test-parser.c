@@ -274,7 +274,7 @@ void test_typedef_parsing() {
     init_lexer_from_string("typedef int i32;");
 
     parse_typedef();
-    Symbol *s = lookup_symbol("i32", global_scope, 0);
+    Symbol *s = lookup_symbol(intern("i32"), global_scope, 0);
     assert_int(0, !s, "Typedef symbol");
     assert_english_type(s->type->target, "int", "typedef int i32");
 
@@ -288,7 +288,7 @@ void test_typedef_parsing() {
 
     init_lexer_from_string("typedef int (fri)();");
     parse_typedef();
-    s = lookup_symbol("fri", global_scope, 0);
+    s = lookup_symbol(intern("fri"), global_scope, 0);
     assert_int(0, !s, "Typedef symbol");
     assert_english_type(s->type->target, "function() returning int", "typedef function() returning int");
     typedef int (fri)();
@@ -87,9 +87,56 @@ void test_cache_elements() {
     assert(3, s->cached_elements[1]);
 }
 
+void test_multiple_words() {
+    Set *s1, *s2, *s3;
+
+    s1 = new_set(200); add_to_set(s1, 0); add_to_set(s1, 63); add_to_set(s1, 64); add_to_set(s1, 200);
+    s2 = new_set(200); add_to_set(s2, 63); add_to_set(s2, 127); add_to_set(s2, 200);
+    assert(4, set_len(s1));
+    assert(1, in_set(s1, 63));
+    assert(1, in_set(s1, 64));
+    assert(0, in_set(s1, 65));
+
+    s3 = set_union(s1, s2);
+    assert(5, set_len(s3));
+
+    s3 = set_intersection(s1, s2);
+    assert(2, set_len(s3));
+    assert(1, in_set(s3, 63));
+    assert(1, in_set(s3, 200));
+
+    s3 = set_difference(s1, s2);
+    assert(2, set_len(s3));
+    assert(1, in_set(s3, 0));
+    assert(1, in_set(s3, 64));
+}
+
+void test_foreach() {
+    Set *s;
+    int count, sum;
+
+    s = new_set(130); add_to_set(s, 1); add_to_set(s, 64); add_to_set(s, 129);
+    assert(1, set_next(s, -1));
+    assert(64, set_next(s, 1));
+    assert(129, set_next(s, 64));
+    assert(-1, set_next(s, 129));
+
+    count = 0;
+    sum = 0;
+    set_foreach(s, i) { count++; sum += i; }
+    assert(3, count);
+    assert(194, sum);
+
+    empty_set(s);
+    assert(-1, set_next(s, -1));
+    assert(0, set_len(s));
+}
+
 int main() {
     test_add_delete();
     test_merges();
     test_set_eq();
     test_cache_elements();
+    test_multiple_words();
+    test_foreach();
 }
@@ -25,16 +25,6 @@ void assert_set(Set *got, int v1, int v2, int v3, int v4, int v5) {
     assert(1, set_eq(got, is));
 }
 
-void assert_longset(LongSet *got, int v1, int v2, int v3, int v4, int v5) {
-    LongSet *expected = new_longset();
-    if (v1 != -1) longset_add(expected, v1);
-    if (v2 != -1) longset_add(expected, v2);
-    if (v3 != -1) longset_add(expected, v3);
-    if (v4 != -1) longset_add(expected, v4);
-    if (v5 != -1) longset_add(expected, v5);
-    assert(1, longset_eq(expected, got));
-}
-
 Function *new_function_with_type(void) {
     Function *result = new_function();
     result->type = new_type(TYPE_FUNCTION);
@@ -315,23 +305,23 @@ void test_liveout1() {
     assert(5, function->cfg->node_count);
     assert(6, function->cfg->edge_count);
 
-    assert_longset(function->uevar[0], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[1],  1, -1, -1, -1, -1);
-    assert_longset(function->uevar[2], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[3],  1,  2, -1, -1, -1);
-    assert_longset(function->uevar[4], -1,  2, -1, -1, -1);
-
-    assert_longset(function->varkill[0],  1, -1, -1, -1, -1);
-    assert_longset(function->varkill[1], -1, -1, -1, -1, -1);
-    assert_longset(function->varkill[2], -1,  2, -1, -1, -1);
-    assert_longset(function->varkill[3],  1,  2, -1, -1, -1);
-    assert_longset(function->varkill[4], -1, -1, -1, -1, -1);
-
-    assert_longset(function->liveout[0],  1,  2, -1, -1, -1);
-    assert_longset(function->liveout[1],  1,  2, -1, -1, -1);
-    assert_longset(function->liveout[2],  1,  2, -1, -1, -1);
-    assert_longset(function->liveout[3],  1,  2, -1, -1, -1);
-    assert_longset(function->liveout[4], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[0], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[1],  1, -1, -1, -1, -1);
+    assert_set(function->uevar[2], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[3],  1,  2, -1, -1, -1);
+    assert_set(function->uevar[4], -1,  2, -1, -1, -1);
+
+    assert_set(function->varkill[0],  1, -1, -1, -1, -1);
+    assert_set(function->varkill[1], -1, -1, -1, -1, -1);
+    assert_set(function->varkill[2], -1,  2, -1, -1, -1);
+    assert_set(function->varkill[3],  1,  2, -1, -1, -1);
+    assert_set(function->varkill[4], -1, -1, -1, -1, -1);
+
+    assert_set(function->liveout[0],  1,  2, -1, -1, -1);
+    assert_set(function->liveout[1],  1,  2, -1, -1, -1);
+    assert_set(function->liveout[2],  1,  2, -1, -1, -1);
+    assert_set(function->liveout[3],  1,  2, -1, -1, -1);
+    assert_set(function->liveout[4], -1, -1, -1, -1, -1);
 }
 
 // Make IR for the test example on page 484 of engineering a compiler
@@ -393,6 +383,48 @@ Function *make_ir2(int init_four_vars) {
     return function;
 }
 
+static int dominance_transfer(Function *function, int block, void *context) {
+    Set **dom = context;
+    int block_count = function->cfg->node_count;
+
+    Set *new_dom = new_set(block_count);
+    if (block) {
+        for (int i = 0; i < block_count; i++) add_to_set(new_dom, i);
+        for (GraphEdge *e = function->cfg->nodes[block].pred; e; e = e->next_pred)
+            set_intersection_to(new_dom, new_dom, dom[e->from->id]);
+    }
+    add_to_set(new_dom, block);
+
+    int changed = !set_eq(new_dom, dom[block]);
+    copy_set_to(dom[block], new_dom);
+    free_set(new_dom);
+
+    return changed;
+}
+
+// Solve dominance as a forward dataflow problem and compare it with make_block_dominance
+void test_forward_dataflow() {
+    Function *function;
+
+    function = make_ir2(0);
+    run_compiler_phases(function, "dummy", COMPILE_START_AT_ARITHMETIC_MANPULATION, COMPILE_STOP_AFTER_ANALYZE_DOMINANCE);
+
+    int block_count = function->cfg->node_count;
+
+    int *postorder = make_block_postorder(function->cfg);
+    assert(0, postorder[block_count - 1]);
+
+    Set **dom = wmalloc(block_count * sizeof(Set *));
+    for (int i = 0; i < block_count; i++) {
+        dom[i] = new_set(block_count);
+        for (int j = 0; j < block_count; j++) add_to_set(dom[i], j);
+    }
+
+    solve_dataflow(function, DATAFLOW_FORWARD, dominance_transfer, dom);
+
+    for (int i = 0; i < block_count; i++) assert(1, set_eq(dom[i], function->dominance[i]));
+}
+
 // Test example on page 484 of engineering a compiler
 void test_liveout2() {
     Function *function;
@@ -405,35 +437,35 @@ void test_liveout2() {
     assert(9, function->cfg->node_count);
     assert(11, function->cfg->edge_count);
 
-    assert_longset(function->uevar[0], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[1], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[2], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[3],  1,  2,  3,  4,  5);
-    assert_longset(function->uevar[4], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[5], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[6], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[7], -1, -1, -1, -1, -1);
-    assert_longset(function->uevar[8], -1, -1, -1, -1, -1);
-
-    assert_longset(function->varkill[0],  1, -1, -1, -1, -1);
-    assert_longset(function->varkill[1],  2,  4, -1, -1, -1);
-    assert_longset(function->varkill[2],  3,  4,  5, -1, -1);
-    assert_longset(function->varkill[3],  1,  6,  7, -1, -1);
-    assert_longset(function->varkill[4], -1, -1, -1, -1, -1);
-    assert_longset(function->varkill[5],  2,  5, -1, -1, -1);
-    assert_longset(function->varkill[6],  5, -1, -1, -1, -1);
-    assert_longset(function->varkill[7],  3, -1, -1, -1, -1);
-    assert_longset(function->varkill[8],  4, -1, -1, -1, -1);
-
-    assert_longset(function->liveout[0],  1, -1, -1, -1, -1);
-    assert_longset(function->liveout[1],  2,  4,  1, -1, -1);
-    assert_longset(function->liveout[2],  1,  2,  3,  4,  5);
-    assert_longset(function->liveout[3],  1, -1, -1, -1, -1);
-    assert_longset(function->liveout[4], -1, -1, -1, -1, -1);
-    assert_longset(function->liveout[5],  1,  2,  4,  5, -1);
-    assert_longset(function->liveout[6],  1,  2,  4,  5, -1);
-    assert_longset(function->liveout[7],  1,  2,  3,  4,  5);
-    assert_longset(function->liveout[8],  1,  2,  4,  5, -1);
+    assert_set(function->uevar[0], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[1], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[2], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[3],  1,  2,  3,  4,  5);
+    assert_set(function->uevar[4], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[5], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[6], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[7], -1, -1, -1, -1, -1);
+    assert_set(function->uevar[8], -1, -1, -1, -1, -1);
+
+    assert_set(function->varkill[0],  1, -1, -1, -1, -1);
+    assert_set(function->varkill[1],  2,  4, -1, -1, -1);
+    assert_set(function->varkill[2],  3,  4,  5, -1, -1);
+    assert_set(function->varkill[3],  1,  6,  7, -1, -1);
+    assert_set(function->varkill[4], -1, -1, -1, -1, -1);
+    assert_set(function->varkill[5],  2,  5, -1, -1, -1);
+    assert_set(function->varkill[6],  5, -1, -1, -1, -1);
+    assert_set(function->varkill[7],  3, -1, -1, -1, -1);
+    assert_set(function->varkill[8],  4, -1, -1, -1, -1);
+
+    assert_set(function->liveout[0],  1, -1, -1, -1, -1);
+    assert_set(function->liveout[1],  2,  4,  1, -1, -1);
+    assert_set(function->liveout[2],  1,  2,  3,  4,  5);
+    assert_set(function->liveout[3],  1, -1, -1, -1, -1);
+    assert_set(function->liveout[4], -1, -1, -1, -1, -1);
+    assert_set(function->liveout[5],  1,  2,  4,  5, -1);
+    assert_set(function->liveout[6],  1,  2,  4,  5, -1);
+    assert_set(function->liveout[7],  1,  2,  3,  4,  5);
+    assert_set(function->liveout[8],  1,  2,  4,  5, -1);
 }
 
 // Test example on page 484 and 531 of engineering a compiler
@@ -668,11 +700,11 @@ Function *make_ir3(int loop_count) {
     i(0, IR_MOVE,   v(4), c(0), 0   ); // d   = 0
     i(0, IR_JMP,    0 ,   l(2), 0   ); // jmp l2
     i(1, IR_NOP,    0,    0,    0   );
-    if (loop_count > 0) i(0, IR_START_LOOP,  0, c(0), c(1));
-    if (loop_count > 1) i(0, IR_START_LOOP,  0, c(1), c(2));
+    if (loop_count > 0) i(3, IR_NOP,    0,    0,    0   ); // Outer loop header
+    if (loop_count > 1) i(4, IR_NOP,    0,    0,    0   ); // Inner loop header
     i(0, IR_MOVE,   v(3), c(0), 0   ); // c   = 0
-    if (loop_count > 1) i(0, IR_END_LOOP,  0, c(1), c(2));
-    if (loop_count > 0) i(0, IR_END_LOOP,  0, c(0), c(1));
+    if (loop_count > 1) i(0, IR_JZ,     0,    c(0), l(4)); // Inner loop back edge
+    if (loop_count > 0) i(0, IR_JZ,     0,    c(0), l(3)); // Outer loop back edge
     i(0, IR_MOVE,   v(4), v(3), 0   ); // d   = c
     i(2, IR_NOP,    0,    0,    0   );
     i(0, IR_ADD,    0,    v(1), v(1)); // ... = a
@@ -686,13 +718,58 @@ Function *make_ir3(int loop_count) {
     return function;
 }
 
-void assert_has_ig_edge(char *ig, int vreg_count, int from, int to) {
-    assert((to > from && ig[from * vreg_count + to]) || ig[to * vreg_count + from], 1);
+void test_loop_nesting_forest() {
+    Function *function;
+    LoopForest *forest;
+
+    // Two nested loops with headers in blocks 3 and 4
+    function = make_ir3(2);
+    run_compiler_phases(function, "dummy", COMPILE_START_AT_ARITHMETIC_MANPULATION, COMPILE_STOP_AFTER_ANALYZE_DOMINANCE);
+    forest = function->loop_forest;
+
+    assert(2, forest->loop_count);
+
+    assert( 4, forest->loops[0].header);
+    assert( 1, forest->loops[0].parent);
+    assert( 2, forest->loops[0].depth);
+    assert_set(forest->loops[0].body,    4, -1, -1, -1, -1);
+    assert_set(forest->loops[0].latches, 4, -1, -1, -1, -1);
+
+    assert( 3, forest->loops[1].header);
+    assert(-1, forest->loops[1].parent);
+    assert( 1, forest->loops[1].depth);
+    assert_set(forest->loops[1].body,    3,  4,  5, -1, -1);
+    assert_set(forest->loops[1].latches, 5, -1, -1, -1, -1);
+
+    assert(-1, forest->block_loops[2]); assert(0, forest->block_depths[2]);
+    assert( 1, forest->block_loops[3]); assert(1, forest->block_depths[3]);
+    assert( 0, forest->block_loops[4]); assert(2, forest->block_depths[4]);
+    assert( 1, forest->block_loops[5]); assert(1, forest->block_depths[5]);
+    assert(-1, forest->block_loops[6]); assert(0, forest->block_depths[6]);
+
+    // The loop from page 500 of engineering a compiler, with a back edge from block 3 to 1
+    function = make_ir2(0);
+    run_compiler_phases(function, "dummy", COMPILE_START_AT_ARITHMETIC_MANPULATION, COMPILE_STOP_AFTER_ANALYZE_DOMINANCE);
+    forest = function->loop_forest;
+
+    assert(1, forest->loop_count);
+    assert(1, forest->loops[0].header);
+    assert(-1, forest->loops[0].parent);
+    assert(7, set_len(forest->loops[0].body));
+    assert_set(forest->loops[0].latches, 3, -1, -1, -1, -1);
+    assert(0, forest->block_depths[0]);
+    assert(1, forest->block_depths[1]);
+    assert(0, forest->block_depths[4]);
+    assert(1, forest->block_depths[8]);
+}
+
+void assert_has_ig_edge(InterferenceGraph *ig, int from, int to) {
+    assert(1, ig_lookup(ig, from, to));
 }
 
 void test_interference_graph1() {
     int l;
-    char *ig;
+    InterferenceGraph *ig;
     Function *function;
 
     l = live_range_reserved_pregs_offset;
@@ -705,16 +782,15 @@ void test_interference_graph1() {
     run_compiler_phases(function, "dummy", COMPILE_START_AT_ARITHMETIC_MANPULATION, COMPILE_STOP_AFTER_LIVE_RANGES);
 
     ig = function->interference_graph;
-    int vreg_count = function->vreg_count;
 
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 2);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 3);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 4);
+    assert_has_ig_edge(ig, l + 1, l + 2);
+    assert_has_ig_edge(ig, l + 1, l + 3);
+    assert_has_ig_edge(ig, l + 1, l + 4);
 }
 
 void test_interference_graph2() {
     int l;
-    char *ig;
+    InterferenceGraph *ig;
     Function *function;
 
     l = live_range_reserved_pregs_offset;
@@ -729,28 +805,27 @@ void test_interference_graph2() {
     if (debug_ssa_interference_graph) print_ir(function, 0, 0);
 
     ig = function->interference_graph;
-    int vreg_count = function->vreg_count;
-
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 2);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 3);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 4);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 5);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 6);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 7);
-    assert_has_ig_edge(ig, vreg_count, l + 2, l + 3);
-    assert_has_ig_edge(ig, vreg_count, l + 2, l + 4);
-    assert_has_ig_edge(ig, vreg_count, l + 2, l + 5);
-    assert_has_ig_edge(ig, vreg_count, l + 3, l + 4);
-    assert_has_ig_edge(ig, vreg_count, l + 3, l + 5);
-    assert_has_ig_edge(ig, vreg_count, l + 4, l + 5);
-    assert_has_ig_edge(ig, vreg_count, l + 4, l + 6);
-    assert_has_ig_edge(ig, vreg_count, l + 5, l + 6);
+
+    assert_has_ig_edge(ig, l + 1, l + 2);
+    assert_has_ig_edge(ig, l + 1, l + 3);
+    assert_has_ig_edge(ig, l + 1, l + 4);
+    assert_has_ig_edge(ig, l + 1, l + 5);
+    assert_has_ig_edge(ig, l + 1, l + 6);
+    assert_has_ig_edge(ig, l + 1, l + 7);
+    assert_has_ig_edge(ig, l + 2, l + 3);
+    assert_has_ig_edge(ig, l + 2, l + 4);
+    assert_has_ig_edge(ig, l + 2, l + 5);
+    assert_has_ig_edge(ig, l + 3, l + 4);
+    assert_has_ig_edge(ig, l + 3, l + 5);
+    assert_has_ig_edge(ig, l + 4, l + 5);
+    assert_has_ig_edge(ig, l + 4, l + 6);
+    assert_has_ig_edge(ig, l + 5, l + 6);
 }
 
 // Test the special case of a register copy not introducing an edge
 void test_interference_graph3() {
     int l;
-    char *ig;
+    InterferenceGraph *ig;
     Function *function;
 
     l = live_range_reserved_pregs_offset;
@@ -777,10 +852,9 @@ void test_interference_graph3() {
     if (debug_ssa_interference_graph) print_ir(function, 0, 0);
 
     ig = function->interference_graph;
-    int vreg_count = function->vreg_count;
 
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 2);
-    assert_has_ig_edge(ig, vreg_count, l + 1, l + 3);
+    assert_has_ig_edge(ig, l + 1, l + 2);
+    assert_has_ig_edge(ig, l + 1, l + 3);
 }
 
 void test_spill_cost() {
@@ -860,7 +934,7 @@ void run_allocate_registers_top_down(Function *function, int physical_register_c
 
 void test_top_down_register_allocation() {
     int i, l, vreg_count;
-    char *ig;
+    InterferenceGraph *ig;
     Function *function;
     VregLocation *vl;
 
@@ -883,12 +957,12 @@ void test_top_down_register_allocation() {
     function->spill_cost = malloc((vreg_count + 1) * sizeof(int));
     for (i = 1; i <= vreg_count; i++) function->spill_cost[i] = i;
 
-    ig = calloc((vreg_count + 1) * (vreg_count + 1), sizeof(int));
+    ig = new_ig(vreg_count);
     function->interference_graph = ig;
 
-    add_ig_edge(ig, vreg_count, 1, 2);
-    add_ig_edge(ig, vreg_count, 1, 3);
-    add_ig_edge(ig, vreg_count, 1, 4);
+    add_ig_edge(ig, 1, 2);
+    add_ig_edge(ig, 1, 3);
+    add_ig_edge(ig, 1, 4);
 
     // Everything is spilled. All nodes are constrained.
     // The vregs with the lowest cost get spilled first
@@ -933,7 +1007,7 @@ void test_top_down_register_allocation() {
 
     // function->interference_graph_edge_count++;
     // edges[3].from = 2; edges[3].to = 4;
-    add_ig_edge(ig, vreg_count, 2, 4);
+    add_ig_edge(ig, 2, 4);
 
     function->stack_register_count = 0;
     run_allocate_registers_top_down(function, 2);
@@ -971,6 +1045,7 @@ int main() {
     test_dominance();
     test_liveout1();
     test_liveout2();
+    test_forward_dataflow();
     test_idom2();
     test_idom3();
     test_phi_insertion();
@@ -979,6 +1054,7 @@ int main() {
     test_interference_graph1();
     test_interference_graph2();
     test_interference_graph3();
+    test_loop_nesting_forest();
     test_spill_cost();
     test_coalesce();
     test_coalesce_promotion();
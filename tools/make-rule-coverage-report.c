@@ -95,14 +95,14 @@ int main() {
 
     covered_count = 0;
     for (i = 0; i <= rule_coverage->max_value; i++) {
-        covered = wcc2_cov->elements[i] || instrsel_tests_cov->elements[i] || wcc_tests_cov->elements[i];
+        covered = in_set(wcc2_cov, i) || in_set(instrsel_tests_cov, i) || in_set(wcc_tests_cov, i);
         if (covered) covered_count++;
 
         fprintf(f, "<tr>");
         fprintf(f, "<td>%d</td>\n", i);
-        fprintf(f, "<td class='%s'</td>", wcc2_cov->elements[i] ? "inset" : "");
-        fprintf(f, "<td class='%s'</td>", instrsel_tests_cov->elements[i] ? "inset" : "");
-        fprintf(f, "<td class='%s'</td>", wcc_tests_cov->elements[i] ? "inset" : "");
+        fprintf(f, "<td class='%s'</td>", in_set(wcc2_cov, i) ? "inset" : "");
+        fprintf(f, "<td class='%s'</td>", in_set(instrsel_tests_cov, i) ? "inset" : "");
+        fprintf(f, "<td class='%s'</td>", in_set(wcc_tests_cov, i) ? "inset" : "");
 
         r = &(instr_rules[i]);
         fprintf(f, "<td class='%s'>%s</td>", covered ? "inset" : "", operation_string(r->operation));
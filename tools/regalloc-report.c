@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Compare the register allocators on the compiler's own sources. For each allocator,
+// report the number of spilled registers, the number of instructions and the
+// number of register to register moves in the generated assembly.
+
+char *allocators[] = {"graph-coloring", "linear-scan", "irc"};
+char *sources[] = {"lexer.c", "parser.c", "types.c", "ir.c", "ssa.c", "regalloc.c", "instrsel.c", "codegen.c", "cpp.c", "tests/e2e/test-floats-and-doubles.c"};
+
+#define ALLOCATOR_COUNT (sizeof(allocators) / sizeof(char *))
+#define SOURCE_COUNT (sizeof(sources) / sizeof(char *))
+
+typedef struct counts {
+    long spills;
+    long instructions;
+    long moves;
+} Counts;
+
+// Run the compiler and return the spilled register count it prints with --prc
+long compile(char *src_dir, char *allocator, char *source) {
+    char command[1024];
+    char line[256];
+    FILE *f;
+    long spills;
+
+    sprintf(command,
+        "../wcc -I %s/include -I .. -I %s -D INSTALL_LIB_DIR='\"\"' "
+        "-Wno-incompatible-pointer-types -Wno-int-conversion -Wno-integer-constant-too-large -Wno-warn-assignment-types-incompatible "
+        "-fregalloc=%s --prc -c -S %s/%s -o regalloc-report.s", src_dir, src_dir, allocator, src_dir, source);
+
+    f = popen(command, "r");
+    if (!f) {
+        perror("popen");
+        exit(1);
+    }
+
+    spills = 0;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "stack_register_count=", 21)) spills = atol(line + 21);
+
+    if (pclose(f)) {
+        printf("Failed to run %s\n", command);
+        exit(1);
+    }
+
+    return spills;
+}
+
+// Count instructions and register to register moves in the generated assembly
+void count_instructions(Counts *counts) {
+    char line[256];
+    char mnemonic[32], operands[200];
+    FILE *f;
+    int n;
+
+    f = fopen("regalloc-report.s", "r");
+    if (!f) {
+        perror("regalloc-report.s");
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] != ' ') continue;
+
+        operands[0] = 0;
+        n = sscanf(line, " %31s %199[^\n]", mnemonic, operands);
+        if (n < 1 || mnemonic[0] == '.') continue;
+
+        counts->instructions++;
+        if (!strncmp(mnemonic, "mov", 3) && operands[0] == '%' && strstr(operands, ", %")) counts->moves++;
+    }
+
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    Counts totals[ALLOCATOR_COUNT];
+    Counts counts;
+    int i, j;
+
+    if (argc != 2) {
+        printf("Usage: %s SRC_DIR\n", argv[0]);
+        exit(1);
+    }
+
+    memset(totals, 0, sizeof(totals));
+
+    printf("%-40s %-16s %8s %12s %8s\n", "Source", "Allocator", "Spills", "Instructions", "Moves");
+
+    for (i = 0; i < SOURCE_COUNT; i++) {
+        for (j = 0; j < ALLOCATOR_COUNT; j++) {
+            memset(&counts, 0, sizeof(counts));
+            counts.spills = compile(argv[1], allocators[j], sources[i]);
+            count_instructions(&counts);
+            printf("%-40s %-16s %8ld %12ld %8ld\n", sources[i], allocators[j], counts.spills, counts.instructions, counts.moves);
+
+            totals[j].spills += counts.spills;
+            totals[j].instructions += counts.instructions;
+            totals[j].moves += counts.moves;
+        }
+    }
+
+    printf("\n");
+    for (j = 0; j < ALLOCATOR_COUNT; j++)
+        printf("%-40s %-16s %8ld %12ld %8ld\n", "Total", allocators[j], totals[j].spills, totals[j].instructions, totals[j].moves);
+
+    remove("regalloc-report.s");
+}
@@ -4,9 +4,7 @@
 
 #include "wcc.h"
 
-static List *allocated_types;
-static List *allocated_type_iterators;
-static List *allocated_struct_members;
+static List *allocated_function_types; // Function types, which have lists that need freeing
 
 List *all_structs_and_unions;  // All structs/unions defined globally.
 
@@ -180,32 +178,17 @@ void print_type_in_english(Type *type) {
 }
 
 void init_type_allocations(void) {
-    allocated_types = new_list(1024);
-    allocated_type_iterators = new_list(32);
-    allocated_struct_members = new_list(128);
+    allocated_function_types = new_list(128);
     all_structs_and_unions = new_list(32);
 }
 
-static void free_type(Type *type) {
-    if (type->type == TYPE_FUNCTION) {
-        FunctionType *function = type->function;
+void free_types(void) {
+    for (int i = 0; i < allocated_function_types->length; i++) {
+        FunctionType *function = allocated_function_types->elements[i];
         free_list(function->param_types); // The types are already GC'd
         free_list(function->param_identifiers); // The identifiers are already GC'd
-        wfree(function);
     }
-
-    wfree(type);
-}
-
-void free_types(void) {
-    for (int i = 0; i < allocated_types->length; i++) free_type(allocated_types->elements[i]);
-    free_list(allocated_types);
-
-    for (int i = 0; i < allocated_type_iterators->length; i++) wfree(allocated_type_iterators->elements[i]);
-    free_list(allocated_type_iterators);
-
-    for (int i = 0; i < allocated_struct_members->length; i++) wfree(allocated_struct_members->elements[i]);
-    free_list(allocated_struct_members);
+    free_list(allocated_function_types);
 
     for (int i = 0; i < all_structs_and_unions->length; i++) {
         StructOrUnion *s = all_structs_and_unions->elements[i];
@@ -216,14 +199,14 @@ void free_types(void) {
 }
 
 Type *new_type(int type) {
-    Type *result = wcalloc(1, sizeof(Type));
+    Type *result = arena_alloc(translation_unit_arena, sizeof(Type));
     result->type = type;
-    append_to_list(allocated_types, result);
 
     if (type == TYPE_FUNCTION) {
-        result->function = wcalloc(1, sizeof(FunctionType));
+        result->function = arena_alloc(translation_unit_arena, sizeof(FunctionType));
         result->function->param_types = new_list(8);
         result->function->param_identifiers = new_list(8);
+        append_to_list(allocated_function_types, result->function);
     }
 
     return result;
@@ -231,8 +214,9 @@ Type *new_type(int type) {
 
 // Do a deep copy of a FunctionType
 FunctionType *dup_function_type(FunctionType *src) {
-    FunctionType *dst = wcalloc(1, sizeof(FunctionType));
+    FunctionType *dst = arena_alloc(translation_unit_arena, sizeof(FunctionType));
     *dst = *src;
+    append_to_list(allocated_function_types, dst);
 
     dst->param_types = new_list(src->param_types->length);
     for (int i = 0; i < src->param_types->length; i++)
@@ -251,14 +235,12 @@ FunctionType *dup_function_type(FunctionType *src) {
 Type *dup_type(Type *src) {
     if (!src) return 0;
 
-    Type *dst = wmalloc(sizeof(Type));
+    Type *dst = arena_alloc(translation_unit_arena, sizeof(Type));
     *dst = *src;
     dst->target = dup_type(src->target);
 
     if (src->function) dst->function = dup_function_type(src->function);
 
-    append_to_list(allocated_types, dst);
-
     return dst;
 }
 
@@ -283,14 +265,12 @@ Type *new_struct_or_union(char *tag_identifier) {
 
 
 StructOrUnionMember *new_struct_member(void) {
-    StructOrUnionMember *result = wcalloc(1, sizeof(StructOrUnionMember));
-    append_to_list(allocated_struct_members, result);
+    StructOrUnionMember *result = arena_alloc(translation_unit_arena, sizeof(StructOrUnionMember));
     return result;
 }
 
 static StructOrUnionMember *dup_struct_or_union_member(StructOrUnionMember *src) {
-    StructOrUnionMember *dst = wmalloc(sizeof(StructOrUnionMember));
-    append_to_list(allocated_struct_members, dst);
+    StructOrUnionMember *dst = arena_alloc(translation_unit_arena, sizeof(StructOrUnionMember));
     dst->identifier = src->identifier;
     dst->type = dup_type(src->type);
     dst->offset = src->offset;
@@ -973,8 +953,7 @@ int type_is_modifiable(Type *type) {
 // Create a new type iterator instance. A type iterator can be used to recurse
 // through all scalars either depth first, or by iterating at a single level.
 TypeIterator *type_iterator(Type *type) {
-    TypeIterator *it = wcalloc(1, sizeof(TypeIterator));
-    append_to_list(allocated_type_iterators, it);
+    TypeIterator *it = arena_alloc(translation_unit_arena, sizeof(TypeIterator));
     it->type = type;
 
     return it;
@@ -1,7 +1,11 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include "wcc.h"
@@ -79,6 +83,46 @@ void terminate_string_buffer(StringBuffer *sb) {
     sb->data[sb->position] = 0;
 }
 
+// Size of the address range used by map_file
+static long get_file_mapping_size(int size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) / page_size * page_size + page_size;
+}
+
+// Map a file read-only into memory. The mapping is followed by at least one page
+// of zeroes, so a lexer can look ahead a few characters past the end and see
+// zeroes, just like a NUL terminated string. Returns 0 if the file can't be read.
+char *map_file(char *filename, int *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    // Reserve the whole range with zeroes, then map the file over the start of it
+    long mapping_size = get_file_mapping_size(st.st_size);
+    char *data = mmap(0, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) panic("Unable to map %ld bytes for %s", mapping_size, filename);
+
+    if (st.st_size && mmap(data, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(data, mapping_size);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+    *size = st.st_size;
+
+    return data;
+}
+
+void unmap_file(char *data, int size) {
+    munmap(data, get_file_mapping_size(size));
+}
+
 void set_debug_logging_start_time() {
     gettimeofday(&debug_log_start, NULL);
 }
@@ -2,34 +2,77 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/wait.h>
 
 #include "wcc.h"
 
+// The parts of a value that are needed to render an x86 instruction. These are sent
+// from a backend worker process back to the parent.
+typedef struct backend_value {
+    int is_present;
+    int type;
+    int vreg;
+    int preg;
+    int is_constant;
+    int is_string_literal;
+    int load_from_got;
+    int stack_index;
+    int stack_offset;
+    int string_literal_index;
+    int offset;
+    int label;
+    long int_value;
+    long double fp_value;
+    Symbol *global_symbol;     // Symbols are created by the parser, so the pointer is valid in the parent
+} BackendValue;
+
+// An instruction as sent from a backend worker process back to the parent.
+typedef struct backend_tac {
+    int operation;
+    int label;
+    int x86_template_length;   // -1 if there is no template
+    int jump_table_count;      // Number of jump table labels following the values
+    Origin *origin;            // Origins are created by the parser, so the pointer is valid in the parent
+} BackendTac;
+
+// Per-function results sent from a backend worker process back to the parent.
+typedef struct backend_function {
+    int symbol_index;
+    int label_count;           // Number of labels used by the function
+    int stack_register_count;  // Contribution to total_stack_register_count
+    int tac_count;
+} BackendFunction;
+
 void init_instruction_selection_rules(void) {
     init_generated_instruction_selection_rules();
 
-    init_rules_by_operation();
+    free_burs();
+    init_burs();
 
     rule_coverage = new_set(instr_rule_count - 1);
 }
 
 void free_instruction_selection_rules(void) {
     free_set(rule_coverage);
-    free_rules_by_operation();
+    free_burs();
 }
 
 void init_memory_management_for_translation_unit(void) {
+    translation_unit_arena = new_arena();
     init_type_allocations();
-    init_value_allocations();
     init_function_allocations();
-    init_ir();
 }
 
 void free_memory_for_translation_unit(void) {
     free_types();
-    free_values();
     free_functions();
-    free_ir();
+    free_arena(translation_unit_arena);
+    translation_unit_arena = 0;
+}
+
+char *get_as_binary(void) {
+    char *env_value = getenv("AS");
+    return env_value ? env_value : DEFAULT_AS_COMMAND;
 }
 
 char *make_temp_filename(char *template) {
@@ -49,6 +92,8 @@ void run_compiler_phases(Function *function, char *function_name, int start_at,
 
     if (log_compiler_phase_durations) debug_log("Starting compiler phases for of %s", function_name);
 
+    if (!function->arena) function->arena = new_arena();
+
     if (start_at == COMPILE_START_AT_BEGINNING) {
         convert_enums(function);
         process_struct_and_union_copies(function);
@@ -129,16 +174,21 @@ void run_compiler_phases(Function *function, char *function_name, int start_at,
     // Register allocation and spilling
     if (log_compiler_phase_durations) debug_log("Register allocation");
     sanity_test_ir_linkage(function);
-    make_interference_graph(function, 1, 0);
+    if (opt_register_allocator == REGALLOC_LINEAR_SCAN)
+        make_live_intervals(function);
+    else
+        make_interference_graph(function, 1, 0);
     free_liveout(function);
     free_dominance(function);
     allocate_registers(function);
     free_interference_graph(function);
+    free_live_intervals(function);
     free_live_range_spill_cost(function);
     free_vreg_preg_classes(function);
     free_preferred_live_range_preg_indexes(function);
     remove_stack_self_moves(function);
     add_spill_code(function);
+    free_rematerializations(function);
 
     if (stop_at == COMPILE_STOP_AFTER_ADD_SPILL_CODE) return;
 
@@ -148,6 +198,9 @@ void run_compiler_phases(Function *function, char *function_name, int start_at,
     remove_nops(function);
     merge_rsp_func_call_add_subs(function);
 
+    free_arena(function->arena);
+    function->arena = 0;
+
     if (log_compiler_phase_durations) debug_log("Finished compilation");
 }
 
@@ -157,16 +210,308 @@ static void compile_internals(void) {
     free_lexer();
 }
 
-void compile(char *input, char *original_input_filename, char *output_filename) {
+static void write_backend_value(FILE *f, Value *v) {
+    BackendValue bv;
+    memset(&bv, 0, sizeof(BackendValue));
+
+    if (v) {
+        bv.is_present = 1;
+        bv.type = v->type ? v->type->type : 0;
+        bv.vreg = v->vreg;
+        bv.preg = v->preg;
+        bv.is_constant = v->is_constant;
+        bv.is_string_literal = v->is_string_literal;
+        bv.load_from_got = v->load_from_got;
+        bv.stack_index = v->stack_index;
+        bv.stack_offset = v->stack_offset;
+        bv.string_literal_index = v->string_literal_index;
+        bv.offset = v->offset;
+        bv.label = v->label;
+        bv.int_value = v->int_value;
+        bv.fp_value = v->fp_value;
+        bv.global_symbol = v->global_symbol;
+    }
+
+    fwrite(&bv, sizeof(BackendValue), 1, f);
+}
+
+// Write the final x86 IR of a function so that the parent can render it
+static void write_backend_function(FILE *f, int symbol_index, Function *function, int label_count, int stack_register_count) {
+    BackendFunction bf;
+    bf.symbol_index = symbol_index;
+    bf.label_count = label_count;
+    bf.stack_register_count = stack_register_count;
+    bf.tac_count = 0;
+    for (Tac *tac = function->ir; tac; tac = tac->next) bf.tac_count++;
+    fwrite(&bf, sizeof(BackendFunction), 1, f);
+
+    for (Tac *tac = function->ir; tac; tac = tac->next) {
+        BackendTac bt;
+        bt.operation = tac->operation;
+        bt.label = tac->label;
+        bt.x86_template_length = tac->x86_template ? strlen(tac->x86_template) : -1;
+        bt.origin = tac->origin;
+        bt.jump_table_count = tac->operation == X_JMP_TABLE ? tac->src2->jump_table->count : 0;
+        fwrite(&bt, sizeof(BackendTac), 1, f);
+        if (tac->x86_template) fwrite(tac->x86_template, 1, bt.x86_template_length, f);
+
+        write_backend_value(f, tac->dst);
+        write_backend_value(f, tac->src1);
+        write_backend_value(f, tac->src2);
+
+        if (bt.jump_table_count) fwrite(tac->src2->jump_table->labels, sizeof(int), bt.jump_table_count, f);
+    }
+}
+
+static void read_backend_data(FILE *f, void *data, int size) {
+    if (fread(data, size, 1, f) != 1) panic("Truncated backend worker output");
+}
+
+static Value *read_backend_value(FILE *f, int label_offset) {
+    BackendValue bv;
+    read_backend_data(f, &bv, sizeof(BackendValue));
+    if (!bv.is_present) return 0;
+
+    Value *v = new_value();
+    v->type = bv.type ? new_type(bv.type) : 0;
+    v->vreg = bv.vreg;
+    v->preg = bv.preg;
+    v->is_constant = bv.is_constant;
+    v->is_string_literal = bv.is_string_literal;
+    v->load_from_got = bv.load_from_got;
+    v->stack_index = bv.stack_index;
+    v->stack_offset = bv.stack_offset;
+    v->string_literal_index = bv.string_literal_index;
+    v->offset = bv.offset;
+    v->label = bv.label ? bv.label + label_offset : 0;
+    v->int_value = bv.int_value;
+    v->fp_value = bv.fp_value;
+    v->global_symbol = bv.global_symbol;
+
+    return v;
+}
+
+// Read the x86 IR of a function written by write_backend_function. Labels are
+// shifted by label_offset, so that they end up where a sequential compilation
+// would have put them.
+static Tac *read_backend_function_ir(FILE *f, int tac_count, int label_offset, List *backend_strings) {
+    Tac *ir = 0;
+    Tac *last = 0;
+
+    for (int i = 0; i < tac_count; i++) {
+        BackendTac bt;
+        read_backend_data(f, &bt, sizeof(BackendTac));
+
+        Tac *tac = new_instruction(bt.operation);
+        tac->label = bt.label ? bt.label + label_offset : 0;
+        tac->origin = bt.origin;
+
+        if (bt.x86_template_length != -1) {
+            tac->x86_template = wmalloc(bt.x86_template_length + 1);
+            if (bt.x86_template_length) read_backend_data(f, tac->x86_template, bt.x86_template_length);
+            tac->x86_template[bt.x86_template_length] = 0;
+            append_to_list(backend_strings, tac->x86_template);
+        }
+
+        tac->dst = read_backend_value(f, label_offset);
+        tac->src1 = read_backend_value(f, label_offset);
+        tac->src2 = read_backend_value(f, label_offset);
+
+        if (bt.jump_table_count) {
+            JumpTable *jump_table = arena_alloc(translation_unit_arena, sizeof(JumpTable));
+            jump_table->count = bt.jump_table_count;
+            jump_table->labels = arena_alloc(translation_unit_arena, bt.jump_table_count * sizeof(int));
+            read_backend_data(f, jump_table->labels, bt.jump_table_count * sizeof(int));
+            for (int j = 0; j < jump_table->count; j++) jump_table->labels[j] += label_offset;
+            tac->src2->jump_table = jump_table;
+        }
+
+        if (last) {
+            last->next = tac;
+            tac->prev = last;
+        }
+        else
+            ir = tac;
+
+        last = tac;
+    }
+
+    return ir;
+}
+
+// Pull function indexes from the work pipe, compile them and write the results
+// to f. Each function starts with the label count at the end of parsing, so
+// that the parent can relocate the labels in sequential order.
+static void run_backend_worker(List *symbols, int work_fd, FILE *f, int first_label) {
+    int index;
+
+    while (read(work_fd, &index, sizeof(int)) == sizeof(int)) {
+        Symbol *symbol = symbols->elements[index];
+
+        label_count = first_label;
+        int stack_register_count = total_stack_register_count;
+        run_compiler_phases(symbol->function, symbol->identifier, COMPILE_START_AT_BEGINNING, COMPILE_STOP_AT_END);
+        write_backend_function(f, index, symbol->function, label_count - first_label, total_stack_register_count - stack_register_count);
+    }
+
+    fflush(f);
+    fflush(stdout);
+    _exit(0);
+}
+
+// Run the per-function compiler phases in job_count worker processes. Each worker
+// has its own copy of all compiler state. The parent hands out functions through
+// a pipe and reads back the final x86 IR, which is then rendered in declaration
+// order by output_code(), the same as in a sequential compilation.
+static void compile_functions_in_parallel(int job_count, List *backend_strings) {
+    List *symbols = new_list(128);
+    for (int i = 0; i < global_scope->symbol_list->length; i++) {
+        Symbol *symbol = global_scope->symbol_list->elements[i];
+        if (symbol->type->type == TYPE_FUNCTION && symbol->function->is_defined)
+            append_to_list(symbols, symbol);
+    }
+
+    if (job_count > symbols->length) job_count = symbols->length;
+
+    int first_label = label_count;
+    int work_fds[2];
+    if (pipe(work_fds) == -1) {
+        perror("in compile_functions_in_parallel");
+        exit(1);
+    }
+
+    FILE **results = wmalloc(job_count * sizeof(FILE *));
+    int *pids = wmalloc(job_count * sizeof(int));
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int i = 0; i < job_count; i++) {
+        results[i] = tmpfile();
+        if (!results[i]) {
+            perror("in compile_functions_in_parallel");
+            exit(1);
+        }
+
+        pids[i] = fork();
+        if (pids[i] == -1) {
+            perror("in compile_functions_in_parallel");
+            exit(1);
+        }
+
+        if (!pids[i]) {
+            close(work_fds[1]);
+            run_backend_worker(symbols, work_fds[0], results[i], first_label);
+        }
+    }
+
+    close(work_fds[0]);
+    for (int i = 0; i < symbols->length; i++) {
+        if (write(work_fds[1], &i, sizeof(int)) != sizeof(int)) {
+            perror("in compile_functions_in_parallel");
+            exit(1);
+        }
+    }
+    close(work_fds[1]);
+
+    int exit_code = 0;
+    for (int i = 0; i < job_count; i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) == -1) {
+            perror("in compile_functions_in_parallel");
+            exit(1);
+        }
+
+        if (!WIFEXITED(status)) exit_code = 1;
+        else if (WEXITSTATUS(status) && !exit_code) exit_code = WEXITSTATUS(status);
+    }
+
+    if (exit_code) exit(exit_code);
+
+    // Find out where each function's results are
+    BackendFunction *functions = wcalloc(symbols->length, sizeof(BackendFunction));
+    long *positions = wcalloc(symbols->length, sizeof(long));
+    FILE **function_results = wcalloc(symbols->length, sizeof(FILE *));
+
+    for (int i = 0; i < job_count; i++) {
+        FILE *f = results[i];
+        fseek(f, 0, SEEK_SET);
+
+        BackendFunction bf;
+        while (fread(&bf, sizeof(BackendFunction), 1, f) == 1) {
+            functions[bf.symbol_index] = bf;
+            function_results[bf.symbol_index] = f;
+            positions[bf.symbol_index] = ftell(f);
+
+            // Skip over the instructions
+            for (int j = 0; j < bf.tac_count; j++) {
+                BackendTac bt;
+                read_backend_data(f, &bt, sizeof(BackendTac));
+                long skip = 3 * sizeof(BackendValue) + bt.jump_table_count * sizeof(int);
+                if (bt.x86_template_length != -1) skip += bt.x86_template_length;
+                fseek(f, skip, SEEK_CUR);
+            }
+        }
+    }
+
+    // Read the IR back in declaration order, relocating the labels
+    int label_offset = 0;
+    for (int i = 0; i < symbols->length; i++) {
+        if (!function_results[i]) panic("Missing backend worker output for function %d", i);
+
+        Symbol *symbol = symbols->elements[i];
+        fseek(function_results[i], positions[i], SEEK_SET);
+        symbol->function->ir = read_backend_function_ir(function_results[i], functions[i].tac_count, label_offset, backend_strings);
+        label_offset += functions[i].label_count;
+        total_stack_register_count += functions[i].stack_register_count;
+    }
+
+    label_count = first_label + label_offset;
+
+    for (int i = 0; i < job_count; i++) fclose(results[i]);
+
+    wfree(functions);
+    wfree(positions);
+    wfree(function_results);
+    wfree(results);
+    wfree(pids);
+    free_list(symbols);
+}
+
+// Assemble the output of output_code() with the external assembler and compare the
+// result with the object file made by output_object_code()
+static void verify_object_code(char *original_input_filename, char *object_filename) {
+    char *assembly_filename = make_temp_filename("/tmp/XXXXXX.s");
+    char *expected_object_filename = make_temp_filename("/tmp/XXXXXX.o");
+
+    output_code(original_input_filename, assembly_filename);
+
+    char *command = wmalloc(strlen(get_as_binary()) + strlen(assembly_filename) + strlen(expected_object_filename) + 16);
+    sprintf(command, "%s -64 %s -o %s", get_as_binary(), assembly_filename, expected_object_filename);
+    int result = system(command);
+    if (result) exit(result >> 8 ? result >> 8 : 1);
+
+    int differences = compare_elf_objects(expected_object_filename, object_filename);
+
+    unlink(assembly_filename);
+    unlink(expected_object_filename);
+    wfree(command);
+    wfree(assembly_filename);
+    wfree(expected_object_filename);
+
+    if (differences) simple_error("Object file for %s differs from the assembler output", original_input_filename);
+}
+
+void compile(CppOutput *input, char *original_input_filename, char *output_filename, int output_object_file) {
     init_parser();
 
     if (!debug_dont_compile_internals) compile_internals();
 
-    memcpy_symbol = lookup_symbol("memcpy", global_scope, 0);
-    memset_symbol = lookup_symbol("memset", global_scope, 0);
+    memcpy_symbol = lookup_symbol(intern("memcpy"), global_scope, 0);
+    memset_symbol = lookup_symbol(intern("memset"), global_scope, 0);
 
     compile_phase = CP_PARSING;
-    init_lexer_from_string(input);
+    init_lexer_from_cpp_output(input);
     parse();
     free_lexer();
 
@@ -178,18 +523,31 @@ void compile(char *input, char *original_input_filename, char *output_filename)
     init_codegen();
 
     // Compile all functions
-    for (int i = 0; i < global_scope->symbol_list->length; i++) {
-        Symbol *symbol = global_scope->symbol_list->elements[i];
-        if (symbol->type->type == TYPE_FUNCTION && symbol->function->is_defined) {
-            Function *function = symbol->function;
-            if (print_ir1) print_ir(function, symbol->identifier, 0);
-
-            run_compiler_phases(function, symbol->identifier, COMPILE_START_AT_BEGINNING, COMPILE_STOP_AT_END);
-            if (print_ir2) print_ir(function, symbol->identifier, 0);
+    List *backend_strings = new_list(128);
+    if (opt_backend_jobs > 1 && !print_ir1 && !print_ir2 && !log_compiler_phase_durations)
+        compile_functions_in_parallel(opt_backend_jobs, backend_strings);
+    else {
+        for (int i = 0; i < global_scope->symbol_list->length; i++) {
+            Symbol *symbol = global_scope->symbol_list->elements[i];
+            if (symbol->type->type == TYPE_FUNCTION && symbol->function->is_defined) {
+                Function *function = symbol->function;
+                if (print_ir1) print_ir(function, symbol->identifier, 0);
+
+                run_compiler_phases(function, symbol->identifier, COMPILE_START_AT_BEGINNING, COMPILE_STOP_AT_END);
+                if (print_ir2) print_ir(function, symbol->identifier, 0);
+            }
         }
     }
 
-    output_code(original_input_filename, output_filename);
+    if (output_object_file) {
+        output_object_code(original_input_filename, output_filename);
+        if (opt_verify_against_as) verify_object_code(original_input_filename, output_filename);
+    }
+    else
+        output_code(original_input_filename, output_filename);
+
+    for (int i = 0; i < backend_strings->length; i++) wfree(backend_strings->elements[i]);
+    free_list(backend_strings);
 
     for (int i = 0; i < global_scope->symbol_list->length; i++) {
         Symbol *symbol = global_scope->symbol_list->elements[i];
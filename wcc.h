@@ -10,14 +10,12 @@
 #define NORETURN
 #endif
 
-#define MAX_CPP_FILESIZE              10 * 1024 * 1024
 #define MAX_CPP_INCLUDE_DEPTH         15
 #define MAX_CPP_MACRO_PARAM_COUNT     1024
 #define MAX_STRUCT_OR_UNION_SCALARS   1024
 #define MAX_TYPEDEFS                  1024
 #define MAX_STRUCT_MEMBERS            1024
 #define MAX_IDENTIFIER_SIZE           1024
-#define MAX_INPUT_SIZE                1 << 20 // 1 MB
 #define MAX_STRING_LITERALS           20480
 #define MAX_FLOATING_POINT_LITERALS   10240
 #define VALUE_STACK_SIZE              10240
@@ -32,11 +30,24 @@
 #define MAX_STACK_SIZE                10240
 #define MAX_BLOCK_PREDECESSOR_COUNT   1024
 #define MAX_GRAPH_EDGE_COUNT          10240
+#define ARENA_CHUNK_SIZE              65536
 
 typedef struct block {
     struct three_address_code *start, *end;
 } Block;
 
+// Memory arena. Chunks are singly linked, the head is the one being allocated from.
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    char *data;
+    long size;
+    long used;
+} ArenaChunk;
+
+typedef struct arena {
+    ArenaChunk *chunks;
+} Arena;
+
 typedef struct graph_node {
     int id;
     struct graph_edge *pred;
@@ -61,11 +72,49 @@ typedef struct graph {
 
 typedef struct set {
     int max_value;
-    char *elements;
+    int word_count;             // Number of 64-bit words in elements
+    unsigned long *elements;    // Bit vector, one bit per possible element
     int cached_element_count;
     int *cached_elements;
 } Set;
 
+// Natural loop in a loop nesting forest. The loops with the same header are merged.
+typedef struct loop {
+    int header;                 // Block that dominates all blocks in the loop
+    int parent;                 // Index of the innermost enclosing loop, -1 for an outermost loop
+    int depth;                  // Nesting depth, 1 for an outermost loop
+    Set *body;                  // Blocks in the loop, including the header
+    Set *latches;               // Blocks with a back edge to the header
+} Loop;
+
+// Loops of a function's control flow graph, nested by the inclusion of their bodies
+typedef struct loop_forest {
+    int loop_count;
+    Loop *loops;
+    int *block_loops;           // Innermost loop for each block, -1 if the block isn't in a loop
+    int *block_depths;          // Loop nesting depth for each block
+} LoopForest;
+
+// Interference graph with nodes 1..node_count. Edges are kept in a lower triangular
+// bit matrix for constant time lookups and in per-node adjacency vectors for
+// iterating over neighbors.
+typedef struct interference_graph {
+    int node_count;
+    unsigned long *matrix;      // Lower triangular bit matrix, including the diagonal
+    int **neighbors;            // Adjacency vector for each node
+    int *degrees;               // Number of neighbors of each node
+    int *allocated_neighbors;   // Allocated size of each adjacency vector
+} InterferenceGraph;
+
+// Live intervals of vregs for the linear scan register allocator. Positions are twice
+// the instruction index, see make_live_intervals().
+typedef struct live_intervals {
+    int *starts;            // First position where a vreg is live, -1 if the vreg isn't used
+    int *ends;              // Last position where a vreg is live
+    int *preg_constraints;  // For each vreg, a bit for each live range preg index - 1 it must not be allocated
+    char *fixed_pregs;      // Live range preg index a vreg must be allocated, zero if any
+} LiveIntervals;
+
 typedef struct stack {
     int *elements;
     int pos;
@@ -89,6 +138,14 @@ typedef struct strset {
     StrMap *strmap;
 } StrSet;
 
+// Immutable hash consed set of interned macro identifiers, see hideset.c
+typedef struct hide_set {
+    int id;                 // Unique id, starting at 1
+    unsigned int hash;
+    int count;
+    char **identifiers;     // Sorted by address
+} HideSet;
+
 typedef struct longmap {
     long *keys;
     void **values;
@@ -245,19 +302,23 @@ typedef struct function {
     Graph *cfg;                                         // Control flow graph
     Block *blocks;                                      // For functions, the blocks
     Set **dominance;                                    // Block dominances
-    LongSet **uevar;                                    // The upward exposed set for each block
-    LongSet **varkill;                                  // The killed var set for each block
-    LongSet **liveout;                                  // The liveout set for each block
+    Set **uevar;                                        // The upward exposed set for each block
+    Set **varkill;                                      // The killed var set for each block
+    Set **liveout;                                      // The liveout set for each block
     int *idom;                                          // Immediate dominator for each block
     Set **dominance_frontiers;                          // Dominance frontier for each block
+    LoopForest *loop_forest;                            // Loop nesting forest of the control flow graph
     Set **var_blocks;                                   // Var/block associations for vars that are written to
     Set *globals;                                       // All variables that are assigned to
     Set **phi_functions;                                // All variables that need phi functions for each block
-    char *interference_graph;                           // The interference graph of live ranges, in a lower diagonal matrix
+    InterferenceGraph *interference_graph;              // The interference graph of live ranges
+    LiveIntervals *live_intervals;                      // Live intervals for the linear scan register allocator
     struct vreg_location *vreg_locations;               // Allocated physical registers and spilled stack indexes
     int *spill_cost;                                    // The estimated spill cost for each live range
+    struct three_address_code **rematerializations;     // Instructions that recompute spilled vregs, indexed by vreg
     char *preferred_live_range_preg_indexes;            // Preferred physical register, when possible
     char *vreg_preg_classes;                            // Preg classes for all vregs
+    Arena *arena;                                       // Allocations for the compiler phases, freed once the function is compiled
 } Function;
 
 // Data of the a single eight byte that's part of a struct or union function parameter or arg
@@ -296,6 +357,13 @@ enum {
     PC_SSE = 2,
 };
 
+// Targets of a switch statement jump table. Entry i is the label jumped to for
+// the i-th value of the table's range.
+typedef struct jump_table {
+    int count;
+    int *labels;
+} JumpTable;
+
 // Value is a value on the value stack. A value can be one of
 // - global
 // - local
@@ -340,6 +408,7 @@ typedef struct value {
     Set *return_value_live_ranges;                       // Live ranges for registers that are part of the function return values
     Symbol *global_symbol;                               // Pointer to a global symbol if the value is a global symbol
     int label;                                           // Target label in the case of jump instructions
+    JumpTable *jump_table;                               // Targets in the case of a jump table label
     int ssa_subscript;                                   // Optional SSA enumeration
     int live_range;                                      // Optional SSA live range
     char preferred_live_range_preg_index;                // Preferred physical register
@@ -356,6 +425,7 @@ typedef struct three_address_code {
     int index;                          // Index in a tac chain
     int operation;                      // IR_* operation
     int label;                          // Label if this instruction is jumped to
+    int loop_depth;                     // Depth in the loop nesting forest, set by analyze_dominance()
     Value *dst;                         // Destination
     Value *src1;                        // First rhs operand
     Value *src2;                        // Second rhs operand
@@ -564,6 +634,7 @@ enum {
     IR_JMP,                   // Unconditional jump
     IR_JZ,                    // Jump if zero
     IR_JNZ,                   // Jump if not zero
+    IR_JMP_TABLE,             // Indirect jump through a jump table, src1 is the index
     IR_ADD,                   // +
     IR_SUB,                   // -
     IR_RSUB,                  // reverse -, used to facilitate code generation for the x86 SUB instruction
@@ -666,12 +737,37 @@ typedef struct cpp_token {
     char *str;              // The token text
     int line_number;
     int line_number_offset; // Amended line number due to #line
-    StrSet *hide_set;       // Hide set, when expanding macros
+    HideSet *hide_set;      // Hide set, when expanding macros
     struct cpp_token *next;
 } CppToken;
 
+// Identifier tokens, including the ones that are directive names. Their str is interned.
+#define is_identifier(t) (\
+    t->kind == CPP_TOK_IDENTIFIER || \
+    t->kind == CPP_TOK_INCLUDE    || \
+    t->kind == CPP_TOK_DEFINE     || \
+    t->kind == CPP_TOK_UNDEF      || \
+    t->kind == CPP_TOK_IF         || \
+    t->kind == CPP_TOK_IFDEF      || \
+    t->kind == CPP_TOK_IFNDEF     || \
+    t->kind == CPP_TOK_ELIF       || \
+    t->kind == CPP_TOK_ELSE       || \
+    t->kind == CPP_TOK_ENDIF      || \
+    t->kind == CPP_TOK_LINE       || \
+    t->kind == CPP_TOK_DEFINED    || \
+    t->kind == CPP_TOK_WARNING    || \
+    t->kind == CPP_TOK_ERROR      || \
+    t->kind == CPP_TOK_PRAGMA)
+
 typedef CppToken *(*DirectiveRenderer)(CppToken *);
 
+// Object-like macros whose replacement lists can't be expanded any further
+enum {
+    MACRO_NOT_LEAF,
+    MACRO_CONSTANT,                 // The replacement list has no identifiers or ##
+    MACRO_LEAF,                     // The replacement list has no ## and no identifiers that are macros, which may change
+};
+
 typedef struct directive {
     char is_function;               // Is the macro an object or function macro
     int param_count;                // Amount of parameters.
@@ -680,8 +776,36 @@ typedef struct directive {
     StrMap *param_identifiers;      // Mapping of parameter identifiers => index, index starts at 1
     CppToken *tokens;               // Replacement tokens
     DirectiveRenderer renderer;     // Renderer for builtin directives
+    char leaf_kind;                 // One of MACRO_*
+    char is_leaf;                   // For MACRO_LEAF, are none of the identifiers macros?
+    int leaf_generation;            // For MACRO_LEAF, the macros generation is_leaf was determined in
 } Directive;
 
+// A line in the preprocessor's output tokens, starting at token_index
+typedef struct cpp_output_line {
+    int token_index;
+    int line_number;                // The line the lexer would be on when lexing the output as text
+    char *filename;                 // Interned
+} CppOutputLine;
+
+// A token in the preprocessor's output
+typedef struct cpp_output_token {
+    int kind;                       // One of CPP_TOK_*. Identifiers, including directive names, are CPP_TOK_IDENTIFIER.
+    char *str;                      // Interned, except for string literals
+} CppOutputToken;
+
+// The preprocessor's output for the parser, either tokens or text
+typedef struct cpp_output {
+    char *text;                     // Output text, if not using tokens
+    CppOutputToken *tokens;         // Tokens, ending with a CPP_TOK_EOF
+    int token_count;
+    int allocated_tokens;
+    CppOutputLine *lines;
+    int line_count;
+    int allocated_lines;
+    Arena *arena;                   // String literals. All other token strings are interned.
+} CppOutput;
+
 // Structure with all directives passed on the command line with -D
 typedef struct cli_directive {
     char *identifier;               // Identifier of the directive
@@ -707,6 +831,13 @@ typedef enum {
     CP_POST_PARSING,
 } CompilePhase;
 
+// Register allocators, selected with -fregalloc
+enum {
+    REGALLOC_GRAPH_COLORING,
+    REGALLOC_LINEAR_SCAN,
+    REGALLOC_IRC,
+};
+
 extern char *cur_filename;              // Current filename being lexed
 extern int cur_line;                    // Current line number being lexed
 
@@ -726,6 +857,14 @@ extern int opt_enable_preferred_pregs;         // Enable preferred preg selectio
 extern int opt_enable_trigraphs;               // Enable trigraph preprocessing
 extern int opt_enable_common_symbols;          // Enable .comm symbols
 extern int opt_warnings_are_errors;            // Treat all warnings as errors
+extern int opt_backend_jobs;                   // Number of worker processes for the per-function compiler phases
+extern int opt_integrated_assembler;           // Make object files without running an external assembler
+extern int opt_integrated_cpp;                 // Parse the preprocessor's output tokens instead of its output text
+extern int opt_verify_against_as;              // Compare object files with the output of the external assembler
+extern int opt_register_allocator;             // One of REGALLOC_*
+extern int opt_rematerialize;                  // Recompute spilled constants and addresses instead of using the stack
+extern int opt_live_range_splitting;           // Split spilled live ranges around loops and function calls
+extern char *opt_cpp_cache_dir;                // Directory for the preprocessed include file cache
 
 extern CliDirective *cli_directives;      // Linked list of directives passed on the command line with -D
 extern CliIncludePath *cli_include_paths; // Linked list of include paths passed on the command line with -I
@@ -779,6 +918,7 @@ extern int debug_ssa_cfg;
 extern int debug_ssa_dominance;
 extern int debug_ssa_idom;
 extern int debug_ssa_dominance_frontiers;
+extern int debug_ssa_loops;
 extern int debug_ssa_phi_insertion;
 extern int debug_ssa_phi_renumbering;
 extern int debug_ssa_live_range;
@@ -792,7 +932,7 @@ extern int debug_instsel_tree_merging;
 extern int debug_instsel_tree_merging_deep;
 extern int debug_instsel_igraph_simplification;
 extern int debug_instsel_tiling;
-extern int debug_instsel_cost_graph;
+extern int debug_instsel_states;
 extern int debug_instsel_spilling;
 extern int debug_stack_frame_layout;
 extern int debug_exit_after_parser;
@@ -803,14 +943,18 @@ extern int debug_dont_compile_internals;
 // set.c
 #define add_to_set(s, value) do { \
     if (value > s->max_value) panic("Max set value of %d exceeded with %d in add_to_set", s->max_value, value); \
-    s->elements[value] = 1; \
+    s->elements[(value) >> 6] |= 1UL << ((value) & 63); \
 } while (0)
 
+#define SET_WORD_COUNT(max_value) (((max_value) >> 6) + 1)
+#define set_foreach(s, it) for (int it = set_next(s, -1); it != -1; it = set_next(s, it))
+
 Set *new_set(int max_value);
 void free_set(Set *s);
 void empty_set(Set *s);
 Set *copy_set(Set *s);
 void copy_set_to(Set *dst, Set *src);
+int set_next(Set *s, int value);
 void cache_set_elements(Set *s);
 int set_len(Set *s);
 void print_set(Set *s);
@@ -824,6 +968,7 @@ Set *set_union(Set *s1, Set *s2);
 void set_union_to(Set *dst, Set *s1, Set *s2);
 Set *set_difference(Set *s1, Set *s2);
 void set_difference_to(Set *dst, Set *s1, Set *s2);
+void set_union_difference_to(Set *dst, Set *s1, Set *s2, Set *s3);
 
 // stack.c
 Stack *new_stack(void);
@@ -838,12 +983,29 @@ void free_strmap(StrMap *map);
 void *strmap_get(StrMap *strmap, char *key);
 void strmap_put(StrMap *strmap, char *key, void *value);
 void strmap_delete(StrMap *strmap, char *key);
+void *strmap_get_interned(StrMap *strmap, char *key);
+void strmap_put_interned(StrMap *strmap, char *key, void *value);
 StrMapIterator strmap_iterator(StrMap *map);
 int strmap_iterator_finished(StrMapIterator *iterator);
 void strmap_iterator_next(StrMapIterator *iterator);
 char *strmap_iterator_key(StrMapIterator *iterator);
 #define strmap_foreach(ls, it) for (StrMapIterator it = strmap_iterator(ls); !strmap_iterator_finished(&it); strmap_iterator_next(&it))
 
+// intern.c
+char *intern_string(char *str, int length);
+char *intern(char *str);
+unsigned int interned_string_hash(char *str);
+int interned_string_length(char *str);
+void free_interned_strings(void);
+
+// hideset.c
+HideSet *hide_set_union(HideSet *hs1, HideSet *hs2);
+HideSet *hide_set_intersection(HideSet *hs1, HideSet *hs2);
+HideSet *hide_set_add(HideSet *hs, char *identifier);
+int hide_set_in(HideSet *hs, char *identifier);
+int hide_set_count(void);
+void free_hide_sets(void);
+
 // strset.c
 StrSet *new_strset(void);
 void free_strset(StrSet *ss);
@@ -914,10 +1076,23 @@ void append_to_list(List *l, void *element);
 
 // graph.c
 Graph *new_graph(int node_count, int edge_count);
+Graph *new_graph_in_arena(Arena *arena, int node_count, int edge_count);
 void free_graph(Graph *g);
 void dump_graph(Graph *g);
 GraphEdge *add_graph_edge(Graph *g, int from, int to);
 
+// dataflow.c
+enum {
+    DATAFLOW_FORWARD,
+    DATAFLOW_BACKWARD,
+};
+
+// Recalculate the sets for a block. Returns 1 if the block's output changed.
+typedef int (*DataflowTransfer)(Function *function, int block, void *context);
+
+int *make_block_postorder(Graph *cfg);
+void solve_dataflow(Function *function, int direction, DataflowTransfer transfer, void *context);
+
 // utils.c
 // A struct for appending strings to a buffer without knowing the size beforehand
 typedef struct string_buffer {
@@ -934,6 +1109,8 @@ StringBuffer *new_string_buffer(int initial_size);
 void free_string_buffer(StringBuffer *sb, int free_data);
 void append_to_string_buffer(StringBuffer *sb, char *str);
 void terminate_string_buffer(StringBuffer *sb);
+char *map_file(char *filename, int *size);
+void unmap_file(char *data, int size);
 
 void set_debug_logging_start_time();
 void debug_log(char *format, ...);
@@ -941,6 +1118,7 @@ void debug_log(char *format, ...);
 // memory.c
 extern int print_heap_usage;
 extern int fail_on_leaked_memory;
+extern Arena *translation_unit_arena; // Values, instructions and types. Freed at the end of the translation unit.
 
 void *wmalloc(size_t size);
 void *wrealloc(void *ptr, size_t size);
@@ -949,6 +1127,9 @@ void *wcalloc(size_t nitems, size_t size);
 char *wstrdup(const char *str);
 void wfree(void *ptr);
 void process_memory_allocation_stats(void);
+Arena *new_arena(void);
+void *arena_alloc(Arena *arena, size_t size);
+void free_arena(Arena *arena);
 
 // error.c
 NORETURN void panic_with_line_number(char *format, ...);
@@ -959,12 +1140,16 @@ void warning(char *format, ...);
 // lexer.c
 void init_lexer_from_filename(char *filename);
 void init_lexer_from_string(char *string);
+void init_lexer_from_cpp_output(CppOutput *cpp_output);
 void free_lexer(void);
 void next(void);
 void rewind_lexer(void);
 void expect(int token, char *what);
 void consume(int token, char *what);
 
+// keywords-generated.c
+int lookup_keyword(char *identifier, int length);
+
 // cpp.c
 typedef struct line_map {
     int position;
@@ -985,8 +1170,26 @@ void transform_trigraphs(void);
 void strip_backslash_newlines(void);
 Directive *parse_cli_define(char *string);
 char *preprocess(char *filename, List *cli_directive_strings);
+CppOutput *preprocess_to_tokens(char *filename, List *cli_directive_strings);
+void free_cpp_output(CppOutput *cpp_output);
 void preprocess_to_file(char *input_filename, char *output_filename, List *cli_directive_strings);
 void free_cpp_allocated_garbage();
+CppToken *new_cpp_token(int kind);
+char *new_cpp_token_string(char *string, int length);
+void classify_directive(Directive *directive);
+void define_directive(char *identifier, Directive *directive);
+void undefine_directive(char *identifier);
+void set_include_file_state(char *path, char *guard, int pragma_once);
+
+// cppcache.c
+void init_cpp_cache(char *include_paths);
+void free_cpp_cache(void);
+void cpp_cache_directive_changed(char *identifier, Directive *old_directive, Directive *new_directive);
+void cpp_cache_include_file_changed(char *canonical_path, char *old_guard, int old_pragma_once, char *guard, int pragma_once);
+void cpp_cache_mark_uncacheable(void);
+int cpp_cache_replay(char *path, StringBuffer *output);
+void cpp_cache_start_recording(char *path, StringBuffer *output);
+void cpp_cache_finish_recording(StringBuffer *output);
 
 // parser.c
 typedef Value *parse_expression_function_type(int);
@@ -1085,11 +1288,7 @@ TypeIterator *type_iterator_dig_for_string_literal(TypeIterator *it);
 TypeIterator *type_iterator_descend(TypeIterator *it);
 
 // ir.c
-void init_ir(void);
-void free_ir(void);
 
-void init_value_allocations(void) ;
-void free_values(void);
 void init_value(Value *v);
 Value *new_value(void);
 Value *new_integral_constant(int type_type, long value);
@@ -1149,19 +1348,28 @@ enum {
 
 extern int live_range_reserved_pregs_offset;
 
-// Interference graph indexing for a lower triangular matrix with size vreg_count
-#define ig_lookup(ig, vreg_count, i1, i2) ig[i1 > i2 ? i2 * vreg_count + i1 : i1 * vreg_count + i2]
+// Interference graph bit matrix indexing for a lower triangular matrix
+#define IG_MATRIX_INDEX(i1, i2) ((i1) > (i2) ? (long) (i1) * ((i1) + 1) / 2 + (i2) : (long) (i2) * ((i2) + 1) / 2 + (i1))
+#define ig_lookup(ig, i1, i2) (((ig)->matrix[IG_MATRIX_INDEX(i1, i2) >> 6] >> (IG_MATRIX_INDEX(i1, i2) & 63)) & 1)
 
-#define add_ig_edge(ig, vreg_count, to, from) \
+#define add_ig_edge(ig, to, from) \
     do { \
         if (debug_ssa_interference_graph) printf("Adding edge %d <-> %d\n", (int) to, (int) from); \
-        ig_lookup(ig, vreg_count, to, from) = 1; \
+        ig_add_edge(ig, to, from); \
     } while(0)
 
+InterferenceGraph *new_ig(int node_count);
+void free_ig(InterferenceGraph *ig);
+void ig_add_edge(InterferenceGraph *ig, int to, int from);
+
 void optimize_arithmetic_operations(Function *function);
 void rewrite_lvalue_reg_assignments(Function *function);
 void make_control_flow_graph(Function *function);
+void free_control_flow_graph(Function *function);
 void make_block_dominance(Function *function);
+void free_block_dominance(Function *function);
+void make_loop_nesting_forest(Function *function);
+void free_loop_nesting_forest(Function *function);
 void analyze_dominance(Function *function);
 void free_dominance(Function *function);
 int make_vreg_count(Function *function, int starting_count);
@@ -1176,12 +1384,16 @@ void free_phi_functions(Function *function);
 void rename_phi_function_variables(Function *function);
 void make_live_ranges(Function *function);
 void free_live_range_spill_cost(Function *function);
+int ten_power(int p);
 void free_vreg_preg_classes(Function *function);
 void blast_vregs_with_live_ranges(Function *function);
 void make_interference_graph(Function *function, int include_clobbers, int include_instrsel_constraints);
 void free_interference_graph(Function *function);
+void make_live_intervals(Function *function);
+void free_live_intervals(Function *function);
 void coalesce_live_ranges(Function *function, int check_register_constraints);
 void make_preferred_live_range_preg_indexes(Function *function);
+void remake_register_allocation_graph(Function *function);
 void free_preferred_live_range_preg_indexes(Function *function);
 
 // functions.c
@@ -1207,7 +1419,10 @@ void compress_vregs(Function *function);
 void init_vreg_locations(Function *function);
 void free_vreg_locations(Function *function);
 void allocate_registers_top_down(Function *function, int live_range_start, int physical_register_count, int preg_class);
+void allocate_registers_linear_scan(Function *function, int live_range_start, int physical_register_count, int preg_class);
+void allocate_registers_irc(Function *function, int live_range_start, int physical_register_count, int preg_class);
 void allocate_registers(Function *function);
+void free_rematerializations(Function *function);
 void init_allocate_registers(void);
 
 // instrsel.c
@@ -1338,6 +1553,7 @@ enum {
     X_JZ,
     X_JNZ,
     X_JMP,
+    X_JMP_TABLE,
 
     X_JE,
     X_JNE,
@@ -1375,6 +1591,18 @@ enum {
     X_CALL_FROM_FUNC,
 };
 
+// Value type classes, see value_type_class()
+enum {
+    VTC_OTHER,
+    VTC_I1, VTC_I2, VTC_I3, VTC_I4,     // Signed integers
+    VTC_U1, VTC_U2, VTC_U3, VTC_U4,     // Unsigned integers
+    VTC_S3, VTC_S4,                     // Float and double
+    VTC_P1, VTC_P2, VTC_P3, VTC_P4,     // Pointers, by target size
+    VTC_P5,                             // Pointer to a long double
+    VTC_PF,                             // Pointer to a function
+    VTC_COUNT,
+};
+
 typedef struct rule {
     int index;
     int operation;
@@ -1399,10 +1627,32 @@ typedef struct x86_operation {
     char arg;                          // The argument (src1 or src2) to load/save
 } X86Operation;
 
+// Tables for labelling instruction trees, made by instrgen. See burs.c
+typedef struct burs_tables {
+    int state_count;
+    int *state_items;               // Index of the first item of each state, state_count + 1 entries
+    short *item_non_terminals;      // Non terminal of each item
+    short *item_rules;              // Cheapest rule reducing to the item's non terminal
+    short *item_costs;              // Cost relative to the cheapest item in the state
+    short *leaf_states;             // By non terminal & value type class
+    int constant_count;
+    int *constant_masks;            // Sorted masks of matching constant non terminals
+    short *constant_states;         // By constant mask
+    int operation_limit;
+    short *operandless_states;      // By operation
+    int operation_count;            // Number of operation & operand count combinations
+    int context_class_count;
+    short *context_classes;         // By context
+    short *operation_contexts;      // By operation index & context class
+    int context_count;
+    int *context_starts;            // First context of each operation index, operation_count + 1 entries
+    int *context_dst_starts;        // First allowed dst of each context, context_count + 1 entries
+    short *context_dsts;            // Allowed dsts
+} BursTables;
+
 extern int instr_rule_count;
 extern Rule *instr_rules;
 extern int disable_merge_constants;
-extern LongMap *instr_rules_by_operation;
 extern Value **saved_values;
 extern char *rule_coverage_file;
 extern Set *rule_coverage;
@@ -1415,6 +1665,20 @@ void add_spill_code(Function *function);
 // instrrules-generated.c
 void init_generated_instruction_selection_rules(void);
 
+// burs.c
+extern BursTables *burs_tables;
+
+BursTables *make_burs_tables(void);
+void free_burs_tables(BursTables *tables);
+void init_burs(void);
+void free_burs(void);
+void remake_burs_tables(void);
+int burs_leaf_state(Value *v);
+int burs_operation_state(Tac *tac, int is_root, int operand_count, int src1_state, int src2_state);
+Rule *burs_state_rule(int state, int non_terminal);
+Rule *burs_root_rule(int state);
+void print_burs_state(int state);
+
 // instrutil.c
 X86Operation *dup_x86_operation(X86Operation *operation);
 char size_to_x86_size(int size);
@@ -1430,11 +1694,11 @@ int uncached_non_terminal_for_value(Value *v);
 // Used to match the root node. It must be an exact match.
 #define match_value_to_rule_dst(v, dst) (non_terminal_for_value(v) == dst)
 
+int value_type_class(Value *v);
+long type_class_non_terminals(int type_class);
 int match_value_type_to_rule_dst(Value *v, int dst);
 char *value_to_non_terminal_string(Value *v);
 int make_x86_size_from_non_terminal(int non_terminal);
-void init_rules_by_operation(void);
-void free_rules_by_operation(void);
 void check_for_duplicate_rules(void);
 void write_rule_coverage_file(void);
 
@@ -1453,9 +1717,84 @@ void remove_nops(Function *function);
 void merge_rsp_func_call_add_subs(Function *function);
 int fprintf_escaped_string_literal(void *f, StringLiteral *sl, int for_assembly);
 void output_code(char *input_filename, char *output_filename);
+void output_object_code(char *input_filename, char *output_filename);
 void init_codegen(void);
 void free_codegen(void);
 
+// elf.c
+// ELF constants taken from elf.h
+#define SHT_PROGBITS                1
+#define SHT_NOBITS                  8
+
+#define SHF_WRITE                   0x1
+#define SHF_ALLOC                   0x2
+#define SHF_EXECINSTR               0x4
+
+#define STB_LOCAL                   0
+#define STB_GLOBAL                  1
+
+#define STT_NOTYPE                  0
+#define STT_OBJECT                  1
+#define STT_FUNC                    2
+
+#define R_X86_64_64                 1
+#define R_X86_64_PC32               2
+#define R_X86_64_PLT32              4
+#define R_X86_64_GOTPCREL           9
+#define R_X86_64_GOTPCRELX          41
+#define R_X86_64_REX_GOTPCRELX      42
+
+typedef struct elf_section {
+    char *name;
+    int index;              // Section header index
+    int type;
+    int flags;
+    int alignment;
+    char *data;             // Contents, zero for SHT_NOBITS sections
+    int size;
+    int allocated;
+    List *relocations;
+} ElfSection;
+
+typedef struct elf_symbol {
+    char *name;
+    ElfSection *section;    // Zero if the symbol is undefined or common
+    long value;             // Offset in the section, or alignment for common symbols
+    long size;
+    int binding;
+    int type;
+    int is_common;
+    int is_temporary;       // .L labels don't go in the symbol table
+    int is_referenced;      // Referenced by a relocation
+    int index;              // Index in the symbol table, set when writing the object
+} ElfSymbol;
+
+typedef struct elf_relocation {
+    long offset;
+    ElfSymbol *symbol;
+    int type;
+    long addend;
+} ElfRelocation;
+
+void init_elf_object(char *source_filename);
+void free_elf_object(void);
+ElfSection *add_elf_section(char *name, int type, int flags);
+void elf_section_append(ElfSection *section, void *data, int size);
+void elf_section_append_zeros(ElfSection *section, int size);
+void elf_section_align(ElfSection *section, int alignment);
+ElfSymbol *get_elf_symbol(char *name);
+void define_elf_symbol(ElfSymbol *symbol, ElfSection *section, long value);
+void add_elf_relocation(ElfSection *section, long offset, ElfSymbol *symbol, int type, long addend);
+void write_elf_object(char *filename);
+int compare_elf_objects(char *expected_filename, char *actual_filename);
+
+// assembler.c
+void init_assembler(ElfSection *text_section);
+void free_assembler(void);
+void assemble_label(ElfSymbol *symbol);
+void assemble_x86_instruction(char *instruction);
+void finish_assembler(void);
+
 // wcc.c
 enum {
     COMPILE_START_AT_BEGINNING,
@@ -1477,7 +1816,8 @@ void free_memory_for_translation_unit(void);
 
 char *make_temp_filename(char *template);
 void run_compiler_phases(Function *function, char *function_name, int start_at, int stop_at);
-void compile(char *input, char *original_input_filename, char *output_filename);
+char *get_as_binary(void);
+void compile(CppOutput *input, char *original_input_filename, char *output_filename, int output_object_file);
 
 // test-utils.c
 extern int failures;